@@ -0,0 +1,130 @@
+/* ftdi_backend.h */
+
+#ifndef _FTDI_BACKEND_H
+#define _FTDI_BACKEND_H
+
+/*--------------------------------------------------------------*/
+/* USB backend of a device					*/
+/*								*/
+/* All USB traffic of a channel, from opening the device to	*/
+/* closing it, goes through the operations of its backend, so	*/
+/* that the Tcl commands and the MPSSE command builders are	*/
+/* written once on top of them.  The operations take the	*/
+/* arguments and return the values of the libftdi functions	*/
+/* named beside them.  A device of any backend is a		*/
+/* "struct ftdi_context":  a backend that does not use libftdi	*/
+/* embeds one at the start of its own context, and fills in	*/
+/* the chip type, which is the only field that the command	*/
+/* layer reads.  Likewise, its transfers are			*/
+/* "struct ftdi_transfer_control"s, of which the command layer	*/
+/* reads only "ftdi" and "completed".				*/
+/*								*/
+/* The backends are "libftdi" and "direct" (ftdi_tcl.c), and	*/
+/* "d2xx" (ftdi_d2xx.c), if built with the FTDI D2XX library.	*/
+/*--------------------------------------------------------------*/
+
+#define USB_DEFAULT_TIMEOUT	5000	// libftdi's USB timeout (ms)
+
+struct _ftdi_backend;
+struct _ftdi_yield;
+
+/* A device to be opened, as found in the USB device cache, and	*/
+/* the state of the device once opened.				*/
+
+typedef struct _open_job {
+   unsigned short vid;		// USB vendor ID of the device
+   unsigned short pid;		// USB product ID of the device
+   unsigned char bus;		// USB bus number of the device
+   unsigned char addr;		// USB address of the device
+   int channel;			// INTERFACE_ANY, INTERFACE_A, etc.
+   unsigned char flags;		// CS_INVERT, SERIAL_MODE, etc.
+   struct _ftdi_backend *backend; // USB backend to use
+   char serial[64];		// Device serial number string
+   char description[100];	// Device description string
+   struct ftdi_context *ftContext; // Open device, or NULL on error
+   unsigned short gpio_out;	// Initial GPIO values
+   unsigned short gpio_dir;	// Initial GPIO directions
+   double sckrate;		// Initial SCK rate
+   char *error;			// Why the device could not be opened
+   char *warning;		// Last error after the device was opened
+   unsigned char unchecked;	// Sanity check failed
+} open_job;
+
+/* Coroutines waiting on the transfers of a device are kept	*/
+/* with its event source (see "libusb event sources" in		*/
+/* ftdi_tcl.c).  A backend that does not use libusb keeps its	*/
+/* own source, with no context, and calls usb_source_resume()	*/
+/* from the Tcl event handler of its devices once transfers	*/
+/* have completed.						*/
+
+typedef struct _usb_source {
+   libusb_context *ctx;		// libusb context, or NULL
+   Tcl_TimerToken timer;	// libusb's next timeout, or NULL
+   struct _ftdi_yield *waiters;	// Coroutines waiting on transfers
+   struct _usb_source *next;
+} usb_source;
+
+extern void usb_source_resume(usb_source *);
+
+typedef struct _ftdi_backend {
+   char *name;			// Name given to "-backend"
+   // Open the device and channel of "job" (ftdi_new(),
+   // ftdi_set_interface(), and ftdi_usb_open_bus_addr()).  Returns
+   // NULL, with job->error set, if the device cannot be opened.
+   struct ftdi_context *(*open)(open_job *);
+   // ftdi_usb_close() and ftdi_free()
+   int (*close)(struct ftdi_context *);
+   // ftdi_usb_reset()
+   int (*reset)(struct ftdi_context *);
+   // ftdi_write_data() and ftdi_read_data()
+   int (*write)(struct ftdi_context *, const unsigned char *, int);
+   int (*read)(struct ftdi_context *, unsigned char *, int);
+   // ftdi_write_data_submit() and ftdi_read_data_submit()
+   struct ftdi_transfer_control *(*write_submit)(struct ftdi_context *,
+		unsigned char *, int);
+   struct ftdi_transfer_control *(*read_submit)(struct ftdi_context *,
+		unsigned char *, int);
+   // ftdi_transfer_data_done()
+   int (*transfer_done)(struct ftdi_transfer_control *);
+   // Stop a transfer, allowing "tv" for it to stop, and free it.
+   // Returns the number of bytes moved, or -1.
+   int (*transfer_cancel)(struct ftdi_transfer_control *, struct timeval *);
+   // Handle events for up to "tv", returning early once the int
+   // given is set (libusb_handle_events_timeout_completed()).
+   int (*handle_events)(struct ftdi_context *, struct timeval *, int *);
+   // Register the events of a device with the Tcl notifier, and
+   // remove them before it is closed.
+   void (*watch)(struct ftdi_context *);
+   void (*unwatch)(struct ftdi_context *);
+   // The event source of a device, or NULL if its transfers must
+   // be polled.
+   usb_source *(*source)(struct ftdi_context *);
+   // ftdi_usb_purge_tx_buffer() and ftdi_usb_purge_rx_buffer()
+   int (*purge_tx)(struct ftdi_context *);
+   int (*purge_rx)(struct ftdi_context *);
+   // ftdi_set_bitmode(), ftdi_set_latency_timer(), ftdi_set_baudrate()
+   int (*set_bitmode)(struct ftdi_context *, unsigned char, unsigned char);
+   int (*set_latency)(struct ftdi_context *, unsigned char);
+   int (*set_baudrate)(struct ftdi_context *, int);
+   // ftdi_read_data_set_chunksize(), ftdi_read_data_get_chunksize(),
+   // ftdi_write_data_set_chunksize(), ftdi_write_data_get_chunksize()
+   int (*set_read_chunksize)(struct ftdi_context *, unsigned int);
+   int (*get_read_chunksize)(struct ftdi_context *, unsigned int *);
+   int (*set_write_chunksize)(struct ftdi_context *, unsigned int);
+   int (*get_write_chunksize)(struct ftdi_context *, unsigned int *);
+   // Set the USB read and write timeouts (ms)
+   int (*set_timeouts)(struct ftdi_context *, int, int);
+   // ftdi_setflowctrl(), ftdi_set_event_char(), ftdi_set_error_char()
+   int (*set_flowctrl)(struct ftdi_context *, int);
+   int (*set_event_char)(struct ftdi_context *, unsigned char, unsigned char);
+   int (*set_error_char)(struct ftdi_context *, unsigned char, unsigned char);
+   // Size the buffer that received data are read ahead into (0 for
+   // none), or NULL if the backend reads only into each transfer.
+   int (*set_bulkread)(struct ftdi_context *, unsigned int);
+} ftdi_backend;
+
+#ifdef HAVE_D2XX
+extern ftdi_backend d2xx_backend;	// Defined in ftdi_d2xx.c
+#endif
+
+#endif /* _FTDI_BACKEND_H */
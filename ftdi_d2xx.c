@@ -0,0 +1,919 @@
+/*
+ *------------------------------------------------------------
+ * ftdi_d2xx.c
+ *------------------------------------------------------------
+ * The "d2xx" backend:  devices driven through FTDI's own D2XX
+ * library instead of libftdi.  Devices are still found in the
+ * libusb device cache of ftdi_tcl.c, then opened in D2XX by
+ * their serial number or description.  All of the commands
+ * are those of ftdi_tcl.c, through the operations of
+ * ftdi_backend.h.
+ *------------------------------------------------------------
+ */
+
+#ifdef HAVE_D2XX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <ftdi.h>
+#include <ftd2xx.h>
+#include <tcl.h>
+
+#include "ftdi_backend.h"
+
+#define D2XX_CHUNKSIZE		4096	// USB transfer size, as libftdi's
+#define D2XX_MAX_USB_SIZE	65536	// Largest USB transfer size
+#define D2XX_XON		0x11	// XON and XOFF characters for
+#define D2XX_XOFF		0x13	// SIO_XON_XOFF_HS
+#define D2XX_READ_SLACK		20	// Wait for more data beyond the
+					// latency timer (ms)
+
+/*--------------------------------------------------------------*/
+/* Device context						*/
+/*								*/
+/* The libftdi context at the start carries only the chip type	*/
+/* and the values set through the chunk size and timeout	*/
+/* operations.  The chunk sizes are D2XX's USB transfer sizes	*/
+/* (FT_SetUSBParameters()).					*/
+/*								*/
+/* D2XX signals "event" whenever data arrive.  Each device has	*/
+/* an event thread, the only waiter on the event, which moves	*/
+/* the data of submitted reads into place as they arrive, and	*/
+/* passes every event on to "done" for the blocking reads of	*/
+/* the interpreter's thread.  Everything below "event" is	*/
+/* guarded by the event's mutex, which D2XX also holds to	*/
+/* signal, so each wait checks its condition under the mutex	*/
+/* and no event can be lost.  A completed read is announced on	*/
+/* "evpipe", which the Tcl notifier watches, to resume the	*/
+/* coroutines waiting on it (see usb_source_resume()).  The	*/
+/* event thread only moves an ended read to "ended";  it is	*/
+/* marked completed by the interpreter's thread, the only one	*/
+/* that reads the flag (see d2xx_collect()).			*/
+/*								*/
+/* With a bulk read buffer ("ring"), the event thread reads	*/
+/* whatever arrives into the ring, in one FT_Read() for all	*/
+/* that is queued, whether or not a read is submitted, and	*/
+/* reads are served from the ring.				*/
+/*--------------------------------------------------------------*/
+
+typedef struct _d2xx_transfer {
+   struct ftdi_transfer_control tc;	// Must be first
+   struct timespec expires;	// Read timeout, from the last data
+   struct _d2xx_transfer *next;
+} d2xx_transfer;
+
+typedef struct _d2xx_context {
+   struct ftdi_context ftdi;	// Must be first
+   FT_HANDLE handle;
+   EVENT_HANDLE event;		// Signalled by D2XX when data arrive
+   pthread_cond_t done;		// Signalled by the event thread
+   d2xx_transfer *reads;		// Submitted reads, oldest first
+   d2xx_transfer *ended;		// Ended reads, not yet marked completed
+   unsigned char busy;		// Event thread is in FT_Read()
+   unsigned char purging;	// Receive queue is being purged
+   unsigned char *ring;		// Bulk read buffer, or NULL
+   DWORD ringsize;		// Size of ring
+   DWORD ringhead;		// Offset of the first unread byte in ring
+   DWORD ringcount;		// Number of unread bytes in ring
+   unsigned char stopping;	// Event thread should exit
+   pthread_t thread;		// Event thread
+   int evpipe[2];		// Completed reads, to the Tcl notifier
+   usb_source src;		// Coroutines waiting on reads
+   unsigned char watched;	// evpipe is registered with Tcl
+   unsigned char latency;	// Latency timer (ms)
+   unsigned char evchar[2];	// Event character and enable (FT_SetChars)
+   unsigned char errchar[2];	// Error character and enable (FT_SetChars)
+} d2xx_context;
+
+#define D2XX(ftdi)	((d2xx_context *)(ftdi))
+#define D2XX_RESULT(ftStatus)	(((ftStatus) == FT_OK) ? 0 : -1)
+
+/* D2XX keeps one device list for the process, and "ftdi_open_many" */
+/* opens devices from several threads.				    */
+
+static pthread_mutex_t d2xx_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set "when" to "ms" from now */
+
+static void
+d2xx_time(struct timespec *when, long ms)
+{
+   clock_gettime(CLOCK_MONOTONIC, when);
+   when->tv_sec += ms / 1000;
+   when->tv_nsec += (ms % 1000) * 1000000L;
+   if (when->tv_nsec >= 1000000000L) {
+      when->tv_sec++;
+      when->tv_nsec -= 1000000000L;
+   }
+}
+
+static void *d2xx_event_thread(void *);
+
+/* libftdi's chip type for a D2XX device type */
+
+static enum ftdi_chip_type
+d2xx_chip_type(ULONG type)
+{
+   switch (type) {
+      case FT_DEVICE_AM:	return TYPE_AM;
+      case FT_DEVICE_2232C:	return TYPE_2232C;
+      case FT_DEVICE_232R:	return TYPE_R;
+      case FT_DEVICE_2232H:	return TYPE_2232H;
+      case FT_DEVICE_4232H:	return TYPE_4232H;
+      case FT_DEVICE_232H:	return TYPE_232H;
+      case FT_DEVICE_X_SERIES:	return TYPE_230X;
+      default:			return TYPE_BM;
+   }
+}
+
+/* Does the D2XX name "name" belong to channel "letter" of the	*/
+/* device named "base"?  D2XX names each channel of a		*/
+/* multi-channel device after the device, with the channel	*/
+/* letter appended ("FT1234A") or, for descriptions, added as	*/
+/* a word ("Dual RS232-HS A").  A single-channel device keeps	*/
+/* its own name, and has only channel A.			*/
+
+static int
+d2xx_name_match(char *name, char *base, char letter, int word)
+{
+   int len = strlen(base);
+
+   if (!strcmp(name, base)) return (letter == 'A') ? 1 : 0;
+   if (strncmp(name, base, len)) return 0;
+   name += len;
+   if (word && (*name++ != ' ')) return 0;
+   return ((name[0] == letter) && (name[1] == '\0')) ? 1 : 0;
+}
+
+/*--------------------------------------------------------------*/
+/* Open the channel of "job" through D2XX.			*/
+/*--------------------------------------------------------------*/
+
+static struct ftdi_context *
+d2xx_open(open_job *job)
+{
+   FT_DEVICE_LIST_INFO_NODE *infonode;
+   pthread_condattr_t attr;
+   d2xx_context *dc;
+   FT_HANDLE handle;
+   FT_STATUS ftStatus;
+   DWORD numDevs;
+   ULONG type;
+   char letter;
+   int devidx;
+
+   letter = 'A' + ((job->channel > INTERFACE_ANY) ? job->channel - 1 : 0);
+
+   pthread_mutex_lock(&d2xx_list_lock);
+   ftStatus = FT_SetVIDPID((DWORD)job->vid, (DWORD)job->pid);
+   if (ftStatus == FT_OK) ftStatus = FT_CreateDeviceInfoList(&numDevs);
+   if (ftStatus != FT_OK) {
+      pthread_mutex_unlock(&d2xx_list_lock);
+      job->error = "Unable to list devices.\n";
+      return NULL;
+   }
+   infonode = (FT_DEVICE_LIST_INFO_NODE *)malloc(numDevs *
+		sizeof(FT_DEVICE_LIST_INFO_NODE));
+   ftStatus = FT_GetDeviceInfoList(infonode, &numDevs);
+   if (ftStatus != FT_OK) numDevs = 0;
+
+   // Match by serial number where the device has one, as the
+   // description need not be unique.
+
+   for (devidx = 0; devidx < (int)numDevs; devidx++) {
+      if (job->serial[0] != '\0') {
+	 if (d2xx_name_match(infonode[devidx].SerialNumber, job->serial,
+		letter, 0)) break;
+      }
+      else if (d2xx_name_match(infonode[devidx].Description,
+		job->description, letter, 1)) break;
+   }
+   if (devidx == (int)numDevs) {
+      free(infonode);
+      pthread_mutex_unlock(&d2xx_list_lock);
+      job->error = "Device is not listed by D2XX (need to rmmod "
+		"ftdi_sio?)\n";
+      return NULL;
+   }
+   type = infonode[devidx].Type;
+   free(infonode);
+   ftStatus = FT_Open(devidx, &handle);
+   pthread_mutex_unlock(&d2xx_list_lock);
+
+   if (ftStatus != FT_OK) {
+      job->error = "Unable to open device\n";
+      return NULL;
+   }
+
+   dc = (d2xx_context *)calloc(1, sizeof(d2xx_context));
+   dc->handle = handle;
+   dc->latency = 16;		// The chip's default
+   dc->ftdi.type = d2xx_chip_type(type);
+   dc->ftdi.interface = job->channel;
+   dc->ftdi.readbuffer_chunksize = D2XX_CHUNKSIZE;
+   dc->ftdi.writebuffer_chunksize = D2XX_CHUNKSIZE;
+   dc->ftdi.usb_read_timeout = USB_DEFAULT_TIMEOUT;
+   dc->ftdi.usb_write_timeout = USB_DEFAULT_TIMEOUT;
+   FT_SetTimeouts(handle, USB_DEFAULT_TIMEOUT, USB_DEFAULT_TIMEOUT);
+
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&dc->event.eCondVar, &attr);
+   pthread_cond_init(&dc->done, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_mutex_init(&dc->event.eMutex, NULL);
+
+   if (pipe(dc->evpipe) == 0) {
+      fcntl(dc->evpipe[0], F_SETFL, O_NONBLOCK);
+      fcntl(dc->evpipe[1], F_SETFL, O_NONBLOCK);
+      ftStatus = FT_SetEventNotification(handle, FT_EVENT_RXCHAR,
+		(PVOID)&dc->event);
+      if (ftStatus == FT_OK) {
+	 if (pthread_create(&dc->thread, NULL, d2xx_event_thread, dc) == 0)
+	    return &dc->ftdi;
+	 FT_SetEventNotification(handle, 0, NULL);
+      }
+      close(dc->evpipe[0]);
+      close(dc->evpipe[1]);
+   }
+   FT_Close(handle);
+   pthread_cond_destroy(&dc->event.eCondVar);
+   pthread_cond_destroy(&dc->done);
+   pthread_mutex_destroy(&dc->event.eMutex);
+   free(dc);
+   job->error = "Unable to set up device events.\n";
+   return NULL;
+}
+
+static int
+d2xx_close(struct ftdi_context *ftdi)
+{
+   d2xx_context *dc = D2XX(ftdi);
+   FT_STATUS ftStatus;
+
+   // Nothing is waiting on the device, so no reads are left
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   dc->stopping = 1;
+   pthread_cond_signal(&dc->event.eCondVar);
+   pthread_mutex_unlock(&dc->event.eMutex);
+   pthread_join(dc->thread, NULL);
+
+   FT_SetEventNotification(dc->handle, 0, NULL);
+   ftStatus = FT_Close(dc->handle);
+   close(dc->evpipe[0]);
+   close(dc->evpipe[1]);
+   pthread_cond_destroy(&dc->event.eCondVar);
+   pthread_cond_destroy(&dc->done);
+   pthread_mutex_destroy(&dc->event.eMutex);
+   if (dc->ring != NULL) free(dc->ring);
+   free(dc);
+   return D2XX_RESULT(ftStatus);
+}
+
+static int
+d2xx_reset(struct ftdi_context *ftdi)
+{
+   return D2XX_RESULT(FT_ResetDevice(D2XX(ftdi)->handle));
+}
+
+/*--------------------------------------------------------------*/
+/* Event thread							*/
+/*								*/
+/* Waits on the D2XX event for data to arrive, passing each	*/
+/* event on to "done".  While a read is submitted, or while	*/
+/* there is room in the bulk read buffer, whatever has arrived	*/
+/* is read at once, with FT_GetQueueStatus() giving the amount,	*/
+/* and without the mutex held, as D2XX needs it to signal.  A	*/
+/* read ends when it is full, or, as a libusb transfer does,	*/
+/* when no data arrive for the read timeout.			*/
+/*--------------------------------------------------------------*/
+
+static void
+d2xx_read_end(d2xx_context *dc)
+{
+   d2xx_transfer *rd = dc->reads;
+   char c = 0;
+
+   dc->reads = rd->next;
+   rd->next = dc->ended;
+   dc->ended = rd;
+   pthread_cond_broadcast(&dc->done);
+
+   // If the pipe is full, the notifier has been told already
+   if (write(dc->evpipe[1], &c, 1) < 0) return;
+}
+
+/* Move up to "size" bytes from the bulk read buffer to "buf",	*/
+/* with the mutex held.  Returns the number moved.		*/
+
+static DWORD
+d2xx_ring_take(d2xx_context *dc, unsigned char *buf, DWORD size)
+{
+   DWORD moved = 0, n;
+
+   while ((moved < size) && (dc->ringcount > 0)) {
+      n = dc->ringsize - dc->ringhead;
+      if (n > dc->ringcount) n = dc->ringcount;
+      if (n > size - moved) n = size - moved;
+      memcpy(buf + moved, dc->ring + dc->ringhead, n);
+      dc->ringhead = (dc->ringhead + n) % dc->ringsize;
+      dc->ringcount -= n;
+      moved += n;
+   }
+
+   // The event thread may be waiting for room
+   if (moved > 0) pthread_cond_signal(&dc->event.eCondVar);
+   return moved;
+}
+
+static void *
+d2xx_event_thread(void *arg)
+{
+   d2xx_context *dc = (d2xx_context *)arg;
+   d2xx_transfer *rd;
+   FT_STATUS ftStatus;
+   DWORD queued, got, room;
+   unsigned char *dest;
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   while (!dc->stopping) {
+      rd = dc->reads;
+
+      // Serve the oldest read from the bulk read buffer first
+      if ((rd != NULL) && (dc->ringcount > 0)) {
+	 rd->tc.offset += d2xx_ring_take(dc, rd->tc.buf + rd->tc.offset,
+		rd->tc.size - rd->tc.offset);
+	 d2xx_time(&rd->expires, dc->ftdi.usb_read_timeout);
+	 if (rd->tc.offset >= rd->tc.size)
+	    d2xx_read_end(dc);
+	 else
+	    pthread_cond_broadcast(&dc->done);
+	 continue;
+      }
+
+      if (dc->ring != NULL) {
+	 got = (dc->ringhead + dc->ringcount) % dc->ringsize;
+	 dest = dc->ring + got;
+	 room = dc->ringsize - dc->ringcount;
+	 if (room > dc->ringsize - got) room = dc->ringsize - got;
+      }
+      else if (rd != NULL) {
+	 dest = rd->tc.buf + rd->tc.offset;
+	 room = rd->tc.size - rd->tc.offset;
+      }
+      else
+	 room = 0;
+
+      queued = 0;
+      if ((room > 0) && !dc->purging) {
+	 ftStatus = FT_GetQueueStatus(dc->handle, &queued);
+	 if ((ftStatus != FT_OK) && (rd != NULL)) {
+	    rd->tc.offset = -1;
+	    d2xx_read_end(dc);
+	    continue;
+	 }
+      }
+      if (queued == 0) {
+	 if (rd == NULL)
+	    pthread_cond_wait(&dc->event.eCondVar, &dc->event.eMutex);
+	 else if (pthread_cond_timedwait(&dc->event.eCondVar,
+		&dc->event.eMutex, &rd->expires) == ETIMEDOUT)
+	    d2xx_read_end(dc);
+	 pthread_cond_broadcast(&dc->done);
+	 continue;
+      }
+
+      if (queued > room) queued = room;
+      dc->busy = 1;
+      pthread_mutex_unlock(&dc->event.eMutex);
+      ftStatus = FT_Read(dc->handle, dest, queued, &got);
+      pthread_mutex_lock(&dc->event.eMutex);
+      dc->busy = 0;
+
+      if (ftStatus != FT_OK) {
+	 if (rd != NULL) {
+	    rd->tc.offset = -1;
+	    d2xx_read_end(dc);
+	    continue;
+	 }
+      }
+      else if (dc->ring != NULL)
+	 dc->ringcount += got;
+      else {
+	 rd->tc.offset += got;
+	 d2xx_time(&rd->expires, dc->ftdi.usb_read_timeout);
+	 if (rd->tc.offset >= rd->tc.size) {
+	    d2xx_read_end(dc);
+	    continue;
+	 }
+      }
+      pthread_cond_broadcast(&dc->done);
+   }
+   pthread_mutex_unlock(&dc->event.eMutex);
+   return NULL;
+}
+
+/*--------------------------------------------------------------*/
+/* Wait up to "ms" for data to be in the receive queue, and	*/
+/* return the number of bytes in it in "queued".		*/
+/*--------------------------------------------------------------*/
+
+static FT_STATUS
+d2xx_wait(d2xx_context *dc, int ms, DWORD *queued)
+{
+   struct timespec when;
+   FT_STATUS ftStatus;
+
+   d2xx_time(&when, ms);
+   pthread_mutex_lock(&dc->event.eMutex);
+   while (1) {
+      ftStatus = FT_GetQueueStatus(dc->handle, queued);
+      if ((ftStatus != FT_OK) || (*queued > 0)) break;
+      if (pthread_cond_timedwait(&dc->done, &dc->event.eMutex,
+		&when) != 0) {
+	 ftStatus = FT_GetQueueStatus(dc->handle, queued);
+	 break;
+      }
+   }
+   pthread_mutex_unlock(&dc->event.eMutex);
+   return ftStatus;
+}
+
+/*--------------------------------------------------------------*/
+/* Read as ftdi_read_data() does:  Return once "size" bytes	*/
+/* have been read, or when no more data arrive within the	*/
+/* latency timer, with whatever was read.  With a bulk read	*/
+/* buffer, the data are taken from the buffer as the event	*/
+/* thread fills it.						*/
+/*--------------------------------------------------------------*/
+
+static int
+d2xx_read(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   d2xx_context *dc = D2XX(ftdi);
+   struct timespec when;
+   DWORD queued, got;
+   int done = 0;
+
+   if (dc->ring != NULL) {
+      d2xx_time(&when, dc->latency + D2XX_READ_SLACK);
+      pthread_mutex_lock(&dc->event.eMutex);
+      while (done < size) {
+	 got = d2xx_ring_take(dc, buf + done, size - done);
+	 if (got > 0) {
+	    done += got;
+	    d2xx_time(&when, dc->latency + D2XX_READ_SLACK);
+	 }
+	 else if (pthread_cond_timedwait(&dc->done, &dc->event.eMutex,
+		&when) != 0)
+	    break;
+      }
+      pthread_mutex_unlock(&dc->event.eMutex);
+      return done;
+   }
+
+   while (done < size) {
+      if (d2xx_wait(dc, dc->latency + D2XX_READ_SLACK, &queued) != FT_OK)
+	 return -1;
+      if (queued == 0) break;
+      if (queued > (DWORD)(size - done)) queued = size - done;
+      if (FT_Read(dc->handle, buf + done, queued, &got) != FT_OK)
+	 return -1;
+      done += got;
+   }
+   return done;
+}
+
+static int
+d2xx_write(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+   DWORD got;
+
+   if (FT_Write(D2XX(ftdi)->handle, (LPVOID)buf, size, &got) != FT_OK)
+      return -1;
+   return (int)got;
+}
+
+/*--------------------------------------------------------------*/
+/* Transfers:  A write is handed to D2XX at once, and is	*/
+/* returned completed.  A read is queued for the event thread,	*/
+/* and completes as its data arrive.				*/
+/*--------------------------------------------------------------*/
+
+static struct ftdi_transfer_control *
+d2xx_write_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   struct ftdi_transfer_control *tc;
+   int moved;
+
+   moved = d2xx_write(ftdi, buf, size);
+   if (moved < 0) return NULL;
+   tc = (struct ftdi_transfer_control *)calloc(1,
+		sizeof(struct ftdi_transfer_control));
+   if (tc == NULL) return NULL;
+   tc->ftdi = ftdi;
+   tc->buf = buf;
+   tc->size = size;
+   tc->offset = moved;
+   tc->completed = 1;
+   return tc;
+}
+
+static struct ftdi_transfer_control *
+d2xx_read_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   d2xx_context *dc = D2XX(ftdi);
+   d2xx_transfer *rd, **rp;
+
+   rd = (d2xx_transfer *)calloc(1, sizeof(d2xx_transfer));
+   if (rd == NULL) return NULL;
+   rd->tc.ftdi = ftdi;
+   rd->tc.buf = buf;
+   rd->tc.size = size;
+   if (size <= 0) {
+      rd->tc.completed = 1;
+      return &rd->tc;
+   }
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   d2xx_time(&rd->expires, ftdi->usb_read_timeout);
+   for (rp = &dc->reads; *rp; rp = &(*rp)->next);
+   *rp = rd;
+   pthread_cond_signal(&dc->event.eCondVar);
+   pthread_mutex_unlock(&dc->event.eMutex);
+   return &rd->tc;
+}
+
+/* Mark the reads that have ended completed.  Called by the	*/
+/* interpreter's thread with the mutex held.			*/
+
+static void
+d2xx_collect(d2xx_context *dc)
+{
+   d2xx_transfer *rd;
+
+   while ((rd = dc->ended) != NULL) {
+      dc->ended = rd->next;
+      rd->tc.completed = 1;
+   }
+}
+
+/* Wait for a transfer to complete, then free it.  A read ends	*/
+/* at the latest at its read timeout.				*/
+
+static int
+d2xx_transfer_done(struct ftdi_transfer_control *tc)
+{
+   d2xx_context *dc = D2XX(tc->ftdi);
+   int moved;
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   d2xx_collect(dc);
+   while (!tc->completed) {
+      pthread_cond_wait(&dc->done, &dc->event.eMutex);
+      d2xx_collect(dc);
+   }
+   pthread_mutex_unlock(&dc->event.eMutex);
+   moved = tc->offset;
+   free(tc);
+   return moved;
+}
+
+/* Take a read away from the event thread, once it is out of	*/
+/* FT_Read(), and free it.					*/
+
+static int
+d2xx_transfer_cancel(struct ftdi_transfer_control *tc, struct timeval *tv)
+{
+   d2xx_context *dc = D2XX(tc->ftdi);
+   d2xx_transfer **rp;
+   int moved;
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   d2xx_collect(dc);
+   while (dc->busy && !tc->completed) {
+      pthread_cond_wait(&dc->done, &dc->event.eMutex);
+      d2xx_collect(dc);
+   }
+   for (rp = &dc->reads; *rp; rp = &(*rp)->next)
+      if (&(*rp)->tc == tc) {
+	 *rp = (*rp)->next;
+	 break;
+      }
+   pthread_mutex_unlock(&dc->event.eMutex);
+   moved = tc->offset;
+   free(tc);
+   return moved;
+}
+
+/* Wait up to "tv" for the event thread, returning early once	*/
+/* "completed" is set.						*/
+
+static int
+d2xx_handle_events(struct ftdi_context *ftdi, struct timeval *tv,
+	int *completed)
+{
+   d2xx_context *dc = D2XX(ftdi);
+   struct timespec when;
+
+   d2xx_time(&when, tv->tv_sec * 1000 + tv->tv_usec / 1000);
+   pthread_mutex_lock(&dc->event.eMutex);
+   d2xx_collect(dc);
+   while ((completed == NULL) || !*completed) {
+      if (pthread_cond_timedwait(&dc->done, &dc->event.eMutex, &when) != 0)
+	 break;
+      d2xx_collect(dc);
+   }
+   pthread_mutex_unlock(&dc->event.eMutex);
+   return 0;
+}
+
+/* Tcl file handler for "evpipe":  Resume the coroutines whose	*/
+/* reads have completed.					*/
+
+static void
+d2xx_events(ClientData clientData, int mask)
+{
+   d2xx_context *dc = (d2xx_context *)clientData;
+   char buf[64];
+
+   while (read(dc->evpipe[0], buf, sizeof(buf)) > 0);
+   pthread_mutex_lock(&dc->event.eMutex);
+   d2xx_collect(dc);
+   pthread_mutex_unlock(&dc->event.eMutex);
+   usb_source_resume(&dc->src);
+}
+
+static void
+d2xx_watch(struct ftdi_context *ftdi)
+{
+   d2xx_context *dc = D2XX(ftdi);
+
+   Tcl_CreateFileHandler(dc->evpipe[0], TCL_READABLE, d2xx_events,
+		(ClientData)dc);
+   dc->watched = 1;
+}
+
+static void
+d2xx_unwatch(struct ftdi_context *ftdi)
+{
+   d2xx_context *dc = D2XX(ftdi);
+
+   if (dc->watched) Tcl_DeleteFileHandler(dc->evpipe[0]);
+   dc->watched = 0;
+}
+
+static usb_source *
+d2xx_source(struct ftdi_context *ftdi)
+{
+   d2xx_context *dc = D2XX(ftdi);
+
+   return (dc->watched) ? &dc->src : NULL;
+}
+
+/*--------------------------------------------------------------*/
+/* Device settings						*/
+/*--------------------------------------------------------------*/
+
+static int
+d2xx_purge_tx(struct ftdi_context *ftdi)
+{
+   return D2XX_RESULT(FT_Purge(D2XX(ftdi)->handle, FT_PURGE_TX));
+}
+
+/* Purge the receive queue, and the bulk read buffer with it.	*/
+/* The event thread is kept out of the queue meanwhile.		*/
+
+static int
+d2xx_purge_rx(struct ftdi_context *ftdi)
+{
+   d2xx_context *dc = D2XX(ftdi);
+   FT_STATUS ftStatus;
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   dc->purging = 1;
+   while (dc->busy)
+      pthread_cond_wait(&dc->done, &dc->event.eMutex);
+   pthread_mutex_unlock(&dc->event.eMutex);
+
+   ftStatus = FT_Purge(dc->handle, FT_PURGE_RX);
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   dc->ringhead = 0;
+   dc->ringcount = 0;
+   dc->purging = 0;
+   pthread_cond_signal(&dc->event.eCondVar);
+   pthread_mutex_unlock(&dc->event.eMutex);
+   return D2XX_RESULT(ftStatus);
+}
+
+static int
+d2xx_set_bitmode(struct ftdi_context *ftdi, unsigned char mask,
+	unsigned char mode)
+{
+   return D2XX_RESULT(FT_SetBitMode(D2XX(ftdi)->handle, mask, mode));
+}
+
+static int
+d2xx_set_latency(struct ftdi_context *ftdi, unsigned char latency)
+{
+   FT_STATUS ftStatus;
+
+   ftStatus = FT_SetLatencyTimer(D2XX(ftdi)->handle, latency);
+   if (ftStatus == FT_OK) D2XX(ftdi)->latency = latency;
+   return D2XX_RESULT(ftStatus);
+}
+
+static int
+d2xx_set_baudrate(struct ftdi_context *ftdi, int baudrate)
+{
+   return D2XX_RESULT(FT_SetBaudRate(D2XX(ftdi)->handle, (ULONG)baudrate));
+}
+
+/* The chunk sizes are the USB transfer sizes of D2XX, which	*/
+/* takes multiples of 64 bytes up to 64kB.  As with libftdi,	*/
+/* the size kept is the one D2XX accepted.  (Some D2XX		*/
+/* versions ignore the write size.)				*/
+
+static unsigned int
+d2xx_usb_size(unsigned int size)
+{
+   if (size > D2XX_MAX_USB_SIZE) return D2XX_MAX_USB_SIZE;
+   if (size < 64) return 64;
+   return (size + 63) & ~63;
+}
+
+static int
+d2xx_usb_parameters(struct ftdi_context *ftdi, unsigned int rdsize,
+	unsigned int wrsize)
+{
+   FT_STATUS ftStatus;
+
+   rdsize = d2xx_usb_size(rdsize);
+   wrsize = d2xx_usb_size(wrsize);
+   if ((rdsize == ftdi->readbuffer_chunksize) &&
+		(wrsize == ftdi->writebuffer_chunksize))
+      return 0;
+   ftStatus = FT_SetUSBParameters(D2XX(ftdi)->handle, (ULONG)rdsize,
+		(ULONG)wrsize);
+   if (ftStatus != FT_OK) return -1;
+   ftdi->readbuffer_chunksize = rdsize;
+   ftdi->writebuffer_chunksize = wrsize;
+   return 0;
+}
+
+static int
+d2xx_set_read_chunksize(struct ftdi_context *ftdi, unsigned int size)
+{
+   return d2xx_usb_parameters(ftdi, size, ftdi->writebuffer_chunksize);
+}
+
+static int
+d2xx_get_read_chunksize(struct ftdi_context *ftdi, unsigned int *size)
+{
+   *size = ftdi->readbuffer_chunksize;
+   return 0;
+}
+
+static int
+d2xx_set_write_chunksize(struct ftdi_context *ftdi, unsigned int size)
+{
+   return d2xx_usb_parameters(ftdi, ftdi->readbuffer_chunksize, size);
+}
+
+static int
+d2xx_get_write_chunksize(struct ftdi_context *ftdi, unsigned int *size)
+{
+   *size = ftdi->writebuffer_chunksize;
+   return 0;
+}
+
+static int
+d2xx_set_timeouts(struct ftdi_context *ftdi, int rdms, int wrms)
+{
+   FT_STATUS ftStatus;
+
+   ftStatus = FT_SetTimeouts(D2XX(ftdi)->handle, (ULONG)rdms, (ULONG)wrms);
+   if (ftStatus == FT_OK) {
+      ftdi->usb_read_timeout = rdms;
+      ftdi->usb_write_timeout = wrms;
+   }
+   return D2XX_RESULT(ftStatus);
+}
+
+static int
+d2xx_set_flowctrl(struct ftdi_context *ftdi, int flowctrl)
+{
+   USHORT flow;
+
+   switch (flowctrl) {
+      case SIO_RTS_CTS_HS:	flow = FT_FLOW_RTS_CTS;		break;
+      case SIO_DTR_DSR_HS:	flow = FT_FLOW_DTR_DSR;		break;
+      case SIO_XON_XOFF_HS:	flow = FT_FLOW_XON_XOFF;	break;
+      default:			flow = FT_FLOW_NONE;		break;
+   }
+   return D2XX_RESULT(FT_SetFlowControl(D2XX(ftdi)->handle, flow,
+		D2XX_XON, D2XX_XOFF));
+}
+
+/* D2XX sets both characters at once */
+
+static int
+d2xx_set_chars(d2xx_context *dc)
+{
+   return D2XX_RESULT(FT_SetChars(dc->handle, dc->evchar[0], dc->evchar[1],
+		dc->errchar[0], dc->errchar[1]));
+}
+
+static int
+d2xx_set_event_char(struct ftdi_context *ftdi, unsigned char c,
+	unsigned char enable)
+{
+   D2XX(ftdi)->evchar[0] = c;
+   D2XX(ftdi)->evchar[1] = enable;
+   return d2xx_set_chars(D2XX(ftdi));
+}
+
+static int
+d2xx_set_error_char(struct ftdi_context *ftdi, unsigned char c,
+	unsigned char enable)
+{
+   D2XX(ftdi)->errchar[0] = c;
+   D2XX(ftdi)->errchar[1] = enable;
+   return d2xx_set_chars(D2XX(ftdi));
+}
+
+/* Replace the bulk read buffer with one of "size" bytes, or	*/
+/* none, keeping any data not yet read (so that it may stay	*/
+/* larger than asked).						*/
+
+static int
+d2xx_set_bulkread(struct ftdi_context *ftdi, unsigned int size)
+{
+   d2xx_context *dc = D2XX(ftdi);
+   unsigned char *ring = NULL;
+   DWORD count;
+
+   pthread_mutex_lock(&dc->event.eMutex);
+   while (dc->busy)
+      pthread_cond_wait(&dc->done, &dc->event.eMutex);
+   count = dc->ringcount;
+   if (size < count) size = count;
+   if (size > 0) {
+      ring = (unsigned char *)malloc(size);
+      if (ring == NULL) {
+	 pthread_mutex_unlock(&dc->event.eMutex);
+	 return -1;
+      }
+      d2xx_ring_take(dc, ring, count);
+   }
+   if (dc->ring != NULL) free(dc->ring);
+   dc->ring = ring;
+   dc->ringsize = size;
+   dc->ringhead = 0;
+   dc->ringcount = count;
+   pthread_cond_signal(&dc->event.eCondVar);
+   pthread_mutex_unlock(&dc->event.eMutex);
+   return 0;
+}
+
+ftdi_backend d2xx_backend = {
+   "d2xx",
+   d2xx_open,
+   d2xx_close,
+   d2xx_reset,
+   d2xx_write,
+   d2xx_read,
+   d2xx_write_submit,
+   d2xx_read_submit,
+   d2xx_transfer_done,
+   d2xx_transfer_cancel,
+   d2xx_handle_events,
+   d2xx_watch,
+   d2xx_unwatch,
+   d2xx_source,
+   d2xx_purge_tx,
+   d2xx_purge_rx,
+   d2xx_set_bitmode,
+   d2xx_set_latency,
+   d2xx_set_baudrate,
+   d2xx_set_read_chunksize,
+   d2xx_get_read_chunksize,
+   d2xx_set_write_chunksize,
+   d2xx_get_write_chunksize,
+   d2xx_set_timeouts,
+   d2xx_set_flowctrl,
+   d2xx_set_event_char,
+   d2xx_set_error_char,
+   d2xx_set_bulkread
+};
+
+#endif /* HAVE_D2XX */
@@ -13,10 +13,15 @@
 #include <unistd.h>
 #include <time.h>
 #include <dlfcn.h>
+#include <pthread.h>
+#include <poll.h>
 
 #include <ftdi.h>
 #include <tcl.h>
 
+#include "ftdi_wave.h"
+#include "ftdi_backend.h"
+
 /* Forward declarations */
 
 extern void Fprintf(Tcl_Interp *interp, FILE *f, char *format, ...);
@@ -26,20 +31,60 @@ extern void Fprintf(Tcl_Interp *interp, FILE *f, char *format, ...);
 /* Each device record contains the device handle and the	*/
 /* device description.  To do:  Add the dbus read-back value	*/
 /* and use this as an alternative device identifier.		*/
+/*								*/
+/* A virtual SPI device (see "ftdi::spi_device") has its own	*/
+/* record with its own chip select, but shares the USB channel	*/
+/* of the record it was made from ("channel").  The GPIO	*/
+/* shadow and merge queue are kept in the channel record only.	*/
 /*--------------------------------------------------------------*/
 
 typedef struct _ftdi_record {
    struct ftdi_context *ftContext;
    char *description;
    unsigned char flags;
+   ftdi_backend *backend;	// USB backend of the channel
    unsigned char cmdwidth;	// Number bits for command word
-   unsigned char wordwidth;	// Bits per word for bit-bang mode
+   int wordwidth;		// Bits per word for bit-bang mode
    unsigned char sigpins[8];	// Signal pin assignments for bit-bang mode
+   unsigned char pinlut[256];	// Logical signal byte to pin values
+   unsigned char *setbuffer;	// Scratch buffer for bitbang_set
+   // Per-channel state
+   unsigned short gpio_out;	// Shadow of GPIO output values (MPSSE)
+   unsigned short gpio_dir;	// Shadow of GPIO directions (MPSSE)
+   unsigned char gpio_pending;	// GPIO bytes changed but not yet sent
+   unsigned short gpio_resv;	// GPIO pins used by SPI and chip selects
+   unsigned char *txqueue;	// Merged SPI writes not yet sent
+   int txlen;			// Number of bytes in txqueue
+   unsigned char merging;	// SPI writes are held in txqueue
+   double sckrate;		// Actual MPSSE SCK rate (Hz)
+   unsigned char clkflags;	// MPSSE clocking options (CLK_3PHASE, etc.)
+   unsigned char hw_mode;	// Bit mode last set (BITMODE_MPSSE, etc.)
+   unsigned char hw_dirs;	// Pin directions last set with hw_mode
+   int hw_baud;			// Baud rate last set, or -1 if unknown
+   int hw_latency;		// Latency timer last set (ms), or -1
+   int tn_latency;		// Latency timer to use (ms), from ftdi::tune
+   unsigned int tn_rdchunk;	// USB read transfer size from ftdi::tune, or 0
+   unsigned int tn_wrchunk;	// USB write transfer size from ftdi::tune, or 0
+   int tn_flow;			// Flow control (index into tune_flow_names)
+   int tn_eventchar;		// Event character, or -1 if disabled
+   int tn_errorchar;		// Error character, or -1 if disabled
+   unsigned int tn_bulkread;	// Size of the bulk read buffer, or 0
+   int tmo_device;		// Deadline of each transfer command (ms), or 0
+   unsigned char suspended;	// A coroutine is waiting on a transfer
+   unsigned char jtag_state;	// JTAG TAP state (TAP_UNKNOWN if not known)
+   int jtag_ndev;		// Number of TAPs in the JTAG scan chain
+   int *jtag_irlen;		// IR length of each TAP, from TDO
+   // Per-device state
+   unsigned short csmask;	// Chip select pin of this device (MPSSE)
+   unsigned char spimode;	// SPI clock mode and bit order (MPSSE)
+   unsigned char op_write;	// MPSSE data write opcode for spimode
+   unsigned char op_read;	// MPSSE data read opcode for spimode
+   struct _ftdi_record *channel; // Record owning the USB channel
 } ftdi_record;
 
 /* Flag definitions */
 #define CS_INVERT    0x01	// CS is sense-positive
-#define MIXED_MODE   0x03	// Mixed mode has SDI and SDO on
+#define MIXED_MODE   0x02	// Mixed mode has SDI and SDO on
 				// different SCK edges.
 #define BITBANG_MODE 0x04	// Set bit-bang mode
 #define CSB_NORAISE  0x08	// CSB is not raised after read or write
@@ -47,6 +92,29 @@ typedef struct _ftdi_record {
 				// opcode and supports 16 registers.
 #define SERIAL_MODE  0x20	// FTDI in default serial mode.
 
+/* SPI mode bits (spimode) */
+#define SPI_CPHA      0x01	// Data sampled on trailing SCK edge
+#define SPI_CPOL      0x02	// SCK idles high
+#define SPI_LSB_FIRST 0x04	// Data shifted least significant bit first
+
+#define HW_UNKNOWN   0xff	// hw_mode not known
+#define TAP_UNKNOWN  0xff	// jtag_state not known;  reset on first use
+
+/* USB transfer size for a bulk command:  the size set with	*/
+/* ftdi::tune if any, else the command's own default.		*/
+#define TUNED_CHUNK(tuned, dflt) (((tuned) > 0) ? (tuned) : (dflt))
+
+/* Backend of the channel of a record */
+#define BACKEND(rec) ((rec)->channel->backend)
+
+/* USB timeout of a channel:  the device deadline, if any (ms) */
+#define DEVICE_TIMEOUT(chan) \
+	(((chan)->tmo_device > 0) ? (chan)->tmo_device : USB_DEFAULT_TIMEOUT)
+
+/* GPIO pending flags */
+#define GPIO_LOW     0x01	// ADBUS shadow not yet sent
+#define GPIO_HIGH    0x02	// ACBUS shadow not yet sent
+
 Tcl_HashTable handletab;
 Tcl_Interp *ftdiinterp;
 
@@ -114,1483 +182,7110 @@ find_record(char *devstr, struct ftdi_context **handleptr)
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi_setid"					*/
-/* Set the product and vendor IDs used by "ftdi_open".		*/
+/* Return true if any virtual SPI device shares the channel	*/
+/* "chan".  Virtual devices are copies of the channel record	*/
+/* made in MPSSE mode, so the channel must stay in MPSSE mode	*/
+/* while any exist.						*/
 /*--------------------------------------------------------------*/
 
-int
-ftditcl_setid(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static bool
+channel_shared(ftdi_record *chan)
 {
-   int vid_val, pid_val;
-   Tcl_Obj *lobj;
-
-   if (objc > 1) {
-
-      Tcl_GetIntFromObj(interp, objv[1], &pid_val);
-      usb_pid = pid_val & 0xffff;
+   Tcl_HashEntry *h;
+   Tcl_HashSearch hs;
+   ftdi_record *ftRecordPtr;
 
-      if (objc > 2) {
-         Tcl_GetIntFromObj(interp, objv[2], &vid_val);
-         usb_vid = vid_val & 0xffff;
-      }
+   for (h = Tcl_FirstHashEntry(&handletab, &hs); h != NULL;
+		h = Tcl_NextHashEntry(&hs)) {
+      ftRecordPtr = (ftdi_record *)Tcl_GetHashValue(h);
+      if ((ftRecordPtr->channel == chan) && (ftRecordPtr != chan))
+	 return true;
    }
-
-   lobj = Tcl_NewListObj(0, NULL);
-   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj(usb_pid));
-   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj(usb_vid));
-   Tcl_SetObjResult(interp, lobj);
-   return TCL_OK;
+   return false;
 }
- 
+
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi_get"					*/
-/* Read status of byte values on device cbus			*/
+/* Direct USB reads						*/
+/*								*/
+/* The "direct" backend reads the bulk IN endpoint with its	*/
+/* own queue of libusb transfers instead of through		*/
+/* ftdi_read_data_submit().  libftdi receives each transfer	*/
+/* into its read buffer, removes the two modem status bytes	*/
+/* that begin every USB packet by moving the data down, and	*/
+/* then copies the data out again.  Here the payload of each	*/
+/* packet is copied once, from the transfer straight into the	*/
+/* caller's buffer, and up to DIRECT_QUEUE transfers are kept	*/
+/* in flight so that the endpoint is not left idle between	*/
+/* them.  Writes are not affected:  libftdi already sends them	*/
+/* from the caller's buffer.					*/
+/*								*/
+/* A direct read is an ordinary ftdi_transfer_control (the	*/
+/* first member of a direct_read), with a NULL "transfer", so	*/
+/* that the command layer waits on it as on any other.  The	*/
+/* backend's own transfer_done and transfer_cancel operations	*/
+/* run libusb until it completes.				*/
+/*								*/
+/* Only whole packets can be asked for, so the last packet may	*/
+/* carry data past the end of the read.  That is left in	*/
+/* libftdi's read buffer, where the next read finds it first,	*/
+/* as libftdi does with its own.				*/
 /*--------------------------------------------------------------*/
 
-int
-ftditcl_get(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+#define DIRECT_QUEUE	4	// Transfers in flight for one read
+
+typedef struct _direct_read {
+   struct ftdi_transfer_control tc;	// Must be first
+   struct libusb_transfer *queue[DIRECT_QUEUE]; // Transfers in flight
+   int pending;			// Number of transfers in flight
+   int asked;			// Payload bytes those transfers can hold
+   int psize;			// USB packet size of the IN endpoint
+   bool stopping;		// Finished, failed, or cancelled
+   bool failed;			// A transfer failed
+   bool orphaned;		// Given up by transfer_wait();  free when idle
+} direct_read;
+
+/* Payload bytes held by a transfer of "length" bytes		*/
+#define DIRECT_PAYLOAD(dr, length) \
+	(((length) / (dr)->psize) * ((dr)->psize - 2))
+
+static void LIBUSB_CALL direct_read_cb(struct libusb_transfer *transfer);
+
+/* Keep data received past the end of a read in libftdi's read	*/
+/* buffer.							*/
+
+static void
+direct_read_keep(struct ftdi_context *ftdi, unsigned char *data, int n)
 {
-   int val;
-   unsigned char flags;
-   unsigned char tbuffer[4];
-   unsigned char rbuffer[4];
+   int end;
+
+   if (ftdi->readbuffer_remaining == 0) ftdi->readbuffer_offset = 0;
+   end = ftdi->readbuffer_offset + ftdi->readbuffer_remaining;
+   if (n > (int)ftdi->readbuffer_chunksize - end)
+      n = (int)ftdi->readbuffer_chunksize - end;
+   if (n <= 0) return;
+   memcpy(ftdi->readbuffer + end, data, n);
+   ftdi->readbuffer_remaining += n;
+}
 
-   long numWritten;
-   long numRead;
-   ftdi_record *ftRecord;
-   struct ftdi_context * ftContext;
-   int ftStatus;
- 
-   if (objc <= 1) {
-     Tcl_SetResult(interp, "get: Need device name\n", NULL);
-     return TCL_ERROR;
-   }
+/* Submit "transfer" (or a new one if NULL) for the part of the	*/
+/* read not yet covered by the transfers in flight.  Returns 1	*/
+/* if submitted, 0 if nothing is left to ask for (freeing	*/
+/* "transfer"), or -1 on error.					*/
 
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "get:  No such device\n", NULL);
-      return TCL_ERROR;
+static int
+direct_read_next(direct_read *dr, struct libusb_transfer *transfer)
+{
+   struct ftdi_context *ftdi = dr->tc.ftdi;
+   unsigned char *buffer;
+   int need, packets, maxpackets, slot;
+
+   need = dr->tc.size - dr->tc.offset - dr->asked;
+   for (slot = 0; slot < DIRECT_QUEUE; slot++)
+      if (dr->queue[slot] == NULL) break;
+   if (dr->stopping || (need <= 0) || (slot == DIRECT_QUEUE)) {
+      if (transfer != NULL) libusb_free_transfer(transfer);
+      return 0;
    }
-   else flags = ftRecord->flags;
-
-   tbuffer[0] = 0x83;		// Read high byte (i.e., Cbus)
 
-   if (verbose > 1) {
-      int i;
-      Fprintf(interp, stderr, "ftdi_get: Writing: ");
-      for (i = 0; i < 1; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+   // Transfers are sized by ftdi_read_data_set_chunksize(), as
+   // libftdi's own are.
+   maxpackets = (int)ftdi->readbuffer_chunksize / dr->psize;
+   if (maxpackets < 1) maxpackets = 1;
+   packets = (need + dr->psize - 3) / (dr->psize - 2);
+   if (packets > maxpackets) packets = maxpackets;
+
+   if (transfer == NULL) {
+      transfer = libusb_alloc_transfer(0);
+      if (transfer == NULL) return -1;
+      buffer = (unsigned char *)malloc(maxpackets * dr->psize);
+      if (buffer == NULL) {
+	 libusb_free_transfer(transfer);
+	 return -1;
       }
-      Fprintf(interp, stderr, "\n");
+      // libftdi's "out_ep" is the endpoint that it reads from
+      libusb_fill_bulk_transfer(transfer, ftdi->usb_dev, ftdi->out_ep,
+		buffer, maxpackets * dr->psize, direct_read_cb, dr,
+		ftdi->usb_read_timeout);
+      transfer->flags |= LIBUSB_TRANSFER_FREE_BUFFER;
    }
+   transfer->length = packets * dr->psize;
 
-   ftStatus = ftdi_write_data(ftContext, tbuffer, 1);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while reading Dbus\n", NULL);
-   else if (ftStatus != 1)
-      Tcl_SetResult(interp, "get:  short write error.\n", NULL);
-
-   ftStatus = ftdi_read_data(ftContext, rbuffer, 1);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while reading Dbus\n", NULL);
-   else if (ftStatus != 1)
-      Tcl_SetResult(interp, "get:  short read error.\n", NULL);
-
-   Tcl_SetObjResult(interp, Tcl_NewIntObj((int)rbuffer[0]));
-   return TCL_OK;
+   if (libusb_submit_transfer(transfer) < 0) {
+      libusb_free_transfer(transfer);
+      return -1;
+   }
+   dr->queue[slot] = transfer;
+   dr->pending++;
+   dr->asked += DIRECT_PAYLOAD(dr, transfer->length);
+   return 1;
 }
 
-/*--------------------------------------------------------------*/
-/* Tcl function "ftdi_verbose"					*/
-/*--------------------------------------------------------------*/
+/* Stop a direct read:  No more transfers are submitted, and	*/
+/* those in flight are cancelled.				*/
 
-int
-ftditcl_verbose(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static void
+direct_read_stop(direct_read *dr)
 {
-  int level, result;
- 
-  if (objc <= 1) {
-     Tcl_SetObjResult(interp, Tcl_NewIntObj((int)verbose));
-     return TCL_OK;
-  }
-
-  result = Tcl_GetIntFromObj(interp, objv[1], &level);
-  if (result != TCL_OK) return result;
-  if (level < 0) {
-      Tcl_SetResult(interp, "verbose: Bad verbose level\n", NULL);
-      return TCL_ERROR;
-  }
+   int slot;
 
-  verbose = level;
-  return TCL_OK;
+   dr->stopping = true;
+   for (slot = 0; slot < DIRECT_QUEUE; slot++)
+      if (dr->queue[slot] != NULL)
+	 libusb_cancel_transfer(dr->queue[slot]);
 }
 
-/*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_command":  Set the word length of	*/
-/* the SPI command word, which can accomodate lengths other	*/
-/* than the default 8.	In bit-bang mode, the bit length is	*/
-/* arbitrary.  In MPSSE mode, the bit length must be a multiple	*/
-/* of 8.							*/
-/*--------------------------------------------------------------*/
+/* Completion callback for the transfers of a direct read	*/
 
-int
-ftditcl_spi_command(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static void LIBUSB_CALL
+direct_read_cb(struct libusb_transfer *transfer)
 {
-   ftdi_record *ftRecord;
-   unsigned char flags;
-   int cmdwidth, result;
+   direct_read *dr = (direct_read *)transfer->user_data;
+   struct ftdi_transfer_control *tc = &dr->tc;
+   unsigned char *data;
+   int i, n, want, slot;
+
+   for (slot = 0; slot < DIRECT_QUEUE; slot++)
+      if (dr->queue[slot] == transfer) dr->queue[slot] = NULL;
+   dr->pending--;
+   dr->asked -= DIRECT_PAYLOAD(dr, transfer->length);
+
+   switch (transfer->status) {
+      case LIBUSB_TRANSFER_COMPLETED:
+      case LIBUSB_TRANSFER_TIMED_OUT:
+      case LIBUSB_TRANSFER_CANCELLED:
+	 if (dr->orphaned) break;	// The caller's buffer is gone
+
+	 // Copy the payload of each packet, skipping its status bytes
+	 for (i = 0; i < transfer->actual_length; i += dr->psize) {
+	    data = transfer->buffer + i + 2;
+	    n = transfer->actual_length - i - 2;
+	    if (n > dr->psize - 2) n = dr->psize - 2;
+	    if (n <= 0) continue;
+	    want = tc->size - tc->offset;
+	    if (want > n) want = n;
+	    if (want > 0) {
+	       memcpy(tc->buf + tc->offset, data, want);
+	       tc->offset += want;
+	    }
+	    if (n > want) direct_read_keep(tc->ftdi, data + want, n - want);
+	 }
+	 break;
+      default:
+	 dr->failed = true;
+	 direct_read_stop(dr);
+	 break;
+   }
 
-   if (objc != 3) {
-      Tcl_SetResult(interp, "spi_command: Need handle and integer value.\n", NULL);
-      return TCL_ERROR;
+   if (!dr->stopping && (tc->offset >= tc->size))
+      direct_read_stop(dr);
+
+   // Reuse the transfer for the next part of the read, and keep
+   // the queue full.
+
+   if (direct_read_next(dr, transfer) >= 0) {
+      while (direct_read_next(dr, NULL) > 0);
    }
-   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
-   if (ftRecord == (ftdi_record *)NULL) {
-      Tcl_SetResult(interp, "spi_command:  No such device\n", NULL);
-      return TCL_ERROR;
+   else if (dr->pending > 0) {
+      dr->failed = true;
+      direct_read_stop(dr);
    }
-   else flags = ftRecord->flags;
+   else
+      dr->failed = true;
 
-   if (flags & LEGACY_MODE) {
-      Tcl_SetResult(interp, "spi_command:  Cannot change command word "
-		"length in legacy mode\n", NULL);
-      return TCL_ERROR;
+   if (dr->pending == 0) {
+      if (dr->orphaned)
+	 free(dr);
+      else {
+	 if (dr->failed) tc->offset = -1;
+	 tc->completed = 1;
+      }
    }
+}
 
-   result = Tcl_GetIntFromObj(interp, objv[2], &cmdwidth);
-   if (result != TCL_OK) return result;
+/* Start a direct read of "size" bytes into "buf".		*/
 
-   if (cmdwidth > 64) {
-      Tcl_SetResult(interp, "spi_command:  Command word "
-		"maximum length is 64 bits.\n", NULL);
-      return TCL_ERROR;
+static struct ftdi_transfer_control *
+direct_read_submit(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+   direct_read *dr;
+   int n;
+
+   dr = (direct_read *)calloc(1, sizeof(direct_read));
+   if (dr == NULL) return NULL;
+   dr->tc.ftdi = ftdi;
+   dr->tc.buf = buf;
+   dr->tc.size = size;
+   dr->psize = (ftdi->max_packet_size > 2) ? ftdi->max_packet_size : 64;
+
+   // Data left over from an earlier read comes first
+
+   n = ftdi->readbuffer_remaining;
+   if (n > size) n = size;
+   if (n > 0) {
+      memcpy(buf, ftdi->readbuffer + ftdi->readbuffer_offset, n);
+      ftdi->readbuffer_offset += n;
+      ftdi->readbuffer_remaining -= n;
+      dr->tc.offset = n;
    }
 
-   ftRecord->cmdwidth = cmdwidth;
-   return TCL_OK;
+   while (direct_read_next(dr, NULL) > 0);
+   if (dr->pending == 0) {
+      if (dr->tc.offset < size) {
+	 free(dr);
+	 return NULL;
+      }
+      dr->tc.completed = 1;
+   }
+   return &dr->tc;
+}
+
+/* Cancel a direct read, allowing "tv" for the cancellation.	*/
+/* Returns the number of bytes read, or -1.  If the transfers	*/
+/* are still outstanding, the read frees itself when they end.	*/
+
+static int
+direct_read_cancel(struct ftdi_transfer_control *tc, struct timeval *tv)
+{
+   direct_read *dr = (direct_read *)tc;
+   int moved, i;
+
+   direct_read_stop(dr);
+   for (i = 0; (i < DIRECT_QUEUE) && !tc->completed; i++)
+      libusb_handle_events_timeout_completed(tc->ftdi->usb_ctx, tv,
+		&tc->completed);
+   moved = tc->offset;
+   if (tc->completed)
+      free(dr);
+   else
+      dr->orphaned = true;
+   return moved;
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::disable":  Disable a channel by	*/
-/* putting it into bitbang mode and setting all bits to input	*/
-/* so that they are all undriven.				*/
+/* Transfer deadlines						*/
+/*								*/
+/* A command that moves data may end with "-timeout <ms>" to	*/
+/* bound the whole command;  otherwise the device deadline set	*/
+/* with "ftdi::timeout" applies (0 for none).  Asynchronous	*/
+/* transfers are waited on with transfer_wait(), which cancels	*/
+/* a transfer still running at the deadline and returns the	*/
+/* number of bytes that it moved, so that the command can	*/
+/* report a partial result with deadline_error().		*/
 /*--------------------------------------------------------------*/
 
-int
-ftditcl_disable(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-   ftdi_record *ftRecord;
-   struct ftdi_context * ftContext;
-   int ftStatus;
+typedef struct _ftdi_deadline {
+   struct timespec when;	// Time at which the command expires
+   int ms;			// Time allowed (ms), or 0 for no deadline
+   int timedout;		// A transfer was cancelled at the deadline
+   ftdi_backend *backend;	// Backend of the channel
+} ftdi_deadline;
 
-   long numWritten;
+#define CANCEL_WAIT		100000	// Time allowed to cancel (us)
 
-   int result, i, j, k;
-   unsigned char *values;
-   unsigned char flags;
-   unsigned char sigio;
-   unsigned char *sigpins;
-   int len, loclen, bangmode;
+/* Strip "-timeout <ms>" from the end of the arguments.  "msptr"	*/
+/* is set to -1 if the option is not given.				*/
 
-   if (objc != 2) {
-      Tcl_SetResult(interp, "disable: Need device name.\n", NULL);
-      return TCL_ERROR;
-   }
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftRecord == (ftdi_record *)NULL) {
-      Tcl_SetResult(interp, "disable:  No such device\n", NULL);
+static int
+deadline_option(Tcl_Interp *interp, int *objcptr, Tcl_Obj *CONST objv[],
+	int *msptr)
+{
+   int objc = *objcptr;
+   int result;
+
+   *msptr = -1;
+   if ((objc < 3) || strcmp(Tcl_GetString(objv[objc - 2]), "-timeout"))
+      return TCL_OK;
+   result = Tcl_GetIntFromObj(interp, objv[objc - 1], msptr);
+   if (result != TCL_OK) return result;
+   if (*msptr < 0) {
+      Tcl_SetResult(interp, "Timeout must be zero (none) or a positive "
+		"number of ms.\n", NULL);
       return TCL_ERROR;
    }
-   flags = ftRecord->flags;
-   sigpins = &(ftRecord->sigpins[0]);
-
-   ftRecord->flags |= BITBANG_MODE;
-   ftRecord->wordwidth = 8;
-   sigio = 0x00;		// Everything is an input
+   *objcptr = objc - 2;
+   return TCL_OK;
+}
 
-   // Mark all signal pins as unassigned.
-   for (i = 0; i < 8; i++) sigpins[i] = 0x00;
+/* Start the clock for a command on "ftRecord".  "ms" is the	*/
+/* deadline given with the command, or -1 to use the device's.	*/
 
-   // Reset the FTDI device
-   ftStatus = ftdi_usb_reset(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while resetting device.\n", NULL);
+static void
+deadline_start(ftdi_deadline *dl, ftdi_record *ftRecord, int ms)
+{
+   dl->ms = (ms < 0) ? ftRecord->channel->tmo_device : ms;
+   dl->timedout = 0;
+   dl->backend = BACKEND(ftRecord);
+   if (dl->ms > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &dl->when);
+      dl->when.tv_sec += dl->ms / 1000;
+      dl->when.tv_nsec += (long)(dl->ms % 1000) * 1000000L;
+      if (dl->when.tv_nsec >= 1000000000L) {
+	 dl->when.tv_sec++;
+	 dl->when.tv_nsec -= 1000000000L;
+      }
+   }
+}
 
-   // Set baudrate to default (Note: actual bits per second is 16 times the value)
-   // So 62500 baud = 1Mbps.  However, SCK clock takes two transmissions (up, down)
-   // so double this value to get a 1Mpbs SCK, or 125000.
-   ftStatus = ftdi_set_baudrate(ftContext, (long)125000);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting baud rate.\n", NULL);
+/* Microseconds left before the deadline "dl" passes		*/
 
-   // Set device to Synchronous bit-bang mode.
+static long
+deadline_left(ftdi_deadline *dl)
+{
+   struct timespec now;
 
-   ftStatus = ftdi_set_bitmode(ftContext, (unsigned char)sigio,
-		(unsigned char)BITMODE_SYNCBB);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting bit mode.\n", NULL);
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (long)(dl->when.tv_sec - now.tv_sec) * 1000000L +
+		(dl->when.tv_nsec - now.tv_nsec) / 1000L;
+}
 
-   ftStatus = ftdi_usb_purge_tx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging transmit buffer.\n", NULL);
+/* Wait for an asynchronous transfer to finish, as		*/
+/* ftdi_transfer_data_done() does, but give up at the deadline.	*/
+/* Returns the number of bytes moved, or -1 on error.		*/
 
-   ftStatus = ftdi_usb_purge_rx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging receive buffer.\n", NULL);
+static int
+transfer_wait(struct ftdi_transfer_control *tc, ftdi_deadline *dl)
+{
+   ftdi_backend *backend = dl->backend;
+   struct timeval tv;
+   long left;
+
+   if (tc == NULL) return -1;
+   if (dl->ms <= 0) return backend->transfer_done(tc);
+
+   while (!tc->completed) {
+      left = deadline_left(dl);
+      if (left <= 0) break;
+      tv.tv_sec = left / 1000000L;
+      tv.tv_usec = left % 1000000L;
+      if (backend->handle_events(tc->ftdi, &tv, &tc->completed) < 0) {
+	 tv.tv_sec = 0;
+	 tv.tv_usec = CANCEL_WAIT;
+	 backend->transfer_cancel(tc, &tv);
+	 return -1;
+      }
+   }
+   if (tc->completed) return backend->transfer_done(tc);
 
-   // Set latency timer (in ms) (legacy case is 16; FT2232 minimum 1)
-   ftStatus = ftdi_set_latency_timer(ftContext, (unsigned char)5);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting latency timer.\n", NULL);
+   // Past the deadline:  Cancel the transfer and let the cancellation
+   // complete, so that any data already received is counted.
 
-   // Return
-   return TCL_OK;
+   dl->timedout = 1;
+   tv.tv_sec = 0;
+   tv.tv_usec = CANCEL_WAIT;
+   return backend->transfer_cancel(tc, &tv);
 }
 
+/* Report a command that ran past its deadline:  The result is	*/
+/* an error message, and the error code is			*/
+/* {FTDI TIMEOUT <done> <total> [<partial>]}, where <partial>,	*/
+/* if not NULL, is the data received before the deadline.	*/
+/* Anything left in the chip's buffers is discarded.		*/
 
+static int
+deadline_error(Tcl_Interp *interp, ftdi_deadline *dl, ftdi_record *ftRecord,
+	char *cmdname, Tcl_WideInt done, Tcl_WideInt total, Tcl_Obj *partial)
+{
+   Tcl_Obj *codeobj;
+   char msg[150];
+
+   BACKEND(ftRecord)->purge_tx(ftRecord->ftContext);
+   BACKEND(ftRecord)->purge_rx(ftRecord->ftContext);
+   ftRecord->channel->jtag_state = TAP_UNKNOWN;
+
+   sprintf(msg, "%s:  Timed out after %d ms, with %lld of %lld bytes "
+		"transferred.\n", cmdname, dl->ms, (long long)done,
+		(long long)total);
+   Tcl_SetResult(interp, msg, TCL_VOLATILE);
+
+   codeobj = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewStringObj("FTDI", -1));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewStringObj("TIMEOUT", -1));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewWideIntObj(done));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewWideIntObj(total));
+   if (partial != NULL)
+      Tcl_ListObjAppendElement(interp, codeobj, partial);
+   Tcl_SetObjErrorCode(interp, codeobj);
+   return TCL_ERROR;
+}
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_bitbang": Set or disable SPI bit-	*/
-/* bang mode.  If setting, optional arguments may specify the	*/
-/* order of pins.						*/
+/* Coroutine-aware commands					*/
+/*								*/
+/* Under Tcl 8.6, "spi_read" and "spi_write" are registered	*/
+/* with Tcl_NRCreateCommand().  Called from within a		*/
+/* coroutine, they submit their transfers and yield, and the	*/
+/* coroutine is resumed when the transfer completes (see	*/
+/* "libusb event sources", below) or the deadline passes.  The	*/
+/* command then finishes just as the blocking version does.	*/
+/* Called from anywhere else, they block as before.		*/
+/*								*/
+/* While a coroutine waits on a channel, the channel is held:	*/
+/* another coroutine using it waits its turn, and the blocking	*/
+/* commands that would interleave with the transfer refuse.	*/
 /*--------------------------------------------------------------*/
 
-// Local indexes for bitbang signals
-#define BB_CSB 0
-#define BB_SDO 1
-#define BB_SDI 2
-#define BB_SCK 3
-#define BB_USR0 4
-#define BB_USR1 5
-#define BB_USR2 6
-#define BB_USR3 7
+#if (TCL_MAJOR_VERSION > 8) || (TCL_MINOR_VERSION >= 6)
+#define FTDI_NRE
+#endif
 
-int
-ftditcl_spi_bitbang(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-   ftdi_record *ftRecord;
-   struct ftdi_context * ftContext;
-   int ftStatus;
+#define YIELD_POLL	1	// Interval between polls of libusb (ms)
 
-   long numWritten;
+typedef struct _ftdi_yield {
+   Tcl_Interp *interp;
+   Tcl_Obj *coro;		// Name of the suspended coroutine
+   Tcl_TimerToken timer;	// Next poll or the deadline, or NULL
+   ftdi_record *chan;		// Channel waited on
+   struct ftdi_transfer_control *tc;	// Transfer waited on, or NULL
+					// to wait for the channel
+   ftdi_deadline *dl;		// Deadline of the transfer
+   struct _usb_source *src;	// Event source of tc, or NULL to poll
+   struct _ftdi_yield *next;	// Next waiter on src or for a channel
+} ftdi_yield;
 
-   int result, i, j, k;
-   unsigned char *values;
-   unsigned char *sigpins;
-   unsigned char tbuffer[1];
-   unsigned char flags;
-   unsigned char sigio, sigassn;
-   int len, loclen, bangmode;
-   char *sigchar;
-   Tcl_Obj *sigpair, *sigval;
+/* Refuse a blocking command on a channel held by a coroutine	*/
 
-   if (objc != 3) {
+static int
+channel_held(Tcl_Interp *interp, ftdi_record *ftRecord, char *cmdname)
+{
+   char msg[100];
+
+   if (!ftRecord->channel->suspended) return 0;
+   sprintf(msg, "%s:  Device is in use by a suspended coroutine.\n",
+		cmdname);
+   Tcl_SetResult(interp, msg, TCL_VOLATILE);
+   return 1;
+}
+
+#ifdef FTDI_NRE
+static void yield_resume(ftdi_yield *);
+#endif
+
+/*--------------------------------------------------------------*/
+/* libusb event sources						*/
+/*								*/
+/* The file descriptors of each libusb context in use (that of	*/
+/* each open channel, and the device cache's) are registered	*/
+/* with the Tcl notifier, so that libusb's events are handled	*/
+/* whenever Tcl waits for events (vwait, Tk, or a suspended	*/
+/* coroutine):  Completed transfers resume the coroutines	*/
+/* waiting on them, and hotplug events update the device	*/
+/* cache.  Any libusb timeout not covered by a descriptor gets	*/
+/* a Tcl timer.  Where libusb has no pollable descriptors,	*/
+/* coroutines poll instead (see yield_poll()).			*/
+/*								*/
+/* The descriptors are registered from the main thread once a	*/
+/* channel is open, as Tcl file handlers belong to the thread	*/
+/* that creates them.						*/
+/*--------------------------------------------------------------*/
+
+static usb_source *usbsources = NULL;
+
+static usb_source *
+usb_source_find(libusb_context *ctx)
+{
+   usb_source *src;
+
+   for (src = usbsources; src; src = src->next)
+      if (src->ctx == ctx) return src;
+   return NULL;
+}
+
+static void usb_source_handle(usb_source *);
+
+static void
+usb_source_events(ClientData clientData, int mask)
+{
+   usb_source_handle((usb_source *)clientData);
+}
+
+static void
+usb_source_timeout(ClientData clientData)
+{
+   usb_source *src = (usb_source *)clientData;
+
+   src->timer = NULL;
+   usb_source_handle(src);
+}
+
+/* Set a timer for libusb's next timeout, if it needs one */
+
+static void
+usb_source_arm(usb_source *src)
+{
+   struct timeval tv;
+
+   if (libusb_pollfds_handle_timeouts(src->ctx)) return;
+   if (src->timer != NULL) Tcl_DeleteTimerHandler(src->timer);
+   src->timer = NULL;
+   if (libusb_get_next_timeout(src->ctx, &tv) == 1)
+      src->timer = Tcl_CreateTimerHandler((int)(tv.tv_sec * 1000 +
+		(tv.tv_usec + 999) / 1000), usb_source_timeout,
+		(ClientData)src);
+}
+
+/* Resume each coroutine waiting on "src" whose transfer has	*/
+/* completed.  A resumed coroutine may wait again, so the list	*/
+/* is searched from the start each time.  Backends without	*/
+/* libusb call this from their own event handlers.		*/
+
+void
+usb_source_resume(usb_source *src)
+{
+   ftdi_yield *y, **yp;
+
+   while (1) {
+      for (yp = &src->waiters; *yp; yp = &(*yp)->next)
+	 if ((*yp)->tc->completed) break;
+      if ((y = *yp) == NULL) break;
+      *yp = y->next;
+      y->src = NULL;
+#ifdef FTDI_NRE
+      yield_resume(y);
+#endif
+   }
+}
+
+/* Handle the libusb events that are ready, then resume the	*/
+/* coroutines whose transfers they completed.			*/
+
+static void
+usb_source_handle(usb_source *src)
+{
+   struct timeval tv;
+
+   tv.tv_sec = 0;
+   tv.tv_usec = 0;
+   libusb_handle_events_timeout_completed(src->ctx, &tv, NULL);
+   usb_source_arm(src);
+   usb_source_resume(src);
+}
+
+static void
+usb_source_fd_added(int fd, short events, void *user_data)
+{
+   Tcl_CreateFileHandler(fd, ((events & POLLIN) ? TCL_READABLE : 0) |
+		((events & POLLOUT) ? TCL_WRITABLE : 0), usb_source_events,
+		(ClientData)user_data);
+}
+
+static void
+usb_source_fd_removed(int fd, void *user_data)
+{
+   Tcl_DeleteFileHandler(fd);
+}
+
+/* Register the descriptors of "ctx", if it has any */
+
+static void
+usb_source_add(libusb_context *ctx)
+{
+   const struct libusb_pollfd **pollfds;
+   usb_source *src;
+   int i;
+
+   if (usb_source_find(ctx) != NULL) return;
+   pollfds = libusb_get_pollfds(ctx);
+   if (pollfds == NULL) return;
+
+   src = (usb_source *)malloc(sizeof(usb_source));
+   src->ctx = ctx;
+   src->timer = NULL;
+   src->waiters = NULL;
+   src->next = usbsources;
+   usbsources = src;
+
+   for (i = 0; pollfds[i] != NULL; i++)
+      usb_source_fd_added(pollfds[i]->fd, pollfds[i]->events, src);
+   libusb_free_pollfds(pollfds);
+   libusb_set_pollfd_notifiers(ctx, usb_source_fd_added,
+		usb_source_fd_removed, src);
+   usb_source_arm(src);
+}
+
+/* Unregister "ctx" before it is closed.  The channel cannot be	*/
+/* held, so nothing is waiting on it.				*/
+
+static void
+usb_source_remove(libusb_context *ctx)
+{
+   const struct libusb_pollfd **pollfds;
+   usb_source *src, **sp;
+   int i;
+
+   for (sp = &usbsources; *sp; sp = &(*sp)->next)
+      if ((*sp)->ctx == ctx) break;
+   if ((src = *sp) == NULL) return;
+   *sp = src->next;
+
+   libusb_set_pollfd_notifiers(ctx, NULL, NULL, NULL);
+   pollfds = libusb_get_pollfds(ctx);
+   if (pollfds != NULL) {
+      for (i = 0; pollfds[i] != NULL; i++)
+	 Tcl_DeleteFileHandler(pollfds[i]->fd);
+      libusb_free_pollfds(pollfds);
+   }
+   if (src->timer != NULL) Tcl_DeleteTimerHandler(src->timer);
+   free(src);
+}
+
+/*--------------------------------------------------------------*/
+/* Backends							*/
+/*								*/
+/* The libftdi backend is libftdi itself.  The direct backend	*/
+/* differs only in its asynchronous reads.  The d2xx backend,	*/
+/* built with the FTDI D2XX library, is in ftdi_d2xx.c.		*/
+/* ftdi_open and ftdi_open_many take "-backend <name>" to	*/
+/* choose one.							*/
+/*--------------------------------------------------------------*/
+
+/* Create a context for the channel of "job" and open the	*/
+/* device by its bus and address.				*/
+
+static struct ftdi_context *
+libftdi_open(open_job *job)
+{
+   struct ftdi_context *ftContext;
+   int ftStatus;
+
+   // The channel must be set between ftdi_new() and opening the device.
+
+   ftContext = ftdi_new();
+   if (ftContext == NULL) {
+      job->error = "Unable to create device context.\n";
+      return NULL;
+   }
+   ftStatus = ftdi_set_interface(ftContext, job->channel);
+   if (ftStatus != 0) {
+      if (ftStatus == -1)
+	 job->error = "Channel is not recognized for device.\n";
+      else if (ftStatus == -2)
+	 job->error = "USB error while setting channel.\n";
+      else
+	 job->error = "Device is open; channel cannot be set.\n";
+      ftdi_free(ftContext);
+      return NULL;
+   }
+
+   // Opening by bus and address needs no string descriptors
+   ftStatus = ftdi_usb_open_bus_addr(ftContext, job->bus, job->addr);
+   if (ftStatus < 0) {
+      job->error = "Unable to open device\n";
+      ftdi_free(ftContext);
+      return NULL;
+   }
+   return ftContext;
+}
+
+static int
+libftdi_close(struct ftdi_context *ftContext)
+{
+   int ftStatus;
+
+   ftStatus = ftdi_usb_close(ftContext);
+   ftdi_free(ftContext);
+   return ftStatus;
+}
+
+static int
+libftdi_set_timeouts(struct ftdi_context *ftContext, int rdms, int wrms)
+{
+   ftContext->usb_read_timeout = rdms;
+   ftContext->usb_write_timeout = wrms;
+   return 0;
+}
+
+/* Handle libusb events.  An interrupted wait is not an error.	*/
+
+static int
+usb_handle_events(struct ftdi_context *ftContext, struct timeval *tv,
+	int *completed)
+{
+   int ret;
+
+   ret = libusb_handle_events_timeout_completed(ftContext->usb_ctx, tv,
+		completed);
+   return (ret == LIBUSB_ERROR_INTERRUPTED) ? 0 : ret;
+}
+
+/* Cancel a libftdi transfer and let the cancellation complete,	*/
+/* so that any data already moved is counted.			*/
+
+static int
+usb_transfer_cancel(struct ftdi_transfer_control *tc, struct timeval *tv)
+{
+   int moved;
+
+   if (!tc->completed && (libusb_cancel_transfer(tc->transfer) == 0))
+      libusb_handle_events_timeout_completed(tc->ftdi->usb_ctx, tv,
+		&tc->completed);
+   moved = tc->offset;
+   if (tc->completed)
+      ftdi_transfer_data_done(tc);
+   else
+      ftdi_transfer_data_cancel(tc, tv);
+   return moved;
+}
+
+/* Wait for a direct read to complete, then free it.  Returns	*/
+/* the number of bytes read, or -1.				*/
+
+static int
+direct_transfer_done(struct ftdi_transfer_control *tc)
+{
+   struct timeval tv;
+   int moved;
+
+   while (!tc->completed) {
+      tv.tv_sec = 1;
+      tv.tv_usec = 0;
+      if (usb_handle_events(tc->ftdi, &tv, &tc->completed) < 0) {
+	 tv.tv_sec = 0;
+	 tv.tv_usec = CANCEL_WAIT;
+	 direct_read_cancel(tc, &tv);
+	 return -1;
+      }
+   }
+   moved = tc->offset;
+   free(tc);
+   return moved;
+}
+
+static void
+usb_watch(struct ftdi_context *ftContext)
+{
+   usb_source_add(ftContext->usb_ctx);
+}
+
+static void
+usb_unwatch(struct ftdi_context *ftContext)
+{
+   usb_source_remove(ftContext->usb_ctx);
+}
+
+static usb_source *
+usb_source_of(struct ftdi_context *ftContext)
+{
+   return usb_source_find(ftContext->usb_ctx);
+}
+
+static ftdi_backend libftdi_backend = {
+   "libftdi",
+   libftdi_open,
+   libftdi_close,
+   ftdi_usb_reset,
+   ftdi_write_data,
+   ftdi_read_data,
+   ftdi_write_data_submit,
+   ftdi_read_data_submit,
+   ftdi_transfer_data_done,
+   usb_transfer_cancel,
+   usb_handle_events,
+   usb_watch,
+   usb_unwatch,
+   usb_source_of,
+   ftdi_usb_purge_tx_buffer,
+   ftdi_usb_purge_rx_buffer,
+   ftdi_set_bitmode,
+   ftdi_set_latency_timer,
+   ftdi_set_baudrate,
+   ftdi_read_data_set_chunksize,
+   ftdi_read_data_get_chunksize,
+   ftdi_write_data_set_chunksize,
+   ftdi_write_data_get_chunksize,
+   libftdi_set_timeouts,
+   ftdi_setflowctrl,
+   ftdi_set_event_char,
+   ftdi_set_error_char,
+   NULL
+};
+
+static ftdi_backend direct_backend = {
+   "direct",
+   libftdi_open,
+   libftdi_close,
+   ftdi_usb_reset,
+   ftdi_write_data,
+   ftdi_read_data,
+   ftdi_write_data_submit,
+   direct_read_submit,
+   direct_transfer_done,
+   direct_read_cancel,
+   usb_handle_events,
+   usb_watch,
+   usb_unwatch,
+   usb_source_of,
+   ftdi_usb_purge_tx_buffer,
+   ftdi_usb_purge_rx_buffer,
+   ftdi_set_bitmode,
+   ftdi_set_latency_timer,
+   ftdi_set_baudrate,
+   ftdi_read_data_set_chunksize,
+   ftdi_read_data_get_chunksize,
+   ftdi_write_data_set_chunksize,
+   ftdi_write_data_get_chunksize,
+   libftdi_set_timeouts,
+   ftdi_setflowctrl,
+   ftdi_set_event_char,
+   ftdi_set_error_char,
+   NULL
+};
+
+static ftdi_backend *backends[] = {
+   &libftdi_backend,		// Default
+   &direct_backend,
+#ifdef HAVE_D2XX
+   &d2xx_backend,
+#endif
+   NULL
+};
+
+/* Return the backend called "name", or NULL if there is none.	*/
+
+static ftdi_backend *
+find_backend(char *name)
+{
+   int i;
+
+   for (i = 0; backends[i] != NULL; i++)
+      if (!strcmp(backends[i]->name, name))
+	 return backends[i];
+   return NULL;
+}
+
+#ifdef FTDI_NRE
+
+/* Return the name of the running coroutine (with a reference	*/
+/* held), or NULL if the command was not called from one.	*/
+
+static Tcl_Obj *
+yield_coroutine(Tcl_Interp *interp)
+{
+   Tcl_Obj *coro;
+
+   if (Tcl_EvalEx(interp, "::info coroutine", -1, 0) != TCL_OK) return NULL;
+   coro = Tcl_GetObjResult(interp);
+   if (Tcl_GetCharLength(coro) == 0) return NULL;
+   Tcl_IncrRefCount(coro);
+   Tcl_ResetResult(interp);
+   return coro;
+}
+
+/* Resume a suspended coroutine.  It finishes the command,	*/
+/* which frees "y".						*/
+
+static void
+yield_resume(ftdi_yield *y)
+{
+   Tcl_Interp *interp = y->interp;
+   Tcl_Obj *coro = y->coro;
+
+   Tcl_Preserve((ClientData)interp);
+   Tcl_IncrRefCount(coro);
+   if (Tcl_EvalObjEx(interp, coro, TCL_EVAL_GLOBAL) != TCL_OK)
+      Tcl_BackgroundException(interp, TCL_ERROR);
+   Tcl_DecrRefCount(coro);
+   Tcl_Release((ClientData)interp);
+}
+
+/* Timer handler for a transfer on a context without an event	*/
+/* source:  Run any libusb events that are ready, and resume	*/
+/* the coroutine once the transfer completes or the deadline	*/
+/* passes.							*/
+
+static void
+yield_poll(ClientData clientData)
+{
+   ftdi_yield *y = (ftdi_yield *)clientData;
+   struct timeval tv;
+
+   y->timer = NULL;
+   if (!y->tc->completed) {
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+      y->dl->backend->handle_events(y->tc->ftdi, &tv, &y->tc->completed);
+   }
+   if (!y->tc->completed && ((y->dl->ms <= 0) ||
+		(deadline_left(y->dl) > 0))) {
+      y->timer = Tcl_CreateTimerHandler(YIELD_POLL, yield_poll, clientData);
+      return;
+   }
+   yield_resume(y);
+}
+
+/* Timer handler for the deadline of a transfer on a context	*/
+/* with an event source, or for a waiter whose turn has come.	*/
+
+static void
+yield_wake(ClientData clientData)
+{
+   ftdi_yield *y = (ftdi_yield *)clientData;
+   ftdi_yield **yp;
+
+   y->timer = NULL;
+   if (y->src != NULL) {
+      for (yp = &y->src->waiters; *yp != y; yp = &(*yp)->next);
+      *yp = y->next;
+      y->src = NULL;
+   }
+   yield_resume(y);
+}
+
+/* Coroutines waiting for a held channel, in order of arrival */
+
+static ftdi_yield *yield_turns = NULL;
+
+/* Suspend the coroutine "coro" until "tc" completes or "dl"	*/
+/* passes, or, if "tc" is NULL, until "chan" is released, then	*/
+/* call "proc" with "data".  "y" must last until "proc" calls	*/
+/* yield_end().							*/
+
+static int
+yield_wait(Tcl_Interp *interp, ftdi_yield *y, Tcl_Obj *coro,
+	ftdi_record *chan, struct ftdi_transfer_control *tc,
+	ftdi_deadline *dl, Tcl_NRPostProc *proc, ClientData data)
+{
+   ftdi_yield **yp;
+   long left;
+
+   y->interp = interp;
+   y->coro = coro;
+   y->chan = chan;
+   y->tc = tc;
+   y->dl = dl;
+   y->src = NULL;
+   y->next = NULL;
+   y->timer = NULL;
+
+   if (tc == NULL) {
+      for (yp = &yield_turns; *yp; yp = &(*yp)->next);
+      *yp = y;
+   }
+   else if (tc->completed)
+      y->timer = Tcl_CreateTimerHandler(0, yield_wake, (ClientData)y);
+   else if ((y->src = dl->backend->source(tc->ftdi)) != NULL) {
+      y->next = y->src->waiters;
+      y->src->waiters = y;
+      if (dl->ms > 0) {
+	 left = deadline_left(dl);
+	 y->timer = Tcl_CreateTimerHandler((left > 0) ? (int)((left + 999) /
+		1000) : 0, yield_wake, (ClientData)y);
+      }
+   }
+   else
+      y->timer = Tcl_CreateTimerHandler(0, yield_poll, (ClientData)y);
+
+   Tcl_NRAddCallback(interp, proc, data, NULL, NULL, NULL);
+   return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+}
+
+/* Called on resuming:  Stop waiting and drop the coroutine.	*/
+/* (If the coroutine was deleted, it may still be on a list.)	*/
+
+static void
+yield_end(ftdi_yield *y)
+{
+   ftdi_yield **yp;
+
+   if (y->timer != NULL) Tcl_DeleteTimerHandler(y->timer);
+   y->timer = NULL;
+   for (yp = (y->src != NULL) ? &y->src->waiters : &yield_turns; *yp;
+		yp = &(*yp)->next)
+      if (*yp == y) {
+	 *yp = y->next;
+	 break;
+      }
+   y->src = NULL;
+   Tcl_DecrRefCount(y->coro);
+}
+
+/* Release a channel held by a coroutine.  If another coroutine	*/
+/* is waiting for it, the channel stays held for that one, and	*/
+/* it is woken.							*/
+
+static void
+channel_release(ftdi_record *chan)
+{
+   ftdi_yield *y, **yp;
+
+   for (yp = &yield_turns; *yp; yp = &(*yp)->next)
+      if ((*yp)->chan == chan) break;
+   if ((y = *yp) == NULL) {
+      chan->suspended = 0;
+      return;
+   }
+   *yp = y->next;
+   y->timer = Tcl_CreateTimerHandler(0, yield_wake, (ClientData)y);
+}
+
+/* Deleting a suspended coroutine resumes it with an error.	*/
+/* Expire the deadline, so that finishing the command cancels	*/
+/* whatever is still running.					*/
+
+static void
+deadline_expire(ftdi_deadline *dl)
+{
+   if (dl->ms <= 0) dl->ms = 1;
+   dl->when.tv_sec = 0;
+   dl->when.tv_nsec = 0;
+}
+
+/* A command waiting for its turn on a held channel		*/
+
+typedef struct _ftdi_turn {
+   ftdi_yield y;
+   Tcl_ObjCmdProc *proc;	// Command to run when the channel is free
+   ClientData clientData;
+   Tcl_Obj *args;		// Arguments of the command
+} ftdi_turn;
+
+static int
+yield_turn_resume(ClientData data[], Tcl_Interp *interp, int result)
+{
+   ftdi_turn *turn = (ftdi_turn *)data[0];
+   ftdi_record *chan = turn->y.chan;
+   ftdi_yield *y;
+   Tcl_Obj **objv;
+   int objc;
+
+   // Was the channel handed over, or was the coroutine deleted
+   // while still waiting?
+
+   for (y = yield_turns; y && (y != &turn->y); y = y->next);
+   yield_end(&turn->y);
+   if (y != NULL) {
+      Tcl_DecrRefCount(turn->args);
+      free(turn);
+      return result;
+   }
+
+   if (result != TCL_OK)
+      channel_release(chan);		// Pass the channel on
+   else {
+      chan->suspended = 0;
+      Tcl_ListObjGetElements(NULL, turn->args, &objc, &objv);
+      result = (*turn->proc)(turn->clientData, interp, objc, objv);
+      if (!chan->suspended) channel_release(chan);
+   }
+   Tcl_DecrRefCount(turn->args);
+   free(turn);
+   return result;
+}
+
+/* Wait in coroutine "coro" for "chan" to be released, then run	*/
+/* the command "proc" with the arguments "objv".		*/
+
+static int
+yield_turn(Tcl_Interp *interp, Tcl_Obj *coro, ftdi_record *chan,
+	Tcl_ObjCmdProc *proc, ClientData clientData, int objc,
+	Tcl_Obj *CONST objv[])
+{
+   ftdi_turn *turn;
+
+   turn = (ftdi_turn *)malloc(sizeof(ftdi_turn));
+   turn->proc = proc;
+   turn->clientData = clientData;
+   turn->args = Tcl_NewListObj(objc, objv);
+   Tcl_IncrRefCount(turn->args);
+   return yield_wait(interp, &turn->y, coro, chan, NULL, NULL,
+		yield_turn_resume, (ClientData)turn);
+}
+
+#endif	/* FTDI_NRE */
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi_setid"					*/
+/* Set the product and vendor IDs used by "ftdi_open".		*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_setid(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int vid_val, pid_val;
+   Tcl_Obj *lobj;
+
+   if (objc > 1) {
+
+      Tcl_GetIntFromObj(interp, objv[1], &pid_val);
+      usb_pid = pid_val & 0xffff;
+
+      if (objc > 2) {
+         Tcl_GetIntFromObj(interp, objv[2], &vid_val);
+         usb_vid = vid_val & 0xffff;
+      }
+   }
+
+   lobj = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj(usb_pid));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj(usb_vid));
+   Tcl_SetObjResult(interp, lobj);
+   return TCL_OK;
+}
+ 
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi_get"					*/
+/* Read status of byte values on device cbus			*/
+/*--------------------------------------------------------------*/
+
+static int spi_queue_flush(Tcl_Interp *interp, ftdi_record *ftRecord);
+
+int
+ftditcl_get(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int val;
+   unsigned char flags;
+   unsigned char tbuffer[4];
+   unsigned char rbuffer[4];
+
+   long numWritten;
+   long numRead;
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   int ftStatus;
+ 
+   if (objc <= 1) {
+     Tcl_SetResult(interp, "get: Need device name\n", NULL);
+     return TCL_ERROR;
+   }
+
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "get:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "get")) return TCL_ERROR;
+
+   if (!(flags & (BITBANG_MODE | SERIAL_MODE)))
+      if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
+
+   tbuffer[0] = 0x83;		// Read high byte (i.e., Cbus)
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "ftdi_get: Writing: ");
+      for (i = 0; i < 1; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, 1);
+   if (ftStatus < 0)
+      Tcl_SetResult(interp, "Received error while reading Dbus\n", NULL);
+   else if (ftStatus != 1)
+      Tcl_SetResult(interp, "get:  short write error.\n", NULL);
+
+   ftStatus = BACKEND(ftRecord)->read(ftContext, rbuffer, 1);
+   if (ftStatus < 0)
+      Tcl_SetResult(interp, "Received error while reading Dbus\n", NULL);
+   else if (ftStatus != 1)
+      Tcl_SetResult(interp, "get:  short read error.\n", NULL);
+
+   Tcl_SetObjResult(interp, Tcl_NewIntObj((int)rbuffer[0]));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* GPIO shadow registers (MPSSE mode)				*/
+/*								*/
+/* Each device record holds the output values and directions	*/
+/* last written to ADBUS (low byte) and ACBUS (high byte), so	*/
+/* that any pin change can be sent as a single 3-byte opcode	*/
+/* without reading the pins back.  ADBUS0-3 belong to the SPI	*/
+/* interface (SCK, SDI, SDO, CS);  the CS bit of the shadow	*/
+/* holds the CS idle (de-asserted) level.			*/
+/*								*/
+/* A change marked pending (see "gpio_set -defer") is sent	*/
+/* with the CS opcodes of the next SPI transaction, so that	*/
+/* chip-select and reset lines cost no extra USB transfer.	*/
+/*--------------------------------------------------------------*/
+
+#define SPI_SCK_PIN	0x01	// ADBUS0
+#define SPI_CS_PIN	0x08	// ADBUS3
+#define SPI_PINS	0x000f	// ADBUS0-3 are used by SPI
+#define SPI_QUEUE_SIZE	65536	// Size of the merged SPI write queue
+
+/*--------------------------------------------------------------*/
+/* Support function "gpio_opcode"				*/
+/*								*/
+/* Fill "buffer" with the opcode setting ADBUS (bus = 0) or	*/
+/* ACBUS (bus = 1) to the output values "value" and the	*/
+/* directions in the channel's shadow register.  Returns 3.	*/
+/*--------------------------------------------------------------*/
+
+static int
+gpio_opcode(ftdi_record *chan, int bus, unsigned short value,
+	unsigned char *buffer)
+{
+   buffer[0] = (bus == 0) ? 0x80 : 0x82;	// Set Dbus or Cbus
+   buffer[1] = (unsigned char)((value >> (bus << 3)) & 0xff);
+   buffer[2] = (unsigned char)((chan->gpio_dir >> (bus << 3)) & 0xff);
+   return 3;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_cs"					*/
+/*								*/
+/* Fill "buffer" with the opcode that asserts or de-asserts the	*/
+/* device's CS pin, carrying the current value of all other	*/
+/* pins on the same bus, along with any pending change on the	*/
+/* other bus.  If the SCK idle level of the device's SPI mode	*/
+/* differs from the present one, SCK is changed first, while	*/
+/* CS is still de-asserted.  Returns the number of bytes placed	*/
+/* in the buffer (at most 9).					*/
+/*--------------------------------------------------------------*/
+
+static int
+spi_cs(ftdi_record *ftRecord, bool assert, unsigned char *buffer)
+{
+   ftdi_record *chan = ftRecord->channel;
+   unsigned short value, sck;
+   int n = 0;
+
+   sck = (ftRecord->spimode & SPI_CPOL) ? SPI_SCK_PIN : 0;
+   if ((chan->gpio_out & SPI_SCK_PIN) != sck) {
+      chan->gpio_out ^= SPI_SCK_PIN;
+      n += gpio_opcode(chan, 0, chan->gpio_out, buffer);
+   }
+
+   chan->gpio_pending |= (ftRecord->csmask & 0x00ff) ? GPIO_LOW : GPIO_HIGH;
+   value = chan->gpio_out ^ ((assert) ? ftRecord->csmask : 0);
+
+   if (chan->gpio_pending & GPIO_LOW)
+      n += gpio_opcode(chan, 0, value, buffer + n);
+   if (chan->gpio_pending & GPIO_HIGH)
+      n += gpio_opcode(chan, 1, value, buffer + n);
+   chan->gpio_pending = 0;
+   return n;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_cs_idle"				*/
+/*								*/
+/* Send the opcode that de-asserts the device's CS pin.  Used	*/
+/* after a purge, which discards any de-assert still queued	*/
+/* behind an unfinished transfer.				*/
+/*--------------------------------------------------------------*/
+
+static void
+spi_cs_idle(ftdi_record *ftRecord)
+{
+   unsigned char tbuffer[12];
+   int ntb;
+
+   ntb = spi_cs(ftRecord, false, tbuffer);
+   BACKEND(ftRecord)->write(ftRecord->ftContext, tbuffer, ntb);
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_set_mode"				*/
+/*								*/
+/* Set the device's SPI mode and precompute the MPSSE data	*/
+/* opcodes for it.  In opcode terms, bit 0 set means data out	*/
+/* changes on the falling SCK edge, bit 2 set means data in is	*/
+/* sampled on the falling edge, and bit 3 set means LSB first.	*/
+/* Modes 0 and 3 sample on the rising edge;  modes 1 and 2 on	*/
+/* the falling edge.  Mixed mode (see ftdi_open) samples data	*/
+/* in on the opposite edge from the one given by the mode.	*/
+/*--------------------------------------------------------------*/
+
+static void
+spi_set_mode(ftdi_record *ftRecord, unsigned char spimode)
+{
+   static unsigned char write_ops[4] = {0x11, 0x10, 0x10, 0x11};
+   static unsigned char read_ops[4] = {0x20, 0x24, 0x24, 0x20};
+   int cmode = spimode & (SPI_CPOL | SPI_CPHA);
+
+   ftRecord->spimode = spimode;
+   ftRecord->op_write = write_ops[cmode];
+   ftRecord->op_read = read_ops[cmode];
+   if (ftRecord->flags & MIXED_MODE) ftRecord->op_read ^= 0x04;
+   if (spimode & SPI_LSB_FIRST) {
+      ftRecord->op_write |= 0x08;
+      ftRecord->op_read |= 0x08;
+   }
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_queue_flush"				*/
+/*								*/
+/* Send any SPI writes held in the channel's merge queue (see	*/
+/* "ftdi::spi_merge").  Must be called before any command that	*/
+/* talks to the channel, so that the order of operations on	*/
+/* the bus is kept.						*/
+/*--------------------------------------------------------------*/
+
+static int
+spi_queue_flush(Tcl_Interp *interp, ftdi_record *ftRecord)
+{
+   ftdi_record *chan = ftRecord->channel;
+   int ftStatus, n;
+
+   n = chan->txlen;
+   if (n == 0) return TCL_OK;
+   chan->txlen = 0;
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "spi_merge: Writing: ");
+      for (i = 0; i < n; i++) {
+         Fprintf(interp, stderr, "0x%02x ", chan->txqueue[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   ftStatus = BACKEND(chan)->write(chan->ftContext, chan->txqueue, n);
+   if (ftStatus != n) {
+      Tcl_SetResult(interp, (ftStatus < 0) ?
+		"Received error while sending merged SPI writes.\n" :
+		"Short write error while sending merged SPI writes.\n", NULL);
+      return TCL_ERROR;
+   }
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_queue_write"				*/
+/*								*/
+/* Send a block of MPSSE opcodes, or add it to the channel's	*/
+/* merge queue if merging is enabled.  The queue is sent when	*/
+/* it fills.  Returns the number of bytes accepted, or -1 on	*/
+/* error, as ftdi_write_data() does.				*/
+/*--------------------------------------------------------------*/
+
+static int
+spi_queue_write(Tcl_Interp *interp, ftdi_record *ftRecord,
+	unsigned char *buffer, int len)
+{
+   ftdi_record *chan = ftRecord->channel;
+
+   if (chan->merging) {
+      if (chan->txlen + len > SPI_QUEUE_SIZE)
+	 if (spi_queue_flush(interp, chan) != TCL_OK) return -1;
+      if (len <= SPI_QUEUE_SIZE) {
+	 if (chan->txqueue == NULL)
+	    chan->txqueue = (unsigned char *)malloc(SPI_QUEUE_SIZE *
+			sizeof(unsigned char));
+	 memcpy(chan->txqueue + chan->txlen, buffer, len);
+	 chan->txlen += len;
+	 return len;
+      }
+   }
+   else if (spi_queue_flush(interp, chan) != TCL_OK) return -1;
+
+   return BACKEND(chan)->write(chan->ftContext, buffer, len);
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "gpio_flush"				*/
+/*								*/
+/* Send any pending GPIO changes to the device.			*/
+/*--------------------------------------------------------------*/
+
+static int
+gpio_flush(Tcl_Interp *interp, ftdi_record *ftRecord, char *cmdname)
+{
+   ftdi_record *chan = ftRecord->channel;
+   unsigned char tbuffer[6];
+   int n = 0;
+   int ftStatus;
+
+   if (chan->gpio_pending & GPIO_LOW)
+      n += gpio_opcode(chan, 0, chan->gpio_out, tbuffer + n);
+   if (chan->gpio_pending & GPIO_HIGH)
+      n += gpio_opcode(chan, 1, chan->gpio_out, tbuffer + n);
+   chan->gpio_pending = 0;
+   if (n == 0) return TCL_OK;
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "%s: Writing: ", cmdname);
+      for (i = 0; i < n; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   ftStatus = spi_queue_write(interp, chan, tbuffer, n);
+   if (ftStatus != n) {
+      Tcl_AppendResult(interp, cmdname, (ftStatus < 0) ?
+		":  Received error while setting GPIO.\n" :
+		":  short write error.\n", NULL);
+      return TCL_ERROR;
+   }
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "gpio_update"				*/
+/*								*/
+/* Common code for "gpio_set" and "gpio_dir", which differ	*/
+/* only in the shadow register being changed.			*/
+/*								*/
+/* Use: <cmd> <device> [<value> [<mask>]] [-defer]		*/
+/*--------------------------------------------------------------*/
+
+static int
+gpio_update(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+	char *cmdname, bool isdir)
+{
+   ftdi_record *ftRecord, *chan;
+   unsigned short *shadow, newval;
+   int result, value, mask;
+   bool defer = false;
+
+   if (objc > 2 && !strcmp(Tcl_GetString(objv[objc - 1]), "-defer")) {
+      defer = true;
+      objc--;
+   }
+   if (objc < 2 || objc > 4) {
+      Tcl_AppendResult(interp, cmdname, ": Need device name, and optional "
+		"value and mask.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_AppendResult(interp, cmdname, ":  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, cmdname)) return TCL_ERROR;
+   if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_AppendResult(interp, cmdname, ":  Device must be in "
+		"MPSSE mode.\n", NULL);
+      return TCL_ERROR;
+   }
+   chan = ftRecord->channel;
+   shadow = (isdir) ? &chan->gpio_dir : &chan->gpio_out;
+
+   if (objc == 2) {
+      Tcl_SetObjResult(interp, Tcl_NewIntObj((int)*shadow));
+      return TCL_OK;
+   }
+
+   result = Tcl_GetIntFromObj(interp, objv[2], &value);
+   if (result != TCL_OK) return result;
+   mask = 0xffff & ~chan->gpio_resv;
+   if (objc == 4) {
+      result = Tcl_GetIntFromObj(interp, objv[3], &mask);
+      if (result != TCL_OK) return result;
+      if (mask & chan->gpio_resv) {
+	 Tcl_AppendResult(interp, cmdname, ":  Pins used for SPI or "
+		"chip select cannot be changed.\n", NULL);
+	 return TCL_ERROR;
+      }
+   }
+   if (value < 0 || value > 0xffff || mask < 0 || mask > 0xffff) {
+      Tcl_AppendResult(interp, cmdname, ":  Value out of range "
+		"0-0xffff.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   newval = (*shadow & ~mask) | (value & mask);
+   if ((newval ^ *shadow) & 0x00ff) chan->gpio_pending |= GPIO_LOW;
+   if ((newval ^ *shadow) & 0xff00) chan->gpio_pending |= GPIO_HIGH;
+   *shadow = newval;
+
+   if (defer) return TCL_OK;
+   return gpio_flush(interp, ftRecord, cmdname);
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::gpio_set"				*/
+/*								*/
+/* Use: gpio_set <device> [<value> [<mask>]] [-defer]		*/
+/*								*/
+/* Set the 16 GPIO output values (ADBUS in the low byte, ACBUS	*/
+/* in the high byte) for the pins in <mask> (default all pins	*/
+/* other than the SPI pins ADBUS0-3).  Only a byte that has	*/
+/* changed is sent.  With "-defer", the change is held and	*/
+/* sent with the next SPI transaction or GPIO command.  With	*/
+/* no value, return the current output values.			*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_gpio_set(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   return gpio_update(interp, objc, objv, "gpio_set", false);
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::gpio_dir"				*/
+/*								*/
+/* Use: gpio_dir <device> [<value> [<mask>]] [-defer]		*/
+/*								*/
+/* As gpio_set, but sets the pin directions (1 = output).	*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_gpio_dir(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   return gpio_update(interp, objc, objv, "gpio_dir", true);
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::gpio_get"				*/
+/*								*/
+/* Use: gpio_get <device> [-timeout <ms>]			*/
+/*								*/
+/* Read all 16 GPIO pins (ADBUS in the low byte, ACBUS in the	*/
+/* high byte).  Pending changes are sent in the same transfer.	*/
+/* The reply is waited on until both bytes arrive or the	*/
+/* deadline passes.						*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_gpio_get(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   unsigned char tbuffer[9];
+   unsigned char rbuffer[2];
+   int n = 0;
+
+   ftdi_record *ftRecord, *chan;
+   struct ftdi_context * ftContext;
+   struct ftdi_transfer_control *wtc, *rtc;
+   int ftStatus, wStatus, tmo;
+   ftdi_deadline dl;
+
+   if (deadline_option(interp, &objc, objv, &tmo) != TCL_OK) return TCL_ERROR;
+   if (objc != 2) {
+      Tcl_SetResult(interp, "gpio_get: Need device name\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "gpio_get:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "gpio_get")) return TCL_ERROR;
+   if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_SetResult(interp, "gpio_get:  Device must be in MPSSE mode.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
+
+   chan = ftRecord->channel;
+   if (chan->gpio_pending & GPIO_LOW)
+      n += gpio_opcode(chan, 0, chan->gpio_out, tbuffer + n);
+   if (chan->gpio_pending & GPIO_HIGH)
+      n += gpio_opcode(chan, 1, chan->gpio_out, tbuffer + n);
+   chan->gpio_pending = 0;
+
+   tbuffer[n++] = 0x81;		// Read low byte (i.e., Dbus)
+   tbuffer[n++] = 0x83;		// Read high byte (i.e., Cbus)
+   tbuffer[n++] = 0x87;		// Send immediate
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "gpio_get: Writing: ");
+      for (i = 0; i < n; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   // The submitted read is resubmitted until both bytes arrive
+
+   deadline_start(&dl, ftRecord, tmo);
+   wtc = BACKEND(ftRecord)->write_submit(ftContext, tbuffer, n);
+   rtc = (wtc == NULL) ? NULL : BACKEND(ftRecord)->read_submit(ftContext,
+		rbuffer, 2);
+   ftStatus = transfer_wait(rtc, &dl);
+   wStatus = transfer_wait(wtc, &dl);
+
+   if (dl.timedout)
+      return deadline_error(interp, &dl, ftRecord, "gpio_get", ftStatus, 2,
+		NULL);
+
+   if (wStatus != n) {
+      Tcl_SetResult(interp, "gpio_get:  Error while writing read "
+		"command.\n", NULL);
+      return TCL_ERROR;
+   }
+   if (ftStatus != 2) {
+      Tcl_SetResult(interp, "gpio_get:  short read error.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   Tcl_SetObjResult(interp, Tcl_NewIntObj((int)rbuffer[0] |
+		((int)rbuffer[1] << 8)));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi_verbose"					*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_verbose(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+  int level, result;
+ 
+  if (objc <= 1) {
+     Tcl_SetObjResult(interp, Tcl_NewIntObj((int)verbose));
+     return TCL_OK;
+  }
+
+  result = Tcl_GetIntFromObj(interp, objv[1], &level);
+  if (result != TCL_OK) return result;
+  if (level < 0) {
+      Tcl_SetResult(interp, "verbose: Bad verbose level\n", NULL);
+      return TCL_ERROR;
+  }
+
+  verbose = level;
+  return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_command":  Set the word length of	*/
+/* the SPI command word, which can accomodate lengths other	*/
+/* than the default 8.	In bit-bang mode, the bit length is	*/
+/* arbitrary.  In MPSSE mode, the bit length must be a multiple	*/
+/* of 8.							*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_spi_command(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   unsigned char flags;
+   int cmdwidth, result;
+
+   if (objc != 3) {
+      Tcl_SetResult(interp, "spi_command: Need handle and integer value.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "spi_command:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "spi_command")) return TCL_ERROR;
+
+   if (flags & LEGACY_MODE) {
+      Tcl_SetResult(interp, "spi_command:  Cannot change command word "
+		"length in legacy mode\n", NULL);
+      return TCL_ERROR;
+   }
+
+   result = Tcl_GetIntFromObj(interp, objv[2], &cmdwidth);
+   if (result != TCL_OK) return result;
+
+   if (cmdwidth > 64) {
+      Tcl_SetResult(interp, "spi_command:  Command word "
+		"maximum length is 64 bits.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   ftRecord->cmdwidth = cmdwidth;
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "bang_pin_table"				*/
+/*								*/
+/* Fill "lut" with the pin value for each of the 256 values of	*/
+/* a byte in logical signal order (bit N = signal N, as given	*/
+/* by BB_CSB, etc.) using the device's signal pin map.  Each	*/
+/* device keeps this table in its record ("pinlut"), and it	*/
+/* must be rebuilt whenever "sigpins" changes.			*/
+/*--------------------------------------------------------------*/
+
+static void
+bang_pin_table(unsigned char *sigpins, unsigned char *lut)
+{
+   int v, j;
+
+   for (v = 0; v < 256; v++) {
+      lut[v] = 0;
+      for (j = 0; j < 8; j++)
+	 if (v & (1 << j)) lut[v] |= sigpins[j];
+   }
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl object type for bit-bang pin lists.			*/
+/*								*/
+/* A pin list such as {SDI SCK} is parsed once and its		*/
+/* internal representation holds the set of signals as a	*/
+/* byte in logical signal order.  This does not depend on any	*/
+/* device;  it is converted to pin values through the device's	*/
+/* "pinlut" table.  The string representation is never		*/
+/* invalidated, so no update or duplication procedures are	*/
+/* needed.							*/
+/*--------------------------------------------------------------*/
+
+static Tcl_ObjType bangPinsType = {
+   "ftdi_pinlist",
+   NULL,		/* freeIntRepProc */
+   NULL,		/* dupIntRepProc */
+   NULL,		/* updateStringProc */
+   NULL			/* setFromAnyProc */
+};
+
+static int
+bang_pins_from_obj(Tcl_Interp *interp, Tcl_Obj *obj, unsigned char *maskptr)
+{
+   Tcl_Obj **pinv;
+   int pinc, result, k, j;
+   unsigned char mask;
+
+   if (obj->typePtr == &bangPinsType) {
+      *maskptr = (unsigned char)obj->internalRep.longValue;
+      return TCL_OK;
+   }
+
+   result = Tcl_ListObjGetElements(interp, obj, &pinc, &pinv);
+   if (result != TCL_OK) return result;
+   if (pinc > 8) {
+      Tcl_SetResult(interp, "Each entry must be a list of pins\n", NULL);
+      return TCL_ERROR;
+   }
+   mask = 0;
+   for (k = 0; k < pinc; k++) {
+      j = bang_signal_index(Tcl_GetString(pinv[k]));
+      if (j < 0) {
+	 Tcl_SetResult(interp, "bitbang_set:  Unknown signal name.  "
+		"Must be one of CSB, SDO, SDI, SCK, or USR0 to USR3\n", NULL);
+	 return TCL_ERROR;
+      }
+      mask |= (1 << j);
+   }
+
+   // Replace the internal representation (the string is kept)
+
+   Tcl_GetString(obj);
+   if ((obj->typePtr != NULL) && (obj->typePtr->freeIntRepProc != NULL))
+      obj->typePtr->freeIntRepProc(obj);
+   obj->typePtr = &bangPinsType;
+   obj->internalRep.longValue = (long)mask;
+
+   *maskptr = mask;
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "bitbang_baud"				*/
+/*								*/
+/* Return the baud rate last requested for the bit-bang	*/
+/* channel "chan".  libftdi keeps four times the requested	*/
+/* value in its context while bit-bang mode is enabled, so the	*/
+/* value passed to hw_configure is used instead.  If the rate	*/
+/* is unknown, the default of 125000 set on entry to bit-bang	*/
+/* mode is assumed.						*/
+/*--------------------------------------------------------------*/
+
+static int
+bitbang_baud(ftdi_record *chan)
+{
+   return (chan->hw_baud > 0) ? chan->hw_baud : 125000;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "hw_configure"				*/
+/*								*/
+/* Put the channel into bit mode "mode" with pin directions	*/
+/* "dirs", baud rate "baud" (if positive), and latency timer	*/
+/* "latency" (ms), sending only the control transfers for the	*/
+/* settings that differ from those last sent.  The chip's	*/
+/* buffers are purged only when the mode changes.  On error,	*/
+/* the failed setting is forgotten so that it is sent again	*/
+/* next time.							*/
+/*--------------------------------------------------------------*/
+
+static int
+hw_configure(Tcl_Interp *interp, ftdi_record *chan, unsigned char mode,
+	unsigned char dirs, int baud, int latency)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+   bool newmode = (mode != chan->hw_mode) ? true : false;
+   int ftStatus;
+
+   // Set baudrate (Note: actual bits per second is 16 times the value)
+   if ((baud > 0) && (baud != chan->hw_baud)) {
+      ftStatus = BACKEND(chan)->set_baudrate(ftContext, baud);
+      if (ftStatus < 0) {
+	 chan->hw_baud = -1;
+	 Tcl_SetResult(interp, "Received error while setting baud rate.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->hw_baud = baud;
+   }
+
+   if (newmode || (dirs != chan->hw_dirs)) {
+      ftStatus = BACKEND(chan)->set_bitmode(ftContext, dirs, mode);
+      if (ftStatus < 0) {
+	 chan->hw_mode = HW_UNKNOWN;
+	 Tcl_SetResult(interp, "Received error while setting bit mode.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->hw_mode = mode;
+      chan->hw_dirs = dirs;
+   }
+
+   // Data queued in the old mode means nothing in the new one
+   if (newmode) {
+      ftStatus = BACKEND(chan)->purge_tx(ftContext);
+      if (ftStatus < 0) {
+	 Tcl_SetResult(interp, "Received error while purging transmit buffer.\n", NULL);
+	 return TCL_ERROR;
+      }
+      ftStatus = BACKEND(chan)->purge_rx(ftContext);
+      if (ftStatus < 0) {
+	 Tcl_SetResult(interp, "Received error while purging receive buffer.\n", NULL);
+	 return TCL_ERROR;
+      }
+   }
+
+   // Set latency timer (in ms) (legacy case is 16; FT2232 minimum 1)
+   if (latency != chan->hw_latency) {
+      ftStatus = BACKEND(chan)->set_latency(ftContext, (unsigned char)latency);
+      if (ftStatus < 0) {
+	 chan->hw_latency = -1;
+	 Tcl_SetResult(interp, "Received error while setting latency timer.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->hw_latency = latency;
+   }
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::disable":  Disable a channel by	*/
+/* putting it into bitbang mode and setting all bits to input	*/
+/* so that they are all undriven.				*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_disable(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+
+   long numWritten;
+
+   int result, i, j, k;
+   unsigned char *values;
+   unsigned char flags;
+   unsigned char sigio;
+   unsigned char *sigpins;
+   int len, loclen, bangmode;
+
+   if (objc != 2) {
+      Tcl_SetResult(interp, "disable: Need device name.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "disable:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "disable")) return TCL_ERROR;
+   if (ftRecord->channel != ftRecord) {
+      Tcl_SetResult(interp, "disable:  Not allowed on a virtual "
+		"SPI device.\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_shared(ftRecord)) {
+      Tcl_SetResult(interp, "disable:  Close the virtual SPI devices "
+		"on this channel first.\n", NULL);
+      return TCL_ERROR;
+   }
+   flags = ftRecord->flags;
+   sigpins = &(ftRecord->sigpins[0]);
+
+   if (!(flags & (BITBANG_MODE | SERIAL_MODE)))
+      if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
+
+   ftRecord->flags |= BITBANG_MODE;
+   ftRecord->wordwidth = 8;
+   ftRecord->jtag_state = TAP_UNKNOWN;
+   sigio = 0x00;		// Everything is an input
+
+   // Mark all signal pins as unassigned.
+   for (i = 0; i < 8; i++) sigpins[i] = 0x00;
+   bang_pin_table(sigpins, ftRecord->pinlut);
+
+   // Synchronous bit-bang mode at the default rate.  Nothing is sent
+   // for settings that are already in place.  The baud rate is 16
+   // times the value, but SCK takes two transmissions (up, down), so
+   // 125000 gives a 1MHz SCK.
+
+   if (hw_configure(interp, ftRecord, BITMODE_SYNCBB, sigio, 125000,
+		ftRecord->channel->tn_latency)
+		!= TCL_OK)
+      return TCL_ERROR;
+
+   // Return
+   return TCL_OK;
+}
+
+
+
+static int mpsse_restore(Tcl_Interp *interp, ftdi_record *chan);
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_bitbang": Set or disable SPI bit-	*/
+/* bang mode.  If setting, optional arguments may specify the	*/
+/* order of pins.						*/
+/*--------------------------------------------------------------*/
+
+// Local indexes for bitbang signals
+#define BB_CSB 0
+#define BB_SDO 1
+#define BB_SDI 2
+#define BB_SCK 3
+#define BB_USR0 4
+#define BB_USR1 5
+#define BB_USR2 6
+#define BB_USR3 7
+
+/*--------------------------------------------------------------*/
+/* Support function "bang_signal_index"				*/
+/*								*/
+/* Return the local index (BB_CSB, etc.) of a bit-bang signal	*/
+/* name, or -1 if the name is not recognized.			*/
+/*--------------------------------------------------------------*/
+
+char *bang_signal_names[] = {
+   "CSB", "SDO", "SDI", "SCK", "USR0", "USR1", "USR2", "USR3", NULL
+};
+
+int
+bang_signal_index(char *name)
+{
+   int j;
+
+   for (j = 0; bang_signal_names[j] != NULL; j++)
+      if (!strcasecmp(name, bang_signal_names[j]))
+	 return j;
+   return -1;
+}
+
+int
+ftditcl_spi_bitbang(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   int ftStatus;
+
+   long numWritten;
+
+   int result, i, j, k;
+   unsigned char *values;
+   unsigned char *sigpins;
+   unsigned char tbuffer[1];
+   unsigned char flags;
+   unsigned char sigio, sigassn;
+   int len, loclen, bangmode;
+   char *sigchar;
+   Tcl_Obj *sigpair, *sigval;
+
+   if (objc != 3) {
       Tcl_SetResult(interp, "spi_bitbang: Need device name and argument.\n", NULL);
       return TCL_ERROR;
    }
    ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftRecord == (ftdi_record *)NULL) {
-      Tcl_SetResult(interp, "spi_bitbang:  No such device\n", NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "spi_bitbang:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "spi_bitbang")) return TCL_ERROR;
+   if (ftRecord->channel != ftRecord) {
+      Tcl_SetResult(interp, "spi_bitbang:  Not allowed on a virtual "
+		"SPI device.\n", NULL);
+      return TCL_ERROR;
+   }
+   flags = ftRecord->flags;
+   sigpins = &(ftRecord->sigpins[0]);
+
+   if (!(flags & (BITBANG_MODE | SERIAL_MODE)))
+      if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
+
+   // NOTE:  locally, signals will be indexed according to definitions
+   // above for BB_CSB, BB_SDO, BB_SDI, BB_SCK
+
+   result = Tcl_ListObjLength(interp, objv[2], &len);
+   if (len == 1) {
+      result = Tcl_GetBooleanFromObj(interp, objv[2], &bangmode);
+      if (result != TCL_OK) return result;
+      if (bangmode && channel_shared(ftRecord)) {
+	 Tcl_SetResult(interp, "spi_bitbang:  Close the virtual SPI devices "
+		"on this channel first.\n", NULL);
+	 return TCL_ERROR;
+      }
+      if (bangmode) {
+	 /* Set default signals. */
+	 ftRecord->flags |= BITBANG_MODE;
+	 ftRecord->wordwidth = 8;
+	 sigpins[7] = 0x80;	// ADBUS7 = USR3
+	 sigpins[6] = 0x40;	// ADBUS6 = USR2
+	 sigpins[5] = 0x20;	// ADBUS5 = USR1
+	 sigpins[4] = 0x10;	// ADBUS4 = USR0
+	 sigpins[3] = 0x08;	// ADBUS3 = SCK
+	 sigpins[2] = 0x04;	// ADBUS2 = SDI
+	 sigpins[1] = 0x02;	// ADBUS1 = SDO
+	 sigpins[0] = 0x01;	// ADBUS0 = CSB
+	 sigio = 0xfd;		// 1 = output, 0 = input
+      }
+      else {
+	 // Turn off bit bang mode, return to MPSSE mode
+	 return mpsse_restore(interp, ftRecord);
+      }
+   }
+   else {
+      /* Declare SPI signals.  Each should be a list of length two */
+      if (channel_shared(ftRecord)) {
+	 Tcl_SetResult(interp, "spi_bitbang:  Close the virtual SPI devices "
+		"on this channel first.\n", NULL);
+	 return TCL_ERROR;
+      }
+      ftRecord->flags |= BITBANG_MODE;
+      ftRecord->wordwidth = 8;
+      sigio = 0xff;
+      sigassn = 0x00;
+      for (i = 0; i < 8; i++) sigpins[i] = 0;
+      if (len < 4) {
+	 Tcl_SetResult(interp, "spi_bitbang:  Must at least declare "
+		"SCK, SDI, SDO, and CSB\n", NULL);
+	 return TCL_ERROR;
+      }
+      else if (len > 8) {
+	 Tcl_SetResult(interp, "spi_bitbang:  Can only define up to 8 signals\n",
+			NULL);
+	 return TCL_ERROR;
+      }
+
+      for (i = 0; i < len; i++) {
+         result = Tcl_ListObjIndex(interp, objv[2], i, &sigpair);
+	 result = Tcl_ListObjLength(interp, sigpair, &loclen);
+	 if (loclen != 2) {
+	    Tcl_SetResult(interp, "spi_bitbang:  List of signals must be in"
+			"form {signal, bit}. bit is 0 to 7\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 result = Tcl_ListObjIndex(interp, sigpair, 0, &sigval);
+
+	 // Recast from i (order in argument list) to j (signal
+	 // canonical order, 0 = CSB, 1 = SDO, 2 = SDI, 3 = SCK
+
+	 j = bang_signal_index(Tcl_GetString(sigval));
+	 if (j < 0) {
+	    Tcl_SetResult(interp, "spi_bitbang:  Unknown signal name.  Must be "
+			"one of CSB, SDO, SDI, SCK, or USR0 to USR3\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 result = Tcl_ListObjIndex(interp, sigpair, 1, &sigval);
+	 result = Tcl_GetIntFromObj(interp, sigval, &k);
+	 sigpins[j] = 0x01 << k;  // Convert bit number to bit mask
+
+	 if (j == BB_SDO) sigio &= ~sigpins[j];
+	 sigassn |= sigpins[j];
+      }
+
+      // Check that all pins are assigned.  
+      j = 0;
+      for (i = 0; i < 8; i++) if (sigassn & (1 << i)) j++;
+      if (j != len) {
+	 Tcl_SetResult(interp, "spi_bitbang:  Not all signals assigned.  Must "
+			"assign all of CSB, SDO, SDI, and SCK\n", NULL);
+	 return TCL_ERROR;
+      }
+   }
+   bang_pin_table(sigpins, ftRecord->pinlut);
+
+   // Set device to Synchronous bit-bang mode, with pins SCK, SDI, and CSB
+   // set to output, SDO to input, at the default rate (see disable).
+   // Switching from MPSSE mode needs no reset;  only the settings
+   // that change are sent.
+
+   if (hw_configure(interp, ftRecord, BITMODE_SYNCBB, sigio, 125000,
+		ftRecord->channel->tn_latency)
+		!= TCL_OK)
+      return TCL_ERROR;
+
+   // Set default values CSB = 1, SDI = 0, SCK = 0, SDO = don't care
+   tbuffer[0] = sigpins[BB_CSB];
+
+   if (verbose > 1) {
+      Fprintf(interp, stderr, "spi_bitbang: Writing: ");
+      for (i = 0; i < 1; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, 1);
+   if (ftStatus < 0)
+      Tcl_SetResult(interp, "Received error while writing init data\n", NULL);
+    else if (ftStatus != 1)
+      Tcl_SetResult(interp, "Short write error\n", NULL);
+
+   // Return
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::bitbang_word":  Set the word length of	*/
+/* the SPI in bit-bang mode, which can accomodate lengths other	*/
+/* than the default 8.						*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_bang_word(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   unsigned char flags;
+   int wordwidth, result;
+
+   if (objc != 3) {
+      Tcl_SetResult(interp, "bitbang_word: Need handle and integer value.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "bitbang_word:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "bitbang_word")) return TCL_ERROR;
+
+   if (!(flags & BITBANG_MODE)) {
+      Tcl_SetResult(interp, "bitbang_word: bit-bang mode must be set first.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   result = Tcl_GetIntFromObj(interp, objv[2], &wordwidth);
+   if (result != TCL_OK) return result;
+   if (wordwidth < 1) {
+      Tcl_SetResult(interp, "bitbang_word: Word width must be at least "
+		"one bit.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   ftRecord->wordwidth = wordwidth;
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support functions for bit-bang words of arbitrary width.	*/
+/* A word of "width" bits is held as "nb" = (width + 7) / 8	*/
+/* bytes, most significant byte first, right-aligned so that	*/
+/* any unused bits are at the top of the first byte.  This is	*/
+/* also the layout used for "-binary" (bytearray) data.		*/
+/*--------------------------------------------------------------*/
+
+/*--------------------------------------------------------------*/
+/* Convert a Tcl integer into a word.  Values that do not fit	*/
+/* a Tcl wide integer must be given in hexadecimal ("0x...").	*/
+/*--------------------------------------------------------------*/
+
+static int
+bang_word_from_obj(Tcl_Interp *interp, Tcl_Obj *obj, int width,
+	unsigned char *wbytes, int nb)
+{
+   Tcl_WideInt value;
+   Tcl_WideUInt uvalue;
+   char *str, *p;
+   int i, d, nibble;
+
+   memset(wbytes, 0, nb);
+   if (Tcl_GetWideIntFromObj(NULL, obj, &value) == TCL_OK) {
+      if ((value < 0) && (width < 64)) goto outofrange;
+      uvalue = (Tcl_WideUInt)value;
+      for (i = nb - 1; (i >= 0) && (uvalue != 0); i--) {
+	 wbytes[i] = (unsigned char)(uvalue & 0xff);
+	 uvalue >>= 8;
+      }
+      if (uvalue != 0) goto outofrange;
+   }
+   else {
+      str = Tcl_GetString(obj);
+      if ((str[0] != '0') || ((str[1] != 'x') && (str[1] != 'X'))) {
+	 Tcl_SetResult(interp, "bitbang_write:  Words wider than 64 bits "
+		"must be given in hexadecimal (0x...)\n", NULL);
+	 return TCL_ERROR;
+      }
+      nibble = 0;
+      for (p = str + strlen(str) - 1; p >= str + 2; p--, nibble++) {
+	 if (!isxdigit(*p)) {
+	    Tcl_SetResult(interp, "bitbang_write:  Bad hexadecimal value\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 d = isdigit(*p) ? (*p - '0') : (tolower(*p) - 'a' + 10);
+	 if ((nibble >> 1) >= nb) {
+	    if (d != 0) goto outofrange;
+	    continue;
+	 }
+	 wbytes[nb - 1 - (nibble >> 1)] |= d << ((nibble & 1) << 2);
+      }
+   }
+   if ((width & 7) && (wbytes[0] >> (width & 7))) goto outofrange;
+   return TCL_OK;
+
+outofrange:
+   Tcl_SetResult(interp, "bitbang_write:  Word value out of range "
+		"for word width\n", NULL);
+   return TCL_ERROR;
+}
+
+/*--------------------------------------------------------------*/
+/* Convert a word into a Tcl integer.  Words of 64 bits or more	*/
+/* are returned as a hexadecimal string, which Tcl accepts as	*/
+/* an integer value.						*/
+/*--------------------------------------------------------------*/
+
+static Tcl_Obj *
+bang_word_to_obj(unsigned char *wbytes, int nb, int width)
+{
+   Tcl_WideInt value;
+   char *hexstr;
+   Tcl_Obj *robj;
+   int i;
+
+   if (width < 64) {
+      value = 0;
+      for (i = 0; i < nb; i++) value = (value << 8) | wbytes[i];
+      return Tcl_NewWideIntObj(value);
+   }
+
+   hexstr = (char *)malloc(2 * nb + 3);
+   strcpy(hexstr, "0x");
+   for (i = 0; i < nb; i++) sprintf(hexstr + 2 + 2 * i, "%02x", wbytes[i]);
+   robj = Tcl_NewStringObj(hexstr, -1);
+   free(hexstr);
+   return robj;
+}
+
+/*--------------------------------------------------------------*/
+/* Copy "width" bits starting at bit "bitoff" of the packed	*/
+/* (MSB-first) bit stream "src" into the word "dst".		*/
+/*--------------------------------------------------------------*/
+
+static void
+bang_word_extract(unsigned char *src, long bitoff, int width,
+	unsigned char *dst, int nb)
+{
+   int lead, i, o;
+   long b;
+
+   lead = (nb << 3) - width;
+   if (((bitoff & 7) == 0) && (lead == 0)) {
+      memcpy(dst, src + (bitoff >> 3), nb);
+      return;
+   }
+   memset(dst, 0, nb);
+   for (i = 0; i < width; i++) {
+      b = bitoff + i;
+      o = lead + i;
+      dst[o >> 3] |= ((src[b >> 3] >> (7 - (b & 7))) & 1) << (7 - (o & 7));
+   }
+}
+
+/*--------------------------------------------------------------*/
+/* Append the bit-bang sequence for one word, MSB first, to	*/
+/* "tbuffer".  Each bit takes two samples:  SDI with SCK low,	*/
+/* then SDI with SCK high.  Returns the updated buffer index.	*/
+/*--------------------------------------------------------------*/
+
+static int
+bang_word_encode(unsigned char *wbytes, int nb, int width,
+	unsigned char *sigpins, unsigned char *tbuffer, int tidx)
+{
+   unsigned char sdi = sigpins[BB_SDI];
+   unsigned char sck = sigpins[BB_SCK];
+   unsigned char bit;
+   int j;
+
+   for (j = width - 1; j >= 0; j--) {
+      // input changes on falling edge of SCK
+      bit = (wbytes[nb - 1 - (j >> 3)] >> (j & 7)) & 1;
+      tbuffer[tidx++] = (unsigned char)(-bit) & sdi;
+      tbuffer[tidx] = tbuffer[tidx - 1] | sck;
+      tidx++;
+   }
+   return tidx;
+}
+
+/*--------------------------------------------------------------*/
+/* Pack the SDO value of every other sample, starting at	*/
+/* "tbuffer[0]", into "nbits" bits of "packed" (MSB first).	*/
+/* Eight bits are assembled at a time without branching.	*/
+/*--------------------------------------------------------------*/
+
+static void
+bang_pack_samples(unsigned char *tbuffer, long nbits, unsigned char sdo,
+	unsigned char *packed)
+{
+   unsigned char *s;
+   int sh;
+   long b;
+
+   for (sh = 0; sh < 7; sh++) if (sdo & (1 << sh)) break;
+
+   s = tbuffer;
+   for (b = 0; b + 8 <= nbits; b += 8, s += 16) {
+      packed[b >> 3] = (((s[0] >> sh) & 1) << 7) | (((s[2] >> sh) & 1) << 6)
+		| (((s[4] >> sh) & 1) << 5) | (((s[6] >> sh) & 1) << 4)
+		| (((s[8] >> sh) & 1) << 3) | (((s[10] >> sh) & 1) << 2)
+		| (((s[12] >> sh) & 1) << 1) | ((s[14] >> sh) & 1);
+   }
+   if (b < nbits) {
+      packed[b >> 3] = 0;
+      for (sh = 7; b < nbits; b++, sh--, s += 2)
+	 packed[b >> 3] |= ((*s & sdo) ? 1 : 0) << sh;
+   }
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "bang_transfer"				*/
+/*								*/
+/* Send "nbytes" of bit-bang data and collect the "nbytes"	*/
+/* that synchronous bit-bang mode returns for them into		*/
+/* "rbuffer" (or discard them if "rbuffer" is NULL).  The	*/
+/* write and the read are submitted together, so that each	*/
+/* transfer takes back exactly the bytes it caused and nothing	*/
+/* is left for the next one.  The chip's buffers are then	*/
+/* purged only to recover when the counts come out wrong.	*/
+/* Returns the number of bytes read, or -1 on error.  If the	*/
+/* deadline "dl" passes, the transfer is cancelled, and the	*/
+/* caller reports the partial result.				*/
+/*--------------------------------------------------------------*/
+
+static int
+bang_transfer(Tcl_Interp *interp, ftdi_record *ftRecord,
+	unsigned char *tbuffer, int nbytes, unsigned char *rbuffer,
+	char *cmdname, ftdi_deadline *dl)
+{
+   struct ftdi_context *ftContext = ftRecord->ftContext;
+   struct ftdi_transfer_control *wtc, *rtc;
+   unsigned char *rbuf = rbuffer;
+   int wStatus, rStatus;
+   char msg[100];
+
+   if (nbytes <= 0) return 0;
+   if (rbuf == NULL)
+      rbuf = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
+
+   wtc = BACKEND(ftRecord)->write_submit(ftContext, tbuffer, nbytes);
+   rtc = (wtc == NULL) ? NULL : BACKEND(ftRecord)->read_submit(ftContext,
+		rbuf, nbytes);
+   rStatus = transfer_wait(rtc, dl);
+   wStatus = transfer_wait(wtc, dl);
+   if (rbuffer == NULL) free(rbuf);
+   if (dl->timedout) return rStatus;
+
+   if (wStatus != nbytes || rStatus != nbytes) {
+      // Out of step with the chip:  Discard whatever is left over
+      BACKEND(ftRecord)->purge_tx(ftContext);
+      BACKEND(ftRecord)->purge_rx(ftContext);
+      sprintf(msg, "%s:  %s\n", cmdname, (wStatus < 0 || rStatus < 0) ?
+		"Received error in bit-bang transfer." :
+		"short transfer error.");
+      Tcl_SetResult(interp, msg, TCL_VOLATILE);
+      return (wStatus < 0) ? -1 : rStatus;
+   }
+   return rStatus;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::bitbang_write":				*/
+/*								*/
+/* Use: bitbang_write [-binary] <device> <register> <values>	*/
+/*								*/
+/* <values> is a list of integers, each of the current word	*/
+/* width (see bitbang_word).  With "-binary", <values> is a	*/
+/* bytearray of packed words, each word taking (width + 7) / 8	*/
+/* bytes, most significant byte first.				*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_bang_write(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int result, nbytes, nb, binlen;
+   int wordcount, i, j, tidx;
+   int wordwidth;
+   Tcl_WideInt regnum;
+   unsigned char cmdwidth;
+   unsigned char flags;
+   unsigned char *tbuffer;
+   unsigned char *sigpins;
+   unsigned char *wbytes, *bindata = NULL;
+   bool binary = false;
+   Tcl_Obj *vector, *lobj;
+
+   long numWritten;
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   int ftStatus, tmo;
+   ftdi_deadline dl;
+
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
+
+   if ((objc == 5) && !strcmp(Tcl_GetString(objv[1]), "-binary")) {
+      binary = true;
+      objc--;
+      objv++;
+   }
+
+   if (objc != 4) {
+      Tcl_SetResult(interp, "bitbang_write: Need device name, "
+		"register, and vector of values.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "bitbang_write:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "bitbang_write")) return TCL_ERROR;
+   flags = ftRecord->flags;
+   wordwidth = ftRecord->wordwidth;
+   cmdwidth = ftRecord->cmdwidth;
+   sigpins = &(ftRecord->sigpins[0]);
+
+   // If we're not in bit-bang mode, use the normal spi_write.
+
+   if (!(flags & BITBANG_MODE)) {
+      if (binary) {
+	 Tcl_SetResult(interp, "bitbang_write:  -binary requires "
+		"bit-bang mode.\n", NULL);
+	 return TCL_ERROR;
+      }
+      result = ftditcl_spi_write(clientData, interp, (tmo < 0) ? objc :
+		objc + 2, objv);
+      return result;
+   }
+
+   // First argument is register number.  This may or may not include
+   // additional information such as an opcode.  If so, it is the
+   // responsibility of the end-user to make sure that the opcode
+   // matches the use of routine "read" or "write".
+
+   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
+   if (result != TCL_OK) return result;
+
+   nb = (wordwidth + 7) >> 3;
+   vector = objv[3];
+   if (binary) {
+      bindata = Tcl_GetByteArrayFromObj(vector, &binlen);
+      if ((binlen % nb) != 0) {
+	 Tcl_SetResult(interp, "bitbang_write:  Binary data length is not "
+		"a multiple of the word size\n", NULL);
+	 return TCL_ERROR;
+      }
+      wordcount = binlen / nb;
+      if (wordwidth & 7) {
+	 for (i = 0; i < wordcount; i++) {
+	    if (bindata[i * nb] >> (wordwidth & 7)) {
+	       Tcl_SetResult(interp, "bitbang_write:  Word value out of "
+			"range for word width\n", NULL);
+	       return TCL_ERROR;
+	    }
+	 }
+      }
+   }
+   else {
+      result = Tcl_ListObjLength(interp, vector, &wordcount);
+      if (result != TCL_OK) return result;
+   }
+
+   // Create complete vector to write in synchronous bit-bang
+   // mode.
+
+   nbytes = ((cmdwidth + wordcount * wordwidth) * 2) + 2;
+   tbuffer = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
+   wbytes = (unsigned char *)malloc(nb * sizeof(unsigned char));
+   tidx = 0;
+ 
+   // Assert CSB
+   tbuffer[tidx++] = (unsigned char)0;
+
+   // Write command/register word msb first
+   for (j = cmdwidth - 1; j >= 0; j--) {
+      // input changes on falling edge of SCK
+      tbuffer[tidx++] = (regnum & ((Tcl_WideInt)1 << j)) ? sigpins[BB_SDI] : 0;
+      tbuffer[tidx] = tbuffer[tidx - 1] | sigpins[BB_SCK];
+      tidx++;
+   }
+
+   for (i = 0; i < wordcount; i++) {
+      if (binary)
+	 tidx = bang_word_encode(bindata + i * nb, nb, wordwidth, sigpins,
+			tbuffer, tidx);
+      else {
+	 result = Tcl_ListObjIndex(interp, vector, i, &lobj);
+	 if (result == TCL_OK)
+	    result = bang_word_from_obj(interp, lobj, wordwidth, wbytes, nb);
+	 if (result != TCL_OK) {
+	    free(wbytes);
+	    free(tbuffer);
+	    return result;
+	 }
+	 tidx = bang_word_encode(wbytes, nb, wordwidth, sigpins, tbuffer, tidx);
+      }
+   }
+   free(wbytes);
+
+   // De-assert CSB
+   tbuffer[tidx++] = (flags & CSB_NORAISE) ? (unsigned char)0 :
+		(unsigned char)sigpins[BB_CSB];
+
+   if (verbose > 1) {
+      Fprintf(interp, stderr, "bitbang_write: Writing: ");
+      for (i = 0; i < nbytes; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   // SPI write using bit bang, taking back the bytes sampled
+   deadline_start(&dl, ftRecord, tmo);
+   ftStatus = bang_transfer(interp, ftRecord, tbuffer, nbytes, NULL,
+		"bitbang_write", &dl);
+   free(tbuffer);
+   if (dl.timedout)
+      return deadline_error(interp, &dl, ftRecord, "bitbang_write",
+		ftStatus, nbytes, NULL);
+   return (ftStatus == nbytes) ? TCL_OK : TCL_ERROR;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::bitbang_set":				*/
+/* Apply individual signal changes.				*/
+/* Use:  bitbang_set <device> <pinlist> [x <count>] ...	*/
+/* Pinlist contains all pins to be set (null list if all pins	*/
+/* should be cleared).  Use multiple lists for operations to be	*/
+/* separated by one clock cycle.  A pinlist followed by "x"	*/
+/* and a count is held for that many clock cycles.		*/
+/* Ex: "bitbang_set ftdi0 {SDI SCK} {SDI} {}"			*/
+/* Ex: "bitbang_set ftdi0 {SCK} {} x 1000"			*/
+/*--------------------------------------------------------------*/
+
+#define BANG_SET_CHUNK	65536
+
+/* Parse the pin list at objv[i] and any repeat count following	*/
+/* it.  Returns the index of the next pin list, or -1 on error.	*/
+
+static int
+bang_set_entry(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+	int i, unsigned char *maskptr, Tcl_WideInt *countptr)
+{
+   char *xstr;
+
+   if (bang_pins_from_obj(interp, objv[i], maskptr) != TCL_OK) return -1;
+   *countptr = 1;
+   i++;
+
+   // "x" is never a valid pin list, so it is unambiguous.  Skip
+   // the string compare if the next argument is a known pin list.
+
+   if ((i >= objc) || (objv[i]->typePtr == &bangPinsType)) return i;
+   xstr = Tcl_GetString(objv[i]);
+   if ((xstr[0] != 'x') || (xstr[1] != '\0')) return i;
+
+   if (i + 1 >= objc) {
+      Tcl_SetResult(interp, "bitbang_set:  \"x\" must be followed by "
+		"a repeat count\n", NULL);
+      return -1;
+   }
+   if (Tcl_GetWideIntFromObj(interp, objv[i + 1], countptr) != TCL_OK)
+      return -1;
+   if (*countptr < 0) {
+      Tcl_SetResult(interp, "bitbang_set:  Repeat count cannot be "
+		"negative\n", NULL);
+      return -1;
+   }
+   return i + 2;
+}
+
+/* Write out the accumulated bitbang_set buffer */
+
+static int
+bang_set_flush(Tcl_Interp *interp, ftdi_record *ftRecord,
+	unsigned char *tbuffer, int nbytes, ftdi_deadline *dl)
+{
+   int i, ftStatus;
+
+   if (verbose > 1) {
+      Fprintf(interp, stderr, "bitbang_set: Writing: ");
+      for (i = 0; i < nbytes; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   // Simple bit bang write, taking back the bytes sampled
+   ftStatus = bang_transfer(interp, ftRecord, tbuffer, nbytes, NULL,
+		"bitbang_set", dl);
+   if (dl->timedout)
+      return deadline_error(interp, dl, ftRecord, "bitbang_set",
+		ftStatus, nbytes, NULL);
+   return (ftStatus == nbytes) ? TCL_OK : TCL_ERROR;
+}
+
+int
+ftditcl_bang_set(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int i, n, tidx;
+   unsigned char flags;
+   unsigned char mask, value;
+   unsigned char *tbuffer;
+   Tcl_WideInt count;
+   int tmo;
+   ftdi_deadline dl;
+
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+
+   if (deadline_option(interp, &objc, objv, &tmo) != TCL_OK) return TCL_ERROR;
+   if (objc < 2) {
+      Tcl_SetResult(interp, "bitbang_set: Need device name and at least "
+		"one pin and value pair.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "bitbang_set:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "bitbang_set")) return TCL_ERROR;
+   flags = ftRecord->flags;
+
+   // Check all arguments before anything is sent.  Pin lists are
+   // parsed once and cached in the argument objects.
+
+   for (i = 2; i < objc;) {
+      i = bang_set_entry(interp, objc, objv, i, &mask, &count);
+      if (i < 0) return TCL_ERROR;
+   }
+
+   // The output is built in a buffer kept with the device record,
+   // and sent each time the buffer fills.
+
+   if (ftRecord->setbuffer == NULL)
+      ftRecord->setbuffer = (unsigned char *)malloc(BANG_SET_CHUNK *
+		sizeof(unsigned char));
+   tbuffer = ftRecord->setbuffer;
+
+   deadline_start(&dl, ftRecord, tmo);
+   tidx = 0;
+   for (i = 2; i < objc;) {
+      i = bang_set_entry(interp, objc, objv, i, &mask, &count);
+      value = ftRecord->pinlut[mask];
+      while (count > 0) {
+	 n = (count < (Tcl_WideInt)(BANG_SET_CHUNK - tidx)) ?
+		(int)count : BANG_SET_CHUNK - tidx;
+	 memset(tbuffer + tidx, value, n);
+	 tidx += n;
+	 count -= n;
+	 if (tidx == BANG_SET_CHUNK) {
+	    if (bang_set_flush(interp, ftRecord, tbuffer, tidx, &dl) != TCL_OK)
+	       return TCL_ERROR;
+	    tidx = 0;
+	 }
+      }
+   }
+   if (tidx > 0) return bang_set_flush(interp, ftRecord, tbuffer, tidx, &dl);
+
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::play":					*/
+/* Play a waveform from a pattern file in bit-bang mode.	*/
+/*								*/
+/* Use:  play <device> <filename> [<step>]			*/
+/*								*/
+/* <filename> is a VCD file or a run-length binary pattern	*/
+/* file (see ftdi_wave.h).  For VCD files, <step> is the	*/
+/* number of VCD time units per bit-bang step, and defaults to	*/
+/* the smallest interval between timestamps in the file.  The	*/
+/* waveform is expanded in 64kB blocks, each block being	*/
+/* generated while the previous one is sent to the device.	*/
+/* Returns the number of steps played.				*/
+/*--------------------------------------------------------------*/
+
+#define PLAY_CHUNK	65536
+
+int
+ftditcl_play(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int result, n, pn = 0, cur, baud0;
+   unsigned int chunksize;
+   Tcl_WideInt step, total, steps, period;
+   unsigned char *lut;
+   unsigned char *values[2], *discard;
+   char *errmsg = NULL;
+   wave_source *ws;
+
+   ftdi_record *ftRecord, *chan;
+   struct ftdi_context * ftContext;
+   struct ftdi_transfer_control *wtc = NULL, *rtc = NULL;
+   int ftStatus, tmo;
+   ftdi_deadline dl;
+
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
+   if (objc != 3 && objc != 4) {
+      Tcl_SetResult(interp, "play: Need device name, pattern file, "
+		"and optional step size.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "play:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "play")) return TCL_ERROR;
+   if (!(ftRecord->flags & BITBANG_MODE)) {
+      Tcl_SetResult(interp, "play: bit-bang mode must be set first.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   step = 0;
+   if (objc == 4) {
+      result = Tcl_GetWideIntFromObj(interp, objv[3], &step);
+      if (result != TCL_OK) return result;
+   }
+
+   ws = wave_open(interp, Tcl_GetString(objv[2]), step);
+   if (ws == NULL) return TCL_ERROR;
+
+   // A run-length file that records its step period is played at
+   // that rate (see spi_speed), and the rate is put back afterward.
+
+   chan = ftRecord->channel;
+   baud0 = chan->hw_baud;
+   period = wave_period(ws);
+   if (period > 0) {
+      if (hw_configure(interp, chan, chan->hw_mode, chan->hw_dirs,
+		(int)(1.0E9 / (16.0 * (double)period) + 0.5),
+		chan->tn_latency) != TCL_OK) {
+	 wave_close(ws);
+	 return TCL_ERROR;
+      }
+   }
+
+   lut = ftRecord->pinlut;
+
+   values[0] = (unsigned char *)malloc(PLAY_CHUNK * sizeof(unsigned char));
+   values[1] = (unsigned char *)malloc(PLAY_CHUNK * sizeof(unsigned char));
+   discard = (unsigned char *)malloc(PLAY_CHUNK * sizeof(unsigned char));
+
+   // Submit each block as one USB request.  In synchronous bit-bang
+   // mode every byte written produces one byte to read, and the chip
+   // stops driving pins when its receive buffer is full, so the
+   // readback is drained alongside each block.
+
+   BACKEND(ftRecord)->get_write_chunksize(ftContext, &chunksize);
+   BACKEND(ftRecord)->set_write_chunksize(ftContext,
+		TUNED_CHUNK(ftRecord->channel->tn_wrchunk, PLAY_CHUNK));
+
+   deadline_start(&dl, ftRecord, tmo);
+   total = 0;
+   cur = 0;
+   while (1) {
+      // Expand the next block while the previous one is in flight
+      n = wave_fill(ws, lut, values[cur], PLAY_CHUNK);
+
+      if (wtc != NULL) {
+	 ftStatus = transfer_wait(wtc, &dl);
+	 if (ftStatus < 0) errmsg = "play:  Received error while writing.\n";
+	 ftStatus = transfer_wait(rtc, &dl);
+	 if ((ftStatus < 0) && (errmsg == NULL))
+	    errmsg = "play:  Received error while reading.\n";
+	 wtc = rtc = NULL;
+	 if (dl.timedout) {
+	    // Each byte read back is a step that was played.  The
+	    // file's total includes the steps not yet submitted.
+	    steps = total + ((n > 0) ? n : 0) + wave_length(ws);
+	    total -= pn - ((ftStatus > 0) ? ftStatus : 0);
+	    break;
+	 }
+	 if (errmsg != NULL) break;
+      }
+      if (n <= 0) break;
+
+      wtc = BACKEND(ftRecord)->write_submit(ftContext, values[cur], n);
+      rtc = (wtc == NULL) ? NULL : BACKEND(ftRecord)->read_submit(ftContext, discard, n);
+      if (rtc == NULL) {
+	 if (wtc != NULL) transfer_wait(wtc, &dl);
+	 errmsg = "play:  Received error while writing.\n";
+	 break;
+      }
+      total += n;
+      pn = n;
+      cur ^= 1;
+   }
+
+   BACKEND(ftRecord)->set_write_chunksize(ftContext, chunksize);
+   wave_close(ws);
+   free(values[0]);
+   free(values[1]);
+   free(discard);
+
+   if ((period > 0) && (baud0 > 0) && (hw_configure(interp, chan,
+		chan->hw_mode, chan->hw_dirs, baud0, chan->tn_latency)
+		!= TCL_OK) && (errmsg == NULL))
+      errmsg = "play:  Received error while restoring baud rate.\n";
+
+   if (dl.timedout)
+      return deadline_error(interp, &dl, ftRecord, "play", total, steps,
+		NULL);
+   if (errmsg != NULL) {
+      Tcl_SetResult(interp, errmsg, NULL);
+      return TCL_ERROR;
+   }
+   Tcl_SetObjResult(interp, Tcl_NewWideIntObj(total));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::bitbang_read":				*/
+/*								*/
+/* Use: bitbang_read [-binary|-raw] <device> <register> <count> */
+/*								*/
+/* Returns a list of <count> integers of the current word	*/
+/* width, or with "-binary", a bytearray of packed words in	*/
+/* the same format accepted by "bitbang_write -binary".  With	*/
+/* "-raw", returns every byte sampled from the pins during the	*/
+/* transfer as a bytearray (see bitbang_dump).			*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_bang_read(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int result, nbytes, numRead, nb;
+   int wordcount, i, j, tidx;
+   int wordwidth;
+   long nbits, availbits;
+   Tcl_WideInt regnum;
+   unsigned char flags;
+   unsigned char *tbuffer;
+   unsigned char cmdwidth;
+   unsigned char *sigpins;
+   unsigned char *packed, *wbytes;
+   unsigned char *rbuffer;
+   bool binary = false, raw = false;
+   Tcl_Obj *vector, *lobj;
+
+   long numWritten;
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   int ftStatus, tmo;
+   ftdi_deadline dl;
+
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
+
+   if (objc == 5) {
+      if (!strcmp(Tcl_GetString(objv[1]), "-binary"))
+	 binary = true;
+      else if (!strcmp(Tcl_GetString(objv[1]), "-raw"))
+	 raw = true;
+      if (binary || raw) {
+	 objc--;
+	 objv++;
+      }
+   }
+
+   if (objc != 4) {
+      Tcl_SetResult(interp, "bitbang_read: Need device name, "
+		"register, and word count.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "bitbang_read:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "bitbang_read")) return TCL_ERROR;
+   flags = ftRecord->flags;
+   wordwidth = ftRecord->wordwidth;
+   cmdwidth = ftRecord->cmdwidth;
+   sigpins = &(ftRecord->sigpins[0]);
+
+   // If we're not in bit-bang mode, use the normal spi_read.
+
+   if (!(flags & BITBANG_MODE)) {
+      if (binary || raw) {
+	 Tcl_SetResult(interp, "bitbang_read:  -binary and -raw require "
+		"bit-bang mode.\n", NULL);
+	 return TCL_ERROR;
+      }
+      result = ftditcl_spi_read(clientData, interp, (tmo < 0) ? objc :
+		objc + 2, objv);
+      return result;
+   }
+
+   // First argument is register number.  This may or may not include
+   // additional information such as an opcode.  If so, it is the
+   // responsibility of the end-user to make sure that the opcode
+   // matches the use of routine "read" or "write".
+
+   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
+   if (result != TCL_OK) return result;
+   result = Tcl_GetIntFromObj(interp, objv[3], &wordcount);
+   if (result != TCL_OK) return result;
+   if (wordcount < 0) {
+      Tcl_SetResult(interp, "bitbang_read:  Word count cannot be "
+		"negative.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   // Create complete vector to write in synchronous bit-bang mode.
+
+   nbytes = ((cmdwidth + wordcount * wordwidth) * 2) + 2;
+   tbuffer = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
+   tidx = 0;
+ 
+   // Assert CSB
+   tbuffer[tidx++] = (unsigned char)0;
+
+   // Write command/register word msb first
+   for (j = cmdwidth - 1; j >= 0; j--) {
+      // input changes on falling edge of SCK
+      tbuffer[tidx++] = (regnum & ((Tcl_WideInt)1 << j)) ? sigpins[BB_SDI] : 0;
+      tbuffer[tidx] = tbuffer[tidx - 1] | sigpins[BB_SCK];
+      tidx++;
+   }
+
+   for (i = 0; i < wordcount; i++) {
+      for (j = 0; j < wordwidth; j++) {
+	 // Drive clock by bit-bang
+	 tbuffer[tidx++] = 0;
+	 tbuffer[tidx++] = sigpins[BB_SCK];
+      }
+   }
+
+   // De-assert CSB
+   tbuffer[tidx++] = (flags & CSB_NORAISE) ? (unsigned char)0 :
+		(unsigned char)sigpins[BB_CSB];
+
+   if (verbose > 1) {
+      Fprintf(interp, stderr, "bitbang_read: Writing: ");
+      for (i = 0; i < nbytes; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   // SPI write and read using bit bang, as one submission.  Raw
+   // captures are read directly into the result bytearray.
+
+   if (raw) {
+      vector = Tcl_NewByteArrayObj(NULL, 0);
+      rbuffer = Tcl_SetByteArrayLength(vector, nbytes);
+   }
+   else
+      rbuffer = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
+
+   deadline_start(&dl, ftRecord, tmo);
+   ftStatus = bang_transfer(interp, ftRecord, tbuffer, nbytes, rbuffer,
+		"bitbang_read", &dl);
+   free(tbuffer);
+
+   // Only an expired deadline returns a partial result;  any other
+   // short transfer is an error (bang_transfer has set the message).
+   if ((ftStatus < 0) || (!dl.timedout && (ftStatus != nbytes))) {
+      if (raw)
+	 Tcl_DecrRefCount(vector);
+      else
+	 free(rbuffer);
+      return TCL_ERROR;
+   }
+   numRead = ftStatus;
+
+   if (raw) {
+      Tcl_SetByteArrayLength(vector, numRead);
+      if (dl.timedout)
+	 return deadline_error(interp, &dl, ftRecord, "bitbang_read",
+		numRead, nbytes, vector);
+      Tcl_SetObjResult(interp, vector);
+      return TCL_OK;
+   }
+
+   // Pack the SDO samples into a contiguous bit stream, then cut
+   // the stream into words.
+
+   tidx = 3 + 2 * cmdwidth;	// No readback during reg/command write
+   nbits = (long)wordcount * wordwidth;
+   availbits = (numRead > tidx) ? (numRead - tidx + 1) / 2 : 0;
+   if (availbits > nbits) availbits = nbits;
+
+   nb = (wordwidth + 7) >> 3;
+   packed = (unsigned char *)malloc(((nbits + 7) >> 3) + 1);
+   bang_pack_samples(rbuffer + tidx, availbits, sigpins[BB_SDO], packed);
+
+   if (binary) {
+      unsigned char *bindata;
+
+      vector = Tcl_NewByteArrayObj(NULL, 0);
+      bindata = Tcl_SetByteArrayLength(vector, wordcount * nb);
+      memset(bindata, 0, wordcount * nb);
+      for (i = 0; (long)(i + 1) * wordwidth <= availbits; i++)
+	 bang_word_extract(packed, (long)i * wordwidth, wordwidth,
+		bindata + i * nb, nb);
+   }
+   else {
+      wbytes = (unsigned char *)malloc(nb * sizeof(unsigned char));
+      vector = Tcl_NewListObj(0, NULL);
+      for (i = 0; i < wordcount; i++) {
+	 if ((long)(i + 1) * wordwidth > availbits)
+	    lobj = Tcl_NewIntObj(-1);
+	 else {
+	    bang_word_extract(packed, (long)i * wordwidth, wordwidth, wbytes, nb);
+	    lobj = bang_word_to_obj(wbytes, nb, wordwidth);
+	 }
+	 Tcl_ListObjAppendElement(interp, vector, lobj);
+      }
+      free(wbytes);
+   }
+   free(packed);
+   free(rbuffer);
+
+   if (dl.timedout)
+      return deadline_error(interp, &dl, ftRecord, "bitbang_read",
+		numRead, nbytes, vector);
+   Tcl_SetObjResult(interp, vector);
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::bitbang_dump":				*/
+/* Save a raw capture from "bitbang_read -raw" to a file.	*/
+/*								*/
+/* Use:  bitbang_dump <device> <capture> <filename> [vcd|binary] */
+/*								*/
+/* The device's signal pin map is used to name the signals,	*/
+/* and the sample period is derived from the bit-bang baud	*/
+/* rate.  The default format is VCD;  "binary" writes the	*/
+/* run-length format read by "play".  The capture is written	*/
+/* directly from the bytearray without conversion to a list.	*/
+/* Returns the number of samples written.			*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_bang_dump(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int result, nsamples, j, p;
+   unsigned char *samples, *sigpins;
+   unsigned char lut[256];
+   unsigned char sigmask;
+   bool dovcd = true;
+   double rate;
+   FILE *f;
+
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+
+   if (objc != 4 && objc != 5) {
+      Tcl_SetResult(interp, "bitbang_dump: Need device name, capture data, "
+		"file name, and optional format.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "bitbang_dump:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "bitbang_dump")) return TCL_ERROR;
+   if (objc == 5) {
+      if (!strcasecmp(Tcl_GetString(objv[4]), "binary"))
+	 dovcd = false;
+      else if (strcasecmp(Tcl_GetString(objv[4]), "vcd")) {
+	 Tcl_SetResult(interp, "bitbang_dump:  Format must be \"vcd\" "
+		"or \"binary\".\n", NULL);
+	 return TCL_ERROR;
+      }
+   }
+   sigpins = &(ftRecord->sigpins[0]);
+   samples = Tcl_GetByteArrayFromObj(objv[2], &nsamples);
+
+   // Table to convert pin values back to logical signal order
+
+   sigmask = 0;
+   for (j = 0; j < 8; j++)
+      if (sigpins[j] != 0) sigmask |= (1 << j);
+   for (p = 0; p < 256; p++) {
+      lut[p] = 0;
+      for (j = 0; j < 8; j++)
+	 if (p & sigpins[j]) lut[p] |= (1 << j);
+   }
+
+   // Bit-bang update rate is 16 times the baud rate (see spi_speed)
+
+   rate = 16.0 * (double)bitbang_baud(ftRecord->channel);
+
+   f = fopen(Tcl_GetString(objv[3]), dovcd ? "w" : "wb");
+   if (f == NULL) {
+      Tcl_AppendResult(interp, "bitbang_dump:  Cannot open file \"",
+		Tcl_GetString(objv[3]), "\" for writing\n", NULL);
+      return TCL_ERROR;
+   }
+   if (dovcd)
+      result = wave_write_vcd(f, samples, (long)nsamples, lut, sigmask,
+		(Tcl_WideInt)(1.0E12 / rate + 0.5));
+   else
+      result = wave_write_rle(f, samples, (long)nsamples, lut,
+		(Tcl_WideInt)(1.0E9 / rate + 0.5));
+   if (fclose(f) != 0) result = -1;
+
+   if (result < 0) {
+      Tcl_SetResult(interp, "bitbang_dump:  Error writing file.\n", NULL);
+      return TCL_ERROR;
+   }
+   Tcl_SetObjResult(interp, Tcl_NewIntObj(nsamples));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_csb_mode":  Change the behavior of	*/
+/* the SPI with respect to CSB.  This function takes one	*/
+/* integer argument in addition to the device name:		*/
+/*								*/
+/*	0: CSB is not de-asserted after each read and write	*/
+/*	1: CSB is de-asserted after each read and write		*/
+/*								*/
+/* NOTE: Currently this is only defined for bit-bang mode.	*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_spi_csb_mode(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   int ftStatus;
+
+   long numWritten;
+
+   int result;
+   unsigned char *tbuffer;
+   unsigned char flags;
+   unsigned char *sigpins;
+   int mode;
+
+   if (objc != 3) {
+      Tcl_SetResult(interp, "spi_csb_mode: Need device name and 0 or 1.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "spi_speed:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "spi_csb_mode")) return TCL_ERROR;
+   sigpins = &(ftRecord->sigpins[0]);
+
+   result = Tcl_GetIntFromObj(interp, objv[2], &mode);
+   if (result != TCL_OK) return result;
+
+   switch (mode) {
+      case 0:
+	 ftRecord->flags &= ~CSB_NORAISE;
+
+	 // In addition to setting flags, raise CSB immediately.
+	 // So "spi_csb_mode 0" can be used to control when CSB
+	 // is deasserted.
+
+         tbuffer = (unsigned char *)malloc(sizeof(unsigned char));
+         tbuffer[0] = (unsigned char)sigpins[BB_CSB];
+
+         if (verbose > 1) {
+	    int i;
+            Fprintf(interp, stderr, "spi_csb_mode: Writing: ");
+            for (i = 0; i < 1; i++) {
+               Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+            }
+            Fprintf(interp, stderr, "\n");
+         }
+
+         ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, 1);
+         if (ftStatus < 0)
+            Tcl_SetResult(interp, "Received error while writing SPI.\n", NULL);
+         else if (ftStatus != 1)
+            Tcl_SetResult(interp, "bitbang write:  short write error.\n", NULL);
+
+         free(tbuffer);
+	 break;
+
+      case 1:
+	 ftRecord->flags |= CSB_NORAISE;
+	 break;
+   }
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "gpio_pin_index"				*/
+/*								*/
+/* Return the GPIO bit number (0 to 7 for ADBUS, 8 to 15 for	*/
+/* ACBUS) of a pin given by number or as one of ADBUS0-7,	*/
+/* ACBUS0-7, GPIOL0-3, or GPIOH0-7.  Returns -1 if the pin is	*/
+/* not recognized.						*/
+/*--------------------------------------------------------------*/
+
+static int
+gpio_pin_index(Tcl_Interp *interp, Tcl_Obj *obj)
+{
+   char *pinname = Tcl_GetString(obj);
+   int pin, base, limit;
+
+   if (!strncasecmp(pinname, "ADBUS", 5)) {
+      base = 0;
+      limit = 8;
+   }
+   else if (!strncasecmp(pinname, "ACBUS", 5)) {
+      base = 8;
+      limit = 8;
+   }
+   else if (!strncasecmp(pinname, "GPIOL", 5)) {
+      base = 4;
+      limit = 4;
+   }
+   else if (!strncasecmp(pinname, "GPIOH", 5)) {
+      base = 8;
+      limit = 8;
+   }
+   else {
+      if (Tcl_GetIntFromObj(interp, obj, &pin) != TCL_OK) return -1;
+      return (pin >= 0 && pin < 16) ? pin : -1;
+   }
+   if (pinname[5] < '0' || pinname[5] >= '0' + limit || pinname[6] != '\0')
+      return -1;
+   return base + pinname[5] - '0';
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_device"				*/
+/*								*/
+/* Use: spi_device <device> <cspin> [-invert]			*/
+/*								*/
+/* Create a virtual SPI device on the MPSSE channel of		*/
+/* <device>, with its chip select on GPIO pin <cspin> (see	*/
+/* gpio_pin_index() above).  The pin is made an output at its	*/
+/* idle level (high, or low if "-invert" is given).  Returns a	*/
+/* handle that can be used like any other device handle.  All	*/
+/* virtual devices are closed along with <device>.		*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_spi_device(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   Tcl_HashEntry *h;
+   ftdi_record *parent, *chan, *ftRecordPtr;
+   unsigned short csmask;
+   char tclhandle[32];
+   char *descr;
+   int pin, new;
+   bool invert = false;
+
+   if (objc == 4 && !strncmp(Tcl_GetString(objv[3]), "-inv", 4)) {
+      invert = true;
+      objc--;
+   }
+   if (objc != 3) {
+      Tcl_SetResult(interp, "spi_device: Need device name and chip "
+		"select pin.\n", NULL);
+      return TCL_ERROR;
+   }
+   parent = find_record(Tcl_GetString(objv[1]), NULL);
+   if (parent == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "spi_device:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, parent, "spi_device")) return TCL_ERROR;
+   if (parent->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_SetResult(interp, "spi_device:  Device must be in MPSSE mode.\n",
+		NULL);
+      return TCL_ERROR;
+   }
+   chan = parent->channel;
+
+   pin = gpio_pin_index(interp, objv[2]);
+   if (pin < 0) {
+      Tcl_SetResult(interp, "spi_device:  Unknown pin.  Must be a number "
+		"0 to 15, or one of ADBUSn, ACBUSn, GPIOLn, or GPIOHn\n", NULL);
+      return TCL_ERROR;
+   }
+   csmask = (unsigned short)(1 << pin);
+   if (chan->gpio_resv & csmask) {
+      Tcl_SetResult(interp, "spi_device:  Pin is already used for SPI "
+		"or chip select.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   sprintf(tclhandle, "ftdi%d", ftdinum + 1);
+   h = Tcl_CreateHashEntry(&handletab, (CONST char *)tclhandle, &new);
+   if (new == 0) {
+      Tcl_SetResult(interp, "spi_device:  Name already defined\n", NULL);
+      return TCL_ERROR;
+   }
+   ftdinum++;
+
+   // The new device starts with the same settings as <device>,
+   // but owns none of the buffers.
+
+   ftRecordPtr = (ftdi_record *)malloc(sizeof(ftdi_record));
+   memcpy(ftRecordPtr, parent, sizeof(ftdi_record));
+   descr = (char *)malloc(strlen(parent->description) + 20);
+   sprintf(descr, "%s (CS %d)", parent->description, pin);
+   ftRecordPtr->description = descr;
+   ftRecordPtr->setbuffer = NULL;
+   ftRecordPtr->txqueue = NULL;
+   ftRecordPtr->txlen = 0;
+   ftRecordPtr->jtag_ndev = 0;
+   ftRecordPtr->jtag_irlen = NULL;
+   ftRecordPtr->flags &= ~CS_INVERT;
+   if (invert) ftRecordPtr->flags |= CS_INVERT;
+   ftRecordPtr->csmask = csmask;
+   ftRecordPtr->channel = chan;
+   Tcl_SetHashValue(h, ftRecordPtr);
+
+   // Drive the chip select pin to its idle level
+
+   chan->gpio_resv |= csmask;
+   chan->gpio_dir |= csmask;
+   if (invert)
+      chan->gpio_out &= ~csmask;
+   else
+      chan->gpio_out |= csmask;
+   chan->gpio_pending |= (csmask & 0x00ff) ? GPIO_LOW : GPIO_HIGH;
+   if (gpio_flush(interp, chan, "spi_device") != TCL_OK) return TCL_ERROR;
+
+   Tcl_SetObjResult(interp, Tcl_NewStringObj(tclhandle, -1));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_merge"				*/
+/*								*/
+/* Use: spi_merge <device> [on|off]				*/
+/*								*/
+/* While merging is on, SPI writes and GPIO changes on the	*/
+/* MPSSE channel of <device> (from <device> or any virtual	*/
+/* device sharing the channel) are held and sent as a single	*/
+/* USB transfer, ahead of the next SPI read or GPIO read, when	*/
+/* 64kB have been queued, or when merging is turned off.	*/
+/* Returns the current setting.					*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_spi_merge(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord, *chan;
+   int result, merging;
+
+   if (objc != 2 && objc != 3) {
+      Tcl_SetResult(interp, "spi_merge: Need device name and optional "
+		"on|off.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "spi_merge:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "spi_merge")) return TCL_ERROR;
+   if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_SetResult(interp, "spi_merge:  Device must be in MPSSE mode.\n",
+		NULL);
+      return TCL_ERROR;
+   }
+   chan = ftRecord->channel;
+
+   if (objc == 3) {
+      result = Tcl_GetBooleanFromObj(interp, objv[2], &merging);
+      if (result != TCL_OK) return result;
+      chan->merging = (unsigned char)merging;
+      if (!merging)
+	 if (spi_queue_flush(interp, chan) != TCL_OK) return TCL_ERROR;
+   }
+   Tcl_SetObjResult(interp, Tcl_NewBooleanObj((int)chan->merging));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_mode"				*/
+/*								*/
+/* Use: spi_mode <device> [<mode> [msb|lsb]]			*/
+/*								*/
+/* Set the SPI clock mode (0 to 3, being CPOL * 2 + CPHA) and	*/
+/* the bit order (default msb) of <device> in MPSSE mode.  The	*/
+/* SCK idle level for the mode is set ahead of the CS assert of	*/
+/* the next transfer.  Returns the mode and bit order.		*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_spi_mode(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   Tcl_Obj *lobj;
+   char *order;
+   int result, mode;
+   unsigned char spimode;
+
+   if (objc < 2 || objc > 4) {
+      Tcl_SetResult(interp, "spi_mode: Need device name, and optional "
+		"mode and bit order.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "spi_mode:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "spi_mode")) return TCL_ERROR;
+
+   if (objc > 2) {
+      result = Tcl_GetIntFromObj(interp, objv[2], &mode);
+      if (result != TCL_OK) return result;
+      if (mode < 0 || mode > 3) {
+	 Tcl_SetResult(interp, "spi_mode:  Mode must be 0 to 3.\n", NULL);
+	 return TCL_ERROR;
+      }
+      spimode = (unsigned char)mode;
+      if (objc > 3) {
+	 order = Tcl_GetString(objv[3]);
+	 if (!strcasecmp(order, "lsb"))
+	    spimode |= SPI_LSB_FIRST;
+	 else if (strcasecmp(order, "msb")) {
+	    Tcl_SetResult(interp, "spi_mode:  Bit order must be msb "
+			"or lsb.\n", NULL);
+	    return TCL_ERROR;
+	 }
+      }
+      spi_set_mode(ftRecord, spimode);
+   }
+
+   lobj = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj((int)(ftRecord->spimode
+		& (SPI_CPOL | SPI_CPHA))));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj(
+		(ftRecord->spimode & SPI_LSB_FIRST) ? "lsb" : "msb", -1));
+   Tcl_SetObjResult(interp, lobj);
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "mpsse_clock_plan"				*/
+/*								*/
+/* Work out the MPSSE clock setting giving the fastest SCK not	*/
+/* above "hz" and fill "buffer" with the opcodes to select it	*/
+/* (at most 6 bytes, count returned in "lenptr").  Returns the	*/
+/* actual SCK rate in Hz, or 0 if "clkflags" asks for a mode	*/
+/* that the chip does not have.					*/
+/*								*/
+/* The H-series chips (FT2232H, FT4232H, FT232H) run the MPSSE	*/
+/* from 60MHz, or 12MHz with the divide-by-5 prescaler on (0x8b	*/
+/* on, 0x8a off).  The FT2232C/D runs from a fixed 12MHz and	*/
+/* does not recognize 0x8a/0x8b.  In either case SCK is the	*/
+/* base clock / ((1 + divisor) * 2), with the 16-bit divisor	*/
+/* set by opcode 0x86.  Three-phase clocking (H-series only)	*/
+/* holds data for an extra half cycle, so the period is three	*/
+/* half cycles instead of two.  Adaptive clocking (H-series	*/
+/* only) waits for the target to return each clock on GPIOL3.	*/
+/*--------------------------------------------------------------*/
+
+#define CLK_3PHASE	0x01	// Three-phase data clocking
+#define CLK_ADAPTIVE	0x02	// Adaptive clocking (RTCK on GPIOL3)
+
+static double
+mpsse_clock_plan(struct ftdi_context *ftContext, double hz,
+	unsigned char clkflags, unsigned char *buffer, int *lenptr)
+{
+   double base, q;
+   int phases, div, n = 0;
+   bool hseries;
+
+   hseries = (ftContext->type == TYPE_2232H || ftContext->type == TYPE_4232H
+		|| ftContext->type == TYPE_232H) ? true : false;
+   if (!hseries && (clkflags & (CLK_3PHASE | CLK_ADAPTIVE))) return 0.0;
+
+   phases = (clkflags & CLK_3PHASE) ? 3 : 2;
+   base = (hseries) ? 60.0E6 : 12.0E6;
+
+   // Divisor for the fastest rate not above the request.  Use the
+   // 12MHz prescaled clock only if the 60MHz clock cannot go slow
+   // enough.
+
+   q = base / (phases * hz);
+   if (hseries && (q > 65536.0)) {
+      base = 12.0E6;
+      q = base / (phases * hz);
+   }
+   div = (q > 65536.0) ? 65536 : (int)q;
+   if (q - div > 1.0E-9) div++;
+   div = (div > 65536) ? 65535 : ((div < 1) ? 0 : div - 1);
+
+   if (hseries) {
+      buffer[n++] = (base > 12.0E6) ? 0x8a : 0x8b;	// Divide-by-5 off/on
+      buffer[n++] = (clkflags & CLK_3PHASE) ? 0x8c : 0x8d; // 3-phase on/off
+      buffer[n++] = (clkflags & CLK_ADAPTIVE) ? 0x96 : 0x97; // Adaptive on/off
+   }
+   buffer[n++] = 0x86;		// Set clock divider
+   buffer[n++] = (unsigned char)(div & 0xff);
+   buffer[n++] = (unsigned char)((div >> 8) & 0xff);
+
+   *lenptr = n;
+   return base / ((double)(div + 1) * phases);
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "mpsse_settings"				*/
+/*								*/
+/* Fill "buffer" with the MPSSE opcodes that set the GPIO pins	*/
+/* and the clock of a channel to their last MPSSE settings.	*/
+/* The resulting SCK rate is returned in "actualptr".  Returns	*/
+/* the number of bytes placed in the buffer (at most 12).	*/
+/*--------------------------------------------------------------*/
+
+static int
+mpsse_settings(ftdi_record *chan, unsigned char *buffer, double *actualptr)
+{
+   int ntb, n;
+
+   ntb = gpio_opcode(chan, 0, chan->gpio_out, buffer);
+   ntb += gpio_opcode(chan, 1, chan->gpio_out, buffer + ntb);
+   *actualptr = mpsse_clock_plan(chan->ftContext, (chan->sckrate > 0.0) ?
+		chan->sckrate : 30.0E6 / 17.0, chan->clkflags, buffer + ntb,
+		&n);
+   return ntb + n;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "mpsse_restore"				*/
+/*								*/
+/* Return a channel from bit-bang mode to MPSSE mode in place,	*/
+/* without a USB reset, and set the GPIO pins and clock back	*/
+/* to their last MPSSE settings.				*/
+/*--------------------------------------------------------------*/
+
+static int
+mpsse_restore(Tcl_Interp *interp, ftdi_record *chan)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+   unsigned char tbuffer[12];
+   double actual;
+   int ftStatus, ntb;
+
+   if (!(chan->flags & BITBANG_MODE)) return TCL_OK;
+
+   if (hw_configure(interp, chan, BITMODE_MPSSE, 0x0b, 0, chan->tn_latency)
+		!= TCL_OK)
+      return TCL_ERROR;
+
+   ntb = mpsse_settings(chan, tbuffer, &actual);
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "spi_bitbang: Writing: ");
+      for (i = 0; i < ntb; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   ftStatus = BACKEND(chan)->write(ftContext, tbuffer, ntb);
+   if (ftStatus != ntb) {
+      Tcl_SetResult(interp, (ftStatus < 0) ? "Received error while "
+		"writing MPSSE setup\n" : "Short write error\n", NULL);
+      return TCL_ERROR;
+   }
+
+   chan->flags &= ~BITBANG_MODE;
+   chan->wordwidth = 8;
+   chan->gpio_pending = 0;
+   chan->sckrate = actual;
+   chan->jtag_state = TAP_UNKNOWN;
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* MPSSE resynchronization					*/
+/*								*/
+/* The MPSSE answers an invalid opcode with 0xfa followed by	*/
+/* the opcode.  Each command that reads from the MPSSE ends its	*/
+/* command stream with the invalid opcode MPSSE_ECHO, so that	*/
+/* the last two bytes of a reply that is in step are always	*/
+/* 0xfa MPSSE_ECHO;  anything else (a short reply, or data	*/
+/* where the echo should be) means the command and reply	*/
+/* streams have come apart.  mpsse_resync() then brings them	*/
+/* back together in place, without closing the device.		*/
+/*--------------------------------------------------------------*/
+
+#define MPSSE_ECHO	0xaa	// Invalid opcode ending each read command
+#define MPSSE_ECHO2	0xab	// Second invalid opcode used by mpsse_sync
+
+/* Send the invalid opcode "op" and read until its echo comes	*/
+/* back, discarding anything ahead of it.  Gives up after	*/
+/* "waitms".  Returns 0 on success, -1 on failure.		*/
+
+static int
+mpsse_sync(ftdi_record *chan, unsigned char op, int waitms)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+   unsigned char cmd[2], rbuffer[64];
+   struct timespec t0, now;
+   int n, i;
+   bool fa = false;
+
+   cmd[0] = op;
+   cmd[1] = 0x87;		// Send immediate
+   if (BACKEND(chan)->write(ftContext, cmd, 2) != 2) return -1;
+
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   while (1) {
+      n = BACKEND(chan)->read(ftContext, rbuffer, sizeof(rbuffer));
+      if (n < 0) return -1;
+      for (i = 0; i < n; i++) {
+	 if (fa && (rbuffer[i] == op)) return 0;
+	 fa = (rbuffer[i] == 0xfa) ? true : false;
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec - t0.tv_sec) * 1000L + (now.tv_nsec - t0.tv_nsec)
+		/ 1000000L >= waitms)
+	 return -1;
+      if (n == 0) usleep(500);
+   }
+}
+
+/* Bring the command and reply streams of a channel back into	*/
+/* step:  Purge the chip's buffers and check with two echoes	*/
+/* (two, so that data that happens to look like an echo cannot	*/
+/* pass).  If the echoes do not come back, the MPSSE is partway	*/
+/* through an opcode and taking them as data, so reset it and	*/
+/* send its GPIO and clock settings again.  Returns 0 if the	*/
+/* channel is back in step, -1 if not.				*/
+
+static int
+mpsse_resync(ftdi_record *chan)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+   unsigned char tbuffer[12];
+   double actual;
+   int ntb, waitms;
+
+   // Replies can be held for one latency timer period
+   waitms = 2 * ((chan->hw_latency > 0) ? chan->hw_latency : 16) + 10;
+
+   chan->jtag_state = TAP_UNKNOWN;
+   BACKEND(chan)->purge_tx(ftContext);
+   BACKEND(chan)->purge_rx(ftContext);
+   if ((mpsse_sync(chan, MPSSE_ECHO, waitms) == 0) &&
+		(mpsse_sync(chan, MPSSE_ECHO2, waitms) == 0))
+      return 0;
+
+   if ((BACKEND(chan)->set_bitmode(ftContext, 0x00, BITMODE_RESET) < 0) ||
+		(BACKEND(chan)->set_bitmode(ftContext, 0x0b, BITMODE_MPSSE) < 0)) {
+      chan->hw_mode = HW_UNKNOWN;
+      return -1;
+   }
+   chan->hw_mode = BITMODE_MPSSE;
+   chan->hw_dirs = 0x0b;
+   BACKEND(chan)->purge_tx(ftContext);
+   BACKEND(chan)->purge_rx(ftContext);
+
+   ntb = mpsse_settings(chan, tbuffer, &actual);
+   if (BACKEND(chan)->write(ftContext, tbuffer, ntb) != ntb) return -1;
+   chan->gpio_pending = 0;
+   chan->sckrate = actual;
+
+   if ((mpsse_sync(chan, MPSSE_ECHO, waitms) == 0) &&
+		(mpsse_sync(chan, MPSSE_ECHO2, waitms) == 0))
+      return 0;
+   return -1;
+}
+
+/* Report a failed or out-of-step MPSSE transfer of "cmdname"	*/
+/* and resynchronize.  "received" and "expected" count reply	*/
+/* bytes, including the echo.  The error code is		*/
+/* {FTDI IO|DESYNC <received> <expected> RESYNCED|FAILED},	*/
+/* IO if libftdi reported an error.				*/
+
+static int
+mpsse_desync(Tcl_Interp *interp, ftdi_record *ftRecord, char *cmdname,
+	bool ioerror, int received, int expected)
+{
+   Tcl_Obj *codeobj;
+   char msg[200];
+   bool ok;
+
+   ok = (mpsse_resync(ftRecord->channel) == 0) ? true : false;
+
+   if (ioerror)
+      sprintf(msg, "%s:  Received error in transfer;  ", cmdname);
+   else
+      sprintf(msg, "%s:  Reply out of step with the command (%d of %d "
+		"bytes);  ", cmdname, received, expected);
+   strcat(msg, (ok) ? "channel resynchronized.\n" :
+		"resynchronization failed.\n");
+   Tcl_SetResult(interp, msg, TCL_VOLATILE);
+
+   codeobj = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewStringObj("FTDI", -1));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewStringObj((ioerror) ?
+		"IO" : "DESYNC", -1));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewIntObj(received));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewIntObj(expected));
+   Tcl_ListObjAppendElement(interp, codeobj, Tcl_NewStringObj((ok) ?
+		"RESYNCED" : "FAILED", -1));
+   Tcl_SetObjErrorCode(interp, codeobj);
+   return TCL_ERROR;
+}
+
+/* Check that a reply of "received" bytes, of which "expected"	*/
+/* were asked for, ends in the echo of MPSSE_ECHO.		*/
+
+#define MPSSE_IN_STEP(reply, received, expected) \
+	(((received) == (expected)) && ((expected) >= 2) && \
+	((reply)[(expected) - 2] == 0xfa) && \
+	((reply)[(expected) - 1] == MPSSE_ECHO))
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_speed":  Set the SPI clock speed of	*/
+/* the FTDI MPSSE SPI protocol.					*/
+/*								*/
+/* Use: spi_speed <device> [<value>] [-3phase] [-adaptive]	*/
+/*								*/
+/* <value> is in MHz.  The clock is shared by all devices on	*/
+/* the channel.  Returns the actual SCK rate in MHz, which is	*/
+/* the fastest rate not above <value> that the chip can make.	*/
+/* With no value, return the present rate.			*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_spi_speed(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord, *chan;
+   struct ftdi_context * ftContext;
+   int ftStatus;
+
+   int result, ntb;
+   unsigned char tbuffer[6];
+   unsigned char flags, clkflags = 0;
+   double mhz, actual;
+   char *swstr;
+
+   while (objc > 2) {
+      swstr = Tcl_GetString(objv[objc - 1]);
+      if (!strcmp(swstr, "-3phase"))
+	 clkflags |= CLK_3PHASE;
+      else if (!strcmp(swstr, "-adaptive"))
+	 clkflags |= CLK_ADAPTIVE;
+      else
+	 break;
+      objc--;
+   }
+   if (objc != 2 && objc != 3) {
+      Tcl_SetResult(interp, "spi_speed: Need device name and value (in MHz).\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "spi_speed:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "spi_speed")) return TCL_ERROR;
+   chan = ftRecord->channel;
+
+   if (objc == 2) {
+      if (flags & BITBANG_MODE)
+	 actual = bitbang_baud(chan) * 8.0;
+      else
+	 actual = chan->sckrate;
+      Tcl_SetObjResult(interp, Tcl_NewDoubleObj(actual / 1.0E6));
+      return TCL_OK;
+   }
+
+   result = Tcl_GetDoubleFromObj(interp, objv[2], &mhz);
+   if (result != TCL_OK) return result;
+   if (mhz <= 0.0) {
+      Tcl_SetResult(interp, "spi_speed:  Value must be positive.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   if (flags & BITBANG_MODE) {
+      if (clkflags != 0) {
+	 Tcl_SetResult(interp, "spi_speed:  Clocking options apply only "
+		"to MPSSE mode.\n", NULL);
+	 return TCL_ERROR;
+      }
+      // Bitbang rate calculation:  bitbang update rate is the baud rate
+      // * 16, but SCK takes two transmissions (up, down), so SCK rate is
+      // the baud rate * 8.  (The requested baud rate is used, not the
+      // value in the context, which libftdi scales by 4 in bitbang mode.)
+
+      if (hw_configure(interp, chan, chan->hw_mode, chan->hw_dirs,
+		(int)((mhz / 8.0) * 1.0E6), chan->tn_latency) != TCL_OK)
+	 return TCL_ERROR;
+      Tcl_SetObjResult(interp, Tcl_NewDoubleObj(bitbang_baud(chan) * 8.0
+		/ 1.0E6));
+      return TCL_OK;
+   }
+
+   actual = mpsse_clock_plan(ftContext, mhz * 1.0E6, clkflags, tbuffer, &ntb);
+   if (actual == 0.0) {
+      Tcl_SetResult(interp, "spi_speed:  Three-phase and adaptive clocking "
+		"need an FT2232H, FT4232H, or FT232H.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "spi_speed: Writing: ");
+      for (i = 0; i < ntb; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   ftStatus = BACKEND(chan)->write(ftContext, tbuffer, ntb);
+   if (ftStatus < 0) {
+      Tcl_SetResult(interp, "Received error while setting SPI"
+		" clock speed.\n", NULL);
+      return TCL_ERROR;
+   }
+   else if (ftStatus != ntb) {
+      Tcl_SetResult(interp, "spi_speed:  short write error.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   chan->sckrate = actual;
+   chan->clkflags = clkflags;
+   Tcl_SetObjResult(interp, Tcl_NewDoubleObj(actual / 1.0E6));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Maximum number of bytes moved by one MPSSE data shifting	*/
+/* opcode (the length field is 16 bits, stored as length - 1).	*/
+/*--------------------------------------------------------------*/
+
+#define MPSSE_MAX_CHUNK	65536
+
+/*--------------------------------------------------------------*/
+/* Support function "tune_apply"				*/
+/*								*/
+/* Set the latency timer (ms) and the USB read and write	*/
+/* transfer sizes of a channel.  A transfer size of 0 lets	*/
+/* each bulk command use its own (64kB, although libftdi caps	*/
+/* reads at 16kB on Linux), and leaves libftdi's 4kB default	*/
+/* for everything else.  The read size kept is the one libftdi	*/
+/* actually accepted.						*/
+/*--------------------------------------------------------------*/
+
+#define TUNE_DEFAULT_CHUNK	4096	// libftdi's default transfer size
+
+static int
+tune_apply(Tcl_Interp *interp, ftdi_record *chan, int latency,
+	unsigned int rdchunk, unsigned int wrchunk)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+
+   // Only the latency timer is sent;  the mode and pins stay as they are
+   if (hw_configure(interp, chan, chan->hw_mode, chan->hw_dirs, 0, latency)
+		!= TCL_OK)
+      return TCL_ERROR;
+   chan->tn_latency = latency;
+
+   if ((BACKEND(chan)->set_read_chunksize(ftContext,
+		TUNED_CHUNK(rdchunk, TUNE_DEFAULT_CHUNK)) < 0) ||
+		(BACKEND(chan)->set_write_chunksize(ftContext,
+		TUNED_CHUNK(wrchunk, TUNE_DEFAULT_CHUNK)) < 0)) {
+      Tcl_SetResult(interp, "Received error while setting USB transfer "
+		"size.\n", NULL);
+      return TCL_ERROR;
+   }
+   if (rdchunk > 0)
+      BACKEND(chan)->get_read_chunksize(ftContext, &rdchunk);
+   chan->tn_rdchunk = rdchunk;
+   chan->tn_wrchunk = wrchunk;
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "tune_apply_flow"				*/
+/*								*/
+/* Set the flow control (an index into tune_flow_names), the	*/
+/* event and error characters (-1 to disable), and the size of	*/
+/* the bulk read buffer of a channel, for those of "set"	*/
+/* (TUNE_SET_FLOW, etc.) only.					*/
+/*--------------------------------------------------------------*/
+
+#define TUNE_SET_FLOW	0x01
+#define TUNE_SET_EVENT	0x02
+#define TUNE_SET_ERROR	0x04
+#define TUNE_SET_BULK	0x08
+
+static const char *tune_flow_names[] = {"none", "rtscts", "dtrdsr",
+	"xonxoff", NULL};
+static const int tune_flow_modes[] = {SIO_DISABLE_FLOW_CTRL, SIO_RTS_CTS_HS,
+	SIO_DTR_DSR_HS, SIO_XON_XOFF_HS};
+
+static int
+tune_apply_flow(Tcl_Interp *interp, ftdi_record *chan, int set, int flow,
+	int evchar, int errchar, unsigned int bulkread)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+
+   if (set & TUNE_SET_FLOW) {
+      if (BACKEND(chan)->set_flowctrl(ftContext, tune_flow_modes[flow]) < 0) {
+	 Tcl_SetResult(interp, "Received error while setting flow "
+		"control.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->tn_flow = flow;
+   }
+   if (set & TUNE_SET_EVENT) {
+      if (BACKEND(chan)->set_event_char(ftContext,
+		(unsigned char)((evchar < 0) ? 0 : evchar),
+		(unsigned char)((evchar < 0) ? 0 : 1)) < 0) {
+	 Tcl_SetResult(interp, "Received error while setting event "
+		"character.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->tn_eventchar = evchar;
+   }
+   if (set & TUNE_SET_ERROR) {
+      if (BACKEND(chan)->set_error_char(ftContext,
+		(unsigned char)((errchar < 0) ? 0 : errchar),
+		(unsigned char)((errchar < 0) ? 0 : 1)) < 0) {
+	 Tcl_SetResult(interp, "Received error while setting error "
+		"character.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->tn_errorchar = errchar;
+   }
+   if ((set & TUNE_SET_BULK) && (BACKEND(chan)->set_bulkread != NULL)) {
+      if (BACKEND(chan)->set_bulkread(ftContext, bulkread) < 0) {
+	 Tcl_SetResult(interp, "tune:  Cannot allocate bulk read "
+		"buffer.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->tn_bulkread = bulkread;
+   }
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "tune_bench"				*/
+/*								*/
+/* Time one round trip of "size" bytes through the MPSSE:	*/
+/* "size" GPIO read opcodes (0x81) out, "size" pin values back,	*/
+/* submitted together as spi_read does.  The opcodes do not	*/
+/* move any pins, so this is safe with any target attached.	*/
+/* There is no "send immediate", so replies that do not fill	*/
+/* a USB packet wait for the latency timer, as they do in	*/
+/* bit-bang mode.  Each run has the device deadline, if any.	*/
+/* Returns the time in seconds, or -1 on error.			*/
+/*--------------------------------------------------------------*/
+
+static double
+tune_bench(Tcl_Interp *interp, ftdi_record *chan,
+	unsigned char *cbuffer, unsigned char *rbuffer, int size)
+{
+   struct ftdi_context *ftContext = chan->ftContext;
+   struct ftdi_transfer_control *wtc, *rtc;
+   struct timespec t0, t1;
+   ftdi_deadline dl;
+   int ftStatus, wStatus;
+
+   deadline_start(&dl, chan, -1);
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   wtc = BACKEND(chan)->write_submit(ftContext, cbuffer, size);
+   rtc = (wtc == NULL) ? NULL : BACKEND(chan)->read_submit(ftContext,
+		rbuffer, size);
+   ftStatus = transfer_wait(rtc, &dl);
+   wStatus = transfer_wait(wtc, &dl);
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+
+   if (dl.timedout) {
+      deadline_error(interp, &dl, chan, "tune", ftStatus, size, NULL);
+      return -1.0;
+   }
+   if ((wStatus != size) || (ftStatus != size)) {
+      BACKEND(chan)->purge_tx(ftContext);
+      BACKEND(chan)->purge_rx(ftContext);
+      Tcl_SetResult(interp, ((wStatus < 0) || (ftStatus < 0)) ?
+		"tune:  Received error during benchmark.\n" :
+		"tune:  Short transfer during benchmark.\n", NULL);
+      return -1.0;
+   }
+   return (double)(t1.tv_sec - t0.tv_sec) +
+		(double)(t1.tv_nsec - t0.tv_nsec) * 1.0E-9;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::tune"					*/
+/*								*/
+/* Use: tune <device> [-latency <ms>] [-readchunk <bytes>]	*/
+/*		[-writechunk <bytes>] [-auto] [-workload <sizes>]	*/
+/*		[-flow <mode>] [-eventchar <char>|none]		*/
+/*		[-errorchar <char>|none] [-bulkread <bytes>]	*/
+/*								*/
+/* Set the latency timer and the USB read and write transfer	*/
+/* sizes of the channel of <device>, and its flow control,	*/
+/* event and error characters, and bulk read buffer (see	*/
+/* tune_apply_flow()).  With "-auto", time each			*/
+/* combination of candidate settings on the transfer sizes in	*/
+/* <sizes> (default 64, 4096, and 65536 bytes) and keep the one	*/
+/* with the lowest total time relative to the best time for	*/
+/* each size, so that no one size dominates.  Settings given	*/
+/* explicitly are held fixed during the search.  Returns the	*/
+/* settings as an option list.					*/
+/*--------------------------------------------------------------*/
+
+#define TUNE_REPS	3	// Runs per benchmark;  the fastest is kept
+
+static const int tune_latencies[] = {1, 2, 4, 8, 16, 0};
+static const unsigned int tune_chunks[] = {4096, 16384, 65536, 0};
+
+int
+ftditcl_tune(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord, *chan;
+   Tcl_Obj *sizelist = NULL, *lobj;
+   char *swstr;
+   int result, i, j, k, r, value, nsizes, ncand, best;
+   int latency, lat0, nlat, nchunk;
+   int setflow = 0, flow, evchar, errchar;
+   unsigned int bulkread;
+   unsigned int rdchunk, wrchunk, rd0, wr0, rdprev = 0, wrprev = 0;
+   bool autotune = false, setlat = false, setrd = false, setwr = false;
+   int *sizes, maxsize;
+   double *times, t, tmin, score, bestscore;
+   unsigned char *cbuffer, *rbuffer;
+
+   if (objc < 2) {
+      Tcl_SetResult(interp, "tune: Need device name.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "tune:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   if (channel_held(interp, ftRecord, "tune")) return TCL_ERROR;
+   chan = ftRecord->channel;
+
+   latency = chan->tn_latency;
+   rdchunk = chan->tn_rdchunk;
+   wrchunk = chan->tn_wrchunk;
+   flow = chan->tn_flow;
+   evchar = chan->tn_eventchar;
+   errchar = chan->tn_errorchar;
+   bulkread = chan->tn_bulkread;
+
+   for (i = 2; i < objc; i++) {
+      swstr = Tcl_GetString(objv[i]);
+      if (!strcmp(swstr, "-auto")) {
+	 autotune = true;
+	 continue;
+      }
+      if (strcmp(swstr, "-workload") && strcmp(swstr, "-latency") &&
+		strcmp(swstr, "-readchunk") && strcmp(swstr, "-writechunk") &&
+		strcmp(swstr, "-flow") && strcmp(swstr, "-eventchar") &&
+		strcmp(swstr, "-errorchar") && strcmp(swstr, "-bulkread")) {
+	 Tcl_SetResult(interp, "tune:  Unknown option.  Must be -latency, "
+		"-readchunk, -writechunk, -auto, -workload, -flow, "
+		"-eventchar, -errorchar, or -bulkread.\n", NULL);
+	 return TCL_ERROR;
+      }
+      if (i + 1 >= objc) {
+	 Tcl_SetResult(interp, "tune:  Option needs a value.\n", NULL);
+	 return TCL_ERROR;
+      }
+      if (!strcmp(swstr, "-workload")) {
+	 sizelist = objv[++i];
+	 continue;
+      }
+      if (!strcmp(swstr, "-flow")) {
+	 for (flow = 0; tune_flow_names[flow] != NULL; flow++)
+	    if (!strcmp(Tcl_GetString(objv[i + 1]), tune_flow_names[flow]))
+	       break;
+	 if (tune_flow_names[flow] == NULL) {
+	    Tcl_SetResult(interp, "tune:  Flow control must be none, rtscts, "
+			"dtrdsr, or xonxoff.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 setflow |= TUNE_SET_FLOW;
+	 i++;
+	 continue;
+      }
+      if (!strcmp(Tcl_GetString(objv[i + 1]), "none") &&
+		(!strcmp(swstr, "-eventchar") || !strcmp(swstr, "-errorchar")))
+	 value = -1;
+      else {
+	 result = Tcl_GetIntFromObj(interp, objv[i + 1], &value);
+	 if (result != TCL_OK) return result;
+      }
+      i++;
+      if (!strcmp(swstr, "-eventchar") || !strcmp(swstr, "-errorchar")) {
+	 if ((value > 255) || ((value < 0) &&
+		strcmp(Tcl_GetString(objv[i]), "none"))) {
+	    Tcl_SetResult(interp, "tune:  Character must be 0 to 255 or "
+			"none.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 if (swstr[2] == 'v') {
+	    evchar = value;
+	    setflow |= TUNE_SET_EVENT;
+	 }
+	 else {
+	    errchar = value;
+	    setflow |= TUNE_SET_ERROR;
+	 }
+      }
+      else if (!strcmp(swstr, "-bulkread")) {
+	 if (value != 0 && (value < 64 || value > 16777216)) {
+	    Tcl_SetResult(interp, "tune:  Bulk read buffer must be 0 (none) "
+			"or 64 to 16777216 bytes.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 if ((value != 0) && (BACKEND(chan)->set_bulkread == NULL)) {
+	    Tcl_SetResult(interp, "tune:  The backend of this device has no "
+			"bulk read buffer.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 bulkread = (unsigned int)value;
+	 setflow |= TUNE_SET_BULK;
+      }
+      else if (!strcmp(swstr, "-latency")) {
+	 if (value < 1 || value > 255) {
+	    Tcl_SetResult(interp, "tune:  Latency must be 1 to 255 ms.\n",
+			NULL);
+	    return TCL_ERROR;
+	 }
+	 latency = value;
+	 setlat = true;
+      }
+      else if (!strcmp(swstr, "-readchunk") || !strcmp(swstr, "-writechunk")) {
+	 if (value != 0 && (value < 64 || value > 1048576)) {
+	    Tcl_SetResult(interp, "tune:  Transfer size must be 0 (default) "
+			"or 64 to 1048576 bytes.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 if (swstr[1] == 'r') {
+	    rdchunk = (unsigned int)value;
+	    setrd = true;
+	 }
+	 else {
+	    wrchunk = (unsigned int)value;
+	    setwr = true;
+	 }
+      }
+   }
+
+   if (setflow != 0)
+      if (tune_apply_flow(interp, chan, setflow, flow, evchar, errchar,
+		bulkread) != TCL_OK)
+	 return TCL_ERROR;
+
+   if (!autotune) {
+      if (objc > 2)
+	 if (tune_apply(interp, chan, latency, rdchunk, wrchunk) != TCL_OK)
+	    return TCL_ERROR;
+   }
+   else {
+      if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+	 Tcl_SetResult(interp, "tune:  Device must be in MPSSE mode for "
+		"-auto.\n", NULL);
+	 return TCL_ERROR;
+      }
+      if (sizelist == NULL) {
+	 nsizes = 3;
+	 sizes = (int *)malloc(nsizes * sizeof(int));
+	 sizes[0] = 64;
+	 sizes[1] = 4096;
+	 sizes[2] = MPSSE_MAX_CHUNK;
+      }
+      else {
+	 result = Tcl_ListObjLength(interp, sizelist, &nsizes);
+	 if (result != TCL_OK) return result;
+	 if (nsizes == 0) {
+	    Tcl_SetResult(interp, "tune:  Workload needs at least one "
+			"transfer size.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 sizes = (int *)malloc(nsizes * sizeof(int));
+	 for (k = 0; k < nsizes; k++) {
+	    Tcl_ListObjIndex(interp, sizelist, k, &lobj);
+	    result = Tcl_GetIntFromObj(interp, lobj, &sizes[k]);
+	    if (result == TCL_OK && (sizes[k] < 1 || sizes[k] > 1048576)) {
+	       Tcl_SetResult(interp, "tune:  Transfer sizes must be 1 to "
+			"1048576 bytes.\n", NULL);
+	       result = TCL_ERROR;
+	    }
+	    if (result != TCL_OK) {
+	       free(sizes);
+	       return result;
+	    }
+	 }
+      }
+      if (spi_queue_flush(interp, chan) != TCL_OK) {
+	 free(sizes);
+	 return TCL_ERROR;
+      }
+
+      maxsize = 0;
+      for (k = 0; k < nsizes; k++)
+	 if (sizes[k] > maxsize) maxsize = sizes[k];
+      cbuffer = (unsigned char *)malloc(maxsize * sizeof(unsigned char));
+      rbuffer = (unsigned char *)malloc(maxsize * sizeof(unsigned char));
+      memset(cbuffer, 0x81, maxsize);	// Read ADBUS pins
+
+      // Candidates are every latency with every transfer size (the
+      // same size for reads and writes), less the settings given.
+      // libftdi may cap the read size, so a candidate that comes out
+      // the same as the one before it reuses its times.
+
+      for (nlat = 0; tune_latencies[nlat] != 0; nlat++);
+      for (nchunk = 0; tune_chunks[nchunk] != 0; nchunk++);
+      if (setlat) nlat = 1;
+      if (setrd && setwr) nchunk = 1;
+      ncand = nlat * nchunk;
+      times = (double *)malloc(ncand * nsizes * sizeof(double));
+
+      lat0 = chan->tn_latency;
+      rd0 = chan->tn_rdchunk;
+      wr0 = chan->tn_wrchunk;
+      result = TCL_OK;
+      for (j = 0; (j < ncand) && (result == TCL_OK); j++) {
+	 result = tune_apply(interp, chan,
+		(setlat) ? latency : tune_latencies[j / nchunk],
+		(setrd) ? rdchunk : tune_chunks[j % nchunk],
+		(setwr) ? wrchunk : tune_chunks[j % nchunk]);
+	 if ((result == TCL_OK) && (j % nchunk != 0) &&
+		(chan->tn_rdchunk == rdprev) && (chan->tn_wrchunk == wrprev)) {
+	    for (k = 0; k < nsizes; k++)
+	       times[j * nsizes + k] = times[(j - 1) * nsizes + k];
+	    continue;
+	 }
+	 rdprev = chan->tn_rdchunk;
+	 wrprev = chan->tn_wrchunk;
+	 for (k = 0; (k < nsizes) && (result == TCL_OK); k++) {
+	    tmin = -1.0;
+	    for (r = 0; r < TUNE_REPS; r++) {
+	       t = tune_bench(interp, chan, cbuffer, rbuffer, sizes[k]);
+	       if (t < 0.0) {
+		  result = TCL_ERROR;
+		  break;
+	       }
+	       if ((tmin < 0.0) || (t < tmin)) tmin = t;
+	    }
+	    times[j * nsizes + k] = tmin;
+	 }
+	 if ((verbose > 1) && (result == TCL_OK)) {
+	    unsigned int rdsize, wrsize;
+
+	    BACKEND(chan)->get_read_chunksize(chan->ftContext, &rdsize);
+	    BACKEND(chan)->get_write_chunksize(chan->ftContext, &wrsize);
+	    Fprintf(interp, stderr, "tune: latency %d read %u write %u:",
+			chan->tn_latency, rdsize, wrsize);
+	    for (k = 0; k < nsizes; k++)
+	       Fprintf(interp, stderr, " %d:%gms", sizes[k],
+			times[j * nsizes + k] * 1.0E3);
+	    Fprintf(interp, stderr, "\n");
+	 }
+      }
+
+      if (result == TCL_OK) {
+	 // Score each candidate by its time for each size relative to
+	 // the fastest candidate for that size.
+
+	 best = 0;
+	 bestscore = 0.0;
+	 for (j = 0; j < ncand; j++) {
+	    score = 0.0;
+	    for (k = 0; k < nsizes; k++) {
+	       tmin = times[k];
+	       for (i = 1; i < ncand; i++)
+		  if (times[i * nsizes + k] < tmin) tmin = times[i * nsizes + k];
+	       score += times[j * nsizes + k] / tmin;
+	    }
+	    if ((j == 0) || (score < bestscore)) {
+	       best = j;
+	       bestscore = score;
+	    }
+	 }
+	 result = tune_apply(interp, chan,
+		(setlat) ? latency : tune_latencies[best / nchunk],
+		(setrd) ? rdchunk : tune_chunks[best % nchunk],
+		(setwr) ? wrchunk : tune_chunks[best % nchunk]);
+      }
+      else {
+	 // Put back the settings from before the search
+	 Tcl_Obj *msg = Tcl_GetObjResult(interp);
+	 Tcl_IncrRefCount(msg);
+	 tune_apply(interp, chan, lat0, rd0, wr0);
+	 Tcl_SetObjResult(interp, msg);
+	 Tcl_DecrRefCount(msg);
+      }
+      free(times);
+      free(cbuffer);
+      free(rbuffer);
+      free(sizes);
+      if (result != TCL_OK) return result;
+   }
+
+   lobj = Tcl_NewListObj(0, NULL);
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-latency", -1));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj(chan->tn_latency));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-readchunk", -1));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj((int)chan->tn_rdchunk));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-writechunk", -1));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewIntObj((int)chan->tn_wrchunk));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-flow", -1));
+   Tcl_ListObjAppendElement(interp, lobj,
+		Tcl_NewStringObj(tune_flow_names[chan->tn_flow], -1));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-eventchar", -1));
+   Tcl_ListObjAppendElement(interp, lobj, (chan->tn_eventchar < 0) ?
+		Tcl_NewStringObj("none", -1) : Tcl_NewIntObj(chan->tn_eventchar));
+   Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-errorchar", -1));
+   Tcl_ListObjAppendElement(interp, lobj, (chan->tn_errorchar < 0) ?
+		Tcl_NewStringObj("none", -1) : Tcl_NewIntObj(chan->tn_errorchar));
+   if (BACKEND(chan)->set_bulkread != NULL) {
+      Tcl_ListObjAppendElement(interp, lobj, Tcl_NewStringObj("-bulkread", -1));
+      Tcl_ListObjAppendElement(interp, lobj,
+		Tcl_NewIntObj((int)chan->tn_bulkread));
+   }
+   Tcl_SetObjResult(interp, lobj);
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::timeout"					*/
+/*								*/
+/* Use: timeout <device> [<ms>]					*/
+/*								*/
+/* Set the deadline of each command that moves data on the	*/
+/* channel of <device>, in ms (0 for none, the default).  A	*/
+/* command may override it with "-timeout <ms>".  The libusb	*/
+/* timeouts of synchronous transfers are set to the same value	*/
+/* (or libftdi's 5s if 0).  Returns the current setting.	*/
+/*--------------------------------------------------------------*/
+
+int
+ftditcl_timeout(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord, *chan;
+   int result, ms;
+
+   if (objc != 2 && objc != 3) {
+      Tcl_SetResult(interp, "timeout: Need device name and optional "
+		"value (in ms).\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "timeout:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   chan = ftRecord->channel;
+
+   if (objc == 3) {
+      result = Tcl_GetIntFromObj(interp, objv[2], &ms);
+      if (result != TCL_OK) return result;
+      if (ms < 0) {
+	 Tcl_SetResult(interp, "timeout:  Value cannot be negative.\n", NULL);
+	 return TCL_ERROR;
+      }
+      chan->tmo_device = ms;
+      BACKEND(chan)->set_timeouts(chan->ftContext, DEVICE_TIMEOUT(chan),
+		DEVICE_TIMEOUT(chan));
+   }
+   Tcl_SetObjResult(interp, Tcl_NewIntObj(chan->tmo_device));
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_command_prefix"			*/
+/*								*/
+/* Fill "buffer" with the MPSSE opcodes that assert CS and	*/
+/* shift out the SPI command word.  "legacyop" is the fixed	*/
+/* command value used in legacy mode.  Returns the number of	*/
+/* bytes placed in the buffer (at most 20).			*/
+/*--------------------------------------------------------------*/
+
+static int
+spi_command_prefix(ftdi_record *ftRecord, Tcl_WideInt regnum,
+	unsigned char legacyop, unsigned char *buffer)
+{
+   unsigned char flags = ftRecord->flags;
+   int cmdcount, i, j, n;
+
+   cmdcount = (flags & LEGACY_MODE) ? 1 : (ftRecord->cmdwidth >> 3);
+
+   n = spi_cs(ftRecord, true, buffer);	// Assert CS
+   if (cmdcount == 0) return n;
+
+   buffer[n++] = ftRecord->op_write;	// Simple write command
+   buffer[n++] = (unsigned char)(cmdcount - 1);
+   buffer[n++] = 0x00;		// (High byte is zero)
+   if (flags & LEGACY_MODE)
+      buffer[n] = legacyop + (unsigned char)regnum;
+   else {
+      for (i = 0; i < cmdcount; i++) {
+	 j = cmdcount - i - 1;
+	 buffer[n + i] = (unsigned char)((regnum >> (j << 3)) & 0xff);
+      }
+   }
+   return n + cmdcount;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "spi_read_request"				*/
+/*								*/
+/* Fill "buffer" with the MPSSE opcodes to clock in "count"	*/
+/* bytes (1 to MPSSE_MAX_CHUNK).  If "last" is true, CS is	*/
+/* de-asserted after the read.  The request ends with "send	*/
+/* immediate" so that the tail of the data is not held in the	*/
+/* chip until the latency timer expires.  Returns the number	*/
+/* of bytes placed in the buffer (at most 13).			*/
+/*--------------------------------------------------------------*/
+
+static int
+spi_read_request(ftdi_record *ftRecord, int count, bool last,
+	unsigned char *buffer)
+{
+   int n = 0;
+
+   buffer[n++] = ftRecord->op_read;	// Simple read command
+   buffer[n++] = (unsigned char)((count - 1) & 0xff);
+   buffer[n++] = (unsigned char)(((count - 1) >> 8) & 0xff);
+   if (last)
+      n += spi_cs(ftRecord, false, buffer + n);	// De-assert CS
+   buffer[n++] = 0x87;		// Send immediate
+   return n;
+}
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_read":				*/
+/*								*/
+/* The command is split in two so that the coroutine version	*/
+/* can yield between submitting the transfers and collecting	*/
+/* the result.							*/
+/*--------------------------------------------------------------*/
+
+typedef struct _spi_read_job {
+   ftdi_record *ftRecord;	// NULL if the command has already finished
+   struct ftdi_transfer_control *wtc, *rtc;
+   unsigned char *cbuffer;	// MPSSE command stream
+   unsigned char *values;	// Reply (bytecount data bytes and the echo)
+   int clen, cstart;		// Length of cbuffer and the part sent first
+   int bytecount;		// Number of bytes to read
+   unsigned int chunksize;	// Read chunk size to restore
+   ftdi_deadline dl;
+   ftdi_yield y;		// Coroutine waiting on the read
+} spi_read_job;
+
+/* Parse the command and submit its transfers.  For a device in	*/
+/* bit-bang mode, the whole command is run here, and		*/
+/* "job->ftRecord" is returned NULL.				*/
+
+static int
+spi_read_start(ClientData clientData, Tcl_Interp *interp, int objc,
+	Tcl_Obj *CONST objv[], spi_read_job *job)
+{
+   int result;
+   int bytecount, remaining, i, n;
+   int clen, cstart, nchunks;
+   Tcl_WideInt regnum;
+   unsigned char *cbuffer;
+   unsigned char flags;
+
+   ftdi_record *ftRecord, *chan;
+   struct ftdi_context * ftContext;
+   int ftStatus, tmo, nargs = objc;
+
+   job->ftRecord = NULL;
+   result = deadline_option(interp, &nargs, objv, &tmo);
+   if (result != TCL_OK) return result;
+   if (nargs != 4) {
+      Tcl_SetResult(interp, "spi_read: Need device name, command, "
+		"and byte count.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "spi_read:  No such device\n", NULL);
+      return TCL_ERROR;
+   }
+   else flags = ftRecord->flags;
+
+   if (flags & BITBANG_MODE) {
+      result = ftditcl_bang_read(clientData, interp, objc, objv);
+      return result;
+   }
+   if (channel_held(interp, ftRecord, "spi_read")) return TCL_ERROR;
+
+   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
+   if (result != TCL_OK) return result;
+   result = Tcl_GetIntFromObj(interp, objv[3], &bytecount);
+   if (result != TCL_OK) return result;
+   if (bytecount <= 0) {
+      Tcl_SetResult(interp, "spi_read:  Byte count must be positive.\n", NULL);
+      return TCL_ERROR;
+   }
+
+   // Build the whole MPSSE command stream up front:  Assert CS and
+   // send the command word, then one read opcode per 64kB chunk
+   // back to back, with CS de-asserted after the last one, and the
+   // echo that closes the reply.  The MPSSE stalls SCK whenever its
+   // read FIFO is full, so queueing all of the opcodes at once
+   // cannot overrun.  Any merged writes waiting on the channel go
+   // out first in the same transfer.
+
+   chan = ftRecord->channel;
+   nchunks = (bytecount + MPSSE_MAX_CHUNK - 1) / MPSSE_MAX_CHUNK;
+   cbuffer = (unsigned char *)malloc((chan->txlen + 20 + 4 * nchunks + 11) *
+		sizeof(unsigned char));
+   clen = chan->txlen;
+   if (clen > 0) memcpy(cbuffer, chan->txqueue, clen);
+   chan->txlen = 0;
+   clen += spi_command_prefix(ftRecord, regnum,
+		(flags & MIXED_MODE) ? 0x20 : 0x80, cbuffer + clen);
+   cstart = 0;
+
+   /* This hack applies only to the DPLL demo board---SPI registers	*/
+   /* require time to access!  Write the command first, pause, then	*/
+   /* do the rest.							*/
+
+   if ((flags & LEGACY_MODE) && (regnum < 16)) {
+      ftStatus = BACKEND(ftRecord)->write(ftContext, cbuffer, clen);
+      if (ftStatus < 0)
+         Tcl_SetResult(interp, "Received error while preparing SPI"
+		" read command.\n", NULL);
+      else if (ftStatus != clen)
+         Tcl_SetResult(interp, "SPI read:  short write error.\n", NULL);
+      usleep(10);		// 10us delay for SPI transmission
+      cstart = clen;
+   }
+
+   for (remaining = bytecount; remaining > 0; remaining -= n) {
+      n = (remaining > MPSSE_MAX_CHUNK) ? MPSSE_MAX_CHUNK : remaining;
+      clen += spi_read_request(ftRecord, n, (remaining == n), cbuffer + clen);
+   }
+   cbuffer[clen++] = MPSSE_ECHO;
+   cbuffer[clen++] = 0x87;	// Send immediate
+
+   if (verbose > 1) {
+      Fprintf(interp, stderr, "spi_read: Writing: ");
+      for (i = 0; i < clen; i++) {
+         Fprintf(interp, stderr, "0x%02x ", cbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
+
+   // SPI read using MPSSE.  The command stream and the read are both
+   // submitted asynchronously so that the IN transfers are queued
+   // while the opcodes are still going out, and each completed IN
+   // transfer is immediately replaced by the next one.
+
+   job->ftRecord = ftRecord;
+   job->cbuffer = cbuffer;
+   job->values = (unsigned char *)malloc((bytecount + 2) *
+		sizeof(unsigned char));
+   job->clen = clen;
+   job->cstart = cstart;
+   job->bytecount = bytecount;
+
+   deadline_start(&job->dl, ftRecord, tmo);
+
+   BACKEND(ftRecord)->get_read_chunksize(ftContext, &job->chunksize);
+   BACKEND(ftRecord)->set_read_chunksize(ftContext,
+		TUNED_CHUNK(ftRecord->channel->tn_rdchunk, MPSSE_MAX_CHUNK));
+
+   job->wtc = BACKEND(ftRecord)->write_submit(ftContext, cbuffer + cstart,
+		clen - cstart);
+   job->rtc = (job->wtc == NULL) ? NULL :
+		BACKEND(ftRecord)->read_submit(ftContext, job->values,
+		bytecount + 2);
+   return TCL_OK;
+}
+
+/* Wait for the transfers submitted by spi_read_start() and set	*/
+/* the result.  Frees the buffers of "job".			*/
+
+static int
+spi_read_finish(Tcl_Interp *interp, spi_read_job *job)
+{
+   ftdi_record *ftRecord = job->ftRecord;
+   int bytecount = job->bytecount;
+   int i, n, ftStatus, wStatus;
+   Tcl_Obj *vector;
+
+   ftStatus = transfer_wait(job->rtc, &job->dl);
+   wStatus = transfer_wait(job->wtc, &job->dl);
+
+   BACKEND(ftRecord)->set_read_chunksize(ftRecord->ftContext, job->chunksize);
+
+   if (!job->dl.timedout && ((wStatus != job->clen - job->cstart) ||
+		!MPSSE_IN_STEP(job->values, ftStatus, bytecount + 2))) {
+      free(job->cbuffer);
+      free(job->values);
+      return mpsse_desync(interp, ftRecord, "spi_read", (wStatus < 0) ||
+		(ftStatus < 0), ftStatus, bytecount + 2);
+   }
+
+   // After a timeout, the bytes that did arrive are the partial result
+   n = (!job->dl.timedout) ? bytecount : (ftStatus < bytecount) ? ftStatus :
+		bytecount;
+   vector = Tcl_NewListObj(0, NULL);
+   for (i = 0; i < n; i++) {
+      Tcl_ListObjAppendElement(interp, vector,
+		Tcl_NewIntObj((int)job->values[i]));
+   }
+   free(job->cbuffer);
+   free(job->values);
+
+   if (job->dl.timedout)
+      return deadline_error(interp, &job->dl, ftRecord, "spi_read", n,
+		bytecount, vector);
+   Tcl_SetObjResult(interp, vector);
+   return TCL_OK;
+}
+
+int
+ftditcl_spi_read(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   spi_read_job job;
+   int result;
+
+   result = spi_read_start(clientData, interp, objc, objv, &job);
+   if ((result != TCL_OK) || (job.ftRecord == NULL)) return result;
+   return spi_read_finish(interp, &job);
+}
+
+#ifdef FTDI_NRE
+
+static int
+spi_read_resume(ClientData data[], Tcl_Interp *interp, int result)
+{
+   spi_read_job *job = (spi_read_job *)data[0];
+   Tcl_InterpState state;
+
+   yield_end(&job->y);
+   channel_release(job->ftRecord->channel);
+   if (result == TCL_OK)
+      result = spi_read_finish(interp, job);
+   else {
+      // The coroutine was deleted:  Cancel the read, and keep
+      // the error that unwinds the coroutine.
+      state = Tcl_SaveInterpState(interp, result);
+      deadline_expire(&job->dl);
+      spi_read_finish(interp, job);
+      result = Tcl_RestoreInterpState(interp, state);
+   }
+   free(job);
+   return result;
+}
+
+/* Coroutine version of "ftdi::spi_read" (see "Coroutine-aware	*/
+/* commands", above)						*/
+
+static int
+ftditcl_spi_read_nr(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   spi_read_job *job;
+   ftdi_record *ftRecord;
+   struct ftdi_context *ftContext;
+   Tcl_Obj *coro;
+   int result;
+
+   if ((coro = yield_coroutine(interp)) == NULL)
+      return ftditcl_spi_read(clientData, interp, objc, objv);
+
+   if (objc > 1) {
+      ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+      if ((ftContext != NULL) && ftRecord->channel->suspended)
+	 return yield_turn(interp, coro, ftRecord->channel,
+		ftditcl_spi_read_nr, clientData, objc, objv);
+   }
+
+   job = (spi_read_job *)malloc(sizeof(spi_read_job));
+   result = spi_read_start(clientData, interp, objc, objv, job);
+   if ((result != TCL_OK) || (job->ftRecord == NULL) || (job->rtc == NULL)) {
+      if ((result == TCL_OK) && (job->ftRecord != NULL))
+	 result = spi_read_finish(interp, job);
+      free(job);
+      Tcl_DecrRefCount(coro);
+      return result;
+   }
+   job->ftRecord->channel->suspended = 1;
+   return yield_wait(interp, &job->y, coro, job->ftRecord->channel,
+		job->rtc, &job->dl, spi_read_resume, (ClientData)job);
+}
+
+#endif	/* FTDI_NRE */
+
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_write":				*/
+/*--------------------------------------------------------------*/
+
+/* Parse the command and build its MPSSE command stream in	*/
+/* "*valuesptr", of length "*lenptr".  For a device in bit-bang	*/
+/* mode, the whole command is run here, and "*valuesptr" is	*/
+/* returned NULL.						*/
+
+static int
+spi_write_build(ClientData clientData, Tcl_Interp *interp, int objc,
+	Tcl_Obj *CONST objv[], ftdi_record **recptr,
+	unsigned char **valuesptr, int *lenptr, int *tmoptr)
+{
+   int result;
+   int bytecount, i, j, value;
+   int len, nchunks;
+   Tcl_WideInt regnum;
+   unsigned char *values;
+   unsigned char flags;
+   Tcl_Obj *vector, *lobj;
+
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   int tmo, nargs = objc;
+
+   *valuesptr = NULL;
+   result = deadline_option(interp, &nargs, objv, &tmo);
+   if (result != TCL_OK) return result;
+   if (nargs != 4) {
+      Tcl_SetResult(interp, "spi_write: Need device name, "
+		"command, and vector of values.\n", NULL);
+      return TCL_ERROR;
+   }
+   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+   if (ftContext == (struct ftdi_context *)NULL) {
+      Tcl_SetResult(interp, "spi_read:  No such device\n", NULL);
       return TCL_ERROR;
    }
-   flags = ftRecord->flags;
-   sigpins = &(ftRecord->sigpins[0]);
+   else flags = ftRecord->flags;
 
-   // NOTE:  locally, signals will be indexed according to definitions
-   // above for BB_CSB, BB_SDO, BB_SDI, BB_SCK
+   if (flags & BITBANG_MODE) {
+      result = ftditcl_bang_write(clientData, interp, objc, objv);
+      return result;
+   }
+   if (channel_held(interp, ftRecord, "spi_write")) return TCL_ERROR;
 
-   result = Tcl_ListObjLength(interp, objv[2], &len);
-   if (len == 1) {
-      result = Tcl_GetBooleanFromObj(interp, objv[2], &bangmode);
+   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
+   if (result != TCL_OK) return result;
+
+   vector = objv[3];
+   result = Tcl_ListObjLength(interp, vector, &bytecount);
+   if (result != TCL_OK) return result;
+
+   for (i = 0; i < bytecount; i++) {
+      result = Tcl_ListObjIndex(interp, vector, i, &lobj);
       if (result != TCL_OK) return result;
-      if (bangmode) {
-	 /* Set default signals. */
-	 ftRecord->flags |= BITBANG_MODE;
-	 ftRecord->wordwidth = 8;
-	 sigpins[7] = 0x80;	// ADBUS7 = USR3
-	 sigpins[6] = 0x40;	// ADBUS6 = USR2
-	 sigpins[5] = 0x20;	// ADBUS5 = USR1
-	 sigpins[4] = 0x10;	// ADBUS4 = USR0
-	 sigpins[3] = 0x08;	// ADBUS3 = SCK
-	 sigpins[2] = 0x04;	// ADBUS2 = SDI
-	 sigpins[1] = 0x02;	// ADBUS1 = SDO
-	 sigpins[0] = 0x01;	// ADBUS0 = CSB
-	 sigio = 0xfd;		// 1 = output, 0 = input
-      }
-      else {
-	 // Turn off bit bang mode, return to MPSSE mode
-	 ftRecord->flags &= ~BITBANG_MODE;
-	 ftRecord->wordwidth = 0;
-	 Tcl_SetResult(interp, "spi_bitbang:  Unimplemented option. "
-		" Close and reopen device to reset mode.\n", NULL);
+      result = Tcl_GetIntFromObj(interp, lobj, &value);
+
+      if (value < 0 || value > 255) {
+         Tcl_SetResult(interp, "spi_write:  Byte value out of range 0-255\n",
+		NULL);
 	 return TCL_ERROR;
       }
    }
-   else {
-      /* Declare SPI signals.  Each should be a list of length two */
-      ftRecord->flags |= BITBANG_MODE;
-      ftRecord->wordwidth = 8;
-      sigio = 0xff;
-      sigassn = 0x00;
-      for (i = 0; i < 8; i++) sigpins[i] = 0;
-      if (len < 4) {
-	 Tcl_SetResult(interp, "spi_bitbang:  Must at least declare "
-		"SCK, SDI, SDO, and CSB\n", NULL);
-	 return TCL_ERROR;
-      }
-      else if (len > 8) {
-	 Tcl_SetResult(interp, "spi_bitbang:  Can only define up to 8 signals\n",
-			NULL);
-	 return TCL_ERROR;
-      }
-
-      for (i = 0; i < len; i++) {
-         result = Tcl_ListObjIndex(interp, objv[2], i, &sigpair);
-	 result = Tcl_ListObjLength(interp, sigpair, &loclen);
-	 if (loclen != 2) {
-	    Tcl_SetResult(interp, "spi_bitbang:  List of signals must be in"
-			"form {signal, bit}. bit is 0 to 7\n", NULL);
-	    return TCL_ERROR;
-	 }
-	 result = Tcl_ListObjIndex(interp, sigpair, 0, &sigval);
 
-	 // Recast from i (order in argument list) to j (signal
-	 // canonical order, 0 = CSB, 1 = SDO, 2 = SDI, 3 = SCK
+   // Assert CS and send the command word, then the data (one write
+   // opcode per 64kB), then de-assert CS, all in one transfer.
 
-	 if (!strcasecmp(Tcl_GetString(sigval), "CSB"))
-	    j = BB_CSB;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "SDO"))
-	    j = BB_SDO;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "SDI"))
-	    j = BB_SDI;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "SCK"))
-	    j = BB_SCK;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "USR0"))
-	    j = BB_USR0;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "USR1"))
-	    j = BB_USR1;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "USR2"))
-	    j = BB_USR2;
-	 else if (!strcasecmp(Tcl_GetString(sigval), "USR3"))
-	    j = BB_USR3;
-	 else {
-	    Tcl_SetResult(interp, "spi_bitbang:  Unknown signal name.  Must be "
-			"one of CSB, SDO, SDI, SCK, or USR0 to USR3\n", NULL);
-	    return TCL_ERROR;
-	 }
-	 result = Tcl_ListObjIndex(interp, sigpair, 1, &sigval);
-	 result = Tcl_GetIntFromObj(interp, sigval, &k);
-	 sigpins[j] = 0x01 << k;  // Convert bit number to bit mask
+   nchunks = (bytecount + MPSSE_MAX_CHUNK - 1) / MPSSE_MAX_CHUNK;
+   values = (unsigned char *)malloc((20 + bytecount + 3 * nchunks + 9) *
+		sizeof(unsigned char));
+   len = spi_command_prefix(ftRecord, regnum,
+		(flags & MIXED_MODE) ? 0x10 : 0x40, values);
 
-	 if (j == BB_SDO) sigio &= ~sigpins[j];
-	 sigassn |= sigpins[j];
+   for (i = 0; i < bytecount; i++) {
+      if ((i % MPSSE_MAX_CHUNK) == 0) {
+	 j = bytecount - i;
+	 if (j > MPSSE_MAX_CHUNK) j = MPSSE_MAX_CHUNK;
+	 values[len++] = ftRecord->op_write;	// Simple write command
+	 // Number of bytes to write (less 1)
+	 values[len++] = (unsigned char)((j - 1) & 0xff);
+	 values[len++] = (unsigned char)(((j - 1) >> 8) & 0xff);
       }
+      result = Tcl_ListObjIndex(interp, vector, i, &lobj);
+      result = Tcl_GetIntFromObj(interp, lobj, &value);
+      values[len++] = (unsigned char)(value & 0xff);
+   }
+   len += spi_cs(ftRecord, false, values + len);	// De-assert CS
 
-      // Check that all pins are assigned.  
-      j = 0;
-      for (i = 0; i < 8; i++) if (sigassn & (1 << i)) j++;
-      if (j != len) {
-	 Tcl_SetResult(interp, "spi_bitbang:  Not all signals assigned.  Must "
-			"assign all of CSB, SDO, SDI, and SCK\n", NULL);
-	 return TCL_ERROR;
+   // SPI write using MPSSE
+
+   if (verbose > 1) {
+      Fprintf(interp, stderr, "spi_write: Writing: ");
+      for (i = 0; i < len; i++) {
+         Fprintf(interp, stderr, "0x%02x ", values[i]);
       }
+      Fprintf(interp, stderr, "\n");
    }
 
-   // Reset the FTDI device
-   ftStatus = ftdi_usb_reset(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while resetting device.\n", NULL);
+   *recptr = ftRecord;
+   *valuesptr = values;
+   *lenptr = len;
+   *tmoptr = tmo;
+   return TCL_OK;
+}
 
-   // Set baudrate to default (Note: actual bits per second is 16 times the value)
-   // So 62500 baud = 1Mbps.  However, SCK clock takes two transmissions (up, down)
-   // so double this value to get a 1Mpbs SCK, or 125000.
-   ftStatus = ftdi_set_baudrate(ftContext, (long)125000);
+int
+ftditcl_spi_write(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   unsigned char *values;
+   int result, len, tmo, ftStatus;
+
+   result = spi_write_build(clientData, interp, objc, objv, &ftRecord,
+		&values, &len, &tmo);
+   if ((result != TCL_OK) || (values == NULL)) return result;
+   ftContext = ftRecord->ftContext;
+
+   // The write is synchronous, so a deadline given with the command
+   // bounds it through the USB write timeout.
+
+   if (tmo > 0) BACKEND(ftRecord)->set_timeouts(ftContext,
+		DEVICE_TIMEOUT(ftRecord->channel), tmo);
+   ftStatus = spi_queue_write(interp, ftRecord, values, len);
+   if (tmo > 0) BACKEND(ftRecord)->set_timeouts(ftContext,
+		DEVICE_TIMEOUT(ftRecord->channel),
+		DEVICE_TIMEOUT(ftRecord->channel));
    if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting baud rate.\n", NULL);
-
-   // Set device to Synchronous bit-bang mode, with pins SCK, SDI, and CSB
-   // set to output, SDO to input (bitbang mode defined as 0x01, should use
-   // defines from ftdi.h).
+      Tcl_SetResult(interp, "Received error in SPI write.\n", NULL);
+   else if (ftStatus != len)
+      Tcl_SetResult(interp, "SPI short write error.\n", NULL);
 
-   ftStatus = ftdi_set_bitmode(ftContext, (unsigned char)sigio,
-		(unsigned char)BITMODE_SYNCBB);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting bit mode.\n", NULL);
+   free(values);
+   return (ftStatus == len) ? TCL_OK : TCL_ERROR;
+}
 
-   ftStatus = ftdi_usb_purge_tx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging transmit buffer.\n", NULL);
+#ifdef FTDI_NRE
 
-   ftStatus = ftdi_usb_purge_rx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging receive buffer.\n", NULL);
+/* State of a "spi_write" suspended in a coroutine		*/
 
-   // Set latency timer (in ms) (legacy case is 16; FT2232 minimum 1)
-   ftStatus = ftdi_set_latency_timer(ftContext, (unsigned char)5);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting latency timer.\n", NULL);
+typedef struct _spi_write_job {
+   ftdi_record *ftRecord;
+   struct ftdi_transfer_control *wtc;
+   unsigned char *values;	// MPSSE command stream
+   int len;			// Length of values
+   ftdi_deadline dl;
+   ftdi_yield y;		// Coroutine waiting on the write
+} spi_write_job;
+
+static int
+spi_write_finish(Tcl_Interp *interp, spi_write_job *job)
+{
+   int ftStatus;
 
-   // Set timeouts (in ms) (no libftdi equivalent to D2XX FT_SetTimeouts()?)
-   /*
-   ftStatus = ftdi_set_timeouts(ftContext, 1000, 1000);
+   ftStatus = transfer_wait(job->wtc, &job->dl);
+   free(job->values);
+   if (job->dl.timedout)
+      return deadline_error(interp, &job->dl, job->ftRecord, "spi_write",
+		(ftStatus < 0) ? 0 : ftStatus, job->len, NULL);
    if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting timeouts.\n", NULL);
-   */
+      Tcl_SetResult(interp, "Received error in SPI write.\n", NULL);
+   else if (ftStatus != job->len)
+      Tcl_SetResult(interp, "SPI short write error.\n", NULL);
+   return (ftStatus == job->len) ? TCL_OK : TCL_ERROR;
+}
 
-   // Set default values CSB = 1, SDI = 0, SCK = 0, SDO = don't care
-   tbuffer[0] = sigpins[BB_CSB];
+static int
+spi_write_resume(ClientData data[], Tcl_Interp *interp, int result)
+{
+   spi_write_job *job = (spi_write_job *)data[0];
+   Tcl_InterpState state;
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_bitbang: Writing: ");
-      for (i = 0; i < 1; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-      }
-      Fprintf(interp, stderr, "\n");
+   yield_end(&job->y);
+   channel_release(job->ftRecord->channel);
+   if (result == TCL_OK)
+      result = spi_write_finish(interp, job);
+   else {
+      state = Tcl_SaveInterpState(interp, result);
+      deadline_expire(&job->dl);
+      spi_write_finish(interp, job);
+      result = Tcl_RestoreInterpState(interp, state);
    }
-
-   ftStatus = ftdi_write_data(ftContext, tbuffer, 1);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while writing init data\n", NULL);
-    else if (ftStatus != 1)
-      Tcl_SetResult(interp, "Short write error\n", NULL);
-
-   // Return
-   return TCL_OK;
+   free(job);
+   return result;
 }
 
-/*--------------------------------------------------------------*/
-/* Tcl function "ftdi::bitbang_word":  Set the word length of	*/
-/* the SPI in bit-bang mode, which can accomodate lengths other	*/
-/* than the default 8.						*/
-/*--------------------------------------------------------------*/
+/* Coroutine version of "ftdi::spi_write".  With merging on,	*/
+/* the write normally goes only to the merge queue, so the	*/
+/* command does not yield.					*/
 
-int
-ftditcl_bang_word(ClientData clientData,
+static int
+ftditcl_spi_write_nr(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
+   spi_write_job *job;
    ftdi_record *ftRecord;
-   unsigned char flags;
-   int wordwidth, result;
+   struct ftdi_context *ftContext;
+   unsigned char *values;
+   Tcl_Obj *coro;
+   int result, len, tmo;
 
-   if (objc != 3) {
-      Tcl_SetResult(interp, "bitbang_word: Need handle and integer value.\n", NULL);
-      return TCL_ERROR;
-   }
-   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
-   if (ftRecord == (ftdi_record *)NULL) {
-      Tcl_SetResult(interp, "bitbang_word:  No such device\n", NULL);
-      return TCL_ERROR;
+   if ((coro = yield_coroutine(interp)) == NULL)
+      return ftditcl_spi_write(clientData, interp, objc, objv);
+
+   if (objc > 1) {
+      ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
+      if ((ftContext != NULL) && ftRecord->channel->suspended)
+	 return yield_turn(interp, coro, ftRecord->channel,
+		ftditcl_spi_write_nr, clientData, objc, objv);
+      if ((ftContext != NULL) && ftRecord->channel->merging) {
+	 Tcl_DecrRefCount(coro);
+	 return ftditcl_spi_write(clientData, interp, objc, objv);
+      }
    }
-   else flags = ftRecord->flags;
 
-   if (!(flags & BITBANG_MODE)) {
-      Tcl_SetResult(interp, "bitbang_word: bit-bang mode must be set first.\n", NULL);
+   result = spi_write_build(clientData, interp, objc, objv, &ftRecord,
+		&values, &len, &tmo);
+   if ((result != TCL_OK) || (values == NULL)) {
+      Tcl_DecrRefCount(coro);
+      return result;
+   }
+   if (spi_queue_flush(interp, ftRecord->channel) != TCL_OK) {
+      free(values);
+      Tcl_DecrRefCount(coro);
       return TCL_ERROR;
    }
 
-   result = Tcl_GetIntFromObj(interp, objv[2], &wordwidth);
-   if (result != TCL_OK) return result;
-
-   ftRecord->wordwidth = wordwidth;
-   return TCL_OK;
+   job = (spi_write_job *)malloc(sizeof(spi_write_job));
+   job->ftRecord = ftRecord;
+   job->values = values;
+   job->len = len;
+   deadline_start(&job->dl, ftRecord, tmo);
+   job->wtc = BACKEND(ftRecord)->write_submit(ftRecord->ftContext, values,
+		len);
+   if (job->wtc == NULL) {
+      result = spi_write_finish(interp, job);
+      free(job);
+      Tcl_DecrRefCount(coro);
+      return result;
+   }
+   ftRecord->channel->suspended = 1;
+   return yield_wait(interp, &job->y, coro, ftRecord->channel, job->wtc,
+		&job->dl, spi_write_resume, (ClientData)job);
 }
 
+#endif	/* FTDI_NRE */
+
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::bitbang_write":				*/
+/* Tcl function "ftdi::spi_readwrite":	Combined read and write	*/
+/* (Note:  readwrite function untested, not sure how to do a	*/
+/* readback of data without sending more clocks.  FT functions	*/
+/* do not appear to be truly bidirectional/full duplex.)	*/
 /*--------------------------------------------------------------*/
 
 int
-ftditcl_bang_write(ClientData clientData,
+ftditcl_spi_readwrite(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-   int result, nbytes;
-   int wordcount, i, j, value, tidx;
+   int result;
+   int bytecount, i, n;
+   int ntb;
    Tcl_WideInt regnum;
-   unsigned char wordwidth;
-   unsigned char cmdwidth;
+   Tcl_Obj *lobj;
+   int value;
+   unsigned char *values;
    unsigned char flags;
-   unsigned char *tbuffer;
-   unsigned char *sigpins;
-   Tcl_Obj *vector, *lobj;
+   Tcl_Obj *vector;
 
    long numWritten;
+   long numRead;
    ftdi_record *ftRecord;
    struct ftdi_context * ftContext;
-   int ftStatus;
+   struct ftdi_transfer_control *wtc, *rtc;
+   int ftStatus, wStatus, tmo;
+   ftdi_deadline dl;
 
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
    if (objc != 4) {
-      Tcl_SetResult(interp, "bitbang_write: Need device name, "
-		"register, and vector of values.\n", NULL);
+      Tcl_SetResult(interp, "spi_readwrite: Need device name, command, "
+		"and byte list.\n", NULL);
       return TCL_ERROR;
    }
    ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
    if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "bitbang_write:  No such device\n", NULL);
+      Tcl_SetResult(interp, "spi_readwrite:  No such device\n", NULL);
       return TCL_ERROR;
    }
-   flags = ftRecord->flags;
-   wordwidth = ftRecord->wordwidth;
-   cmdwidth = ftRecord->cmdwidth;
-   sigpins = &(ftRecord->sigpins[0]);
-
-   // If we're not in bit-bang mode, use the normal spi_write.
-
-   if (!(flags & BITBANG_MODE)) {
-      result = ftditcl_spi_write(clientData, interp, objc, objv);
-      return result;
-   }
-
-   // First argument is register number.  This may or may not include
-   // additional information such as an opcode.  If so, it is the
-   // responsibility of the end-user to make sure that the opcode
-   // matches the use of routine "read" or "write".
+   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "spi_readwrite")) return TCL_ERROR;
 
    result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
    if (result != TCL_OK) return result;
 
    vector = objv[3];
-   result = Tcl_ListObjLength(interp, vector, &wordcount);
+   result = Tcl_ListObjLength(interp, vector, &bytecount);
    if (result != TCL_OK) return result;
 
-   for (i = 0; i < wordcount; i++) {
+   for (i = 0; i < bytecount; i++) {
       result = Tcl_ListObjIndex(interp, vector, i, &lobj);
       if (result != TCL_OK) return result;
       result = Tcl_GetIntFromObj(interp, lobj, &value);
 
       if (value < 0 || value > 255) {
-         Tcl_SetResult(interp, "bitbang_write:  Byte value out of range 0-255\n",
+         Tcl_SetResult(interp, "spi_write:  Byte value out of range 0-255\n",
 		NULL);
 	 return TCL_ERROR;
       }
    }
 
-   // Create complete vector to write in synchronous bit-bang
-   // mode.
+   if (bytecount < 1 || bytecount > MPSSE_MAX_CHUNK) {
+      Tcl_SetResult(interp, "spi_readwrite:  Byte list must have 1 to "
+		"65536 entries.\n", NULL);
+      return TCL_ERROR;
+   }
 
-   nbytes = ((cmdwidth + wordcount * wordwidth) * 2) + 2;
-   tbuffer = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
-   tidx = 0;
- 
-   // Assert CSB
-   tbuffer[tidx++] = (unsigned char)0;
+   values = (unsigned char *)malloc((bytecount + 40) * sizeof(unsigned char));
 
-   // Write command/register word msb first
-   for (j = cmdwidth - 1; j >= 0; j--) {
-      // input changes on falling edge of SCK
-      tbuffer[tidx++] = (regnum & ((Tcl_WideInt)1 << j)) ? sigpins[BB_SDI] : 0;
-      tbuffer[tidx] = tbuffer[tidx - 1] | sigpins[BB_SCK];
-      tidx++;
+   if (spi_queue_flush(interp, ftRecord) != TCL_OK) {
+      free(values);
+      return TCL_ERROR;
    }
 
-   for (i = 0; i < wordcount; i++) {
-      result = Tcl_ListObjIndex(interp, vector, i, &lobj);
-      result = Tcl_GetIntFromObj(interp, lobj, &value);
-      for (j = wordwidth - 1; j >= 0; j--) {
-	 // input changes on falling edge of SCK
-	 tbuffer[tidx++] = (value & (1 << j)) ? sigpins[BB_SDI] : 0;
-	 tbuffer[tidx] = tbuffer[tidx - 1] | sigpins[BB_SCK];
-	 tidx++;
-      }
-   }
+   // Write values to MPSSE to generate the SPI read command, followed
+   // by the read (number of bytes is limited to one read opcode)
 
-   // De-assert CSB
-   tbuffer[tidx++] = (flags & CSB_NORAISE) ? (unsigned char)0 :
-		(unsigned char)sigpins[BB_CSB];
+   ntb = spi_command_prefix(ftRecord, regnum,
+		(flags & MIXED_MODE) ? 0x20 : 0x80, values);
+   ntb += spi_read_request(ftRecord, bytecount, true, values + ntb);
+   values[ntb++] = MPSSE_ECHO;
+   values[ntb++] = 0x87;	// Send immediate
 
    if (verbose > 1) {
-      Fprintf(interp, stderr, "bitbang_write: Writing: ");
-      for (i = 0; i < nbytes; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      Fprintf(interp, stderr, "spi_readwrite: Writing: ");
+      for (i = 0; i < ntb; i++) {
+         Fprintf(interp, stderr, "0x%02x ", values[i]);
       }
       Fprintf(interp, stderr, "\n");
    }
 
-   // Purge TX buffer
-   ftStatus = ftdi_usb_purge_tx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging transmit buffer.\n", NULL);
+   // SPI read using MPSSE, with the command and the read submitted
+   // together.  The reply goes after the command in the same buffer.
+
+   deadline_start(&dl, ftRecord, tmo);
+   wtc = BACKEND(ftRecord)->write_submit(ftContext, values, ntb);
+   rtc = (wtc == NULL) ? NULL : BACKEND(ftRecord)->read_submit(ftContext, 
+		values + ntb, bytecount + 2);
+   ftStatus = transfer_wait(rtc, &dl);
+   wStatus = transfer_wait(wtc, &dl);
+
+   if (!dl.timedout && ((wStatus != ntb) ||
+		!MPSSE_IN_STEP(values + ntb, ftStatus, bytecount + 2))) {
+      free(values);
+      return mpsse_desync(interp, ftRecord, "spi_readwrite", (wStatus < 0) ||
+		(ftStatus < 0), ftStatus, bytecount + 2);
+   }
 
-   // SPI write using bit bang
-   ftStatus = ftdi_write_data(ftContext, tbuffer, nbytes);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while writing SPI.\n", NULL);
-   else if (ftStatus != nbytes)
-      Tcl_SetResult(interp, "bitbang write:  short write error.\n", NULL);
+   n = (!dl.timedout) ? bytecount : (ftStatus < bytecount) ? ftStatus :
+		bytecount;
+   vector = Tcl_NewListObj(0, NULL);
+   for (i = 0; i < n; i++) {
+      Tcl_ListObjAppendElement(interp, vector,
+		Tcl_NewIntObj((int)values[ntb + i]));
+   }
+   free(values);
 
-   free(tbuffer);
+   if (dl.timedout)
+      return deadline_error(interp, &dl, ftRecord, "spi_readwrite", n,
+		bytecount, vector);
+   Tcl_SetObjResult(interp, vector);
    return TCL_OK;
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::bitbang_set":				*/
-/* Apply individual signal changes.				*/
-/* Use:  bitbang_set <device> <pinlist> ...			*/
-/* Pinlist contains all pins to be set (null list if all pins	*/
-/* should be cleared).  Use multiple lists for operations to be	*/
-/* separated by one clock cycle.				*/
-/* Ex: "bitbang_set ftdi0 {SDI SCK} {SDI} {}"			*/
+/* Support function "spi_chan_setup"				*/
+/*								*/
+/* Check arguments common to spi_read_chan and spi_write_chan	*/
+/* and look up the device record and the Tcl channel.		*/
 /*--------------------------------------------------------------*/
 
-int
-ftditcl_bang_set(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static int
+spi_chan_setup(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[],
+	char *cmdname, int chanmode, ftdi_record **recordptr,
+	Tcl_WideInt *regnumptr, Tcl_WideInt *countptr, Tcl_Channel *chanptr)
 {
-   int result, numobj, nbytes;
-   int i, j, k, value, tidx;
-   unsigned char flags;
-   unsigned char *tbuffer;
-   unsigned char *sigpins;
-   Tcl_Obj *vector, *lobj;
-
-   long numWritten;
    ftdi_record *ftRecord;
-   struct ftdi_context * ftContext;
-   int ftStatus;
+   Tcl_WideInt count;
+   int result, mode;
 
-   if (objc < 2) {
-      Tcl_SetResult(interp, "bitbang_set: Need device name and at least "
-		"one pin and value pair.\n", NULL);
+   if (objc != 5) {
+      Tcl_AppendResult(interp, cmdname, ": Need device name, command, "
+		"byte count, and channel.\n", NULL);
       return TCL_ERROR;
    }
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "bitbang_set:  No such device\n", NULL);
+   ftRecord = find_record(Tcl_GetString(objv[1]), NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_AppendResult(interp, cmdname, ":  No such device\n", NULL);
       return TCL_ERROR;
    }
-   flags = ftRecord->flags;
-   sigpins = &(ftRecord->sigpins[0]);
-
-   nbytes = objc - 2;
-   tbuffer = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
-
-   for (i = 0; i < objc - 2; i++) {
-
-      /* Parse pin list and apply value */
-      result = Tcl_ListObjLength(interp, objv[i + 2], &numobj);
-      if (result != TCL_OK) return result;
-      if (numobj > 8) {
-	 Tcl_SetResult(interp, "Each entry must be a list of pins\n", NULL);
-	 free(tbuffer);
-	 return TCL_ERROR;
-      }
-      tbuffer[i] = 0;
-      for (k = 0; k < numobj; k++) {
-         result = Tcl_ListObjIndex(interp, objv[i + 2], k, &lobj);
-         if (result != TCL_OK) {
-	    free(tbuffer);
-	    return result;
-	 }
-         if (!strcasecmp(Tcl_GetString(lobj), "CSB"))
-	    j = BB_CSB;
-         else if (!strcasecmp(Tcl_GetString(lobj), "SDO"))
-	    j = BB_SDO;
-         else if (!strcasecmp(Tcl_GetString(lobj), "SDI"))
-	    j = BB_SDI;
-         else if (!strcasecmp(Tcl_GetString(lobj), "SCK"))
-	    j = BB_SCK;
-         else if (!strcasecmp(Tcl_GetString(lobj), "USR0"))
-	    j = BB_USR0;
-         else if (!strcasecmp(Tcl_GetString(lobj), "USR1"))
-	    j = BB_USR1;
-         else if (!strcasecmp(Tcl_GetString(lobj), "USR2"))
-	    j = BB_USR2;
-         else if (!strcasecmp(Tcl_GetString(lobj), "USR3"))
-	    j = BB_USR3;
-         else {
-	    Tcl_SetResult(interp, "bitbang_set:  Unknown signal name.  "
-			"Must be one of CSB, SDO, SDI, or SCK\n", NULL);
-	    free(tbuffer);
-	    return TCL_ERROR;
-         }
-         tbuffer[i] |= sigpins[j];
-      }
-      // Fprintf(interp, stderr, "Byte %d set to %d\n", i, tbuffer[i]);
+   if (channel_held(interp, ftRecord, cmdname)) return TCL_ERROR;
+   if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_AppendResult(interp, cmdname, ":  Device must be in "
+		"MPSSE mode.\n", NULL);
+      return TCL_ERROR;
    }
-   // Fprintf(interp, stderr, "Writing %d bytes\n", nbytes);
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "bitbang_set: Writing: ");
-      for (i = 0; i < nbytes; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-      }
-      Fprintf(interp, stderr, "\n");
+   result = Tcl_GetWideIntFromObj(interp, objv[2], regnumptr);
+   if (result != TCL_OK) return result;
+   result = Tcl_GetWideIntFromObj(interp, objv[3], &count);
+   if (result != TCL_OK) return result;
+   if (count < 0) {
+      Tcl_AppendResult(interp, cmdname, ":  Byte count cannot be "
+		"negative.\n", NULL);
+      return TCL_ERROR;
    }
 
-   // Simple bit bang write
-   ftStatus = ftdi_write_data(ftContext, tbuffer, nbytes);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while banging bits.\n", NULL);
-   else if (ftStatus != nbytes)
-      Tcl_SetResult(interp, "bitbang set:  short write error.\n", NULL);
+   *chanptr = Tcl_GetChannel(interp, Tcl_GetString(objv[4]), &mode);
+   if (*chanptr == (Tcl_Channel)NULL) return TCL_ERROR;
+   if (!(mode & chanmode)) {
+      Tcl_AppendResult(interp, cmdname, ":  Channel \"",
+		Tcl_GetString(objv[4]), (chanmode == TCL_READABLE) ?
+		"\" is not open for reading.\n" :
+		"\" is not open for writing.\n", NULL);
+      return TCL_ERROR;
+   }
 
-   free(tbuffer);
-   return TCL_OK;
+   *recordptr = ftRecord;
+   *countptr = count;
+   return spi_queue_flush(interp, ftRecord);
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::bitbang_read":				*/
+/* Tcl function "ftdi::spi_read_chan":				*/
+/*								*/
+/* Use: spi_read_chan <device> <command> <num_bytes> <channel>	*/
+/*								*/
+/* Send SPI command <command> and read back <num_bytes> bytes,	*/
+/* writing them to the Tcl channel <channel> as they arrive.	*/
+/* The data are moved in chunks of up to 64kB with CS held	*/
+/* asserted for the whole transfer.  Two buffers are used so	*/
+/* that the USB read of one chunk overlaps the channel write	*/
+/* of the previous one, keeping memory use constant.  Returns	*/
+/* the number of bytes written to the channel.			*/
 /*--------------------------------------------------------------*/
 
 int
-ftditcl_bang_read(ClientData clientData,
+ftditcl_spi_read_chan(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-   int result, nbytes, numRead;
-   int wordcount, i, j, value, tidx;
-   Tcl_WideInt regnum;
+   int result, n, nnext, cur, ntb;
+   unsigned int chunksize;
+   Tcl_WideInt regnum, bytecount, remaining, total;
+   unsigned char *values[2];
+   unsigned char tbuffer[40];
    unsigned char flags;
-   unsigned char *tbuffer;
-   unsigned char wordwidth;
-   unsigned char cmdwidth;
-   unsigned char *sigpins;
-   Tcl_Obj *vector, *lobj;
+   Tcl_Channel chan;
+   char *errmsg = NULL;
 
-   long numWritten;
    ftdi_record *ftRecord;
    struct ftdi_context * ftContext;
-   int ftStatus;
+   struct ftdi_transfer_control *tc = NULL;
+   int ftStatus, tmo;
+   ftdi_deadline dl;
 
-   if (objc != 4) {
-      Tcl_SetResult(interp, "bitbang_read: Need device name, "
-		"register, and word count.\n", NULL);
-      return TCL_ERROR;
-   }
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "bitbang_read:  No such device\n", NULL);
-      return TCL_ERROR;
-   }
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
+   result = spi_chan_setup(interp, objc, objv, "spi_read_chan",
+		TCL_WRITABLE, &ftRecord, &regnum, &bytecount, &chan);
+   if (result != TCL_OK) return result;
+   ftContext = ftRecord->ftContext;
    flags = ftRecord->flags;
-   wordwidth = ftRecord->wordwidth;
-   cmdwidth = ftRecord->cmdwidth;
-   sigpins = &(ftRecord->sigpins[0]);
+   deadline_start(&dl, ftRecord, tmo);
+
+   // Each chunk's reply ends with the echo of MPSSE_ECHO (2 bytes)
+   values[0] = (unsigned char *)malloc((MPSSE_MAX_CHUNK + 2) * sizeof(unsigned char));
+   values[1] = (unsigned char *)malloc((MPSSE_MAX_CHUNK + 2) * sizeof(unsigned char));
+
+   // Use the largest read transfer libftdi allows, so that a single
+   // USB request is in flight while the previous chunk is written out.
+   BACKEND(ftRecord)->get_read_chunksize(ftContext, &chunksize);
+   BACKEND(ftRecord)->set_read_chunksize(ftContext,
+		TUNED_CHUNK(ftRecord->channel->tn_rdchunk, MPSSE_MAX_CHUNK));
+
+   // Assert CS and send the command word
+
+   ntb = spi_command_prefix(ftRecord, regnum,
+		(flags & MIXED_MODE) ? 0x20 : 0x80, tbuffer);
+   remaining = bytecount;
+   n = (remaining > MPSSE_MAX_CHUNK) ? MPSSE_MAX_CHUNK : (int)remaining;
+   if (n > 0) {
+      ntb += spi_read_request(ftRecord, n, (remaining == n), tbuffer + ntb);
+      tbuffer[ntb++] = MPSSE_ECHO;
+      tbuffer[ntb++] = 0x87;	// Send immediate
+   }
+   else
+      ntb += spi_cs(ftRecord, false, tbuffer + ntb);	// De-assert CS
 
-   // If we're not in bit-bang mode, use the normal spi_read.
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "spi_read_chan: Writing: ");
+      for (i = 0; i < ntb; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      }
+      Fprintf(interp, stderr, "\n");
+   }
 
-   if (!(flags & BITBANG_MODE)) {
-      result = ftditcl_spi_read(clientData, interp, objc, objv);
-      return result;
+   ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, ntb);
+   if (ftStatus != ntb) {
+      errmsg = "spi_read_chan:  Error while preparing SPI read command.\n";
+      n = 0;
    }
+   else if (n > 0)
+      tc = BACKEND(ftRecord)->read_submit(ftContext, values[0], n + 2);
+
+   total = 0;
+   cur = 0;
+   while (n > 0) {
+      remaining -= n;
+      ftStatus = transfer_wait(tc, &dl);
+      tc = NULL;
+      if (dl.timedout) {
+	 // Pass on the part of the chunk that arrived in time
+	 if (ftStatus > n) ftStatus = n;
+	 if ((ftStatus > 0) && (Tcl_Write(chan, (char *)values[cur],
+		ftStatus) == ftStatus))
+	    total += ftStatus;
+	 break;
+      }
+      if (!MPSSE_IN_STEP(values[cur], ftStatus, n + 2)) {
+	 BACKEND(ftRecord)->set_read_chunksize(ftContext, chunksize);
+	 free(values[0]);
+	 free(values[1]);
+	 return mpsse_desync(interp, ftRecord, "spi_read_chan", (ftStatus < 0),
+		ftStatus, n + 2);
+      }
 
-   // First argument is register number.  This may or may not include
-   // additional information such as an opcode.  If so, it is the
-   // responsibility of the end-user to make sure that the opcode
-   // matches the use of routine "read" or "write".
+      // Queue the next chunk before handing this one to the channel
+
+      nnext = (remaining > MPSSE_MAX_CHUNK) ? MPSSE_MAX_CHUNK : (int)remaining;
+      if (nnext > 0) {
+	 ntb = spi_read_request(ftRecord, nnext, (remaining == nnext), tbuffer);
+	 tbuffer[ntb++] = MPSSE_ECHO;
+	 tbuffer[ntb++] = 0x87;	// Send immediate
+	 ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, ntb);
+	 if (ftStatus != ntb) {
+	    errmsg = "spi_read_chan:  Error while preparing SPI read command.\n";
+	    nnext = 0;
+	 }
+	 else
+	    tc = BACKEND(ftRecord)->read_submit(ftContext, values[cur ^ 1], nnext + 2);
+      }
 
-   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
-   if (result != TCL_OK) return result;
-   result = Tcl_GetIntFromObj(interp, objv[3], &wordcount);
-   if (result != TCL_OK) return result;
+      if (Tcl_Write(chan, (char *)values[cur], n) != n) {
+	 if (errmsg == NULL)
+	    errmsg = "spi_read_chan:  Error writing to channel.\n";
+	 break;
+      }
+      total += n;
+      cur ^= 1;
+      n = nnext;
+   }
 
-   // Create complete vector to write in synchronous bit-bang mode.
+   // Do not release the buffers while a read is still outstanding
+   if (tc != NULL) transfer_wait(tc, &dl);
 
-   nbytes = ((cmdwidth + wordcount * wordwidth) * 2) + 2;
-   tbuffer = (unsigned char *)malloc(nbytes * sizeof(unsigned char));
-   tidx = 0;
- 
-   // Assert CSB
-   tbuffer[tidx++] = (unsigned char)0;
+   BACKEND(ftRecord)->set_read_chunksize(ftContext, chunksize);
+   free(values[0]);
+   free(values[1]);
 
-   // Write command/register word msb first
-   for (j = cmdwidth - 1; j >= 0; j--) {
-      // input changes on falling edge of SCK
-      tbuffer[tidx++] = (regnum & ((Tcl_WideInt)1 << j)) ? sigpins[BB_SDI] : 0;
-      tbuffer[tidx] = tbuffer[tidx - 1] | sigpins[BB_SCK];
-      tidx++;
+   if (dl.timedout) {
+      // The purge drops the CS de-assert queued behind the transfer
+      result = deadline_error(interp, &dl, ftRecord, "spi_read_chan", total,
+		bytecount, NULL);
+      spi_cs_idle(ftRecord);
+      return result;
    }
-
-   for (i = 0; i < wordcount; i++) {
-      for (j = 0; j < wordwidth; j++) {
-	 // Drive clock by bit-bang
-	 tbuffer[tidx++] = 0;
-	 tbuffer[tidx++] = sigpins[BB_SCK];
-      }
+   if (errmsg != NULL) {
+      Tcl_SetResult(interp, errmsg, NULL);
+      return TCL_ERROR;
    }
+   Tcl_SetObjResult(interp, Tcl_NewWideIntObj(total));
+   return TCL_OK;
+}
 
-   // De-assert CSB
-   tbuffer[tidx++] = (flags & CSB_NORAISE) ? (unsigned char)0 :
-		(unsigned char)sigpins[BB_CSB];
+/*--------------------------------------------------------------*/
+/* Tcl function "ftdi::spi_write_chan":				*/
+/*								*/
+/* Use: spi_write_chan <device> <command> <num_bytes> <channel>	*/
+/*								*/
+/* Send SPI command <command> followed by up to <num_bytes>	*/
+/* bytes read from the Tcl channel <channel>.  Stops early if	*/
+/* the channel reaches end-of-file.  As with spi_read_chan,	*/
+/* data are moved in chunks of up to 64kB, and the channel	*/
+/* read of each chunk overlaps the USB write of the previous	*/
+/* one.  The channel is read in blocking mode for the length	*/
+/* of the command, so that a chunk is short only at		*/
+/* end-of-file.  Returns the number of bytes sent to the	*/
+/* device.							*/
+/*--------------------------------------------------------------*/
 
-   // Purge read buffer
-   ftStatus = ftdi_usb_purge_rx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging SPI RX.\n", NULL);
+int
+ftditcl_spi_write_chan(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   int result, n, want, cur, ntb, len, pn = 0;
+   unsigned int chunksize;
+   Tcl_WideInt regnum, bytecount, remaining, total;
+   unsigned char *values[2];
+   unsigned char tbuffer[24];
+   unsigned char flags;
+   bool last = false;
+   Tcl_Channel chan;
+   Tcl_DString blocking;
+   char *errmsg = NULL;
 
-   // Purge write buffer
-   ftStatus = ftdi_usb_purge_tx_buffer(ftContext);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while purging SPI TX.\n", NULL);
+   ftdi_record *ftRecord;
+   struct ftdi_context * ftContext;
+   struct ftdi_transfer_control *tc = NULL;
+   int ftStatus, tmo;
+   ftdi_deadline dl;
+
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
+   result = spi_chan_setup(interp, objc, objv, "spi_write_chan",
+		TCL_READABLE, &ftRecord, &regnum, &bytecount, &chan);
+   if (result != TCL_OK) return result;
+   ftContext = ftRecord->ftContext;
+   flags = ftRecord->flags;
+   deadline_start(&dl, ftRecord, tmo);
+
+   // Each buffer holds a 3-byte opcode header, the data, and the
+   // trailing CS de-assert (up to 9 bytes).
+   values[0] = (unsigned char *)malloc((MPSSE_MAX_CHUNK + 12) * sizeof(unsigned char));
+   values[1] = (unsigned char *)malloc((MPSSE_MAX_CHUNK + 12) * sizeof(unsigned char));
+
+   // Submit each chunk as a single USB request so that it proceeds
+   // entirely in the background while the channel is being read.
+   BACKEND(ftRecord)->get_write_chunksize(ftContext, &chunksize);
+   BACKEND(ftRecord)->set_write_chunksize(ftContext,
+		TUNED_CHUNK(ftRecord->channel->tn_wrchunk, MPSSE_MAX_CHUNK + 12));
+
+   // Assert CS and send the command word
+
+   ntb = spi_command_prefix(ftRecord, regnum,
+		(flags & MIXED_MODE) ? 0x10 : 0x40, tbuffer);
 
    if (verbose > 1) {
-      Fprintf(interp, stderr, "bitbang_read: Writing: ");
-      for (i = 0; i < nbytes; i++) {
+      int i;
+      Fprintf(interp, stderr, "spi_write_chan: Writing: ");
+      for (i = 0; i < ntb; i++) {
          Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
       }
       Fprintf(interp, stderr, "\n");
    }
 
-   // SPI write using bit bang
-   ftStatus = ftdi_write_data(ftContext, tbuffer, nbytes);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while writing SPI.\n", NULL);
-   else if (ftStatus != nbytes)
-      Tcl_SetResult(interp, "SPI write:  short write error.\n", NULL);
-
-   // SPI read using bit bang
-   ftStatus = ftdi_read_data(ftContext, tbuffer, nbytes);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while reading SPI.\n", NULL);
-   else if (ftStatus != nbytes)
-      Tcl_SetResult(interp, "SPI read:  short read error.\n", NULL);
-
-   vector = Tcl_NewListObj(0, NULL);
-
-   tidx = 3 + 2 * cmdwidth;	// No readback during reg/command write
-   for (i = 0; i < wordcount; i++) {
-      value = 0;
-      for (j = wordwidth - 1; j >= 0; j--) {
-	 if (tidx >= nbytes) {
-	    value = -1;
+   ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, ntb);
+   if (ftStatus != ntb)
+      errmsg = "spi_write_chan:  Error while preparing SPI write command.\n";
+
+   // A non-blocking channel would return whatever has arrived, so
+   // read in blocking mode and restore the mode afterwards.
+   Tcl_DStringInit(&blocking);
+   Tcl_GetChannelOption(NULL, chan, "-blocking", &blocking);
+   Tcl_SetChannelOption(NULL, chan, "-blocking", "1");
+
+   total = 0;
+   cur = 0;
+   remaining = bytecount;
+   while ((errmsg == NULL) && (remaining > 0) && !Tcl_Eof(chan)) {
+      want = (remaining > MPSSE_MAX_CHUNK) ? MPSSE_MAX_CHUNK : (int)remaining;
+      n = Tcl_Read(chan, (char *)values[cur] + 3, want);
+      if (n < 0) {
+	 errmsg = "spi_write_chan:  Error reading from channel.\n";
+	 break;
+      }
+      else if (n == 0) continue;	// End of file
+
+      remaining -= n;
+      last = ((remaining == 0) || Tcl_Eof(chan)) ? true : false;
+
+      values[cur][0] = ftRecord->op_write;	// Simple write command
+      values[cur][1] = (unsigned char)((n - 1) & 0xff);
+      values[cur][2] = (unsigned char)(((n - 1) >> 8) & 0xff);
+      len = n + 3;
+      if (last)
+	 len += spi_cs(ftRecord, false, values[cur] + len);	// De-assert CS
+
+      // Wait for the previous chunk before queueing this one
+      if (tc != NULL) {
+	 ftStatus = transfer_wait(tc, &dl);
+	 tc = NULL;
+	 if (dl.timedout) break;
+	 if (ftStatus < 0) {
+	    errmsg = "spi_write_chan:  Received error in SPI write.\n";
 	    break;
 	 }
-	 if (tbuffer[tidx] & sigpins[BB_SDO]) {
-	    value |= (1 << j);
-	 }
-	 tidx += 2;
       }
-      Tcl_ListObjAppendElement(interp, vector, Tcl_NewIntObj(value));
+
+      tc = BACKEND(ftRecord)->write_submit(ftContext, values[cur], len);
+      if (tc == NULL) {
+	 errmsg = "spi_write_chan:  Received error in SPI write.\n";
+	 break;
+      }
+      total += n;
+      pn = n;
+      cur ^= 1;
+      if (last) break;
+   }
+
+   if ((tc != NULL) && !dl.timedout) {
+      ftStatus = transfer_wait(tc, &dl);
+      if ((ftStatus < 0) && (errmsg == NULL))
+	 errmsg = "spi_write_chan:  Received error in SPI write.\n";
    }
 
-   // Should be nothing left in the read buffer, but just in case. . . 
-   unsigned int x = ftContext->readbuffer_remaining;
-   if (x != 0) {
-       unsigned char *xbuffer;
+   // At a timeout, count only the data of the chunk in flight that
+   // went out after its 3-byte opcode header.
 
-       Fprintf(interp, stderr, "%d words still remaining in buffer\n", x);
-       xbuffer = (unsigned char *)malloc(x * sizeof(unsigned char));
-       ftStatus = ftdi_read_data(ftContext, xbuffer, x);
+   if (dl.timedout) {
+      n = (ftStatus > 3) ? ftStatus - 3 : 0;
+      total -= pn - ((n < pn) ? n : pn);
+   }
 
-       // for (tidx = 0; tidx < x; tidx++) {
-       //    value = xbuffer[tidx];
-       //    Tcl_ListObjAppendElement(interp, vector, Tcl_NewIntObj(value));
-       // }
+   // If the data ran out before the final chunk was marked, raise
+   // CS separately.
 
-       free(xbuffer);
+   else if (!last) {
+      ntb = spi_cs(ftRecord, false, tbuffer);	// De-assert CS
+      ftStatus = BACKEND(ftRecord)->write(ftContext, tbuffer, ntb);
+      if ((ftStatus != ntb) && (errmsg == NULL))
+	 errmsg = "spi_write_chan:  SPI short write error.\n";
    }
 
-   Tcl_SetObjResult(interp, vector);
-   free(tbuffer);
+   Tcl_SetChannelOption(NULL, chan, "-blocking", Tcl_DStringValue(&blocking));
+   Tcl_DStringFree(&blocking);
+   BACKEND(ftRecord)->set_write_chunksize(ftContext, chunksize);
+   free(values[0]);
+   free(values[1]);
+
+   if (dl.timedout) {
+      // The purge drops the CS de-assert queued behind the transfer
+      result = deadline_error(interp, &dl, ftRecord, "spi_write_chan", total,
+		bytecount, NULL);
+      spi_cs_idle(ftRecord);
+      return result;
+   }
+   if (errmsg != NULL) {
+      Tcl_SetResult(interp, errmsg, NULL);
+      return TCL_ERROR;
+   }
+   Tcl_SetObjResult(interp, Tcl_NewWideIntObj(total));
    return TCL_OK;
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_csb_mode":  Change the behavior of	*/
-/* the SPI with respect to CSB.  This function takes one	*/
-/* integer argument in addition to the device name:		*/
+/* I2C master using the MPSSE					*/
 /*								*/
-/*	0: CSB is not de-asserted after each read and write	*/
-/*	1: CSB is de-asserted after each read and write		*/
+/* SCL is ADBUS0, SDA out is ADBUS1, and SDA in is ADBUS2;	*/
+/* ADBUS1 and ADBUS2 must be tied together on the board.  Data	*/
+/* are moved with three-phase clocking so that SDA is stable	*/
+/* on both SCL edges.  Open-drain behavior is emulated by	*/
+/* turning SDA into an input wherever the slave drives it (ACK	*/
+/* and read data);  on the FT232H, ADBUS0-1 are also set to	*/
+/* drive only zeros (opcode 0x9e).				*/
 /*								*/
-/* NOTE: Currently this is only defined for bit-bang mode.	*/
+/* A whole transaction (START, address, data, ACK bits,		*/
+/* repeated START, reads, STOP) is sent as one command stream	*/
+/* and the reply is decoded afterwards.  The reply holds one	*/
+/* byte per byte written (the ACK bit in bit 0, 0 = ACK)	*/
+/* followed by the bytes read, in stream order.			*/
 /*--------------------------------------------------------------*/
 
-int
-ftditcl_spi_csb_mode(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-   ftdi_record *ftRecord;
-   struct ftdi_context * ftContext;
-   int ftStatus;
+#define I2C_SCL		0x01	// ADBUS0
+#define I2C_SDA		0x02	// ADBUS1 (SDA out)
+#define I2C_SDA_IN	0x04	// ADBUS2 (SDA in)
+#define I2C_HOLD	4	// Repeats of each START/STOP state
 
-   long numWritten;
+/* Fill "buffer" with "count" copies of the ADBUS opcode for the	*/
+/* given SCL/SDA levels, with SDA an output if "sdaout" is true.	*/
+/* Other ADBUS pins keep their shadow values.				*/
 
-   int result;
-   unsigned char *tbuffer;
-   unsigned char flags;
-   unsigned char *sigpins;
-   int mode;
+static int
+i2c_pins(ftdi_record *chan, unsigned char levels, bool sdaout, int count,
+	unsigned char *buffer)
+{
+   int i, n = 0;
 
-   if (objc != 3) {
-      Tcl_SetResult(interp, "spi_csb_mode: Need device name and 0 or 1.\n", NULL);
-      return TCL_ERROR;
-   }
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "spi_speed:  No such device\n", NULL);
-      return TCL_ERROR;
+   for (i = 0; i < count; i++) {
+      buffer[n++] = 0x80;	// Set Dbus
+      buffer[n++] = (unsigned char)((chan->gpio_out & 0xf8) | levels);
+      buffer[n++] = (unsigned char)((chan->gpio_dir & 0xf8) | I2C_SCL |
+		((sdaout) ? I2C_SDA : 0));
    }
-   else flags = ftRecord->flags;
-   sigpins = &(ftRecord->sigpins[0]);
+   return n;
+}
 
-   result = Tcl_GetIntFromObj(interp, objv[2], &mode);
-   if (result != TCL_OK) return result;
+/* START (or repeated START):  SDA falls while SCL is high */
 
-   switch (mode) {
-      case 0:
-	 ftRecord->flags &= ~CSB_NORAISE;
+static int
+i2c_start(ftdi_record *chan, unsigned char *buffer)
+{
+   int n = 0;
 
-	 // In addition to setting flags, raise CSB immediately.
-	 // So "spi_csb_mode 0" can be used to control when CSB
-	 // is deasserted.
+   n += i2c_pins(chan, I2C_SCL | I2C_SDA, true, I2C_HOLD, buffer + n);
+   n += i2c_pins(chan, I2C_SCL, true, I2C_HOLD, buffer + n);
+   n += i2c_pins(chan, 0, true, I2C_HOLD, buffer + n);
+   return n;
+}
 
-         tbuffer = (unsigned char *)malloc(sizeof(unsigned char));
-         tbuffer[0] = (unsigned char)sigpins[BB_CSB];
+/* STOP:  SDA rises while SCL is high */
 
-         if (verbose > 1) {
-	    int i;
-            Fprintf(interp, stderr, "spi_csb_mode: Writing: ");
-            for (i = 0; i < 1; i++) {
-               Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-            }
-            Fprintf(interp, stderr, "\n");
-         }
+static int
+i2c_stop(ftdi_record *chan, unsigned char *buffer)
+{
+   int n = 0;
 
-         ftStatus = ftdi_write_data(ftContext, tbuffer, 1);
-         if (ftStatus < 0)
-            Tcl_SetResult(interp, "Received error while writing SPI.\n", NULL);
-         else if (ftStatus != 1)
-            Tcl_SetResult(interp, "bitbang write:  short write error.\n", NULL);
+   n += i2c_pins(chan, 0, true, I2C_HOLD, buffer + n);
+   n += i2c_pins(chan, I2C_SCL, true, I2C_HOLD, buffer + n);
+   n += i2c_pins(chan, I2C_SCL | I2C_SDA, true, I2C_HOLD, buffer + n);
+   return n;
+}
 
-         free(tbuffer);
-	 break;
+/* Write one byte and clock in the slave's ACK bit (1 reply byte) */
 
-      case 1:
-	 ftRecord->flags |= CSB_NORAISE;
-	 break;
+static int
+i2c_write_byte(ftdi_record *chan, unsigned char value, unsigned char *buffer)
+{
+   int n = 0;
+
+   buffer[n++] = 0x11;		// Write bytes, -ve edge, MSB first
+   buffer[n++] = 0x00;		// Length = 1
+   buffer[n++] = 0x00;
+   buffer[n++] = value;
+   n += i2c_pins(chan, 0, false, 1, buffer + n);	// Release SDA
+   buffer[n++] = 0x22;		// Read bits, +ve edge, MSB first
+   buffer[n++] = 0x00;		// Length = 1 bit
+   n += i2c_pins(chan, I2C_SDA, true, 1, buffer + n);
+   return n;
+}
+
+/* Clock in one byte (1 reply byte) and send ACK, or NACK if "last" */
+
+static int
+i2c_read_byte(ftdi_record *chan, bool last, unsigned char *buffer)
+{
+   int n = 0;
+
+   n += i2c_pins(chan, 0, false, 1, buffer + n);	// Release SDA
+   buffer[n++] = 0x20;		// Read bytes, +ve edge, MSB first
+   buffer[n++] = 0x00;		// Length = 1
+   buffer[n++] = 0x00;
+   n += i2c_pins(chan, 0, true, 1, buffer + n);
+   buffer[n++] = 0x13;		// Write bits, -ve edge, MSB first
+   buffer[n++] = 0x00;		// Length = 1 bit
+   buffer[n++] = (last) ? 0xff : 0x00;	// NACK or ACK
+   n += i2c_pins(chan, I2C_SDA, true, 1, buffer + n);
+   return n;
+}
+
+/*--------------------------------------------------------------*/
+/* Support function "i2c_setup"					*/
+/*								*/
+/* Switch the channel to three-phase clocking at "khz" (if	*/
+/* nonzero, or if three-phase clocking is not yet on, in which	*/
+/* case 100kHz is used).  Fills "buffer" and returns the	*/
+/* number of bytes, or -1 if the chip cannot do it.  The new	*/
+/* SCK rate is put in "actual" (0 if unchanged);  the caller	*/
+/* records it in the channel once the transaction succeeds.	*/
+/*--------------------------------------------------------------*/
+
+static int
+i2c_setup(ftdi_record *chan, double khz, unsigned char *buffer,
+	double *actual)
+{
+   int n = 0;
+
+   *actual = 0.0;
+   if ((khz == 0.0) && (chan->clkflags & CLK_3PHASE)) return 0;
+   if (khz == 0.0) khz = 100.0;
+
+   *actual = mpsse_clock_plan(chan->ftContext, khz * 1.0E3, CLK_3PHASE,
+		buffer, &n);
+   if (*actual == 0.0) return -1;
+
+   if (chan->ftContext->type == TYPE_232H) {
+      buffer[n++] = 0x9e;	// Drive only zero on
+      buffer[n++] = I2C_SCL | I2C_SDA;	// ADBUS0-1
+      buffer[n++] = 0x00;	// (no ACBUS pins)
    }
-   return TCL_OK;
+   return n;
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_speed":  Set the SPI clock speed of	*/
-/* the FTDI MPSSE SPI protocol.					*/
+/* Tcl function "ftdi::i2c"					*/
+/*								*/
+/* Use: i2c <device> <address> [-speed <kHz>]			*/
+/*		[-write <byte_list>] [-read <num_bytes>]	*/
+/*								*/
+/* Run one I2C transaction with the 7-bit slave <address>:	*/
+/* write <byte_list>, then (after a repeated START if there	*/
+/* was a write) read <num_bytes> bytes, then STOP.  Returns	*/
+/* the list of bytes read.  It is an error if the slave does	*/
+/* not acknowledge its address or a written byte.  With	*/
+/* neither -write nor -read, only the address is sent, and the	*/
+/* result is 1 if the slave acknowledged and 0 if not.		*/
+/* "-speed" sets the SCL rate (default 100kHz);  the channel	*/
+/* is left in three-phase clocking mode.			*/
 /*--------------------------------------------------------------*/
 
 int
-ftditcl_spi_speed(ClientData clientData,
+ftditcl_i2c(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-   ftdi_record *ftRecord;
+   int result, i, n, value, address, nwrite, nread, nreply;
+   int clen, ack, probe;
+   double khz = 0.0, actual;
+   unsigned char *cbuffer, *rbuffer;
+   char *swstr, msg[80];
+   Tcl_Obj *wvector = NULL, *lobj, *vector;
+
+   ftdi_record *ftRecord, *chan;
    struct ftdi_context * ftContext;
-   int ftStatus;
-
-   long numWritten;
-
-   int result;
-   unsigned char *values;
-   unsigned char tbuffer[6];
-   unsigned char flags;
-   double mhz;
-   int ival;
+   struct ftdi_transfer_control *wtc, *rtc;
+   int ftStatus, wStatus, tmo = -1;
+   ftdi_deadline dl;
 
-   if (objc != 3) {
-      Tcl_SetResult(interp, "spi_speed: Need device name and value (in MHz).\n", NULL);
+   if (objc < 3) {
+      Tcl_SetResult(interp, "i2c: Need device name and slave address.\n",
+		NULL);
       return TCL_ERROR;
    }
    ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "spi_speed:  No such device\n", NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "i2c:  No such device\n", NULL);
       return TCL_ERROR;
    }
-   else flags = ftRecord->flags;
+   if (channel_held(interp, ftRecord, "i2c")) return TCL_ERROR;
+   if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_SetResult(interp, "i2c:  Device must be in MPSSE mode.\n", NULL);
+      return TCL_ERROR;
+   }
+   chan = ftRecord->channel;
 
-   result = Tcl_GetDoubleFromObj(interp, objv[2], &mhz);
+   result = Tcl_GetIntFromObj(interp, objv[2], &address);
    if (result != TCL_OK) return result;
+   if (address < 0 || address > 127) {
+      Tcl_SetResult(interp, "i2c:  Address must be 0 to 127.\n", NULL);
+      return TCL_ERROR;
+   }
 
-   if (flags & BITBANG_MODE) {
-      ftStatus = ftdi_set_baudrate(ftContext, (long)125000);
-      if (ftStatus < 0) {
-	 Tcl_SetResult(interp, "Received error while setting baud rate.\n", NULL);
+   nwrite = nread = 0;
+   for (i = 3; i < objc; i += 2) {
+      swstr = Tcl_GetString(objv[i]);
+      if (i + 1 >= objc) {
+	 Tcl_SetResult(interp, "i2c:  Option needs a value.\n", NULL);
 	 return TCL_ERROR;
       }
-
-      // Bitbang rate calculation:  bitbang update rate is the baud rate
-      // * 16, but SCK takes two transmissions (up, down), so SCK rate is
-      // the baud rate * 8.
-
-      ftStatus = ftdi_set_baudrate(ftContext, (long)((mhz / 8.0) * 1.0E6));
-      if (ftStatus < 0) {
-         Tcl_SetResult(interp, "Received error while setting baud rate.\n", NULL);
+      if (!strcmp(swstr, "-write")) {
+	 wvector = objv[i + 1];
+	 result = Tcl_ListObjLength(interp, wvector, &nwrite);
+	 if (result != TCL_OK) return result;
+      }
+      else if (!strcmp(swstr, "-read")) {
+	 result = Tcl_GetIntFromObj(interp, objv[i + 1], &nread);
+	 if (result != TCL_OK) return result;
+	 if (nread < 0 || nread > MPSSE_MAX_CHUNK) {
+	    Tcl_SetResult(interp, "i2c:  Read count must be 0 to 65536.\n",
+			NULL);
+	    return TCL_ERROR;
+	 }
+      }
+      else if (!strcmp(swstr, "-speed")) {
+	 result = Tcl_GetDoubleFromObj(interp, objv[i + 1], &khz);
+	 if (result != TCL_OK) return result;
+	 if (khz <= 0.0) {
+	    Tcl_SetResult(interp, "i2c:  Speed must be positive.\n", NULL);
+	    return TCL_ERROR;
+	 }
+      }
+      else if (!strcmp(swstr, "-timeout")) {
+	 result = Tcl_GetIntFromObj(interp, objv[i + 1], &tmo);
+	 if (result != TCL_OK) return result;
+	 if (tmo < 0) {
+	    Tcl_SetResult(interp, "i2c:  Timeout cannot be negative.\n", NULL);
+	    return TCL_ERROR;
+	 }
+      }
+      else {
+	 Tcl_SetResult(interp, "i2c:  Unknown option.  Must be -write, "
+		"-read, -speed, or -timeout.\n", NULL);
 	 return TCL_ERROR;
       }
-      return TCL_OK;
    }
+   if (nwrite > MPSSE_MAX_CHUNK) {
+      Tcl_SetResult(interp, "i2c:  Too many bytes to write.\n", NULL);
+      return TCL_ERROR;
+   }
+   probe = (wvector == NULL && nread == 0) ? 1 : 0;
+
+   if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
 
-   /* Convert double into two bytes in tbuffer */
+   // Build the whole transaction.  Sizes:  Clock setup is up to 9
+   // bytes, START or STOP 36, each byte written 12, each byte read 15,
+   // and the closing echo 2.
 
-   ival = (int)((30.0 / mhz) - 1.0);
+   cbuffer = (unsigned char *)malloc((9 + 3 * 36 + 12 * (nwrite + 2)
+		+ 15 * nread + 3) * sizeof(unsigned char));
+   clen = i2c_setup(chan, khz, cbuffer, &actual);
+   if (clen < 0) {
+      free(cbuffer);
+      Tcl_SetResult(interp, "i2c:  I2C needs three-phase clocking "
+		"(FT2232H, FT4232H, or FT232H).\n", NULL);
+      return TCL_ERROR;
+   }
 
-   tbuffer[0] = 0x8a;        // Enable high-speed clock (x5, up to 30MHz)
-   tbuffer[1] = 0x86;        // Set clock divider
-   tbuffer[2] = ival & 0xff;
-   tbuffer[3] = (ival >> 8) & 0xff;
+   nreply = 0;
+   if (wvector != NULL || probe) {
+      clen += i2c_start(chan, cbuffer + clen);
+      clen += i2c_write_byte(chan, (unsigned char)(address << 1), cbuffer + clen);
+      nreply++;
+      for (i = 0; i < nwrite; i++) {
+	 result = Tcl_ListObjIndex(interp, wvector, i, &lobj);
+	 if (result == TCL_OK)
+	    result = Tcl_GetIntFromObj(interp, lobj, &value);
+	 if (result != TCL_OK || value < 0 || value > 255) {
+	    free(cbuffer);
+	    if (result == TCL_OK)
+	       Tcl_SetResult(interp, "i2c:  Byte value out of range 0-255\n",
+			NULL);
+	    return TCL_ERROR;
+	 }
+	 clen += i2c_write_byte(chan, (unsigned char)value, cbuffer + clen);
+	 nreply++;
+      }
+   }
+   if (nread > 0) {
+      clen += i2c_start(chan, cbuffer + clen);
+      clen += i2c_write_byte(chan, (unsigned char)((address << 1) | 1),
+		cbuffer + clen);
+      nreply++;
+      for (i = 0; i < nread; i++)
+	 clen += i2c_read_byte(chan, (i == nread - 1), cbuffer + clen);
+      nreply += nread;
+   }
+   clen += i2c_stop(chan, cbuffer + clen);
+   cbuffer[clen++] = MPSSE_ECHO;
+   cbuffer[clen++] = 0x87;	// Send immediate
 
    if (verbose > 1) {
-      int i;
-      Fprintf(interp, stderr, "spi_speed: Writing: ");
-      for (i = 0; i < 4; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
+      Fprintf(interp, stderr, "i2c: Writing: ");
+      for (i = 0; i < clen; i++) {
+         Fprintf(interp, stderr, "0x%02x ", cbuffer[i]);
       }
       Fprintf(interp, stderr, "\n");
    }
 
-   ftStatus = ftdi_write_data(ftContext, tbuffer, 4);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while setting SPI"
-		" clock speed.\n", NULL);
-   else if (ftStatus != 4)
-      Tcl_SetResult(interp, "SPI read:  short write error.\n", NULL);
+   // One submission for the whole transaction
+
+   rbuffer = (unsigned char *)malloc((nreply + 2) * sizeof(unsigned char));
+   deadline_start(&dl, ftRecord, tmo);
+   wtc = BACKEND(ftRecord)->write_submit(ftContext, cbuffer, clen);
+   rtc = (wtc == NULL) ? NULL : BACKEND(ftRecord)->read_submit(ftContext, rbuffer,
+		nreply + 2);
+   ftStatus = transfer_wait(rtc, &dl);
+   wStatus = transfer_wait(wtc, &dl);
+   free(cbuffer);
+
+   if (dl.timedout) {
+      free(rbuffer);
+      return deadline_error(interp, &dl, ftRecord, "i2c", ftStatus,
+		nreply + 2, NULL);
+   }
+
+   if ((wStatus != clen) || !MPSSE_IN_STEP(rbuffer, ftStatus, nreply + 2)) {
+      free(rbuffer);
+      return mpsse_desync(interp, ftRecord, "i2c", (wStatus < 0) ||
+		(ftStatus < 0), ftStatus, nreply + 2);
+   }
+
+   // The bus is idle after STOP:  SCL and SDA driven high, SDA in
+   // (ADBUS2) an input.
+   if (actual != 0.0) {
+      chan->sckrate = actual;
+      chan->clkflags = CLK_3PHASE;
+   }
+   chan->gpio_out |= I2C_SCL | I2C_SDA;
+   chan->gpio_dir = (chan->gpio_dir & ~I2C_SDA_IN) | I2C_SCL | I2C_SDA;
+
+   // Decode the ACK bits and data
+
+   n = 0;
+   ack = !(rbuffer[n++] & 0x01);
+   if (probe) {
+      free(rbuffer);
+      Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ack));
+      return TCL_OK;
+   }
+   for (i = 0; ack && (wvector != NULL) && (i < nwrite); i++) {
+      if (rbuffer[n++] & 0x01) {
+	 sprintf(msg, "i2c:  Byte %d not acknowledged by slave 0x%02x.\n",
+		i, address);
+	 Tcl_SetResult(interp, msg, TCL_VOLATILE);
+	 free(rbuffer);
+	 return TCL_ERROR;
+      }
+   }
+   if (ack && (wvector != NULL) && (nread > 0))
+      ack = !(rbuffer[n++] & 0x01);
+   if (!ack) {
+      sprintf(msg, "i2c:  No acknowledge from slave 0x%02x.\n", address);
+      Tcl_SetResult(interp, msg, TCL_VOLATILE);
+      free(rbuffer);
+      return TCL_ERROR;
+   }
 
+   vector = Tcl_NewListObj(0, NULL);
+   for (i = 0; i < nread; i++)
+      Tcl_ListObjAppendElement(interp, vector, Tcl_NewIntObj((int)rbuffer[n++]));
+   Tcl_SetObjResult(interp, vector);
+   free(rbuffer);
    return TCL_OK;
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_read":				*/
+/* JTAG support (MPSSE)						*/
+/*								*/
+/* TCK, TDI, TDO, and TMS are ADBUS0 to ADBUS3 (the SPI SCK,	*/
+/* SDO, SDI, and CS pins).  TMS is clocked with opcode 0x4b,	*/
+/* or 0x6b for the last bit of a scan, which is read on the	*/
+/* way out of the shift state.  Data is clocked with opcodes	*/
+/* 0x39 (bytes) and 0x3b (bits), out on the falling edge of	*/
+/* TCK and in on the rising edge, least significant bit first.	*/
+/*								*/
+/* The TAP state of the channel is tracked so that each move	*/
+/* clocks only the shortest TMS sequence (tap_path below).	*/
 /*--------------------------------------------------------------*/
 
-int
-ftditcl_spi_read(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
-{
-   int result;
-   int bytecount, i, j;
-   int cmdcount;
-   Tcl_WideInt regnum;
-   unsigned char *values;
-   unsigned char tbuffer[13];
-   unsigned char flags;
-   Tcl_Obj *vector;
+#define JTAG_TCK	0x01	// ADBUS0
+#define JTAG_TDI	0x02	// ADBUS1
+#define JTAG_TDO	0x04	// ADBUS2
+#define JTAG_TMS	0x08	// ADBUS3
 
-   long numWritten;
-   long numRead;
-   ftdi_record *ftRecord;
-   struct ftdi_context * ftContext;
-   int ftStatus;
 
-   if (objc != 4) {
-      Tcl_SetResult(interp, "spi_read: Need device name, command, "
-		"and byte count.\n", NULL);
-      return TCL_ERROR;
-   }
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "spi_read:  No such device\n", NULL);
-      return TCL_ERROR;
+enum {
+   TAP_RESET, TAP_IDLE, TAP_DRSELECT, TAP_DRCAPTURE, TAP_DRSHIFT,
+   TAP_DREXIT1, TAP_DRPAUSE, TAP_DREXIT2, TAP_DRUPDATE, TAP_IRSELECT,
+   TAP_IRCAPTURE, TAP_IRSHIFT, TAP_IREXIT1, TAP_IRPAUSE, TAP_IREXIT2,
+   TAP_IRUPDATE
+};
+
+/* State names as used by SVF */
+
+static const char *tap_state_names[] = {
+   "RESET", "IDLE", "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1",
+   "DRPAUSE", "DREXIT2", "DRUPDATE", "IRSELECT", "IRCAPTURE", "IRSHIFT",
+   "IREXIT1", "IRPAUSE", "IREXIT2", "IRUPDATE", NULL
+};
+
+/* Shortest TMS sequence from each TAP state (row) to each	*/
+/* state (column), as {TMS bits, first bit in bit 0; count}.	*/
+/* Found by a breadth-first search of the TAP state graph.	*/
+
+static const unsigned char tap_path[16][16][2] = {
+   /* RESET */
+   {{0x00, 0}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x02, 4}, {0x0a, 4}, {0x0a, 5}, {0x2a, 6},
+    {0x1a, 5}, {0x06, 3}, {0x06, 4}, {0x06, 5}, {0x16, 5}, {0x16, 6}, {0x56, 7}, {0x36, 6}},
+   /* IDLE */
+   {{0x07, 3}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5},
+    {0x0d, 4}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5}},
+   /* DRSELECT */
+   {{0x03, 2}, {0x03, 3}, {0x00, 0}, {0x00, 1}, {0x00, 2}, {0x02, 2}, {0x02, 3}, {0x0a, 4},
+    {0x06, 3}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5}, {0x0d, 4}},
+   /* DRCAPTURE */
+   {{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x00, 0}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x05, 3},
+    {0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7}},
+   /* DRSHIFT */
+   {{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x05, 3},
+    {0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7}},
+   /* DREXIT1 */
+   {{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x02, 3}, {0x00, 0}, {0x00, 1}, {0x02, 2},
+    {0x01, 1}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}},
+   /* DRPAUSE */
+   {{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x01, 2}, {0x05, 3}, {0x00, 0}, {0x01, 1},
+    {0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7}},
+   /* DREXIT2 */
+   {{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x00, 0},
+    {0x01, 1}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6}},
+   /* DRUPDATE */
+   {{0x07, 3}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5},
+    {0x00, 0}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5}},
+   /* IRSELECT */
+   {{0x01, 1}, {0x01, 2}, {0x05, 3}, {0x05, 4}, {0x05, 5}, {0x15, 5}, {0x15, 6}, {0x55, 7},
+    {0x35, 6}, {0x00, 0}, {0x00, 1}, {0x00, 2}, {0x02, 2}, {0x02, 3}, {0x0a, 4}, {0x06, 3}},
+   /* IRCAPTURE */
+   {{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7},
+    {0x37, 6}, {0x0f, 4}, {0x00, 0}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2}},
+   /* IRSHIFT */
+   {{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7},
+    {0x37, 6}, {0x0f, 4}, {0x0f, 5}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2}},
+   /* IREXIT1 */
+   {{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6},
+    {0x1b, 5}, {0x07, 3}, {0x07, 4}, {0x02, 3}, {0x00, 0}, {0x00, 1}, {0x02, 2}, {0x01, 1}},
+   /* IRPAUSE */
+   {{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7},
+    {0x37, 6}, {0x0f, 4}, {0x0f, 5}, {0x01, 2}, {0x05, 3}, {0x00, 0}, {0x01, 1}, {0x03, 2}},
+   /* IREXIT2 */
+   {{0x0f, 4}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6},
+    {0x1b, 5}, {0x07, 3}, {0x07, 4}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x00, 0}, {0x01, 1}},
+   /* IRUPDATE */
+   {{0x07, 3}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5},
+    {0x0d, 4}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x00, 0}}
+};
+
+/* A batch of JTAG operations compiled into one MPSSE command	*/
+/* stream, which is sent in a single transfer.			*/
+
+typedef struct {
+   unsigned char *cmd;		// MPSSE command stream
+   int clen;			// Number of bytes in cmd
+   int csize;			// Allocated size of cmd
+   long nreply;			// Number of reply bytes expected
+   unsigned char state;		// TAP state at the end of cmd
+   unsigned char tms;		// TMS level at the end of cmd
+} jtag_batch;
+
+/* Make room for "n" more command bytes and return where they go */
+
+static unsigned char *
+jtag_reserve(jtag_batch *jb, int n)
+{
+   if (jb->clen + n > jb->csize) {
+      while (jb->clen + n > jb->csize) jb->csize *= 2;
+      jb->cmd = (unsigned char *)realloc(jb->cmd, jb->csize);
    }
-   else flags = ftRecord->flags;
+   return jb->cmd + jb->clen;
+}
 
-   if (flags & BITBANG_MODE) {
-      result = ftditcl_bang_read(clientData, interp, objc, objv);
-      return result;
+/* Clock "count" TMS bits (first bit in bit 0), 7 per opcode */
+
+static void
+jtag_tms(jtag_batch *jb, unsigned int bits, int count)
+{
+   unsigned char *p;
+   int k;
+
+   while (count > 0) {
+      k = (count > 7) ? 7 : count;
+      p = jtag_reserve(jb, 3);
+      p[0] = 0x4b;		// Clock TMS, -ve edge, LSB first
+      p[1] = (unsigned char)(k - 1);
+      p[2] = (unsigned char)(bits & ((1 << k) - 1));	// TDI (bit 7) low
+      jb->clen += 3;
+      jb->tms = (bits >> (k - 1)) & 1;
+      bits >>= k;
+      count -= k;
    }
+}
 
-   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
-   if (result != TCL_OK) return result;
-   result = Tcl_GetIntFromObj(interp, objv[3], &bytecount);
-   if (result != TCL_OK) return result;
-   values = (unsigned char *)malloc(bytecount * sizeof(unsigned char));
+/* Move the TAP to "state" by the shortest path */
 
-   // Write values to MPSSE to generate the SPI read command
+static void
+jtag_goto(jtag_batch *jb, int state)
+{
+   jtag_tms(jb, tap_path[jb->state][state][0], tap_path[jb->state][state][1]);
+   jb->state = state;
+}
 
-   tbuffer[0] = 0x80;        // Set Dbus
-   tbuffer[1] = (flags & CS_INVERT) ? 0x08 : 0x00; // Assert CS
-   tbuffer[2] = 0x0b;     // SCK, SDI, and CS are outputs
-   tbuffer[3] = 0x11;     // Simple write command
-   cmdcount = ftRecord->cmdwidth >> 3;
-   if (flags & LEGACY_MODE)
-      tbuffer[4] = 0x00;     // Length = 1;
-   else
-      tbuffer[4] = (unsigned char)(cmdcount - 1);
-   tbuffer[5] = 0x00;     // (High byte is zero)
-   // Command to send is "read register" + register no.
-   if (flags & LEGACY_MODE)
-      tbuffer[6] = ((flags & MIXED_MODE) ? 0x20 : 0x80) + (unsigned char)regnum;
-   else {
-      for (i = 0; i < cmdcount; i++) {
-	 j = cmdcount - i - 1;
-	 tbuffer[6 + i] = (unsigned char)((regnum >> (j << 3)) & 0xff);
-      }
+/* Five TMS high clocks reach Test-Logic-Reset from any state */
+
+static void
+jtag_reset(jtag_batch *jb)
+{
+   jtag_tms(jb, 0x1f, 5);
+   jb->state = TAP_RESET;
+}
+
+/* Clock "cycles" TCK cycles in Run-Test/Idle.  The H-series	*/
+/* chips can clock without data (0x8e, 0x8f);  the FT2232D	*/
+/* clocks TMS low instead.					*/
+
+static void
+jtag_idle(jtag_batch *jb, int cycles, bool hseries)
+{
+   unsigned char *p;
+   int k;
+
+   jtag_goto(jb, TAP_IDLE);
+   if (!hseries) {
+      jtag_tms(jb, 0, cycles);
+      return;
+   }
+   while (cycles >= 8) {
+      k = cycles >> 3;
+      if (k > MPSSE_MAX_CHUNK) k = MPSSE_MAX_CHUNK;
+      p = jtag_reserve(jb, 3);
+      p[0] = 0x8f;		// Clock k * 8 bits with no data
+      p[1] = (unsigned char)((k - 1) & 0xff);
+      p[2] = (unsigned char)(((k - 1) >> 8) & 0xff);
+      jb->clen += 3;
+      cycles -= k << 3;
    }
+   if (cycles > 0) {
+      p = jtag_reserve(jb, 2);
+      p[0] = 0x8e;		// Clock 1 to 7 bits with no data
+      p[1] = (unsigned char)(cycles - 1);
+      jb->clen += 2;
+   }
+}
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_read: Writing: ");
-      for (i = 0; i < 6 + cmdcount; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-      }
-      Fprintf(interp, stderr, "\n");
+/* Shift the "nbits" vector "tdi" (first bit in bit 0 of byte	*/
+/* 0) through the register selected by "shift" (TAP_DRSHIFT	*/
+/* or TAP_IRSHIFT) and end in "endstate".  TDO is captured:	*/
+/* all but the last bit by 0x39 and 0x3b, and the last bit by	*/
+/* 0x6b, which raises TMS to leave the shift state with it.	*/
+
+static void
+jtag_shift(jtag_batch *jb, int shift, unsigned char *tdi, long nbits,
+	int endstate)
+{
+   unsigned char *p;
+   long n, nbytes, off, k;
+   int rem;
+
+   n = nbits - 1;
+   nbytes = n >> 3;
+   rem = (int)(n & 7);
+
+   jtag_goto(jb, shift);
+   for (off = 0; off < nbytes; off += k) {
+      k = nbytes - off;
+      if (k > MPSSE_MAX_CHUNK) k = MPSSE_MAX_CHUNK;
+      p = jtag_reserve(jb, (int)k + 3);
+      p[0] = 0x39;		// Read/write bytes, LSB first
+      p[1] = (unsigned char)((k - 1) & 0xff);
+      p[2] = (unsigned char)(((k - 1) >> 8) & 0xff);
+      memcpy(p + 3, tdi + off, k);
+      jb->clen += (int)k + 3;
+   }
+   if (rem > 0) {
+      p = jtag_reserve(jb, 3);
+      p[0] = 0x3b;		// Read/write bits, LSB first
+      p[1] = (unsigned char)(rem - 1);
+      p[2] = tdi[nbytes];
+      jb->clen += 3;
    }
+   p = jtag_reserve(jb, 3);
+   p[0] = 0x6b;			// Clock TMS with read, LSB first
+   p[1] = 0x00;			// Length = 1 bit
+   p[2] = (unsigned char)((((tdi[n >> 3] >> (n & 7)) & 1) << 7) | 0x01);
+   jb->clen += 3;
+
+   jb->nreply += nbytes + ((rem > 0) ? 1 : 0) + 1;
+   jb->tms = 1;
+   jb->state = shift + 1;	// DREXIT1 or IREXIT1
+   jtag_goto(jb, endstate);
+}
 
-   ftStatus = ftdi_write_data(ftContext, tbuffer, 6 + cmdcount);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while preparing SPI"
-		" read command.\n", NULL);
-   else if (ftStatus != 7)
-      Tcl_SetResult(interp, "SPI read:  short write error.\n", NULL);
+/* Return bit "i" of an "nbits" scan from its reply bytes (see	*/
+/* jtag_shift()).  Bits clocked by 0x3b and 0x6b arrive at the	*/
+/* top of their byte.						*/
 
-   /* This hack applies only to the DPLL demo board---SPI registers	*/
-   /* require time to access!  Write the first 10 bytes, pause, then	*/
-   /* do the rest.							*/
+static int
+jtag_tdo_bit(unsigned char *reply, long nbits, long i)
+{
+   long n = nbits - 1, nbytes = n >> 3;
+   int rem = (int)(n & 7);
 
-   if ((flags & LEGACY_MODE) && (regnum < 16)) {
-      usleep(10);		// 10us delay for SPI transmission
-   }
+   if (i < (nbytes << 3))
+      return (reply[i >> 3] >> (i & 7)) & 1;
+   else if (i < n)
+      return (reply[nbytes] >> (8 - rem + (int)(i - (nbytes << 3)))) & 1;
+   else
+      return (reply[nbytes + ((rem > 0) ? 1 : 0)] >> 7) & 1;
+}
 
-   tbuffer[0] = (flags & MIXED_MODE) ? 0x24 : 0x20;     // Simple read command
-   // Number bytes to read (less one)
-   tbuffer[1] = (unsigned char)((bytecount - 1) & 0xff);
-   tbuffer[2] = (unsigned char)(((bytecount - 1) >> 8) & 0xff);
-   tbuffer[3] = 0x80;	// Set Dbus
-   tbuffer[4] = (flags & CS_INVERT) ? 0x00 : 0x08; // De-assert CS
-   tbuffer[5] = 0x0b;	// SCK, SDI, and CS are outputs
+/* Set "nbits" bits of vector "vec" from bit "bitoff" from a	*/
+/* Tcl value:  A byte array (first bit in bit 0 of byte 0,	*/
+/* zero-filled if short), or an integer of up to 64 bits.	*/
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_read: Writing: ");
-      for (i = 0; i < 6; i++) {
-         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-      }
-      Fprintf(interp, stderr, "\n");
+static int
+jtag_bits_from_obj(Tcl_Interp *interp, Tcl_Obj *obj, long nbits,
+	unsigned char *vec, long bitoff)
+{
+   unsigned char *bytes = NULL;
+   Tcl_WideInt value = 0;
+   long i, b;
+   int nb = 0, bit;
+
+   if (obj->typePtr == Tcl_GetObjType("bytearray"))
+      bytes = Tcl_GetByteArrayFromObj(obj, &nb);
+   else if (nbits > 64) {
+      Tcl_SetResult(interp, "jtag:  Scans longer than 64 bits need a "
+		"byte array value.\n", NULL);
+      return TCL_ERROR;
+   }
+   else if (Tcl_GetWideIntFromObj(interp, obj, &value) != TCL_OK)
+      return TCL_ERROR;
+
+   for (i = 0; i < nbits; i++) {
+      if (bytes != NULL)
+	 bit = (i < ((long)nb << 3)) ? (bytes[i >> 3] >> (i & 7)) & 1 : 0;
+      else
+	 bit = (int)((value >> i) & 1);
+      b = bitoff + i;
+      if (bit)
+	 vec[b >> 3] |= (unsigned char)(1 << (b & 7));
+      else
+	 vec[b >> 3] &= (unsigned char)~(1 << (b & 7));
    }
+   return TCL_OK;
+}
 
-   ftStatus = ftdi_write_data(ftContext, tbuffer, 6);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while preparing SPI"
-		" read command.\n", NULL);
-   else if (ftStatus != 6)
-      Tcl_SetResult(interp, "SPI read:  short write error.\n", NULL);
+/* Return "nbits" bits of a "total"-bit scan reply from bit	*/
+/* "bitoff" as an integer, or as a byte array if longer than	*/
+/* 64 bits.							*/
 
-   // SPI read using MPSSE
+static Tcl_Obj *
+jtag_bits_to_obj(unsigned char *reply, long total, long bitoff, long nbits)
+{
+   unsigned char *bytes;
+   Tcl_WideUInt value = 0;
+   Tcl_Obj *obj;
+   long i;
+
+   if (nbits <= 64) {
+      for (i = 0; i < nbits; i++)
+	 if (jtag_tdo_bit(reply, total, bitoff + i))
+	    value |= (Tcl_WideUInt)1 << i;
+      return Tcl_NewWideIntObj((Tcl_WideInt)value);
+   }
+   bytes = (unsigned char *)calloc((nbits + 7) >> 3, sizeof(unsigned char));
+   for (i = 0; i < nbits; i++)
+      if (jtag_tdo_bit(reply, total, bitoff + i))
+	 bytes[i >> 3] |= (unsigned char)(1 << (i & 7));
+   obj = Tcl_NewByteArrayObj(bytes, (int)((nbits + 7) >> 3));
+   free(bytes);
+   return obj;
+}
 
-   ftStatus = ftdi_read_data(ftContext, values, bytecount);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error in SPI read.\n", NULL);
-   else if (ftStatus != bytecount)
-      Tcl_SetResult(interp, "SPI short read error.\n", NULL);
+/* Find a TAP state by name (case-insensitive), or -1 */
 
-   vector = Tcl_NewListObj(0, NULL);
-   for (i = 0; i < bytecount; i++) {
-      Tcl_ListObjAppendElement(interp, vector, Tcl_NewIntObj((int)values[i]));
-   }
+static int
+jtag_state_index(char *name)
+{
+   int i;
 
-   Tcl_SetObjResult(interp, vector);
-   free(values);
-   return TCL_OK;
+   for (i = 0; tap_state_names[i] != NULL; i++)
+      if (!strcasecmp(name, tap_state_names[i])) return i;
+   return -1;
 }
 
+/* A scan whose captured TDO bits are returned */
+
+typedef struct {
+   long start;			// Offset of the scan in the reply
+   long total;			// Number of bits shifted
+   long bitoff;			// First bit returned
+   long nbits;			// Number of bits returned
+} jtag_capture;
+
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_write":				*/
+/* Tcl function "ftdi::jtag"					*/
+/*								*/
+/* Use: jtag <device> chain [<irlen_list>]			*/
+/*	jtag <device> state					*/
+/*	jtag <device> scan <op_list>				*/
+/*								*/
+/* "chain" sets (or returns) the instruction register length	*/
+/* of each TAP in the scan chain, starting from the TAP whose	*/
+/* TDO drives the FTDI.  "state" returns the TAP state.		*/
+/*								*/
+/* "scan" runs a list of operations, each of which is one of:	*/
+/*	reset			Five TMS high clocks		*/
+/*	state <name>		Move to TAP state <name>	*/
+/*	idle <cycles>		Clock TCK in Run-Test/Idle	*/
+/*	ir <bits> <value>	Shift the whole IR chain	*/
+/*	dr <bits> <value>	Shift the whole DR chain	*/
+/*	irscan <tap> <value>	Shift <tap>'s IR (others BYPASS)*/
+/*	drscan <tap> <bits> <value>  Shift <tap>'s DR (others	*/
+/*				in BYPASS)			*/
+/* Scans end in Run-Test/Idle.  All operations go to the	*/
+/* device as one command stream, and the result is a list of	*/
+/* the values captured by the scans, in order.  Values are	*/
+/* integers, or byte arrays (first bit in bit 0 of byte 0),	*/
+/* which are needed for scans longer than 64 bits.		*/
 /*--------------------------------------------------------------*/
 
 int
-ftditcl_spi_write(ClientData clientData,
+ftditcl_jtag(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-   int result;
-   int bytecount, i, j, value;
-   int cmdcount, allcount;
-   Tcl_WideInt regnum;
-   unsigned char *values;
-   unsigned char flags;
-   Tcl_Obj *vector, *lobj;
-
-   long numWritten;
-   ftdi_record *ftRecord;
+   int result, i, j, nops, nargs, ncaps, ndev, tap, cycles, state, shift, n;
+   int *irlen;
+   long nbits, total, bitoff;
+   double actual = 0.0;
+   unsigned char fill, *p, *tdi, *rbuffer;
+   char *subcmd, *opname;
+   bool hseries;
+   Tcl_Obj **ops, **args, *valobj, *vector;
+   jtag_batch jb;
+   jtag_capture *caps;
+
+   ftdi_record *ftRecord, *chan;
    struct ftdi_context * ftContext;
-   int ftStatus;
+   struct ftdi_transfer_control *wtc, *rtc;
+   int ftStatus, wStatus, tmo;
+   ftdi_deadline dl;
 
-   if (objc != 4) {
-      Tcl_SetResult(interp, "spi_write: Need device name, "
-		"command, and vector of values.\n", NULL);
+   result = deadline_option(interp, &objc, objv, &tmo);
+   if (result != TCL_OK) return result;
+   if (objc < 3) {
+      Tcl_SetResult(interp, "jtag: Need device name and option.\n", NULL);
       return TCL_ERROR;
    }
    ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "spi_read:  No such device\n", NULL);
+   if (ftRecord == (ftdi_record *)NULL) {
+      Tcl_SetResult(interp, "jtag:  No such device\n", NULL);
       return TCL_ERROR;
    }
-   else flags = ftRecord->flags;
-
-   if (flags & BITBANG_MODE) {
-      result = ftditcl_bang_write(clientData, interp, objc, objv);
-      return result;
+   if (channel_held(interp, ftRecord, "jtag")) return TCL_ERROR;
+   if (ftRecord->flags & (BITBANG_MODE | SERIAL_MODE)) {
+      Tcl_SetResult(interp, "jtag:  Device must be in MPSSE mode.\n", NULL);
+      return TCL_ERROR;
    }
-
-   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
-   if (result != TCL_OK) return result;
-
-   vector = objv[3];
-   result = Tcl_ListObjLength(interp, vector, &bytecount);
-   if (result != TCL_OK) return result;
-
-   for (i = 0; i < bytecount; i++) {
-      result = Tcl_ListObjIndex(interp, vector, i, &lobj);
-      if (result != TCL_OK) return result;
-      result = Tcl_GetIntFromObj(interp, lobj, &value);
-
-      if (value < 0 || value > 255) {
-         Tcl_SetResult(interp, "spi_write:  Byte value out of range 0-255\n",
-		NULL);
+   chan = ftRecord->channel;
+   ndev = chan->jtag_ndev;
+   subcmd = Tcl_GetString(objv[2]);
+
+   if (!strcmp(subcmd, "chain")) {
+      if (objc == 3) {
+	 vector = Tcl_NewListObj(0, NULL);
+	 for (i = 0; i < ndev; i++)
+	    Tcl_ListObjAppendElement(interp, vector,
+			Tcl_NewIntObj(chan->jtag_irlen[i]));
+	 Tcl_SetObjResult(interp, vector);
+	 return TCL_OK;
+      }
+      else if (objc != 4) {
+	 Tcl_SetResult(interp, "jtag:  Usage: jtag <device> chain "
+		"[<irlen_list>]\n", NULL);
 	 return TCL_ERROR;
       }
+      result = Tcl_ListObjGetElements(interp, objv[3], &nargs, &args);
+      if (result != TCL_OK) return result;
+      irlen = (int *)malloc((nargs + 1) * sizeof(int));
+      for (i = 0; i < nargs; i++) {
+	 result = Tcl_GetIntFromObj(interp, args[i], &irlen[i]);
+	 if (result == TCL_OK && irlen[i] < 2) {
+	    Tcl_SetResult(interp, "jtag:  IR length must be at least 2.\n",
+			NULL);
+	    result = TCL_ERROR;
+	 }
+	 if (result != TCL_OK) {
+	    free(irlen);
+	    return result;
+	 }
+      }
+      if (chan->jtag_irlen != NULL) free(chan->jtag_irlen);
+      chan->jtag_irlen = irlen;
+      chan->jtag_ndev = nargs;
+      return TCL_OK;
+   }
+   else if (!strcmp(subcmd, "state")) {
+      Tcl_SetResult(interp, (chan->jtag_state == TAP_UNKNOWN) ? "UNKNOWN" :
+		(char *)tap_state_names[chan->jtag_state], TCL_STATIC);
+      return TCL_OK;
+   }
+   else if (strcmp(subcmd, "scan") || (objc != 4)) {
+      Tcl_SetResult(interp, "jtag:  Usage: jtag <device> chain|state|"
+		"scan ...\n", NULL);
+      return TCL_ERROR;
    }
 
-   cmdcount = ftRecord->cmdwidth >> 3;
-   values = (unsigned char *)malloc((6 + cmdcount + bytecount) * sizeof(unsigned char));
-
-   values[0] = 0x80;        // Set Dbus
-   values[1] = (flags & CS_INVERT) ? 0x08 : 0x00; // Assert CS
-   values[2] = 0x0b;        // SCK, SDI, and CS are outputs
+   result = Tcl_ListObjGetElements(interp, objv[3], &nops, &ops);
+   if (result != TCL_OK) return result;
 
-   values[3] = 0x11;        // Simple write command
-   // Number of bytes to write (less 1)
-   allcount = bytecount + cmdcount - 1;
-   values[4] = (unsigned char)(allcount & 0xff);
-   values[5] = (unsigned char)((allcount >> 8) & 0xff);
-   if (flags & LEGACY_MODE)
-      // Command to send is "write register" + register no.
-      values[6] = ((flags & MIXED_MODE) ? 0x10 : 0x40) + (unsigned char)regnum;
-   else {
-      for (i = 0; i < cmdcount; i++) {
-	 j = cmdcount - i - 1;
-	 values[6 + i] = (unsigned char)((regnum >> (j << 3)) & 0xff);
+   if (spi_queue_flush(interp, ftRecord) != TCL_OK) return TCL_ERROR;
+
+   hseries = (ftContext->type == TYPE_2232H || ftContext->type == TYPE_4232H
+		|| ftContext->type == TYPE_232H) ? true : false;
+
+   jb.csize = 256;
+   jb.cmd = (unsigned char *)malloc(jb.csize * sizeof(unsigned char));
+   jb.clen = 0;
+   jb.nreply = 0;
+   jb.state = chan->jtag_state;
+   jb.tms = (chan->gpio_out & JTAG_TMS) ? 1 : 0;
+
+   // JTAG needs two-phase clocking.  Then set TCK and TDI low and
+   // TMS at its present level, with TDO an input.
+
+   p = jtag_reserve(&jb, 9);
+   n = 0;
+   if (chan->clkflags & CLK_3PHASE)
+      actual = mpsse_clock_plan(ftContext, chan->sckrate,
+		chan->clkflags & ~CLK_3PHASE, p, &n);
+   p[n++] = 0x80;		// Set Dbus
+   p[n++] = (unsigned char)((chan->gpio_out & 0xf0) | ((jb.tms) ? JTAG_TMS : 0));
+   p[n++] = (unsigned char)((chan->gpio_dir & 0xf0) | JTAG_TCK | JTAG_TDI
+		| JTAG_TMS);
+   jb.clen += n;
+   if (jb.state == TAP_UNKNOWN) jtag_reset(&jb);
+
+   caps = (jtag_capture *)malloc((nops + 1) * sizeof(jtag_capture));
+   ncaps = 0;
+
+   for (i = 0; i < nops; i++) {
+      result = Tcl_ListObjGetElements(interp, ops[i], &nargs, &args);
+      if (result != TCL_OK) break;
+      if (nargs == 0) continue;
+      opname = Tcl_GetString(args[0]);
+      shift = -1;
+
+      if (!strcmp(opname, "reset") && (nargs == 1))
+	 jtag_reset(&jb);
+      else if (!strcmp(opname, "state") && (nargs == 2)) {
+	 state = jtag_state_index(Tcl_GetString(args[1]));
+	 if (state < 0) {
+	    Tcl_SetResult(interp, "jtag:  Unknown TAP state.\n", NULL);
+	    result = TCL_ERROR;
+	 }
+	 else
+	    jtag_goto(&jb, state);
+      }
+      else if (!strcmp(opname, "idle") && (nargs == 2)) {
+	 result = Tcl_GetIntFromObj(interp, args[1], &cycles);
+	 if (result == TCL_OK && cycles < 0) {
+	    Tcl_SetResult(interp, "jtag:  Idle cycles must not be negative.\n",
+			NULL);
+	    result = TCL_ERROR;
+	 }
+	 if (result == TCL_OK) jtag_idle(&jb, cycles, hseries);
+      }
+      else if ((!strcmp(opname, "ir") || !strcmp(opname, "dr")) &&
+		(nargs == 3)) {
+	 result = Tcl_GetLongFromObj(interp, args[1], &nbits);
+	 if (result == TCL_OK && nbits < 1) {
+	    Tcl_SetResult(interp, "jtag:  Scan length must be positive.\n",
+			NULL);
+	    result = TCL_ERROR;
+	 }
+	 shift = (opname[0] == 'i') ? TAP_IRSHIFT : TAP_DRSHIFT;
+	 total = nbits;
+	 bitoff = 0;
+	 fill = 0x00;
+	 valobj = args[2];
+      }
+      else if ((!strcmp(opname, "irscan") && (nargs == 3)) ||
+		(!strcmp(opname, "drscan") && (nargs == 4))) {
+	 result = Tcl_GetIntFromObj(interp, args[1], &tap);
+	 if (result == TCL_OK && (tap < 0 || tap >= ((ndev > 0) ? ndev : 1)
+			|| (ndev == 0 && opname[0] == 'i'))) {
+	    Tcl_SetResult(interp, (ndev == 0) ? "jtag:  No scan chain defined "
+			"(see \"jtag <device> chain\").\n" :
+			"jtag:  No such TAP in the scan chain.\n", NULL);
+	    result = TCL_ERROR;
+	 }
+	 if (result != TCL_OK) break;
+
+	 if (opname[0] == 'i') {
+	    // Other TAPs get the all-ones BYPASS instruction
+	    shift = TAP_IRSHIFT;
+	    for (total = 0, bitoff = 0, j = 0; j < ndev; j++) {
+	       if (j == tap) bitoff = total;
+	       total += chan->jtag_irlen[j];
+	    }
+	    nbits = chan->jtag_irlen[tap];
+	    fill = 0xff;
+	    valobj = args[2];
+	 }
+	 else {
+	    // Each TAP in BYPASS adds one bit to the DR chain
+	    shift = TAP_DRSHIFT;
+	    result = Tcl_GetLongFromObj(interp, args[2], &nbits);
+	    if (result == TCL_OK && nbits < 1) {
+	       Tcl_SetResult(interp, "jtag:  Scan length must be positive.\n",
+			NULL);
+	       result = TCL_ERROR;
+	    }
+	    total = nbits + ((ndev > 0) ? ndev - 1 : 0);
+	    bitoff = tap;
+	    fill = 0x00;
+	    valobj = args[3];
+	 }
+      }
+      else {
+	 Tcl_SetResult(interp, "jtag:  Bad scan operation.  Must be reset, "
+		"state <name>, idle <cycles>, ir <bits> <value>, "
+		"dr <bits> <value>, irscan <tap> <value>, "
+		"or drscan <tap> <bits> <value>.\n", NULL);
+	 result = TCL_ERROR;
+      }
+      if (result != TCL_OK) break;
+
+      if (shift >= 0) {
+	 tdi = (unsigned char *)malloc((total + 7) >> 3);
+	 memset(tdi, fill, (total + 7) >> 3);
+	 result = jtag_bits_from_obj(interp, valobj, nbits, tdi, bitoff);
+	 if (result == TCL_OK) {
+	    caps[ncaps].start = jb.nreply;
+	    caps[ncaps].total = total;
+	    caps[ncaps].bitoff = bitoff;
+	    caps[ncaps].nbits = nbits;
+	    ncaps++;
+	    jtag_shift(&jb, shift, tdi, total, TAP_IDLE);
+	 }
+	 free(tdi);
+	 if (result != TCL_OK) break;
       }
    }
+   if (result != TCL_OK) {
+      free(caps);
+      free(jb.cmd);
+      return TCL_ERROR;
+   }
+   p = jtag_reserve(&jb, 2);
+   p[0] = MPSSE_ECHO;		// Closes the reply (see mpsse_resync)
+   p[1] = 0x87;			// Send immediate
+   jb.clen += 2;
+   jb.nreply += 2;
 
    if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_write: Writing: ");
-      for (i = 0; i < 6 + cmdcount; i++) {
-         Fprintf(interp, stderr, "0x%02x ", values[i]);
+      Fprintf(interp, stderr, "jtag: Writing: ");
+      for (i = 0; i < jb.clen; i++) {
+         Fprintf(interp, stderr, "0x%02x ", jb.cmd[i]);
       }
       Fprintf(interp, stderr, "\n");
    }
 
-   ftStatus = ftdi_write_data(ftContext, values, 6 + cmdcount);
+   // One submission for the whole batch
+
+   rbuffer = (unsigned char *)malloc(jb.nreply * sizeof(unsigned char));
+   deadline_start(&dl, ftRecord, tmo);
+   wtc = BACKEND(ftRecord)->write_submit(ftContext, jb.cmd, jb.clen);
+   rtc = (wtc == NULL) ? NULL :
+		BACKEND(ftRecord)->read_submit(ftContext, rbuffer, (int)jb.nreply);
+   ftStatus = transfer_wait(rtc, &dl);
+   wStatus = transfer_wait(wtc, &dl);
+   free(jb.cmd);
+
+   if (dl.timedout) {
+      free(rbuffer);
+      free(caps);
+      return deadline_error(interp, &dl, ftRecord, "jtag", ftStatus,
+		jb.nreply, NULL);
+   }
 
-   for (i = 0; i < bytecount; i++) {
-      result = Tcl_ListObjIndex(interp, vector, i, &lobj);
-      result = Tcl_GetIntFromObj(interp, lobj, &value);
-      values[i + 6 + cmdcount] = (unsigned char)(value & 0xff);
+   if ((wStatus != jb.clen) ||
+		!MPSSE_IN_STEP(rbuffer, ftStatus, (int)jb.nreply)) {
+      free(rbuffer);
+      free(caps);
+      return mpsse_desync(interp, ftRecord, "jtag", (wStatus < 0) ||
+		(ftStatus < 0), ftStatus, (int)jb.nreply);
    }
 
-   // SPI write using MPSSE
+   // TCK and TDI are low and TMS holds its last level
+   if (actual != 0.0) {
+      chan->sckrate = actual;
+      chan->clkflags &= ~CLK_3PHASE;
+   }
+   chan->jtag_state = jb.state;
+   chan->gpio_out = (chan->gpio_out & ~(JTAG_TCK | JTAG_TDI | JTAG_TMS)) |
+		((jb.tms) ? JTAG_TMS : 0);
+   chan->gpio_dir = (chan->gpio_dir & ~(JTAG_TCK | JTAG_TDI | JTAG_TDO |
+		JTAG_TMS)) | JTAG_TCK | JTAG_TDI | JTAG_TMS;
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_write: Writing: ");
-      for (i = 0; i < 6 + bytecount + cmdcount; i++) {
-         Fprintf(interp, stderr, "0x%02x ", values[i]);
+   vector = Tcl_NewListObj(0, NULL);
+   for (i = 0; i < ncaps; i++)
+      Tcl_ListObjAppendElement(interp, vector,
+		jtag_bits_to_obj(rbuffer + caps[i].start, caps[i].total,
+		caps[i].bitoff, caps[i].nbits));
+   Tcl_SetObjResult(interp, vector);
+   free(rbuffer);
+   free(caps);
+   return TCL_OK;
+}
+
+/*--------------------------------------------------------------*/
+/* USB device cache						*/
+/*								*/
+/* Reading the description and serial number strings of a	*/
+/* device takes USB control transfers, so they are read once	*/
+/* per device and kept here for "ftdi::opendev" and		*/
+/* "ftdi::listdev -all".  The cache has its own libusb		*/
+/* context with a hotplug callback, which adds devices as they	*/
+/* arrive (their strings are read when first needed) and	*/
+/* removes them as they leave.  Pending hotplug events are	*/
+/* handled each time the cache is used.  If libusb has no	*/
+/* hotplug support, the device list is read again each time,	*/
+/* but strings are still read only for new devices.  (Hotplug	*/
+/* events are also handled from the Tcl event loop;  see	*/
+/* "libusb event sources".)					*/
+/*--------------------------------------------------------------*/
+
+typedef struct _usb_cache_entry {
+   libusb_device *dev;		// libusb device (referenced)
+   unsigned short vid;		// USB vendor ID
+   unsigned short pid;		// USB product ID
+   unsigned char bus;		// USB bus number
+   unsigned char addr;		// USB device address
+   char path[32];		// Bus and port path, e.g., "1-2.4"
+   char serial[64];		// Serial number string
+   char description[100];	// Description (product) string
+   bool stale;			// Strings not yet read
+   bool seen;			// Found in the last device list
+   struct _usb_cache_entry *next;
+} usb_cache_entry;
+
+static struct ftdi_context *usbcache_ctx = NULL;
+static usb_cache_entry *usbcache = NULL;
+static bool usbcache_hotplug = false;
+
+/* Add a device to the cache, or mark it seen if present */
+
+static void
+usb_cache_add(libusb_device *dev)
+{
+   struct libusb_device_descriptor desc;
+   usb_cache_entry *entry, **tail;
+   unsigned char ports[8];
+   int i, n, len;
+
+   for (tail = &usbcache; *tail; tail = &(*tail)->next)
+      if ((*tail)->dev == dev) {
+	 (*tail)->seen = true;
+	 return;
       }
-      Fprintf(interp, stderr, "\n");
-   }
+   if (libusb_get_device_descriptor(dev, &desc) < 0) return;
+
+   entry = (usb_cache_entry *)malloc(sizeof(usb_cache_entry));
+   entry->dev = libusb_ref_device(dev);
+   entry->vid = desc.idVendor;
+   entry->pid = desc.idProduct;
+   entry->bus = libusb_get_bus_number(dev);
+   entry->addr = libusb_get_device_address(dev);
+   len = sprintf(entry->path, "%d", (int)entry->bus);
+   n = libusb_get_port_numbers(dev, ports, 7);
+   for (i = 0; i < n; i++)
+      len += sprintf(entry->path + len, "%c%d", (i == 0) ? '-' : '.',
+		(int)ports[i]);
+   entry->serial[0] = '\0';
+   entry->description[0] = '\0';
+   entry->stale = true;
+   entry->seen = true;
+   entry->next = NULL;
+   *tail = entry;		// Keep the order of enumeration
+}
 
-   ftStatus = ftdi_write_data(ftContext, values, bytecount + cmdcount + 6);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error in SPI write.\n", NULL);
-   else if (ftStatus != (bytecount + cmdcount + 6))
-      Tcl_SetResult(interp, "SPI short write error.\n", NULL);
+/* Remove a device from the cache */
 
-   values[0] = 0x80;        // Set Dbus
-   values[1] = (flags & CS_INVERT) ? 0x00 : 0x08; // De-assert CS
-   values[2] = 0x0b;        // SCK, SDI, and CS are outputs
+static void
+usb_cache_remove(libusb_device *dev)
+{
+   usb_cache_entry *entry, *last = NULL;
+
+   for (entry = usbcache; entry; last = entry, entry = entry->next)
+      if (entry->dev == dev) {
+	 if (last == NULL)
+	    usbcache = entry->next;
+	 else
+	    last->next = entry->next;
+	 libusb_unref_device(entry->dev);
+	 free(entry);
+	 return;
+      }
+}
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_write: Writing: ");
-      for (i = 0; i < 3; i++) {
-         Fprintf(interp, stderr, "0x%02x ", values[i]);
+/* libusb hotplug callback.  This does no I/O;  strings are	*/
+/* read by usb_cache_update().					*/
+
+static int
+usb_cache_hotplug(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+   if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+      usb_cache_add(dev);
+   else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+      usb_cache_remove(dev);
+   return 0;			// Keep the callback registered
+}
+
+/* Is the cache entry a device with the current VID/PID? */
+
+#define usb_cache_match(entry) \
+	(((entry)->vid == usb_vid) && ((entry)->pid == usb_pid))
+
+/*--------------------------------------------------------------*/
+/* Support function "usb_cache_update"				*/
+/*								*/
+/* Bring the cache up to date, and read the strings of any new	*/
+/* devices with the current VID/PID.  Returns -1 if libusb	*/
+/* could not be started or the devices could not be listed.	*/
+/*--------------------------------------------------------------*/
+
+static int
+usb_cache_update()
+{
+   struct timeval zerotime = {0, 0};
+   usb_cache_entry *entry, *enext;
+   libusb_device **devlist;
+   libusb_hotplug_callback_handle hph;
+   ssize_t ndev, i;
+
+   if (usbcache_ctx == NULL) {
+      usbcache_ctx = ftdi_new();
+      if (usbcache_ctx == NULL) return -1;
+      if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		(libusb_hotplug_register_callback(usbcache_ctx->usb_ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, usb_cache_hotplug, NULL, &hph)
+		== LIBUSB_SUCCESS))
+	 usbcache_hotplug = true;
+      usb_source_add(usbcache_ctx->usb_ctx);
+   }
+
+   if (usbcache_hotplug)
+      libusb_handle_events_timeout_completed(usbcache_ctx->usb_ctx,
+		&zerotime, NULL);
+   else {
+      ndev = libusb_get_device_list(usbcache_ctx->usb_ctx, &devlist);
+      if (ndev < 0) return -1;
+      for (entry = usbcache; entry; entry = entry->next)
+	 entry->seen = false;
+      for (i = 0; i < ndev; i++)
+	 usb_cache_add(devlist[i]);
+      libusb_free_device_list(devlist, 1);
+      for (entry = usbcache; entry; entry = enext) {
+	 enext = entry->next;
+	 if (!entry->seen) usb_cache_remove(entry->dev);
       }
-      Fprintf(interp, stderr, "\n");
    }
 
-   ftStatus = ftdi_write_data(ftContext, values, 3);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error in SPI write.\n", NULL);
-   else if (ftStatus != 3)
-      Tcl_SetResult(interp, "SPI short write error.\n", NULL);
+   for (entry = usbcache; entry; entry = entry->next)
+      if (entry->stale && usb_cache_match(entry))
+	 if (ftdi_usb_get_strings(usbcache_ctx, entry->dev, NULL, 0,
+		entry->description, 100, entry->serial, 64) >= 0)
+	    entry->stale = false;
+   return 0;
+}
 
-   free(values);
-   return TCL_OK;
+/* Find the first device with the current VID/PID whose	*/
+/* description, serial number, or path is "name", after	*/
+/* "after" (or from the start if NULL).  Returns NULL if none.	*/
+
+static usb_cache_entry *
+usb_cache_find(char *name, usb_cache_entry *after)
+{
+   usb_cache_entry *entry;
+
+   entry = (after == NULL) ? usbcache : after->next;
+   for (; entry; entry = entry->next)
+      if (usb_cache_match(entry) && (!strcmp(entry->path, name) ||
+		(!entry->stale && (!strcmp(entry->description, name) ||
+		!strcmp(entry->serial, name)))))
+	 return entry;
+   return NULL;
 }
 
 /*--------------------------------------------------------------*/
-/* Tcl function "ftdi::spi_readwrite":	Combined read and write	*/
-/* (Note:  readwrite function untested, not sure how to do a	*/
-/* readback of data without sending more clocks.  FT functions	*/
-/* do not appear to be truly bidirectional/full duplex.)	*/
+/* Tcl function "ftdi_list":					*/
+/*								*/
+/* Create a list of all of the known interfaces (boards)	*/
+/*								*/
+/* With "-all", list every attached device with the current	*/
+/* VID/PID, open or not, as {description serial path}, from	*/
+/* the USB device cache.					*/
 /*--------------------------------------------------------------*/
 
 int
-ftditcl_spi_readwrite(ClientData clientData,
+ftditcl_list(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-   int result;
-   int bytecount, i, j;
-   int cmdcount;
-   Tcl_WideInt regnum;
-   Tcl_Obj *lobj;
-   int value;
-   unsigned char *values;
-   unsigned char tbuffer[13];
-   unsigned char flags;
-   Tcl_Obj *vector;
+   Tcl_Obj *lobj, *lobj2;
+   Tcl_Obj *sobj;
+   Tcl_HashSearch hs;
+   Tcl_HashEntry *h;
+   char *dname;
+   usb_cache_entry *entry;
 
-   long numWritten;
-   long numRead;
-   ftdi_record *ftRecord;
    struct ftdi_context * ftContext;
-   int ftStatus;
+   ftdi_record *ftRecordPtr;
+ 
+   lobj = Tcl_NewListObj(0, NULL);
 
-   if (objc != 4) {
-      Tcl_SetResult(interp, "spi_readwrite: Need device name, command, "
-		"and byte list.\n", NULL);
-      return TCL_ERROR;
+   if (objc == 2 && !strcmp(Tcl_GetString(objv[1]), "-all")) {
+      if (usb_cache_update() < 0) {
+	 Tcl_SetResult(interp, "listdev:  Unable to list devices.\n", NULL);
+	 return TCL_ERROR;
+      }
+      for (entry = usbcache; entry; entry = entry->next) {
+	 if (!usb_cache_match(entry)) continue;
+	 lobj2 = Tcl_NewListObj(0, NULL);
+	 Tcl_ListObjAppendElement(interp, lobj2,
+		Tcl_NewStringObj(entry->description, -1));
+	 Tcl_ListObjAppendElement(interp, lobj2,
+		Tcl_NewStringObj(entry->serial, -1));
+	 Tcl_ListObjAppendElement(interp, lobj2,
+		Tcl_NewStringObj(entry->path, -1));
+	 Tcl_ListObjAppendElement(interp, lobj, lobj2);
+      }
+      Tcl_SetObjResult(interp, lobj);
+      return TCL_OK;
    }
-   ftRecord = find_record(Tcl_GetString(objv[1]), &ftContext);
-   if (ftContext == (struct ftdi_context *)NULL) {
-      Tcl_SetResult(interp, "spi_readwrite:  No such device\n", NULL);
+   else if (objc != 1) {
+      Tcl_SetResult(interp, "listdev:  Usage: listdev [-all]\n", NULL);
       return TCL_ERROR;
    }
-   else flags = ftRecord->flags;
 
-   result = Tcl_GetWideIntFromObj(interp, objv[2], &regnum);
-   if (result != TCL_OK) return result;
+   h = Tcl_FirstHashEntry(&handletab, &hs);
+   while (h != NULL) {
+      ftRecordPtr = (ftdi_record *)Tcl_GetHashValue(h);
+      if (ftRecordPtr != (ftdi_record *)NULL) {
+	 lobj2 = Tcl_NewListObj(0, NULL);
+         dname = Tcl_GetHashKey(&handletab, h);
+	 sobj = Tcl_NewStringObj(dname, -1);
+	 Tcl_ListObjAppendElement(interp, lobj2, sobj);
+	 sobj = Tcl_NewStringObj(ftRecordPtr->description, -1);
+	 Tcl_ListObjAppendElement(interp, lobj2, sobj);
+	 Tcl_ListObjAppendElement(interp, lobj, lobj2);
+      }
+      h = Tcl_NextHashEntry(&hs);
+   }
+   Tcl_SetObjResult(interp, lobj);
+   return TCL_OK;
+}
 
-   vector = objv[3];
-   result = Tcl_ListObjLength(interp, vector, &bytecount);
-   if (result != TCL_OK) return result;
+//--------------------------------------------------------------
+// Support functions for "ftdi_open" and "ftdi_open_many"
+//
+// open_device_hw() does all of the USB work of opening one
+// device:  open, reset, mode and clock setup, and the 0xff
+// sanity check.  It uses no Tcl state (other than verbose
+// output when "interp" is non-NULL), so that "ftdi_open_many"
+// can run it for several devices at once in separate threads.
+// open_device_record() then makes the device record and handle
+// in the interpreter's thread.
+//--------------------------------------------------------------
 
-   for (i = 0; i < bytecount; i++) {
-      result = Tcl_ListObjIndex(interp, vector, i, &lobj);
-      if (result != TCL_OK) return result;
-      result = Tcl_GetIntFromObj(interp, lobj, &value);
+static void
+open_device_hw(open_job *job, Tcl_Interp *interp)
+{
+   struct ftdi_context *ftContext;
+   unsigned char tbuffer[12], rbuffer[12];
+   int ftStatus, ntb, i;
 
-      if (value < 0 || value > 255) {
-         Tcl_SetResult(interp, "spi_write:  Byte value out of range 0-255\n",
-		NULL);
-	 return TCL_ERROR;
-      }
-   }
+   job->ftContext = NULL;
+   job->error = NULL;
+   job->warning = NULL;
+   job->unchecked = false;
+   job->sckrate = 0.0;
+
+   ftContext = job->backend->open(job);
+   if (ftContext == NULL) return;
 
-   cmdcount = ftRecord->cmdwidth >> 3;
-   values = (unsigned char *)malloc((6 + cmdcount + bytecount) * sizeof(unsigned char));
+   // Reset the FTDI device
+   ftStatus = job->backend->reset(ftContext);
+   if (ftStatus < 0)
+      job->warning = "Received error while resetting device.\n";
 
-   // Write values to MPSSE to generate the SPI read command
+   // Set device to MPSSE mode, with bits 0, 1, and 3 set to output
+   // (SCK, SDI, and CS).  All others (SDO and Dbus) are set to type input.
 
-   values[0] = 0x80;        // Set Dbus
-   values[1] = (flags & CS_INVERT) ? 0x08 : 0x00; // Assert CS
-   values[2] = 0x0b;        // SCK, SDI, and CS are outputs
-   values[3] = 0x11;     // Simple write command
-   // Command to send is "read register" + register no.
-   cmdcount = ftRecord->cmdwidth >> 3;
-   if (flags & LEGACY_MODE)
-      values[4] = 0x00;     // Length = 1;
-   else
-      values[4] = (unsigned char)(cmdcount - 1);
-   values[5] = 0x00;     // (High byte is zero)
-   if (flags & LEGACY_MODE)
-      values[6] = ((flags & MIXED_MODE) ? 0x20 : 0x80) + (unsigned char)regnum;
-   else {
-      for (i = 0; i < cmdcount; i++) {
-	 j = cmdcount - i - 1;
-	 values[6 + i] = (unsigned char)((regnum >> (j << 3)) & 0xff);
-      }
+   if (!(job->flags & SERIAL_MODE)) {
+      ftStatus = job->backend->set_bitmode(ftContext, (unsigned char)0x0b,
+		(unsigned char)BITMODE_MPSSE);
+      if (ftStatus < 0)
+	 job->warning = "Received error while setting bit mode.\n";
    }
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_readwrite: Writing: ");
-      for (i = 0; i < 6 + cmdcount; i++) {
-         Fprintf(interp, stderr, "0x%02x ", values[i]);
+   ftStatus = job->backend->purge_tx(ftContext);
+   if (ftStatus < 0)
+      job->warning = "Received error while purging transmit buffer.\n";
+
+   ftStatus = job->backend->purge_rx(ftContext);
+   if (ftStatus < 0)
+      job->warning = "Received error while purging receive buffer.\n";
+
+   // Set latency timer (in ms) (legacy case is 16; FT2232 minimum 1)
+   ftStatus = job->backend->set_latency(ftContext, (unsigned char)5);
+   if (ftStatus < 0)
+      job->warning = "Received error while setting latency timer.\n";
+
+   // USB timeouts are libftdi's default (USB_DEFAULT_TIMEOUT)
+   // until set with "ftdi::timeout".
+
+   // Initial GPIO state:  De-assert CS (initial value 0 if CS, 1 if
+   // CSB).  SCK, SDI, and CS are outputs.  All Cbus (rotary switch)
+   // pins are input with initial output values 0.
+   job->gpio_out = (job->flags & CS_INVERT) ? 0x0000 : SPI_CS_PIN;
+   job->gpio_dir = 0x000b;
+   job->ftContext = ftContext;
+
+   if (job->flags & SERIAL_MODE) return;
+
+   // MPSSE setup. . .
+   tbuffer[0] = 0x80;        // Set Dbus
+   tbuffer[1] = (unsigned char)(job->gpio_out & 0xff);
+   tbuffer[2] = (unsigned char)(job->gpio_dir & 0xff);
+
+   tbuffer[3] = 0x82;        // Set Cbus
+   tbuffer[4] = (unsigned char)(job->gpio_out >> 8);
+   tbuffer[5] = (unsigned char)(job->gpio_dir >> 8);
+
+   // Initial SCK is 60MHz / 34 (1.76MHz), or the nearest
+   // rate below on chips without the 60MHz clock.
+   job->sckrate = mpsse_clock_plan(ftContext, 30.0E6 / 17.0, 0,
+		tbuffer + 6, &ntb);
+   ntb += 6;
+
+   if (verbose > 1 && interp != NULL) {
+      Fprintf(interp, stderr, "ftdi_open: Writing: ");
+      for (i = 0; i < ntb; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
       }
       Fprintf(interp, stderr, "\n");
    }
 
-   ftStatus = ftdi_write_data(ftContext, values, 6 + cmdcount);
+   ftStatus = job->backend->write(ftContext, tbuffer, ntb);
    if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while preparing SPI"
-		" read command.\n", NULL);
-   else if (ftStatus != 7)
-      Tcl_SetResult(interp, "SPI readwrite:  short write error.\n", NULL);
+      job->warning = "Received error while writing init data\n";
+   else if (ftStatus != ntb)
+      job->warning = "Short write error\n";
 
-   values[0] = (flags & MIXED_MODE) ? 0x24 : 0x20;     // Simple read command
-   // Number bytes to read (less one)
-   values[1] = (unsigned char)((bytecount - 1) && 0xff);
-   values[2] = (unsigned char)(((bytecount - 1) >> 8) & 0xff);
- 
-   values[3] = 0x80;	// Set Dbus
-   values[4] = (flags & CS_INVERT) ? 0x00 : 0x08; // De-assert CS
-   values[5] = 0x0b;	// SCK, SDI, and CS are outputs
+   /* Sanity check:  Give an error code (invalid opcode 0xff)  */
+   /* and read the response "0xfa 0xff".			  */
 
-   if (verbose > 1) {
-      Fprintf(interp, stderr, "spi_readwrite: Writing: ");
-      for (i = 0; i < 6; i++) {
-         Fprintf(interp, stderr, "0x%02x ", values[i]);
+   tbuffer[0] = 0xff;		// not a command
+
+   if (verbose > 1 && interp != NULL) {
+      Fprintf(interp, stderr, "ftdi_open: Writing: ");
+      for (i = 0; i < 1; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
       }
       Fprintf(interp, stderr, "\n");
    }
 
-   ftStatus = ftdi_write_data(ftContext, values, 6);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error while preparing SPI"
-		" read command.\n", NULL);
-   else if (ftStatus != 6)
-      Tcl_SetResult(interp, "SPI readwrite:  short write error.\n", NULL);
+   ftStatus = job->backend->write(ftContext, tbuffer, 1);
+   if (ftStatus < 0) {
+      job->warning = "Received error while writing test data\n";
+      job->unchecked = true;
+   }
+   else if (ftStatus != 1) {
+      job->warning = "Short write error on test data\n";
+      job->unchecked = true;
+   }
 
-   // SPI read using MPSSE
+   ftStatus = job->backend->read(ftContext, rbuffer, 2);
+   if (ftStatus < 0 || ftStatus != 2) {
+      job->warning = "Error message not received after invalid command.\n";
+      job->unchecked = true;
+   }
+}
 
-   ftStatus = ftdi_read_data(ftContext, values, bytecount);
-   if (ftStatus < 0)
-      Tcl_SetResult(interp, "Received error in SPI read.\n", NULL);
-   else if (ftStatus != bytecount)
-      Tcl_SetResult(interp, "SPI short read error.\n", NULL);
+/* Thread body for "ftdi_open_many" */
 
-   vector = Tcl_NewListObj(0, NULL);
-   for (i = 0; i < bytecount; i++) {
-      Tcl_ListObjAppendElement(interp, vector, Tcl_NewIntObj((int)values[i]));
-   }
-   Tcl_SetObjResult(interp, vector);
-   free(values);
-   return TCL_OK;
+static void *
+open_device_thread(void *arg)
+{
+   open_device_hw((open_job *)arg, NULL);
+   return NULL;
 }
 
-/*--------------------------------------------------------------*/
-/* Tcl function "ftdi_list":					*/
-/*								*/
-/* Create a list of all of the known interfaces (boards)	*/
-/*--------------------------------------------------------------*/
+//--------------------------------------------------------------
+// Create the record and handle for a device opened by
+// open_device_hw(), and return the handle in "handleptr".
+// Returns TCL_ERROR, with the handle still valid, if the
+// device failed its sanity check.  Errors after the device
+// is open are printed to stderr but not passed as a result.
+// It will be the responsibility of the end-user to deal with
+// an open device that is not acting normal.
+//--------------------------------------------------------------
 
-int
-ftditcl_list(ClientData clientData,
-	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+static int
+open_device_record(Tcl_Interp *interp, open_job *job, Tcl_Obj **handleptr)
 {
-   Tcl_Obj *lobj, *lobj2;
-   Tcl_Obj *sobj;
-   Tcl_HashSearch hs;
    Tcl_HashEntry *h;
-   char *dname;
-
-   struct ftdi_context * ftContext;
    ftdi_record *ftRecordPtr;
- 
-   lobj = Tcl_NewListObj(0, NULL);
-   h = Tcl_FirstHashEntry(&handletab, &hs);
-   while (h != NULL) {
-      ftRecordPtr = (ftdi_record *)Tcl_GetHashValue(h);
-      if (ftRecordPtr != (ftdi_record *)NULL) {
-	 lobj2 = Tcl_NewListObj(0, NULL);
-         dname = Tcl_GetHashKey(&handletab, h);
-	 sobj = Tcl_NewStringObj(dname, -1);
-	 Tcl_ListObjAppendElement(interp, lobj2, sobj);
-	 sobj = Tcl_NewStringObj(ftRecordPtr->description, -1);
-	 Tcl_ListObjAppendElement(interp, lobj2, sobj);
-	 Tcl_ListObjAppendElement(interp, lobj, lobj2);
+   struct ftdi_context *ftContext = job->ftContext;
+   unsigned char tbuffer[12];
+   char tclhandle[32];
+   int ftStatus, new, result = TCL_OK;
+
+   *handleptr = NULL;
+
+   // Now assign a unique string handler to the device and associate it
+   // with the ftContext in a hash table.
+
+   sprintf(tclhandle, "ftdi%d", ftdinum + 1);
+   h = Tcl_CreateHashEntry(&handletab, (CONST char *)tclhandle, &new);
+   if (new == 0) {
+      Tcl_SetResult(interp, "open:  Name already defined\n", NULL);
+      job->backend->close(ftContext);
+      return TCL_ERROR;
+   }
+   ftdinum++;
+
+   ftRecordPtr = (ftdi_record *)malloc(sizeof(ftdi_record));
+   ftRecordPtr->ftContext = ftContext;
+   ftRecordPtr->description = strdup(job->description);
+   ftRecordPtr->flags = job->flags;
+   ftRecordPtr->backend = job->backend;
+   ftRecordPtr->cmdwidth = 8;
+   ftRecordPtr->wordwidth = 8;
+   memset(ftRecordPtr->sigpins, 0, 8);
+   memset(ftRecordPtr->pinlut, 0, 256);
+   ftRecordPtr->setbuffer = NULL;
+   ftRecordPtr->gpio_out = job->gpio_out;
+   ftRecordPtr->gpio_dir = job->gpio_dir;
+   ftRecordPtr->gpio_pending = 0;
+   ftRecordPtr->gpio_resv = SPI_PINS;
+   ftRecordPtr->csmask = SPI_CS_PIN;
+   ftRecordPtr->channel = ftRecordPtr;
+   spi_set_mode(ftRecordPtr, 0);
+   ftRecordPtr->txqueue = NULL;
+   ftRecordPtr->txlen = 0;
+   ftRecordPtr->merging = 0;
+   ftRecordPtr->sckrate = job->sckrate;
+   ftRecordPtr->clkflags = 0;
+   ftRecordPtr->hw_mode = (job->flags & SERIAL_MODE) ? BITMODE_RESET :
+		BITMODE_MPSSE;
+   ftRecordPtr->hw_dirs = (job->flags & SERIAL_MODE) ? 0x00 : 0x0b;
+   ftRecordPtr->hw_baud = -1;
+   ftRecordPtr->hw_latency = 5;
+   ftRecordPtr->tn_latency = 5;
+   ftRecordPtr->tn_rdchunk = 0;
+   ftRecordPtr->tn_wrchunk = 0;
+   ftRecordPtr->tn_flow = 0;
+   ftRecordPtr->tn_eventchar = -1;
+   ftRecordPtr->tn_errorchar = -1;
+   ftRecordPtr->tn_bulkread = 0;
+   ftRecordPtr->tmo_device = 0;
+   ftRecordPtr->suspended = 0;
+   ftRecordPtr->jtag_state = TAP_UNKNOWN;
+   ftRecordPtr->jtag_ndev = 0;
+   ftRecordPtr->jtag_irlen = NULL;
+   Tcl_SetHashValue(h, ftRecordPtr);
+   *handleptr = Tcl_NewStringObj(tclhandle, -1);
+   BACKEND(ftRecordPtr)->watch(ftContext);
+
+   if (job->warning != NULL)
+      Fprintf(interp, stderr, "%s:  %s", tclhandle, job->warning);
+   if (job->unchecked) result = TCL_ERROR;
+
+   if (job->flags & SERIAL_MODE) return result;
+
+   // Assert CS line
+   spi_cs(ftRecordPtr, true, tbuffer);
+
+   if (verbose > 1) {
+      int i;
+      Fprintf(interp, stderr, "ftdi_open: Writing: ");
+      for (i = 0; i < 3; i++) {
+         Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
       }
-      h = Tcl_NextHashEntry(&hs);
+      Fprintf(interp, stderr, "\n");
    }
-   Tcl_SetObjResult(interp, lobj);
-   return TCL_OK;
+
+   ftStatus = BACKEND(ftRecordPtr)->write(ftContext, tbuffer, 3);
+   if (ftStatus < 0) {
+      Fprintf(interp, stderr, "Received error while asserting CS.\n");
+      result = TCL_ERROR;
+   }
+   else if (ftStatus != 3) {
+      Fprintf(interp, stderr, "Short write error while asserting CS\n");
+      result = TCL_ERROR;
+   }
+   return result;
+}
+
+//--------------------------------------------------------------
+// Parse the option switches of "ftdi_open" and "ftdi_open_many",
+// which must be at the beginning of the command.  Returns the
+// index of the first argument after them, or -1 if the backend
+// named with "-backend" does not exist.
+//--------------------------------------------------------------
+
+static int
+open_switches(int objc, Tcl_Obj *CONST objv[], unsigned char *flagsptr,
+	ftdi_backend **backendptr, bool *listptr)
+{
+   int argstart;
+   char *swstr;
+
+   *flagsptr = 0;
+   *backendptr = backends[0];
+   if (listptr != NULL) *listptr = false;
+   for (argstart = 1; argstart < objc; argstart++) {
+      swstr = Tcl_GetString(objv[argstart]);
+      if (!strncmp(swstr, "-inv", 4))
+	 *flagsptr |= CS_INVERT;
+      else if (!strncmp(swstr, "-mixed", 6))
+	 *flagsptr |= MIXED_MODE;
+      else if (!strncmp(swstr, "-legacy", 7))
+	 *flagsptr |= LEGACY_MODE;
+      else if (!strncmp(swstr, "-serial", 7))
+	 *flagsptr |= SERIAL_MODE;
+      else if (!strcmp(swstr, "-backend") && (argstart < objc - 1)) {
+	 *backendptr = find_backend(Tcl_GetString(objv[++argstart]));
+	 if (*backendptr == NULL) return -1;
+      }
+      else if (!strncmp(swstr, "-direct", 7))
+	 *backendptr = &direct_backend;
+      else if (!strncmp(swstr, "-list", 5) && (listptr != NULL))
+	 *listptr = true;
+      else
+	 break;
+   }
+   return argstart;
+}
+
+/* Convert a channel name "A" to "D" or "any" to a libftdi	*/
+/* interface, or return -1.					*/
+
+static int
+open_channel(char *chanstr)
+{
+   if (chanstr == NULL)
+      return INTERFACE_ANY;
+   else if (!strcmp(chanstr, "any"))
+      return INTERFACE_ANY;
+   else if (!strcmp(chanstr, "A"))
+      return INTERFACE_A;
+   else if (!strcmp(chanstr, "B"))
+      return INTERFACE_B;
+   else if (!strcmp(chanstr, "C"))
+      return INTERFACE_C;
+   else if (!strcmp(chanstr, "D"))
+      return INTERFACE_D;
+   return -1;
 }
 
 //--------------------------------------------------------------
@@ -1598,14 +7293,17 @@ ftditcl_list(ClientData clientData,
 //
 // Open an ftdi-usb device
 //
-// Usage:  ftdi_open [-invert|-mixed_mode|-legacy|-serial] [<descriptor_string>]
+// Usage:  ftdi_open [-invert|-mixed_mode|-legacy|-serial]
+//		[-backend <name>|-direct] [<descriptor_string>]
 //
 // This routine will parse through the USB device entries for
 // one matching either "<descriptor_string>", if supplied, or
 // the default string "Dual RS232-HS B".  If there is a match,
 // the device will be opened, and the routine will return a
 // handle (name) "ftdi<X>", where <X> is an integer value, that
-// can be passed to subsequent routines.
+// can be passed to subsequent routines.  "<descriptor_string>"
+// may also be the serial number of the device, or its USB bus
+// and port path (e.g., "1-2.4", see "ftdi_list -all").
 //
 // If the option switch "-invert" is present, use a negative-
 // sense chip select (i.e., CSB instead of CS).  If the option
@@ -1617,6 +7315,11 @@ ftditcl_list(ClientData clientData,
 // to communicate with any FTDI serial device (e.g., Prologix
 // GPIB bus controller).
 //
+// Option switch "-backend" picks the USB backend of the device
+// ("libftdi", the default, "direct", or, if built with the FTDI
+// D2XX library, "d2xx";  see "Backends").
+// "-direct" is short for "-backend direct".
+//
 // In conjunction with the Open Circuit Design testbench
 // project, the code defines a device name "TestBench" and
 // a product ID code of 0x60fe.  This is programmed into an
@@ -1632,61 +7335,26 @@ int
 ftditcl_open(ClientData clientData,
 	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
 {
-   Tcl_HashEntry *h;
    Tcl_Obj *tobj;
    static char devdflt0[] = "TestBench";
    static char devdflt1[] = "Dual RS232-HS";
 
-   struct ftdi_context *ftContext, *ftLink;
-   int ftStatus;
-   ftdi_record *ftRecordPtr;
-   struct ftdi_device_list *infonode = NULL, *snode;
-   long numBytes;
-   long numWritten, numRead;
-   int devnum, new, argstart, result, channel;
+   usb_cache_entry *match, *entry;
+   open_job job;
+   int argstart, result, channel, ndev;
    unsigned char flags = 0x0;
-   char tclhandle[32], *devstr, *swstr, *chanstr;
-   unsigned char tbuffer[12], rbuffer[12];
-   char descr[100];
+   ftdi_backend *backend;
+   char *devstr, *chanstr;
    bool dolist = false;
 
-   // Check for "-invert", "-mixed_mode", "-legacy", or "-serial" switches
-   // These must be at the beginning of the command.
-   flags = 0;
-   argstart = 1;
-   while (objc > 1) {
-      swstr = Tcl_GetString(objv[1]);
-      if (!strncmp(swstr, "-inv", 4)) {
-	 objc--;
-	 argstart++;
-	 flags |= CS_INVERT;
-      }
-      else if (!strncmp(swstr, "-mixed", 6)) {
-	 objc--;
-	 argstart++;
-	 flags |= MIXED_MODE;
-      }
-      else if (!strncmp(swstr, "-legacy", 7)) {
-	 objc--;
-	 argstart++;
-	 flags |= LEGACY_MODE;
-      }
-      else if (!strncmp(swstr, "-serial", 7)) {
-	 objc--;
-	 argstart++;
-	 flags |= SERIAL_MODE;
-      }
-      else if (!strncmp(swstr, "-list", 5)) {
-	 objc--;
-	 argstart++;
-	 dolist = true;
-      }
-      else
-	 break;
+   // Check for "-invert", "-mixed_mode", "-legacy", "-serial",
+   // "-backend", or "-direct" switches
+   argstart = open_switches(objc, objv, &flags, &backend, &dolist);
+   if (argstart < 0) {
+      Tcl_SetResult(interp, "Unknown backend.\n", NULL);
+      return TCL_ERROR;
    }
-
-   // Create and initialize a new context
-   ftContext = ftdi_new();
+   objc -= argstart - 1;
 
    // Assume device (devdflt0) unless otherwise specified
    if (objc < 2)
@@ -1694,7 +7362,6 @@ ftditcl_open(ClientData clientData,
    else
       devstr = Tcl_GetString(objv[argstart]);
 
-   channel = INTERFACE_ANY;
    if (objc < 3)
       chanstr = NULL;	/* Assume INTERFACE_ALL */
    else
@@ -1712,262 +7379,244 @@ ftditcl_open(ClientData clientData,
 	 }
    }
 
-   // If devstr ends in a space followed by "A" to "D", then set the
-   // device channel here (must be done between ftdi_() and ftdi_open(),
-   // and given an uninitialized context).
-
-   if (chanstr == NULL)
-      channel = INTERFACE_ANY;
-   else if (!strcmp(chanstr, "any"))
-      channel = INTERFACE_ANY;
-   else if (!strcmp(chanstr, "A"))
-      channel = INTERFACE_A;
-   else if (!strcmp(chanstr, "B"))
-      channel = INTERFACE_B;
-   else if (!strcmp(chanstr, "C"))
-      channel = INTERFACE_C;
-   else if (!strcmp(chanstr, "D"))
-      channel = INTERFACE_D;
-   else {
+   channel = open_channel(chanstr);
+   if (channel < 0) {
       Tcl_SetResult(interp, "Unknown device channel.\n", NULL);
       return TCL_ERROR;
    }
-   result = ftdi_set_interface(ftContext, channel);
-   if (result != 0) {
-      if (result == -1) {
-	 Tcl_SetResult(interp, "Channel is not recognized for device.\n", NULL);
-      }
-      else if (result == -2) {
-	 Tcl_SetResult(interp, "USB error while setting channel.\n", NULL);
-      }
-      else if (result == -3) {
-	 Tcl_SetResult(interp, "Device is open; channel cannot be set.\n", NULL);
-      }
-      return TCL_ERROR;
-   }
-
 
-   // Generate a list of USB devices and check for match with the
-   // description string.
+   // Look for a device matching the description string (or serial
+   // number or path) in the USB device cache.
 
-   ftStatus = ftdi_usb_find_all(ftContext, &infonode, usb_vid, usb_pid);
-   if (ftStatus < 0) {
+   if (usb_cache_update() < 0) {
       Tcl_SetResult(interp, "Unable to list devices.\n", NULL);
       return TCL_ERROR;
    }
-   else if (infonode == NULL) {
+   for (ndev = 0, entry = usbcache; entry; entry = entry->next)
+      if (usb_cache_match(entry)) ndev++;
+   if (ndev == 0) {
       Tcl_SetResult(interp, "There are no FTDI devices present.\n", NULL);
       return TCL_ERROR;
    }
 
-   for (snode = infonode; snode; snode = snode->next) {
-      ftdi_usb_get_strings(ftContext, snode->dev, NULL, 0, descr, 100, NULL, 0);
-      if (!strcmp(descr, devstr))
-	 break;
-   }
-
-   if ((snode == NULL) && (devstr == devdflt0)) {
+   match = usb_cache_find(devstr, NULL);
+   if ((match == NULL) && (devstr == devdflt0)) {
       // Try the other default (i.e., unprogrammed EPROM). . .
       devstr = devdflt1;
-
-      for (snode = infonode; snode; snode = snode->next) {
-         ftdi_usb_get_strings(ftContext, snode->dev, NULL, 0, descr, 100, NULL, 0);
-         if (!strcmp(descr, devstr))
-	    break;
-      }
+      match = usb_cache_find(devstr, NULL);
    }
 
-   if (snode == NULL || dolist == true) {
+   if (match == NULL || dolist == true) {
       // Tcl_SetResult(interp, "No device matches description.\n", NULL);
       Tcl_Obj *lobj, *sobj;
 
       lobj = Tcl_NewListObj(0, NULL);
-      for (snode = infonode; snode; snode = snode->next) {
-         ftdi_usb_get_strings(ftContext, snode->dev, NULL, 0, descr, 100, NULL, 0);
-	 sobj = Tcl_NewStringObj(descr, -1);
+      for (entry = usbcache; entry; entry = entry->next) {
+	 if (!usb_cache_match(entry)) continue;
+	 sobj = Tcl_NewStringObj(entry->description, -1);
          Tcl_ListObjAppendElement(interp, lobj, sobj);
+	 match = entry;
       }
 
       // If there is only one device, attempt to open it.  Otherwise,
       // return a list of the description strings so that the user can
       // try again with the one they're looking for.
 
-      if (infonode->next == NULL && dolist == false) {
-	 ftStatus = ftdi_usb_open_dev(ftContext, infonode->dev);
-      }
-      else {
+      if (ndev > 1 || dolist == true) {
          Tcl_SetObjResult(interp, lobj);
-         ftdi_list_free(&infonode);
          return TCL_OK;
       }
+      Tcl_DecrRefCount(lobj);
    }
-   else
-      ftStatus = ftdi_usb_open_dev(ftContext, snode->dev);
 
-   if (ftStatus < 0) {
-      Tcl_SetResult(interp, "Unable to open device\n", NULL);
-      ftdi_list_free(&infonode);
+   job.vid = match->vid;
+   job.pid = match->pid;
+   job.bus = match->bus;
+   job.addr = match->addr;
+   job.channel = channel;
+   job.flags = flags;
+   job.backend = backend;
+   strcpy(job.serial, match->serial);
+   strcpy(job.description, match->description);
+
+   open_device_hw(&job, interp);
+   if (job.ftContext == NULL) {
+      Tcl_SetResult(interp, job.error, NULL);
       return TCL_ERROR;
    }
-   else {
-      // Reset the FTDI device
-      ftStatus = ftdi_usb_reset(ftContext);
-      if (ftStatus < 0)
-	 Tcl_SetResult(interp, "Received error while resetting device.\n", NULL);
-
-      // Set device to MPSSE mode, with bits 0, 1, and 3 set to output
-      // (SCK, SDI, and CS).  All others (SDO and Dbus) are set to type input.
-
-      if (!(flags & SERIAL_MODE)) {
-         ftStatus = ftdi_set_bitmode(ftContext, (unsigned char)0x0b,
-		(unsigned char)BITMODE_MPSSE);
-         if (ftStatus < 0)
-	    Tcl_SetResult(interp, "Received error while setting bit mode.\n", NULL);
-      }
-
-      ftStatus = ftdi_usb_purge_tx_buffer(ftContext);
-      if (ftStatus < 0)
-	 Tcl_SetResult(interp, "Received error while purging transmit buffer.\n", NULL);
-
-      ftStatus = ftdi_usb_purge_rx_buffer(ftContext);
-      if (ftStatus < 0)
-	 Tcl_SetResult(interp, "Received error while purging receive buffer.\n", NULL);
-
-      // Set latency timer (in ms) (legacy case is 16; FT2232 minimum 1)
-      ftStatus = ftdi_set_latency_timer(ftContext, (unsigned char)5);
-      if (ftStatus < 0)
-	 Tcl_SetResult(interp, "Received error while setting latency timer.\n", NULL);
+   result = open_device_record(interp, &job, &tobj);
+   if (tobj != NULL) Tcl_SetObjResult(interp, tobj);
+   return result;
+}
 
-      // Set timeouts (in ms)
-      /*
-      ftStatus = ftdi_set_timeouts(ftContext, 1000, 1000);
-      if (ftStatus < 0)
-	 Tcl_SetResult(interp, "Received error while setting timeouts.\n", NULL);
-      */
+int close_device(Tcl_Interp *interp, char *devname);
 
-      if (!(flags & SERIAL_MODE)) {
-         // MPSSE setup. . .
-         tbuffer[0] = 0x80;        // Set Dbus
-         // De-assert CS (initial value 0 if CS, 1 if CSB)
-         tbuffer[1] = (flags & CS_INVERT) ? 0x00 : 0x08;
-         tbuffer[2] = 0x0b;        // SCK, SDI, and CS are outputs
+//--------------------------------------------------------------
+// Function "ftdi_open_many"
+//
+// Open several ftdi-usb devices at once
+//
+// Usage:  ftdi_open_many [-invert|-mixed_mode|-legacy|-serial]
+//		[-backend <name>|-direct]
+//		<device_list>
+//
+// Each item in <device_list> is a description string, serial
+// number, or USB path as for "ftdi_open", optionally followed
+// by a channel ("{TestBench B}").  A description matching more
+// than one device selects a different device for each item
+// that uses it.  The devices are opened, reset, and set up
+// concurrently, one thread per device, and the list of
+// handles is returned in the same order.  If any device
+// cannot be opened, or fails its sanity check, none are, and
+// the result is an error.
+//--------------------------------------------------------------
 
-         tbuffer[3] = 0x82;        // Set Cbus (rotary switch)
-         tbuffer[4] = 0x00;        // Initial output values are 0
-         tbuffer[5] = 0x00;        // All pins are input
+int
+ftditcl_open_many(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   Tcl_Obj **items, **parts, *lobj, *tobj;
+   usb_cache_entry *match;
+   open_job *jobs;
+   pthread_t *threads;
+   bool *started;
+   int argstart, result, nitems, nparts, i, j;
+   unsigned char flags;
+   ftdi_backend *backend;
+   char *devstr, msg[200];
 
-         tbuffer[6] = 0x8a;        // Enable high-speed clock (x5, up to 30MHz)
+   argstart = open_switches(objc, objv, &flags, &backend, NULL);
+   if (argstart < 0) {
+      Tcl_SetResult(interp, "opendev_many:  Unknown backend.\n", NULL);
+      return TCL_ERROR;
+   }
+   if (argstart != objc - 1) {
+      Tcl_SetResult(interp, "opendev_many:  Usage: opendev_many "
+		"[-invert|-mixed_mode|-legacy|-serial] [-backend <name>] "
+		"<device_list>\n", NULL);
+      return TCL_ERROR;
+   }
+   result = Tcl_ListObjGetElements(interp, objv[argstart], &nitems, &items);
+   if (result != TCL_OK) return result;
+   if (nitems == 0) return TCL_OK;
 
-         tbuffer[7] = 0x86;        // Set clock divider
-         tbuffer[8] = 0x10;     	// Divide by 16
-         tbuffer[9] = 0x00;        // (High byte is zero)
+   if (usb_cache_update() < 0) {
+      Tcl_SetResult(interp, "Unable to list devices.\n", NULL);
+      return TCL_ERROR;
+   }
 
-         if (verbose > 1) {
-	    int i;
-            Fprintf(interp, stderr, "ftdi_open: Writing: ");
-            for (i = 0; i < 10; i++) {
-               Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-            }
-            Fprintf(interp, stderr, "\n");
-         }
+   // Resolve all of the devices before opening any of them
 
-         ftStatus = ftdi_write_data(ftContext, tbuffer, 10);
-         if (ftStatus < 0)
-            Tcl_SetResult(interp, "Received error while writing init data\n", NULL);
-         else if (ftStatus != 10)
-            Tcl_SetResult(interp, "Short write error\n", NULL);
+   jobs = (open_job *)malloc(nitems * sizeof(open_job));
+   for (i = 0; i < nitems; i++) {
+      result = Tcl_ListObjGetElements(interp, items[i], &nparts, &parts);
+      if (result == TCL_OK && (nparts < 1 || nparts > 2)) {
+	 Tcl_SetResult(interp, "opendev_many:  Each device must be "
+		"<device> or {<device> <channel>}.\n", NULL);
+	 result = TCL_ERROR;
       }
-
-      // Now assign a unique string handler to the device and associate it
-      // with the ftContext in a hash table.
-
-      devnum = ++ftdinum;
-      sprintf(tclhandle, "ftdi%d", devnum);
-
-      h = Tcl_CreateHashEntry(&handletab, (CONST char *)tclhandle, &new);
-      if (new > 0) {
-	 ftRecordPtr = (ftdi_record *)malloc(sizeof(ftdi_record));
-	 ftRecordPtr->ftContext = ftContext;
-	 ftRecordPtr->description = strdup(descr);
-	 ftRecordPtr->flags = flags;
-	 ftRecordPtr->cmdwidth = 8;
-	 ftRecordPtr->wordwidth = 8;
-	 Tcl_SetHashValue(h, ftRecordPtr);
-	 result = TCL_OK;
+      if (result != TCL_OK) {
+	 free(jobs);
+	 return result;
       }
-      else {
-	 Tcl_SetResult(interp, "open:  Name already defined\n", NULL);
-	 ftStatus = ftdi_usb_close(ftContext);
+      devstr = Tcl_GetString(parts[0]);
+      jobs[i].flags = flags;
+      jobs[i].backend = backend;
+      jobs[i].channel = open_channel((nparts == 2) ?
+		Tcl_GetString(parts[1]) : NULL);
+      if (jobs[i].channel < 0) {
+	 free(jobs);
+	 Tcl_SetResult(interp, "Unknown device channel.\n", NULL);
 	 return TCL_ERROR;
       }
-      tobj = Tcl_NewStringObj(tclhandle, -1);
-
-      if (flags & SERIAL_MODE) return result;
 
-      /* For everything beyond this point, the device is open	*/
-      /* and the result code has been set.  All other errors	*/
-      /* should be printed to stderr but not passed as a result	*/
-      /* code.  It will be the responsibility of the end-user	*/
-      /* to deal with an open device that is not acting normal.	*/
+      // Skip devices already claimed by an earlier item for the
+      // same channel.
 
-      /* Sanity check:  Give an error code (invalid opcode 0xff)  */
-      /* and read the response "0xfa 0xff".			  */
-
-      tbuffer[0] = 0xff;		// not a command
-
-      if (verbose > 1) {
-	 int i;
-         Fprintf(interp, stderr, "ftdi_open: Writing: ");
-         for (i = 0; i < 1; i++) {
-            Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-         }
-         Fprintf(interp, stderr, "\n");
-      }
-
-      ftStatus = ftdi_write_data(ftContext, tbuffer, 1);
-      if (ftStatus < 0) {
-         Fprintf(interp, stderr, "Received error while writing test data\n");
-	 result = TCL_ERROR;
+      for (match = usb_cache_find(devstr, NULL); match != NULL;
+		match = usb_cache_find(devstr, match)) {
+	 for (j = 0; j < i; j++)
+	    if ((jobs[j].bus == match->bus) && (jobs[j].addr == match->addr)
+			&& (jobs[j].channel == jobs[i].channel))
+	       break;
+	 if (j == i) break;
       }
-      else if (ftStatus != 1) {
-         Fprintf(interp, stderr, "Short write error on test data\n");
-	 result = TCL_ERROR;
+      if (match == NULL) {
+	 free(jobs);
+	 snprintf(msg, sizeof(msg), "opendev_many:  No device \"%s\".\n",
+		devstr);
+	 Tcl_SetResult(interp, msg, TCL_VOLATILE);
+	 return TCL_ERROR;
       }
+      jobs[i].vid = match->vid;
+      jobs[i].pid = match->pid;
+      jobs[i].bus = match->bus;
+      jobs[i].addr = match->addr;
+      strcpy(jobs[i].serial, match->serial);
+      strcpy(jobs[i].description, match->description);
+   }
+
+   // Open all of the devices concurrently.  Each device has its own
+   // libusb context, so the threads share no USB state.
+
+   threads = (pthread_t *)malloc(nitems * sizeof(pthread_t));
+   started = (bool *)malloc(nitems * sizeof(bool));
+   for (i = 0; i < nitems; i++)
+      started[i] = (pthread_create(&threads[i], NULL, open_device_thread,
+		&jobs[i]) == 0) ? true : false;
+   for (i = 0; i < nitems; i++) {
+      if (started[i])
+	 pthread_join(threads[i], NULL);
+      else
+	 open_device_hw(&jobs[i], interp);
+   }
+   free(threads);
+   free(started);
+
+   // A device that failed its sanity check counts as not opened
+
+   for (i = 0; i < nitems; i++)
+      if ((jobs[i].ftContext == NULL) || jobs[i].unchecked) break;
+   if (i < nitems) {
+      snprintf(msg, sizeof(msg), "opendev_many:  %s:  %s",
+		Tcl_GetString(items[i]), (jobs[i].ftContext == NULL) ?
+		jobs[i].error : jobs[i].warning);
+      for (j = 0; j < nitems; j++)
+	 if (jobs[j].ftContext != NULL)
+	    jobs[j].backend->close(jobs[j].ftContext);
+      free(jobs);
+      Tcl_SetResult(interp, msg, TCL_VOLATILE);
+      return TCL_ERROR;
+   }
 
-      ftStatus = ftdi_read_data(ftContext, rbuffer, 2);
-      if (ftStatus < 0 || ftStatus != 2) {
-         Fprintf(interp, stderr, "Error message not received after invalid"
-			" command.\n");
+   lobj = Tcl_NewListObj(0, NULL);
+   Tcl_IncrRefCount(lobj);
+   result = TCL_OK;
+   for (i = 0; i < nitems; i++) {
+      if ((open_device_record(interp, &jobs[i], &tobj) != TCL_OK) &&
+		(result == TCL_OK)) {
+	 snprintf(msg, sizeof(msg), "opendev_many:  %s:  Unable to set "
+		"up device.\n", Tcl_GetString(items[i]));
 	 result = TCL_ERROR;
       }
-      ftdi_list_free(&infonode);
-
-      // Assert CS line
-      tbuffer[0] = 0x80;
-      tbuffer[1] = (ftRecordPtr->flags & CS_INVERT) ? 0x08 : 0x00;
-      tbuffer[2] = 0x0b;
+      if (tobj != NULL)
+	 Tcl_ListObjAppendElement(interp, lobj, tobj);
+   }
+   free(jobs);
 
-      if (verbose > 1) {
-	 int i;
-         Fprintf(interp, stderr, "ftdi_open: Writing: ");
-         for (i = 0; i < 3; i++) {
-            Fprintf(interp, stderr, "0x%02x ", tbuffer[i]);
-         }
-         Fprintf(interp, stderr, "\n");
-      }
+   // Close every device opened if any one could not be set up
 
-      ftStatus = ftdi_write_data(ftContext, tbuffer, 3);
-      if (ftStatus < 0) {
-         Fprintf(interp, stderr, "Received error while asserting CS.\n");
-	 result = TCL_ERROR;
-      }
-      else if (ftStatus != 3) {
-         Fprintf(interp, stderr, "Short write error while asserting CS\n");
-	 result = TCL_ERROR;
-      }
-      Tcl_SetObjResult(interp, tobj);
+   if (result != TCL_OK) {
+      Tcl_ListObjGetElements(interp, lobj, &nparts, &parts);
+      for (j = 0; j < nparts; j++)
+	 close_device(interp, Tcl_GetString(parts[j]));
+      Tcl_DecrRefCount(lobj);
+      Tcl_SetResult(interp, msg, TCL_VOLATILE);
+      return TCL_ERROR;
    }
-   return result;
+   Tcl_SetObjResult(interp, lobj);
+   Tcl_DecrRefCount(lobj);
+   return TCL_OK;
 }
 
 //--------------------------------------------------------------
@@ -1996,6 +7645,9 @@ ftditcl_close(ClientData clientData,
          devname = Tcl_GetHashKey(&handletab, h);
 	 result = close_device(interp, devname);
 	 if (result != TCL_OK) return result;
+
+	 // Closing a device may also remove its virtual devices
+	 h = Tcl_FirstHashEntry(&handletab, &hs);
       }
       return TCL_OK;
    }
@@ -2019,16 +7671,46 @@ int close_device(Tcl_Interp *interp, char *devname)
 {
    struct ftdi_context * ftContext;
    int ftStatus;
-   ftdi_record *ftRecordPtr;
+   ftdi_record *ftRecordPtr, *vRecordPtr, *chan;
    long numWritten;
    Tcl_HashSearch hs;
-   Tcl_HashEntry *h;
+   Tcl_HashEntry *h, *h2;
    unsigned char flags;
    unsigned char tbuffer[12];
 
    ftContext = find_handle(devname, &flags);
    if (ftContext == (struct ftdi_context *)NULL) return TCL_ERROR;
 
+   h = Tcl_FindHashEntry(&handletab, devname);
+   ftRecordPtr = (ftdi_record *)Tcl_GetHashValue(h);
+   chan = ftRecordPtr->channel;
+   if (channel_held(interp, ftRecordPtr, "close")) return TCL_ERROR;
+   if (!(flags & (BITBANG_MODE | SERIAL_MODE)))
+      spi_queue_flush(interp, chan);
+
+   if (chan != ftRecordPtr) {
+      // Virtual SPI device:  Release the chip select pin, leaving it
+      // driven at its idle level, and keep the channel open.
+      chan->gpio_resv &= ~ftRecordPtr->csmask;
+      free(ftRecordPtr->description);
+      if (ftRecordPtr->setbuffer != NULL) free(ftRecordPtr->setbuffer);
+      free(ftRecordPtr);
+      Tcl_DeleteHashEntry(h);
+      return TCL_OK;
+   }
+
+   // Remove all virtual devices sharing this channel
+   for (h2 = Tcl_FirstHashEntry(&handletab, &hs); h2 != NULL;
+		h2 = Tcl_NextHashEntry(&hs)) {
+      vRecordPtr = (ftdi_record *)Tcl_GetHashValue(h2);
+      if ((vRecordPtr->channel == chan) && (vRecordPtr != chan)) {
+	 free(vRecordPtr->description);
+	 if (vRecordPtr->setbuffer != NULL) free(vRecordPtr->setbuffer);
+	 free(vRecordPtr);
+	 Tcl_DeleteHashEntry(h2);
+      }
+   }
+
    tbuffer[0] = 0x80;        // Set Dbus
    tbuffer[1] = (flags & CS_INVERT) ? 0x00 : 0x08;
    tbuffer[2] = 0x00;
@@ -2045,21 +7727,22 @@ int close_device(Tcl_Interp *interp, char *devname)
       Fprintf(interp, stderr, "\n");
    }
 
-   ftStatus = ftdi_write_data(ftContext, tbuffer, 6);
+   ftStatus = BACKEND(chan)->write(ftContext, tbuffer, 6);
    if (ftStatus < 0)
       Tcl_SetResult(interp, "Received error while preparing device for close.", NULL);
    else if (ftStatus != 6)
       Tcl_SetResult(interp, "Short write to device.", NULL);
 
-   ftStatus = ftdi_usb_purge_tx_buffer(ftContext);
+   ftStatus = BACKEND(chan)->purge_tx(ftContext);
    if (ftStatus < 0)
       Tcl_SetResult(interp, "Received error while purging transmit buffer.", NULL);
 
-   ftStatus = ftdi_usb_purge_rx_buffer(ftContext);
+   ftStatus = BACKEND(chan)->purge_rx(ftContext);
    if (ftStatus < 0)
       Tcl_SetResult(interp, "Received error while purging receive buffer.", NULL);
 
-   ftStatus = ftdi_usb_close(ftContext);
+   BACKEND(chan)->unwatch(ftContext);
+   ftStatus = BACKEND(chan)->close(ftContext);
    if (ftStatus < 0) {
       Tcl_SetResult(interp, "Received error while closing device.", NULL);
       return TCL_ERROR;
@@ -2068,6 +7751,9 @@ int close_device(Tcl_Interp *interp, char *devname)
    if (h != (Tcl_HashEntry *)NULL) {
       ftRecordPtr = (ftdi_record *)Tcl_GetHashValue(h);
       free(ftRecordPtr->description);
+      if (ftRecordPtr->setbuffer != NULL) free(ftRecordPtr->setbuffer);
+      if (ftRecordPtr->txqueue != NULL) free(ftRecordPtr->txqueue);
+      if (ftRecordPtr->jtag_irlen != NULL) free(ftRecordPtr->jtag_irlen);
       free(ftRecordPtr);
       Tcl_DeleteHashEntry(h);
    }
@@ -2088,11 +7774,23 @@ typedef struct {
 static cmdstruct ftdi_commands[] =
 {
    {"ftdi::get", (void *)ftditcl_get},
+   {"ftdi::gpio_set", (void *)ftditcl_gpio_set},
+   {"ftdi::gpio_get", (void *)ftditcl_gpio_get},
+   {"ftdi::gpio_dir", (void *)ftditcl_gpio_dir},
    {"ftdi::verbose", (void *)ftditcl_verbose},
    {"ftdi::spi_read", (void *)ftditcl_spi_read},
    {"ftdi::spi_write", (void *)ftditcl_spi_write},
    {"ftdi::spi_readwrite", (void *)ftditcl_spi_readwrite},
+   {"ftdi::spi_read_chan", (void *)ftditcl_spi_read_chan},
+   {"ftdi::spi_write_chan", (void *)ftditcl_spi_write_chan},
    {"ftdi::spi_speed", (void *)ftditcl_spi_speed},
+   {"ftdi::spi_device", (void *)ftditcl_spi_device},
+   {"ftdi::spi_merge", (void *)ftditcl_spi_merge},
+   {"ftdi::spi_mode", (void *)ftditcl_spi_mode},
+   {"ftdi::tune", (void *)ftditcl_tune},
+   {"ftdi::timeout", (void *)ftditcl_timeout},
+   {"ftdi::i2c", (void *)ftditcl_i2c},
+   {"ftdi::jtag", (void *)ftditcl_jtag},
    {"ftdi::spi_command", (void *)ftditcl_spi_command},
    {"ftdi::spi_csb_mode", (void *)ftditcl_spi_csb_mode},
    {"ftdi::spi_bitbang", (void *)ftditcl_spi_bitbang},
@@ -2100,14 +7798,36 @@ static cmdstruct ftdi_commands[] =
    {"ftdi::bitbang_write", (void *)ftditcl_bang_write},
    {"ftdi::bitbang_word", (void *)ftditcl_bang_word},
    {"ftdi::bitbang_set", (void *)ftditcl_bang_set},
+   {"ftdi::bitbang_dump", (void *)ftditcl_bang_dump},
+   {"ftdi::play", (void *)ftditcl_play},
    {"ftdi::disable", (void *)ftditcl_disable},
    {"ftdi::listdev", (void *)ftditcl_list},
    {"ftdi::opendev", (void *)ftditcl_open},
+   {"ftdi::opendev_many", (void *)ftditcl_open_many},
    {"ftdi::setid", (void *)ftditcl_setid},
    {"ftdi::closedev", (void *)ftditcl_close},
    {"", NULL} /* sentinel */
 };
 
+#ifdef FTDI_NRE
+
+/* Commands that also have a coroutine version			*/
+
+typedef struct {
+   const char	   *cmdstr;
+   Tcl_ObjCmdProc  *func;
+   Tcl_ObjCmdProc  *nrfunc;
+} nrcmdstruct;
+
+static nrcmdstruct ftdi_nr_commands[] =
+{
+   {"ftdi::spi_read", ftditcl_spi_read, ftditcl_spi_read_nr},
+   {"ftdi::spi_write", ftditcl_spi_write, ftditcl_spi_write_nr},
+   {"", NULL, NULL} /* sentinel */
+};
+
+#endif	/* FTDI_NRE */
+
 /*--------------------------------------------------------------*/
 /* Stdout/Stderr redirect to Tk console				*/
 /*--------------------------------------------------------------*/
@@ -2209,6 +7929,20 @@ Tclftdi_Init(Tcl_Interp *interp)
 		(Tcl_ObjCmdProc *)ftdi_commands[cmdidx].func,
 		(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
    }
+
+#ifdef FTDI_NRE
+   // The package needs only Tcl 8.4, so the coroutine versions
+   // replace the blocking ones only if the interpreter has NRE.
+
+   if (Tcl_PkgPresent(interp, "Tcl", "8.6", 0) != NULL) {
+      for (cmdidx = 0; ftdi_nr_commands[cmdidx].func != NULL; cmdidx++)
+	 Tcl_NRCreateCommand(interp, ftdi_nr_commands[cmdidx].cmdstr,
+		ftdi_nr_commands[cmdidx].func,
+		ftdi_nr_commands[cmdidx].nrfunc,
+		(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+   }
+#endif
+
    gpib_command_init(interp);
    Tcl_InitHashTable(&handletab, TCL_STRING_KEYS);
    gpib_global_init(interp);
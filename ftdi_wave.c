@@ -0,0 +1,465 @@
+/*
+ *------------------------------------------------------------
+ * ftdi_wave.c
+ *------------------------------------------------------------
+ * Readers for VCD and run-length binary pattern files, used
+ * to play waveforms in synchronous bit-bang mode, and writers
+ * for the same formats, used to save raw bit-bang captures.
+ * Files are processed incrementally so that memory use does
+ * not depend on the length of the waveform.
+ *------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <tcl.h>
+
+#include "ftdi_wave.h"
+
+#define WAVE_MAX_IDS	64
+#define WAVE_TOKEN_LEN	256
+
+/*--------------------------------------------------------------*/
+/* Reader state						*/
+/*--------------------------------------------------------------*/
+
+struct _wave_source {
+   FILE *file;
+   int isvcd;			// 1 = VCD, 0 = run-length binary
+   Tcl_WideInt step;		// VCD time units per bit-bang step
+   Tcl_WideInt curtime;		// VCD time of the current value
+   int started;			// VCD:  first timestamp seen
+   int finished;		// End of file reached
+   unsigned char value;		// Current logical pin value
+   int changed;			// VCD:  value changed since last timestamp
+   Tcl_WideInt run;		// Steps remaining at current value
+   Tcl_WideInt period;		// Run-length:  step period (ns), or 0
+
+   int numids;			// VCD identifier codes of mapped signals
+   char *ids[WAVE_MAX_IDS];
+   unsigned char masks[WAVE_MAX_IDS];
+};
+
+/*--------------------------------------------------------------*/
+/* Read one whitespace-delimited token.  Returns 0 at EOF.	*/
+/*--------------------------------------------------------------*/
+
+static int
+wave_token(FILE *f, char *buf)
+{
+   int c, n = 0;
+
+   while ((c = getc(f)) != EOF && isspace(c));
+   if (c == EOF) return 0;
+   while (c != EOF && !isspace(c)) {
+      if (n < WAVE_TOKEN_LEN - 1) buf[n++] = (char)c;
+      c = getc(f);
+   }
+   buf[n] = '\0';
+   return 1;
+}
+
+/*--------------------------------------------------------------*/
+/* Return 1 and set "t" if "tok" is a VCD timestamp:  "#"	*/
+/* followed by digits.  Scalar value changes ("1#") never	*/
+/* start with "#";  the identifier of a vector value change	*/
+/* ("b1 #5") must be skipped by the caller.			*/
+/*--------------------------------------------------------------*/
+
+static int
+wave_vcd_time(char *tok, Tcl_WideInt *t)
+{
+   char *p;
+
+   if ((tok[0] != '#') || !isdigit((unsigned char)tok[1]))
+      return 0;
+   for (p = tok + 2; *p != '\0'; p++)
+      if (!isdigit((unsigned char)*p)) return 0;
+   *t = strtoll(tok + 1, NULL, 10);
+   return 1;
+}
+
+/*--------------------------------------------------------------*/
+/* Skip tokens up to and including "$end".			*/
+/*--------------------------------------------------------------*/
+
+static void
+wave_skip_section(FILE *f, char *buf)
+{
+   while (wave_token(f, buf))
+      if (!strcmp(buf, "$end")) break;
+}
+
+/*--------------------------------------------------------------*/
+/* Parse the VCD header up to "$enddefinitions".  Scalar	*/
+/* signals whose names match a bit-bang signal are recorded.	*/
+/*--------------------------------------------------------------*/
+
+static int
+wave_vcd_header(Tcl_Interp *interp, wave_source *ws)
+{
+   char tok[WAVE_TOKEN_LEN];
+   char id[WAVE_TOKEN_LEN];
+   char *p;
+   int width, sig;
+
+   while (wave_token(ws->file, tok)) {
+      if (!strcmp(tok, "$enddefinitions")) {
+	 wave_skip_section(ws->file, tok);
+	 if (ws->numids == 0) {
+	    Tcl_SetResult(interp, "play:  No signals in VCD file match "
+			"bit-bang signal names.\n", NULL);
+	    return TCL_ERROR;
+	 }
+	 return TCL_OK;
+      }
+      else if (!strcmp(tok, "$var")) {
+	 // $var <type> <width> <id> <name> [<range>] $end
+	 if (!wave_token(ws->file, tok)) break;
+	 if (!wave_token(ws->file, tok)) break;
+	 width = atoi(tok);
+	 if (!wave_token(ws->file, id)) break;
+	 if (!wave_token(ws->file, tok)) break;
+	 if ((p = strchr(tok, '[')) != NULL) *p = '\0';
+	 sig = (width == 1) ? bang_signal_index(tok) : -1;
+	 if (sig >= 0 && ws->numids < WAVE_MAX_IDS) {
+	    ws->ids[ws->numids] = strdup(id);
+	    ws->masks[ws->numids] = (unsigned char)(1 << sig);
+	    ws->numids++;
+	 }
+	 wave_skip_section(ws->file, tok);
+      }
+      else if (tok[0] == '$')
+	 wave_skip_section(ws->file, tok);	// $scope, $timescale, etc.
+   }
+   Tcl_SetResult(interp, "play:  Incomplete VCD header.\n", NULL);
+   return TCL_ERROR;
+}
+
+/*--------------------------------------------------------------*/
+/* Find the smallest nonzero interval between VCD timestamps,	*/
+/* used as the step size when none is given.			*/
+/*--------------------------------------------------------------*/
+
+static Tcl_WideInt
+wave_vcd_min_step(FILE *f)
+{
+   char tok[WAVE_TOKEN_LEN];
+   long pos;
+   Tcl_WideInt t, last = -1, minstep = 0;
+
+   pos = ftell(f);
+   while (wave_token(f, tok)) {
+      if (tok[0] == 'b' || tok[0] == 'B' || tok[0] == 'r' || tok[0] == 'R') {
+	 // Vector value;  the identifier that follows may begin with "#"
+	 if (!wave_token(f, tok)) break;
+	 continue;
+      }
+      if (!wave_vcd_time(tok, &t)) continue;
+      if (last >= 0 && t > last && (minstep == 0 || t - last < minstep))
+	 minstep = t - last;
+      last = t;
+   }
+   fseek(f, pos, SEEK_SET);
+   return (minstep > 0) ? minstep : 1;
+}
+
+/*--------------------------------------------------------------*/
+/* Apply a VCD value change token ("0!", "1!", "b1 !", etc.).	*/
+/*--------------------------------------------------------------*/
+
+static void
+wave_vcd_change(wave_source *ws, char *tok)
+{
+   char idbuf[WAVE_TOKEN_LEN];
+   char *id, bit;
+   int i;
+
+   if (tok[0] == 'b' || tok[0] == 'B' || tok[0] == 'r' || tok[0] == 'R') {
+      // Vector value;  the identifier is the following token.
+      bit = tok[strlen(tok) - 1];
+      if (!wave_token(ws->file, idbuf)) return;
+      id = idbuf;
+   }
+   else {
+      bit = tok[0];
+      id = tok + 1;
+   }
+
+   for (i = 0; i < ws->numids; i++) {
+      if (!strcmp(ws->ids[i], id)) {
+	 if (bit == '1')
+	    ws->value |= ws->masks[i];
+	 else
+	    ws->value &= ~ws->masks[i];	// 0, x, and z all drive low
+	 ws->changed = 1;
+      }
+   }
+}
+
+/*--------------------------------------------------------------*/
+/* Advance the VCD reader to the next timestamp, setting the	*/
+/* number of steps for which the current value holds.		*/
+/*--------------------------------------------------------------*/
+
+static void
+wave_vcd_next(wave_source *ws)
+{
+   char tok[WAVE_TOKEN_LEN];
+   Tcl_WideInt t;
+
+   while (wave_token(ws->file, tok)) {
+      if (wave_vcd_time(tok, &t)) {
+	 ws->changed = 0;
+	 if (ws->started) {
+	    ws->run = (t - ws->curtime) / ws->step;
+	    ws->curtime += ws->run * ws->step;
+	    if (ws->run > 0) return;
+	 }
+	 else {
+	    ws->started = 1;
+	    ws->curtime = t;
+	 }
+      }
+      else if (!strcmp(tok, "$comment"))
+	 wave_skip_section(ws->file, tok);
+      else if (tok[0] == '$')
+	 continue;		// $dumpvars, $end, etc.
+      else
+	 wave_vcd_change(ws, tok);
+   }
+
+   // Hold a final value that has no closing timestamp for one step
+   ws->finished = 1;
+   ws->run = (ws->started && ws->changed) ? 1 : 0;
+}
+
+/*--------------------------------------------------------------*/
+/* Advance the run-length reader to the next record.		*/
+/*--------------------------------------------------------------*/
+
+static void
+wave_rle_next(wave_source *ws)
+{
+   int c, shift;
+   Tcl_WideInt count;
+
+   if ((c = getc(ws->file)) == EOF) {
+      ws->finished = 1;
+      return;
+   }
+   ws->value = (unsigned char)c;
+   count = 0;
+   for (shift = 0; shift < 63; shift += 7) {
+      if ((c = getc(ws->file)) == EOF) {
+	 ws->finished = 1;
+	 break;
+      }
+      count |= (Tcl_WideInt)(c & 0x7f) << shift;
+      if (!(c & 0x80)) break;
+   }
+   ws->run = count;
+}
+
+/*--------------------------------------------------------------*/
+/* Open a pattern file.  "step" is the number of VCD time	*/
+/* units per bit-bang step, or 0 to use the smallest interval	*/
+/* found in the file.  Returns NULL and sets the interpreter	*/
+/* result on error.						*/
+/*--------------------------------------------------------------*/
+
+wave_source *
+wave_open(Tcl_Interp *interp, char *filename, Tcl_WideInt step)
+{
+   wave_source *ws;
+   unsigned char magic[8];
+   int j;
+
+   ws = (wave_source *)calloc(1, sizeof(wave_source));
+   ws->file = fopen(filename, "rb");
+   if (ws->file == NULL) {
+      Tcl_AppendResult(interp, "play:  Cannot open file \"", filename,
+		"\"\n", NULL);
+      free(ws);
+      return NULL;
+   }
+
+   if ((fread(magic, 1, 4, ws->file) == 4) &&
+		!strncmp((char *)magic, WAVE_RLE_MAGIC, 4)) {
+      ws->isvcd = 0;
+      if (fread(magic, 1, 4, ws->file) != 4)
+	 ws->finished = 1;
+      else
+	 for (j = 0; j < 4; j++)
+	    ws->period |= (Tcl_WideInt)magic[j] << (j << 3);
+      return ws;
+   }
+
+   rewind(ws->file);
+   ws->isvcd = 1;
+   if (wave_vcd_header(interp, ws) != TCL_OK) {
+      wave_close(ws);
+      return NULL;
+   }
+   ws->step = (step > 0) ? step : wave_vcd_min_step(ws->file);
+   return ws;
+}
+
+/*--------------------------------------------------------------*/
+/* Expand up to "max" steps into "buf", converting each value	*/
+/* through the lookup table "lut".  Returns the number of	*/
+/* bytes written, 0 when the pattern is exhausted.		*/
+/*--------------------------------------------------------------*/
+
+int
+wave_fill(wave_source *ws, unsigned char *lut, unsigned char *buf, int max)
+{
+   int n = 0, k;
+
+   while (n < max) {
+      if (ws->run <= 0) {
+	 if (ws->finished) break;
+	 if (ws->isvcd)
+	    wave_vcd_next(ws);
+	 else
+	    wave_rle_next(ws);
+	 continue;
+      }
+      k = (ws->run > (max - n)) ? (max - n) : (int)ws->run;
+      memset(buf + n, lut[ws->value], k);
+      n += k;
+      ws->run -= k;
+   }
+   return n;
+}
+
+/*--------------------------------------------------------------*/
+/* Return the step period (ns) recorded in a run-length file,	*/
+/* or 0 if it is unknown or the file is VCD.			*/
+/*--------------------------------------------------------------*/
+
+Tcl_WideInt
+wave_period(wave_source *ws)
+{
+   return ws->period;
+}
+
+/*--------------------------------------------------------------*/
+/* Count the steps left in a pattern file, from the reader's	*/
+/* current position to the end, leaving the reader where it	*/
+/* was.								*/
+/*--------------------------------------------------------------*/
+
+Tcl_WideInt
+wave_length(wave_source *ws)
+{
+   wave_source save;
+   long pos;
+   Tcl_WideInt total = 0;
+
+   save = *ws;
+   pos = ftell(ws->file);
+   while (1) {
+      if (ws->run > 0) {
+	 total += ws->run;
+	 ws->run = 0;
+      }
+      if (ws->finished) break;
+      if (ws->isvcd)
+	 wave_vcd_next(ws);
+      else
+	 wave_rle_next(ws);
+   }
+   *ws = save;
+   fseek(ws->file, pos, SEEK_SET);
+   return total;
+}
+
+/*--------------------------------------------------------------*/
+/* Close a pattern file and free the reader.			*/
+/*--------------------------------------------------------------*/
+
+void
+wave_close(wave_source *ws)
+{
+   int i;
+
+   if (ws == NULL) return;
+   for (i = 0; i < ws->numids; i++) free(ws->ids[i]);
+   if (ws->file != NULL) fclose(ws->file);
+   free(ws);
+}
+
+/*--------------------------------------------------------------*/
+/* Write "n" raw pin samples to a VCD file.  "lut" converts a	*/
+/* pin value to logical signal order, and "sigmask" has a bit	*/
+/* set for each signal that is assigned to a pin.  "period" is	*/
+/* the time between samples in picoseconds.  Only changes are	*/
+/* written.  Returns 0 on success, -1 on a write error.		*/
+/*--------------------------------------------------------------*/
+
+int
+wave_write_vcd(FILE *f, unsigned char *samples, long n, unsigned char *lut,
+	unsigned char sigmask, Tcl_WideInt period)
+{
+   unsigned char value, last = 0, diff;
+   long i;
+   int j;
+
+   fprintf(f, "$comment tclftdi bit-bang capture $end\n");
+   fprintf(f, "$timescale 1ps $end\n");
+   fprintf(f, "$scope module ftdi $end\n");
+   for (j = 0; j < 8; j++)
+      if (sigmask & (1 << j))
+	 fprintf(f, "$var wire 1 %c %s $end\n", '!' + j, bang_signal_names[j]);
+   fprintf(f, "$upscope $end\n");
+   fprintf(f, "$enddefinitions $end\n");
+
+   for (i = 0; i < n; i++) {
+      value = lut[samples[i]];
+      diff = (i == 0) ? sigmask : ((value ^ last) & sigmask);
+      if (diff) {
+	 fprintf(f, "#%lld\n", (long long)(i * period));
+	 if (i == 0) fprintf(f, "$dumpvars\n");
+	 for (j = 0; j < 8; j++)
+	    if (diff & (1 << j))
+	       fprintf(f, "%c%c\n", (value & (1 << j)) ? '1' : '0', '!' + j);
+	 if (i == 0) fprintf(f, "$end\n");
+      }
+      last = value;
+   }
+   if (n > 0) fprintf(f, "#%lld\n", (long long)(n * period));
+   return ferror(f) ? -1 : 0;
+}
+
+/*--------------------------------------------------------------*/
+/* Write "n" raw pin samples to a run-length binary file.	*/
+/* "period" is the time between samples in nanoseconds.		*/
+/* Returns 0 on success, -1 on a write error.			*/
+/*--------------------------------------------------------------*/
+
+int
+wave_write_rle(FILE *f, unsigned char *samples, long n, unsigned char *lut,
+	Tcl_WideInt period)
+{
+   unsigned char hdr[4], value;
+   Tcl_WideUInt count;
+   long i, j;
+
+   fwrite(WAVE_RLE_MAGIC, 1, 4, f);
+   for (j = 0; j < 4; j++) hdr[j] = (unsigned char)((period >> (j << 3)) & 0xff);
+   fwrite(hdr, 1, 4, f);
+
+   for (i = 0; i < n; i = j) {
+      value = lut[samples[i]];
+      for (j = i + 1; (j < n) && (lut[samples[j]] == value); j++);
+      putc(value, f);
+      for (count = (Tcl_WideUInt)(j - i); count >= 0x80; count >>= 7)
+	 putc((int)((count & 0x7f) | 0x80), f);
+      putc((int)count, f);
+   }
+   return ferror(f) ? -1 : 0;
+}
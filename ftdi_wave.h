@@ -0,0 +1,47 @@
+/* ftdi_wave.h */
+
+#ifndef _FTDI_WAVE_H
+#define _FTDI_WAVE_H
+
+/*--------------------------------------------------------------*/
+/* Waveform (pattern) files for synchronous bit-bang mode.	*/
+/*								*/
+/* Pattern values are bytes in logical signal order:  bit N	*/
+/* is signal N of the bit-bang map (0 = CSB, 1 = SDO, 2 = SDI,	*/
+/* 3 = SCK, 4 to 7 = USR0 to USR3).  The caller converts them	*/
+/* to pin values through the device's signal pin map.		*/
+/*								*/
+/* Two file formats are recognized:				*/
+/*								*/
+/*   VCD:  Scalar signals named CSB, SDO, SDI, SCK, or USR0 to	*/
+/*	   USR3 (case-insensitive, scope ignored) are mapped;	*/
+/*	   all other signals are ignored.  Each bit-bang step	*/
+/*	   covers "step" VCD time units.			*/
+/*								*/
+/*   Run-length binary:  The 4-byte magic "FTRL", a 4-byte	*/
+/*	   little-endian step period in nanoseconds (0 if	*/
+/*	   unknown), then records of one value byte followed	*/
+/*	   by the run length as an unsigned LEB128 number.	*/
+/*--------------------------------------------------------------*/
+
+#define WAVE_RLE_MAGIC	"FTRL"
+
+typedef struct _wave_source wave_source;
+
+extern wave_source *wave_open(Tcl_Interp *, char *, Tcl_WideInt);
+extern int wave_fill(wave_source *, unsigned char *, unsigned char *, int);
+extern Tcl_WideInt wave_period(wave_source *);
+extern Tcl_WideInt wave_length(wave_source *);
+extern void wave_close(wave_source *);
+
+extern int wave_write_vcd(FILE *, unsigned char *, long, unsigned char *,
+		unsigned char, Tcl_WideInt);
+extern int wave_write_rle(FILE *, unsigned char *, long, unsigned char *,
+		Tcl_WideInt);
+
+/* Defined in ftdi_tcl.c */
+
+extern char *bang_signal_names[];
+extern int bang_signal_index(char *);
+
+#endif /* _FTDI_WAVE_H */
@@ -27,11 +27,11 @@
 /*--------------------------------------------------------------*/
 
 per_controller_state_t controller[MAX_CONTROLLERS] = {
-  {0, 0, -1, -1, 0, 0, 0, NULL},
-  {0, 0, -1, -1, 0, 0, 0, NULL},
-  {0, 0, -1, -1, 0, 0, 0, NULL},
-  {0, 0, -1, -1, 0, 0, 0, NULL},
-  {0, 0, -1, -1, 0, 0, 0, NULL}
+  {0, 0, -1, -1, 0, 0, 0, 0, NULL},
+  {0, 0, -1, -1, 0, 0, 0, 0, NULL},
+  {0, 0, -1, -1, 0, 0, 0, 0, NULL},
+  {0, 0, -1, -1, 0, 0, 0, 0, NULL},
+  {0, 0, -1, -1, 0, 0, 0, 0, NULL}
 };
 
 /*--------------------------------------------------------------*/
@@ -271,6 +271,7 @@ open_gpib_interfaces(Tcl_Interp *interp)
 	 controller[board].dev = devtty;
 	 controller[board].error = 0;
 	 controller[board].active = -1;
+	 controller[board].busy = 0;
 	 controller[board].data = NULL;
 	 foundone = 1;
          Fprintf(interp, stderr, "Initializing controller \"%s\" for IO\n", buffer);
@@ -548,13 +548,71 @@ gpib_send(Tcl_Interp *interp, char *devname, void *databuf, long datacnt, int lo
    return 0;
 }
 
-// May want to replace the following with a delay passed to the
-// gpib_receive() routine
+/*--------------------------------------------------------------*/
+/* Address a device and tell the controller to read from it	*/
+/* until the terminator given by the device's flags.		*/
+/*--------------------------------------------------------------*/
+
+int
+gpib_request_read(gpib_record *link)
+{
+   int cid, flags, fd;
 
-#define DELAY_COUNT 5
-#define STAT_DELAY 10000
+   cid = gpib_address_device(NULL, &link);
+   if (cid < 0) return -1;
+
+   flags = link->flags;
+   fd = controller[cid].fd;
+   if ((flags & READ_EOI) != 0)
+      write(fd, "++read eoi\r", 11);
+   else if (flags & READ_LF)
+      write(fd, "++read 10\r", 10);
+   else if (flags & READ_CR)
+      write(fd, "++read 13\r", 10);
+   else
+      write(fd, "++read\r", 7);
+   return 0;
+}
 
 /*--------------------------------------------------------------*/
+/* Serially poll a device that signals data in its status	*/
+/* byte.  Returns 1 if the device has data to send, 0 if not,	*/
+/* or -1 if the poll failed.  (For "gpib::read" in a		*/
+/* coroutine, which waits between polls instead of sleeping.)	*/
+/*--------------------------------------------------------------*/
+
+int
+gpib_read_ready(gpib_record *link)
+{
+   int cid, result, status = 0;
+
+   cid = gpib_address_device(NULL, &link);
+   if (cid < 0) return -1;
+   result = gpib_status(cid, 250, &status);
+   if (result < 0) return -1;
+   if ((status & link->flags & READ_STB) == 0) {
+      controller[cid].error = 15;	/* device has nothing to send */
+      return 0;
+   }
+   return 1;
+}
+
+/*--------------------------------------------------------------*/
+/* Abandon a read started with gpib_request_read():  Discard	*/
+/* whatever the controller has sent or is still sending.	*/
+/*--------------------------------------------------------------*/
+
+void
+gpib_read_abort(gpib_record *link)
+{
+   link->flags &= ~READ_READY;
+   tcflush(controller[link->controller_id].fd, TCIFLUSH);
+}
+
+/*--------------------------------------------------------------*/
+/* With READ_READY set, the read has already been requested	*/
+/* and the controller has started to send, so both the status	*/
+/* poll and the delays are skipped.				*/
 /*--------------------------------------------------------------*/
 
 int
@@ -578,7 +636,7 @@ gpib_receive(Tcl_Interp *interp, char *devname, unsigned char *buffer, long cnt,
    fd = controller[cid].fd;
    stbbit = flags & READ_STB;
 
-   if (!(flags & READ_AUTO)) {
+   if (!(flags & (READ_AUTO | READ_READY))) {
 
       if (stbbit) {
          for (i = 0; i < DELAY_COUNT; i++) {
@@ -595,22 +653,15 @@ gpib_receive(Tcl_Interp *interp, char *devname, unsigned char *buffer, long cnt,
 	    return -1;
 	 }
       }
-      else {
+      else
 	 usleep(STAT_DELAY * DELAY_COUNT);   /* 1/10 second delay before reading */
-         gpib_address_device(NULL, &link);
-      }
 
-      if ((flags & READ_EOI) != 0)
-	 write(fd, "++read eoi\r", 11);
-      else if (flags & READ_LF)
-         write(fd, "++read 10\r", 10);
-      else if (flags & READ_CR)
-         write(fd, "++read 13\r", 10);
-      else
-         write(fd, "++read\r", 7);
+      gpib_request_read(link);
    }
 
-   usleep(STAT_DELAY * DELAY_COUNT);   /* 1/10 second delay before reading */
+   if (!(flags & READ_READY))
+      usleep(STAT_DELAY * DELAY_COUNT);   /* 1/10 second delay before reading */
+   link->flags &= ~READ_READY;
    count = poll_and_read(fd, buffer, (size_t)cnt, (stbbit) ? 0 : 300);
 
    switch(count) {
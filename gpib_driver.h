@@ -32,6 +32,7 @@ typedef struct per_controller_state_st
   short  revision;
   int    error;
   int    count;
+  int    busy;		// A coroutine is waiting on a read
   void  *data;		// GPIB or DIO device record
 
 } per_controller_state_t;
@@ -80,6 +81,9 @@ extern per_controller_state_t controller[MAX_CONTROLLERS];
 /*		 expected result to avoid losing data	*/
 /*  IS_BINARY -- Temporary flag set by the controller	*/
 /*		 to indicate a binary transmission	*/
+/*  READ_READY - Temporary flag set when a read has	*/
+/*		 already been requested and the		*/
+/*		 controller has started sending		*/
 /*							*/
 /*  The default setting is:				*/
 /*  0x10 | READ_EOI | TERM_EOI | TERM_LF | TERM_CR	*/
@@ -116,6 +120,13 @@ extern per_controller_state_t controller[MAX_CONTROLLERS];
 #define READ_AUTO	0x010000
 #define IS_BINARY	0x020000
 #define NO_NEWLINE	0x040000
+#define READ_READY	0x080000
+
+// May want to replace the following with a delay passed to the
+// gpib_receive() routine
+
+#define DELAY_COUNT 5
+#define STAT_DELAY 10000
 
 /* Forward references */
 
@@ -139,6 +150,9 @@ extern int gpib_status_byte(char *, int *);
 extern int gpib_send(Tcl_Interp *, char *, void *, long, int);
 extern int gpib_receive(Tcl_Interp *, char *, unsigned char *, long, int *,
 		gpib_record **);
+extern int gpib_request_read(gpib_record *);
+extern int gpib_read_ready(gpib_record *);
+extern void gpib_read_abort(gpib_record *);
 extern int gpib_buffered_read(Tcl_Interp *, char *, unsigned char **, long *);
 extern void gpib_list_links(Tcl_Interp *);
 extern int gpib_find_listeners(Tcl_Interp *, int *, int, int);
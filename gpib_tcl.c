@@ -38,6 +38,11 @@ int gpibtcl_read();
 
 int parse_flag_list(Tcl_Interp *, Tcl_Obj *, int *);
 
+#if (TCL_MAJOR_VERSION > 8) || (TCL_MINOR_VERSION >= 6)
+#define GPIB_NRE
+static int gpibtcl_read_nr(ClientData, Tcl_Interp *, int, Tcl_Obj *CONST []);
+#endif
+
 /*--------------------------------------------------------------*/
 /* Command data							*/
 /*--------------------------------------------------------------*/
@@ -78,9 +83,43 @@ gpib_command_init(Tcl_Interp *interp)
 		(Tcl_ObjCmdProc *)gpib_commands[cmdidx].func,
 		(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
    }
+
+#ifdef GPIB_NRE
+   /* Under Tcl 8.6, "gpib::read" yields when called in a coroutine */
+   if (Tcl_PkgPresent(interp, "Tcl", "8.6", 0) != NULL)
+      Tcl_NRCreateCommand(interp, "gpib::read",
+		(Tcl_ObjCmdProc *)gpibtcl_read, gpibtcl_read_nr,
+		(ClientData)NULL, (Tcl_CmdDeleteProc *)NULL);
+#endif
+
    Tcl_Eval(interp, "namespace eval gpib namespace export *");
 }
 
+/*--------------------------------------------------------------*/
+/* Check whether the controller of device "devname" is held by	*/
+/* a "gpib::read" suspended in a coroutine, or with "devname"	*/
+/* NULL, whether any controller is.  If so, leave an error	*/
+/* message in the interpreter and return 1.			*/
+/*--------------------------------------------------------------*/
+
+static int
+gpib_busy(Tcl_Interp *interp, char *devname)
+{
+   int i, cid;
+
+   if (devname != NULL) {
+      cid = gpib_find_controller(devname, NULL);
+      if ((cid < 0) || !controller[cid].busy) return 0;
+   }
+   else {
+      for (i = 0; i < MAX_CONTROLLERS; i++)
+	 if (controller[i].busy) break;
+      if (i == MAX_CONTROLLERS) return 0;
+   }
+   Tcl_SetResult(interp, "Device is in use by a suspended coroutine", NULL);
+   return 1;
+}
+
 /*--------------------------------------------------------------*/
 /* Maintain a record of which device names correspond to which	*/
 /* GPIB addresses.						*/
@@ -166,6 +205,7 @@ gpibtcl_findid(ClientData clientData,
       }
    }
 
+   if (gpib_busy(interp, NULL)) return TCL_ERROR;
    nresp = gpib_find_listeners(interp, &list[0], begin, end);
 
    if (nresp > 0) {
@@ -271,6 +311,7 @@ gpibtcl_openid(ClientData clientData,
    /* Check first if device is already open */
    gpib_find_controller(devname, &link);
    if (link == NULL) {
+      if (gpib_busy(interp, NULL)) return TCL_ERROR;
       result = gpib_init(interp, devname, flags);
       if (result < 0) {
 	 if (result == -2)
@@ -297,11 +338,13 @@ gpibtcl_closeid(ClientData clientData,
    char *devname;
 
    if (objc < 2) {
+      if (gpib_busy(interp, NULL)) return TCL_ERROR;
       for (i = 0; i < MAX_CONTROLLERS; i++)
 	 gpib_close(interp, i);
    }
    else {
       devname = Tcl_GetString(objv[1]);
+      if (gpib_busy(interp, devname)) return TCL_ERROR;
       result = gpib_close_link(interp, devname);
       if (result < 0) {
 	 Tcl_SetResult(interp, "No such device open", NULL);
@@ -327,6 +370,7 @@ gpibtcl_remote(ClientData clientData,
    }
    else {
       devname = Tcl_GetString(objv[1]);
+      if (gpib_busy(interp, devname)) return TCL_ERROR;
       gpib_address_device(devname, NULL);
    }
    return TCL_OK;
@@ -348,6 +392,7 @@ gpibtcl_local(ClientData clientData,
    }
    else {
       devname = Tcl_GetString(objv[1]);
+      if (gpib_busy(interp, devname)) return TCL_ERROR;
       gpib_local(devname);
    }
    return TCL_OK;
@@ -369,6 +414,7 @@ gpibtcl_clearid(ClientData clientData,
    }
    else {
       devname = Tcl_GetString(objv[1]);
+      if (gpib_busy(interp, devname)) return TCL_ERROR;
       gpib_clear(devname);
    }
    return TCL_OK;
@@ -390,6 +436,7 @@ gpibtcl_trigger(ClientData clientData,
    }
    else {
       devname = Tcl_GetString(objv[1]); 
+      if (gpib_busy(interp, devname)) return TCL_ERROR;
       gpib_trigger(devname);
    }
    return TCL_OK;
@@ -412,6 +459,7 @@ gpibtcl_status(ClientData clientData,
    }
    else {
       devname = Tcl_GetString(objv[1]);
+      if (gpib_busy(interp, devname)) return TCL_ERROR;
       result = gpib_status_byte(devname, &status);
       if (result < 0) {
 	 Tcl_SetResult(interp, "No status available\n", NULL);
@@ -468,6 +516,7 @@ gpibtcl_write(ClientData clientData,
 
    devname = Tcl_GetString(objv[argstart]);
    sendstr = Tcl_GetString(objv[argstart + 1]);
+   if (gpib_busy(interp, devname)) return TCL_ERROR;
 
    status = gpib_send(interp, devname, sendstr, strlen(sendstr), locflags);
    status = gpib_buffered_read(interp, devname, (unsigned char **)(&rcvstr), &count);
@@ -498,6 +547,8 @@ gpibtcl_read(ClientData clientData,
    else
       devname = Tcl_GetString(objv[1]);
 
+   if (gpib_busy(interp, devname)) return TCL_ERROR;
+
    status = gpib_buffered_read(interp, devname, (unsigned char **)(&rcvstr), &count);
    if (count > 0) {
       tobj = Tcl_NewStringObj(rcvstr, count);
@@ -506,3 +557,192 @@ gpibtcl_read(ClientData clientData,
    return TCL_OK;
 }
 
+#ifdef GPIB_NRE
+
+/*--------------------------------------------------------------*/
+/* Coroutine version of "gpib::read".  Called from within a	*/
+/* coroutine, the command yields instead of sleeping:  between	*/
+/* serial polls of the device's status byte, and while waiting	*/
+/* for the controller to start sending.  The data are then	*/
+/* read as the blocking command reads them.  The controller is	*/
+/* held while a read is outstanding, so that commands to other	*/
+/* devices on it wait their turn.				*/
+/*--------------------------------------------------------------*/
+
+#define READ_WAIT 350	/* Time (ms) for the controller to start sending */
+
+typedef struct {
+   Tcl_Interp *interp;
+   Tcl_Obj *coro;		/* Name of the suspended coroutine */
+   char *devname;
+   int tries;			/* Number of status polls or delays so far */
+   int requested;		/* The read was requested from the controller */
+   int fd;			/* Controller's file descriptor, when waited on */
+   Tcl_TimerToken timer;
+} gpib_read_job;
+
+static int gpibtcl_read_step(ClientData [], Tcl_Interp *, int);
+
+/*--------------------------------------------------------------*/
+/* Timer and file handlers:  resume the coroutine.		*/
+/*--------------------------------------------------------------*/
+
+static void
+gpib_read_resume(gpib_read_job *job)
+{
+   Tcl_Interp *interp = job->interp;
+   Tcl_Obj *coro = job->coro;
+
+   Tcl_Preserve((ClientData)interp);
+   Tcl_IncrRefCount(coro);
+   if (Tcl_EvalObjEx(interp, coro, TCL_EVAL_GLOBAL) != TCL_OK)
+      Tcl_BackgroundException(interp, TCL_ERROR);
+   Tcl_DecrRefCount(coro);
+   Tcl_Release((ClientData)interp);
+}
+
+static void
+gpib_read_wake(ClientData clientData)
+{
+   gpib_read_job *job = (gpib_read_job *)clientData;
+
+   job->timer = NULL;
+   gpib_read_resume(job);
+}
+
+static void
+gpib_read_readable(ClientData clientData, int mask)
+{
+   gpib_read_resume((gpib_read_job *)clientData);
+}
+
+/*--------------------------------------------------------------*/
+/* Yield until "ms" have passed or, if "fd" is not negative,	*/
+/* until it has data to read.					*/
+/*--------------------------------------------------------------*/
+
+static int
+gpib_read_yield(Tcl_Interp *interp, gpib_read_job *job, int ms, int fd)
+{
+   job->timer = Tcl_CreateTimerHandler(ms, gpib_read_wake, (ClientData)job);
+   job->fd = fd;
+   if (fd >= 0)
+      Tcl_CreateFileHandler(fd, TCL_READABLE, gpib_read_readable,
+		(ClientData)job);
+   Tcl_NRAddCallback(interp, gpibtcl_read_step, (ClientData)job, NULL,
+		NULL, NULL);
+   return Tcl_NREvalObj(interp, Tcl_NewStringObj("::yield", -1), 0);
+}
+
+/*--------------------------------------------------------------*/
+/* Run the read up to the next wait, or finish it.		*/
+/*--------------------------------------------------------------*/
+
+static int
+gpibtcl_read_step(ClientData data[], Tcl_Interp *interp, int result)
+{
+   gpib_read_job *job = (gpib_read_job *)data[0];
+   gpib_record *link = NULL;
+   int cid, ready;
+   char *rcvstr;
+   long count = 0;
+
+   if (job->timer != NULL) Tcl_DeleteTimerHandler(job->timer);
+   job->timer = NULL;
+   if (job->fd >= 0) Tcl_DeleteFileHandler(job->fd);
+   job->fd = -1;
+
+   /* (The device may have been closed while the coroutine waited) */
+   cid = gpib_find_controller(job->devname, &link);
+   if ((cid < 0) || (link == NULL)) goto done;
+
+   if (result != TCL_OK) {
+      /* The coroutine was deleted */
+      if (job->requested) {
+	 gpib_read_abort(link);
+	 controller[cid].busy = 0;
+      }
+      goto done;
+   }
+
+   if (job->requested) {
+      /* The controller is sending (or never started):  Read as	*/
+      /* the blocking command does.				*/
+      controller[cid].busy = 0;
+      gpib_buffered_read(interp, job->devname, (unsigned char **)(&rcvstr),
+		&count);
+      if (count > 0)
+	 Tcl_SetObjResult(interp, Tcl_NewStringObj(rcvstr, count));
+      goto done;
+   }
+
+   /* Wait for any other read on the controller to finish */
+   if (controller[cid].busy)
+      return gpib_read_yield(interp, job, STAT_DELAY / 1000, -1);
+
+   if (link->flags & READ_STB) {
+      ready = gpib_read_ready(link);
+      if ((ready == 0) && (++job->tries < DELAY_COUNT))
+	 return gpib_read_yield(interp, job, STAT_DELAY / 1000, -1);
+      if (ready <= 0) goto done;	/* Device has nothing to send */
+   }
+   else if (job->tries++ == 0)
+      return gpib_read_yield(interp, job, STAT_DELAY * DELAY_COUNT / 1000, -1);
+
+   if (gpib_request_read(link) < 0) goto done;
+   link->flags |= READ_READY;
+   controller[cid].busy = 1;
+   job->requested = 1;
+   return gpib_read_yield(interp, job, READ_WAIT, controller[cid].fd);
+
+done:
+   Tcl_DecrRefCount(job->coro);
+   free(job->devname);
+   free(job);
+   return result;
+}
+
+/*--------------------------------------------------------------*/
+/*--------------------------------------------------------------*/
+
+static int
+gpibtcl_read_nr(ClientData clientData,
+	Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+   gpib_read_job *job;
+   gpib_record *link = NULL;
+   Tcl_Obj *coro;
+   ClientData data[1];
+   int cid;
+
+   if (objc < 2)
+      return gpibtcl_read(clientData, interp, objc, objv);
+
+   /* Outside of a coroutine, or in the middle of a "write" */
+   /* that expects a reply, the command blocks.		     */
+
+   cid = gpib_find_controller(Tcl_GetString(objv[1]), &link);
+   if ((cid < 0) || (link == NULL) || (link->flags & READ_AUTO))
+      return gpibtcl_read(clientData, interp, objc, objv);
+   if (Tcl_EvalEx(interp, "::info coroutine", -1, 0) != TCL_OK)
+      return TCL_ERROR;
+   coro = Tcl_GetObjResult(interp);
+   if (Tcl_GetCharLength(coro) == 0)
+      return gpibtcl_read(clientData, interp, objc, objv);
+   Tcl_IncrRefCount(coro);
+   Tcl_ResetResult(interp);
+
+   job = (gpib_read_job *)malloc(sizeof(gpib_read_job));
+   job->interp = interp;
+   job->coro = coro;
+   job->devname = strdup(Tcl_GetString(objv[1]));
+   job->tries = 0;
+   job->requested = 0;
+   job->fd = -1;
+   job->timer = NULL;
+
+   data[0] = (ClientData)job;
+   return gpibtcl_read_step(data, interp, TCL_OK);
+}
+
+#endif	/* GPIB_NRE */